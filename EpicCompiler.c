@@ -1,7 +1,27 @@
+// POSIX and BSD interfaces (mmap flags, madvise, getline, strdup, mkstemp,
+// SA_RESTART) stay declared under -std=c11
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <string.h>
 #include <ctype.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <setjmp.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include "epic.h"
 
 // Define token types
 typedef enum {
@@ -11,57 +31,319 @@ typedef enum {
     TOKEN_LBRACE, TOKEN_RBRACE,TOKEN_LBRACKET,TOKEN_RBRACKET, TOKEN_SEMICOLON, TOKEN_COMMA,TOKEN_DOT, TOKEN_ASSIGN,TOKEN_ARRAY, TOKEN_EOF
 } TokenType;
 
-// Token structure
+#define TOKEN_TYPE_COUNT (TOKEN_EOF + 1)
+
+const char *tokenTypeNames[TOKEN_TYPE_COUNT] = {
+    "TOKEN_VAR", "TOKEN_ACTION", "TOKEN_MAIN", "TOKEN_IF", "TOKEN_ELIF", "TOKEN_ELSE", "TOKEN_WHILE", "TOKEN_FOR",
+    "TOKEN_PRINT", "TOKEN_INPUT", "TOKEN_RETURN", "TOKEN_IDENTIFIER", "TOKEN_NUMBER",
+    "TOKEN_STRING_LITERAL", "TOKEN_OPERATOR", "TOKEN_COMPARATOR", "TOKEN_LOGICAL_OPERATOR", "TOKEN_LPAREN", "TOKEN_RPAREN",
+    "TOKEN_LBRACE", "TOKEN_RBRACE", "TOKEN_LBRACKET", "TOKEN_RBRACKET", "TOKEN_SEMICOLON", "TOKEN_COMMA", "TOKEN_DOT", "TOKEN_ASSIGN", "TOKEN_ARRAY", "TOKEN_EOF"
+};
+
+// Token structure: a slice of the source buffer. For string literals the
+// slice covers the text between the quotes.
 typedef struct {
     TokenType type;
-    char lexeme[100];
+    uint32_t offset;
+    uint32_t length;
 } Token;
 
+// Token buffer, filled in one pass by tokenize(). Kept as parallel arrays
+// so the parser's type checks walk a dense byte array.
+typedef struct {
+    uint8_t *types;
+    uint32_t *offsets;
+    uint32_t *lengths;
+    size_t count;
+    size_t capacity;
+} TokenBuffer;
+
+// Source buffer: either a read-only mapping of a regular file or a heap
+// buffer filled from a pipe. In both cases at least SOURCE_PADDING zero
+// bytes follow the data, so the lexer can always look one character ahead.
+#define SOURCE_PADDING 64
+#define SOURCE_CHUNK (64 * 1024)
+
+typedef struct {
+    char *data;
+    size_t size;        // Bytes read from the input
+    size_t mappedSize;  // Size of the mapping, 0 for heap buffers
+} SourceBuffer;
+
+// Everything one compilation builds, from the source buffer to the
+// bytecode, is thread-local: a batch compiles many files at once, one per
+// worker thread, and resetCompilation() clears it between files. Tables
+// filled once at startup (lexer classes, keywords) are shared.
+#define COMPILATION_LOCAL _Thread_local
+
 // Global variables
-char *sourceCode;
-int currentPos = 0;
+COMPILATION_LOCAL SourceBuffer source;
+COMPILATION_LOCAL const char *sourceCode;
+COMPILATION_LOCAL size_t sourceLength;  // The lexer stops here (just after the last '}')
+COMPILATION_LOCAL size_t currentPos = 0;
+COMPILATION_LOCAL TokenBuffer tokens;
+
+// The first error ends a compilation. With `recover` set (the batch
+// driver) the message is kept and control returns there; otherwise it is
+// printed and the process exits.
+typedef struct {
+    jmp_buf *recover;
+    char message[512];
+} CompileFailure;
+
+COMPILATION_LOCAL CompileFailure failure;
+
+void failCompilation(FILE *stream, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    vsnprintf(failure.message, sizeof(failure.message), format, args);
+    va_end(args);
+    if (failure.recover != NULL) {
+        longjmp(*failure.recover, 1);
+    }
+    fprintf(stream, "%s\n", failure.message);
+    exit(EXIT_FAILURE);
+}
+
+// Tracing. EPIC_TRACE=0 at compile time removes every trace point; at run
+// time a message is printed when its level is at most traceLevel and its
+// category is set in traceMask.
+#ifndef EPIC_TRACE
+#define EPIC_TRACE 1
+#endif
+
+enum { TRACE_OFF, TRACE_INFO, TRACE_DEBUG, TRACE_VERBOSE };
+
+enum {
+    TRACE_IO = 1 << 0,
+    TRACE_LEX = 1 << 1,
+    TRACE_PARSE = 1 << 2,
+    TRACE_OPT = 1 << 3,
+    TRACE_JIT = 1 << 4,
+    TRACE_ALL = 0xFF
+};
+
+const char *traceCategoryNames[] = {"io", "lex", "parse", "opt", "jit"};
+#define TRACE_CATEGORY_COUNT (sizeof(traceCategoryNames) / sizeof(traceCategoryNames[0]))
+
+int traceLevel = TRACE_OFF;
+unsigned traceMask = TRACE_ALL;
+
+#if EPIC_TRACE
+#define TRACE(category, level, ...) \
+    do { \
+        if (traceLevel >= (level) && (traceMask & (category))) traceMessage((category), __VA_ARGS__); \
+    } while (0)
+#else
+#define TRACE(category, level, ...) do { } while (0)
+#endif
+
+void traceMessage(unsigned category, const char *format, ...) {
+    const char *name = "trace";
+    for (size_t i = 0; i < TRACE_CATEGORY_COUNT; i++) {
+        if (category == (1u << i)) {
+            name = traceCategoryNames[i];
+        }
+    }
+    va_list args;
+    va_start(args, format);
+    fprintf(stderr, "[%s] ", name);
+    vfprintf(stderr, format, args);
+    fputc('\n', stderr);
+    va_end(args);
+}
+
+// Per-phase counters and timers, written by printStats()
+typedef struct {
+    uint64_t bytesRead;
+    uint64_t tokens;
+    uint64_t tokensByType[TOKEN_TYPE_COUNT];
+    uint64_t parseNodes;     // AST nodes built by the parser
+    uint64_t parseThreads;   // Threads that lexed and parsed chunks of the file
+    uint64_t parseChunks;    // Chunks the file was split into; 1 when parsed sequentially
+    uint64_t edits;          // Applied by --edits
+    uint64_t incrementalReparses;
+    uint64_t fullReparses;
+    uint64_t relexedTokens;  // Tokens lexed again by incremental reparses
+    uint64_t reparsedNodes;  // AST nodes they built
+    uint64_t astBytes;       // Arena bytes holding those nodes
+    uint64_t bytecodeWords;  // Instruction words across all functions
+    uint64_t nodesRemoved;   // By the optimizer
+    uint64_t instructionsRemoved;
+    uint64_t memoizedActions;
+    uint64_t memoHits;
+    uint64_t memoMisses;
+    uint64_t boundsChecksRemoved;  // Array reads a loop bound proved valid
+    uint64_t vectorizedLoops;      // Loops compiled to SUM_ARRAY
+    uint64_t specializedOperations;  // Arithmetic and comparisons on proven ints, left unchecked
+    uint64_t checkedOperations;      // Those that keep their type checks
+    uint64_t jitCompiles;    // Actions translated to machine code
+    uint64_t jitCodeBytes;
+    uint64_t jitEntries;     // Interpreter-to-native transitions
+    uint64_t jitDeopts;      // Type guards that failed
+    uint64_t allocations;    // Heap objects created while running
+    uint64_t bytesCopied;    // String bytes written by concatenation and methods
+    uint64_t inPlaceAppends; // Concatenations that extended their left operand's storage
+    uint64_t internedStrings;  // Literals and characters shared instead of allocated
+    uint64_t linesPrinted;
+    uint64_t outputWrites;   // writev calls that sent program output
+    uint64_t linesRead;      // By input()
+    uint64_t inputReads;     // read calls that filled the input buffer
+    double readSeconds;
+    double lexSeconds;
+    double parseSeconds;
+    double compileSeconds;
+    double executeSeconds;
+    double editSeconds;      // Applying edits and reparsing
+    double cacheSeconds;     // Hashing the source and loading or writing its cache entry
+    const char *cache;       // What --cache found: hit, miss, stale or corrupt
+} CompilerStats;
+
+COMPILATION_LOCAL CompilerStats stats;
+
+double nowSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+
 
+// Find the end of the program: everything after the last '}' is ignored.
+// Scans backwards, so it only touches the trailing bytes of the file.
+size_t findSourceEnd(const char *data, size_t size) {
+    size_t end = size;
+    while (end > 0) {
+        if (data[end - 1] == '}') {
+            return end;
+        }
+        end--;
+    }
+    return size;
+}
+
+void sourceOutOfMemory() {
+    failCompilation(stdout, "Memory allocation error!");
+}
+
+// Map a regular file read-only. The mapping is placed at the start of a
+// reserved region one page larger than the file, so the bytes after the
+// file are guaranteed to be readable zeros.
+int mapSource(int fd, size_t size) {
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t reserved = (size + page - 1) / page * page + page;
+
+    char *base = mmap(NULL, reserved, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        return 0;
+    }
+    if (mmap(base, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+        munmap(base, reserved);
+        return 0;
+    }
+    madvise(base, size, MADV_SEQUENTIAL);
+
+    source.data = base;
+    source.size = size;
+    source.mappedSize = reserved;
+    return 1;
+}
 
+// Read a pipe or terminal in chunks into a growing buffer
+void streamSource(int fd) {
+    size_t capacity = SOURCE_CHUNK;
+    size_t size = 0;
+    char *buffer = malloc(capacity + SOURCE_PADDING);
+    if (buffer == NULL) {
+        sourceOutOfMemory();
+    }
 
-void cleanContent() {
-    // Find the last occurrence of '}'
-    char *lastBrace = strrchr(sourceCode, '}');
-    
-    if (lastBrace != NULL) {
-        // Null-terminate the string right after the last '}'
-        *(lastBrace + 1) = '\0';
+    for (;;) {
+        if (capacity - size < SOURCE_CHUNK / 2) {
+            capacity *= 2;
+            char *grown = realloc(buffer, capacity + SOURCE_PADDING);
+            if (grown == NULL) {
+                free(buffer);
+                sourceOutOfMemory();
+            }
+            buffer = grown;
+        }
+        ssize_t count = read(fd, buffer + size, capacity - size);
+        if (count < 0) {
+            free(buffer);
+            failCompilation(stdout, "Error reading file");
+        }
+        if (count == 0) {
+            break;
+        }
+        size += (size_t)count;
     }
+    memset(buffer + size, 0, SOURCE_PADDING);
+
+    source.data = buffer;
+    source.size = size;
+    source.mappedSize = 0;
 }
 
+// Load the source: regular files are mapped, anything else (or "-" for
+// stdin) is streamed. The lexer reads the buffer in place.
 void readFile(const char *filename) {
-    // Open the file for reading
-    FILE *file = fopen(filename, "r");
-    if (file == NULL) {
-        printf("Error opening file: %s\n", filename);
-        exit(1); // Exit if the file cannot be opened
+    int fd = STDIN_FILENO;
+    if (strcmp(filename, "-") != 0) {
+        fd = open(filename, O_RDONLY);
+        if (fd < 0) {
+            failCompilation(stdout, "Error opening file: %s", filename);
+        }
     }
 
-    // Get the file size
-    fseek(file, 0, SEEK_END);
-    long fileSize = ftell(file);
-    fseek(file, 0, SEEK_SET);
+    struct stat info;
+    int mapped = 0;
+    if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+        mapped = mapSource(fd, (size_t)info.st_size);
+    }
+    if (!mapped) {
+        streamSource(fd);
+    }
 
-    // Allocate memory to store the file content
-    sourceCode = (char *)malloc(fileSize + 1); // +1 for the null-terminator
-    if (sourceCode == NULL) {
-        printf("Memory allocation error!\n");
-        exit(1); // Exit if memory cannot be allocated
+    if (fd != STDIN_FILENO) {
+        close(fd);
     }
 
-    // Read the file content into sourceCode
-    fread(sourceCode, 1, fileSize, file);
-    sourceCode[fileSize] = '\0'; // Null-terminate the string
+    sourceCode = source.data;
+    sourceLength = findSourceEnd(source.data, source.size);
+    currentPos = 0;
+    stats.bytesRead = source.size;
+    TRACE(TRACE_IO, TRACE_INFO, "read %zu bytes from %s (%s)", source.size, filename,
+          mapped ? "mapped" : "streamed");
+}
 
-    // Clean the content (remove unnecessary characters after the last '}')
-    cleanContent();
+// Load source text from memory, padded like a streamed file
+void copySource(const char *text, size_t length) {
+    char *buffer = malloc(length + SOURCE_PADDING);
+    if (buffer == NULL) {
+        sourceOutOfMemory();
+    }
+    memcpy(buffer, text, length);
+    memset(buffer + length, 0, SOURCE_PADDING);
+    source.data = buffer;
+    source.size = length;
+    source.mappedSize = 0;
+    sourceCode = source.data;
+    sourceLength = findSourceEnd(source.data, source.size);
+    currentPos = 0;
+    stats.bytesRead = length;
+}
 
-    // Close the file
-    fclose(file);
+// Release the source buffer
+void closeSource() {
+    if (source.mappedSize > 0) {
+        munmap(source.data, source.mappedSize);
+    } else {
+        free(source.data);
+    }
+    source.data = NULL;
+    sourceCode = NULL;
+    sourceLength = 0;
 }
 
 
@@ -74,7 +356,7 @@ void readFile(const char *filename) {
 
 
 // Function prototypes
-Token getNextToken();
+static inline Token getNextToken();
 void printToken(Token token);
 void error(const char *message);
 
@@ -87,139 +369,383 @@ int isComparator(char c) {
     return c == '=' || c == '!' || c == '<' || c == '>';
 }
 
-// Lexer: Get the next token
-Token getNextToken() {
+// Compare a source slice with a NUL-terminated string
+int lexemeEquals(const char *text, size_t length, const char *word) {
+    return strncmp(text, word, length) == 0 && word[length] == '\0';
+}
+
+// Text of a token for printing; the EOF token reads as "EOF"
+const char *tokenLexeme(Token token, int *length) {
+    if (token.type == TOKEN_EOF) {
+        *length = 3;
+        return "EOF";
+    }
+    *length = (int)token.length;
+    return sourceCode + token.offset;
+}
+
+// Check whether a token's text is exactly `word`
+int tokenIs(Token token, const char *word) {
+    return lexemeEquals(sourceCode + token.offset, token.length, word);
+}
+
+// Grow the token buffer to hold at least `capacity` tokens
+void reserveTokens(size_t capacity) {
+    if (capacity <= tokens.capacity) {
+        return;
+    }
+    uint8_t *types = realloc(tokens.types, capacity * sizeof(uint8_t));
+    uint32_t *offsets = realloc(tokens.offsets, capacity * sizeof(uint32_t));
+    uint32_t *lengths = realloc(tokens.lengths, capacity * sizeof(uint32_t));
+    if (types == NULL || offsets == NULL || lengths == NULL) {
+        sourceOutOfMemory();
+    }
+    tokens.types = types;
+    tokens.offsets = offsets;
+    tokens.lengths = lengths;
+    tokens.capacity = capacity;
+}
+
+// Character classes for the lexer's hot loops
+enum {
+    CHAR_SPACE = 1,        // isspace() in the C locale
+    CHAR_IDENT_START = 2,  // letter or '_'
+    CHAR_IDENT = 4,        // letter, digit or '_'
+    CHAR_DIGIT = 8
+};
+
+uint8_t charClass[256];
+
+// Run scanners: each returns a pointer to the first byte that does not
+// belong to the run. They rely on the zero padding after the source, and
+// all of them stop at '\0'.
+typedef const char *(*ScanFunction)(const char *p);
+
+typedef struct {
+    const char *name;
+    ScanFunction skipSpace;
+    ScanFunction scanIdentifier;
+    ScanFunction scanDigits;
+    ScanFunction scanString;  // Stops at '"' or '\0'
+} LexerBackend;
+
+LexerBackend lexer;
+
+const char *scalarSkipSpace(const char *p) {
+    while (charClass[(unsigned char)*p] & CHAR_SPACE) p++;
+    return p;
+}
+
+const char *scalarScanIdentifier(const char *p) {
+    while (charClass[(unsigned char)*p] & CHAR_IDENT) p++;
+    return p;
+}
+
+const char *scalarScanDigits(const char *p) {
+    while (charClass[(unsigned char)*p] & CHAR_DIGIT) p++;
+    return p;
+}
+
+const char *scalarScanString(const char *p) {
+    while (*p != '"' && *p != '\0') p++;
+    return p;
+}
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+
+// Byte-wise lo <= v <= hi, as a mask of 0xFF lanes
+#define SSE_IN_RANGE(v, lo, hi) \
+    _mm_cmpeq_epi8(_mm_min_epu8(_mm_sub_epi8((v), _mm_set1_epi8(lo)), _mm_set1_epi8((hi) - (lo))), \
+                   _mm_sub_epi8((v), _mm_set1_epi8(lo)))
+#define AVX_IN_RANGE(v, lo, hi) \
+    _mm256_cmpeq_epi8(_mm256_min_epu8(_mm256_sub_epi8((v), _mm256_set1_epi8(lo)), _mm256_set1_epi8((hi) - (lo))), \
+                      _mm256_sub_epi8((v), _mm256_set1_epi8(lo)))
+
+// SSE2 is part of the x86-64 baseline, so these need no feature check
+const char *sse2SkipSpace(const char *p) {
+    for (;; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8(' ')), SSE_IN_RANGE(v, '\t', '\r'));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit) ^ 0xFFFFu;
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+}
+
+const char *sse2ScanIdentifier(const char *p) {
+    for (;; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i letter = SSE_IN_RANGE(_mm_or_si128(v, _mm_set1_epi8(0x20)), 'a', 'z');
+        __m128i hit = _mm_or_si128(_mm_or_si128(letter, SSE_IN_RANGE(v, '0', '9')),
+                                   _mm_cmpeq_epi8(v, _mm_set1_epi8('_')));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit) ^ 0xFFFFu;
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+}
+
+const char *sse2ScanDigits(const char *p) {
+    for (;; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        unsigned mask = (unsigned)_mm_movemask_epi8(SSE_IN_RANGE(v, '0', '9')) ^ 0xFFFFu;
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+}
+
+const char *sse2ScanString(const char *p) {
+    for (;; p += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)p);
+        __m128i hit = _mm_or_si128(_mm_cmpeq_epi8(v, _mm_set1_epi8('"')), _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+        unsigned mask = (unsigned)_mm_movemask_epi8(hit);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+}
+
+// AVX2 variants, only selected when the CPU reports support. Short runs
+// are the common case, so each starts with one 16-byte SSE2 probe.
+__attribute__((target("avx2")))
+const char *avx2SkipSpace(const char *p) {
+    const char *end = sse2SkipSpace(p);
+    if (end < p + 16) return end;
+    for (p = end;; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8(' ')), AVX_IN_RANGE(v, '\t', '\r'));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(hit);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+}
+
+__attribute__((target("avx2")))
+const char *avx2ScanIdentifier(const char *p) {
+    const char *end = sse2ScanIdentifier(p);
+    if (end < p + 16) return end;
+    for (p = end;; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i letter = AVX_IN_RANGE(_mm256_or_si256(v, _mm256_set1_epi8(0x20)), 'a', 'z');
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(letter, AVX_IN_RANGE(v, '0', '9')),
+                                      _mm256_cmpeq_epi8(v, _mm256_set1_epi8('_')));
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(hit);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+}
+
+__attribute__((target("avx2")))
+const char *avx2ScanDigits(const char *p) {
+    const char *end = sse2ScanDigits(p);
+    if (end < p + 16) return end;
+    for (p = end;; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        unsigned mask = ~(unsigned)_mm256_movemask_epi8(AVX_IN_RANGE(v, '0', '9'));
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+}
+
+__attribute__((target("avx2")))
+const char *avx2ScanString(const char *p) {
+    for (;; p += 32) {
+        __m256i v = _mm256_loadu_si256((const __m256i *)p);
+        __m256i hit = _mm256_or_si256(_mm256_cmpeq_epi8(v, _mm256_set1_epi8('"')),
+                                      _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask != 0) return p + __builtin_ctz(mask);
+    }
+}
+#define LEXER_HAVE_SIMD 1
+#endif
+
+// Keywords, placed by keywordHash(): a perfect hash for this keyword set
+typedef struct {
+    const char *word;
+    uint8_t length;
+    uint8_t type;
+} Keyword;
+
+#define KEYWORD_SLOTS 32
+Keyword keywordTable[KEYWORD_SLOTS];
+
+unsigned keywordHash(const char *text, size_t length) {
+    return ((unsigned char)text[0] + 2u * (unsigned char)text[length - 1] + 7u * (unsigned)length) & (KEYWORD_SLOTS - 1);
+}
+
+void addKeyword(const char *word, TokenType type) {
+    size_t length = strlen(word);
+    Keyword *slot = &keywordTable[keywordHash(word, length)];
+    if (slot->word != NULL) {
+        fprintf(stderr, "Keyword hash collision: %s and %s\n", slot->word, word);
+        exit(EXIT_FAILURE);
+    }
+    slot->word = word;
+    slot->length = (uint8_t)length;
+    slot->type = (uint8_t)type;
+}
+
+// Classify an identifier: one hash, one length check and one memcmp
+TokenType keywordType(const char *text, size_t length) {
+    if (length < 2 || length > 6) {
+        return TOKEN_IDENTIFIER;
+    }
+    const Keyword *slot = &keywordTable[keywordHash(text, length)];
+    if (slot->length == length && memcmp(slot->word, text, length) == 0) {
+        return (TokenType)slot->type;
+    }
+    return TOKEN_IDENTIFIER;
+}
+
+// Build the tables and pick the fastest scanners this CPU supports.
+// EPIC_LEXER=scalar|sse2|avx2 overrides the choice for benchmarking.
+void initLexer() {
+    for (int c = 0; c < 256; c++) {
+        uint8_t cls = 0;
+        if (c == ' ' || (c >= '\t' && c <= '\r')) cls |= CHAR_SPACE;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_') cls |= CHAR_IDENT_START | CHAR_IDENT;
+        if (c >= '0' && c <= '9') cls |= CHAR_DIGIT | CHAR_IDENT;
+        charClass[c] = cls;
+    }
+
+    memset(keywordTable, 0, sizeof(keywordTable));
+    addKeyword("var", TOKEN_VAR);
+    addKeyword("array", TOKEN_ARRAY);
+    addKeyword("action", TOKEN_ACTION);
+    addKeyword("main", TOKEN_MAIN);
+    addKeyword("if", TOKEN_IF);
+    addKeyword("elif", TOKEN_ELIF);
+    addKeyword("else", TOKEN_ELSE);
+    addKeyword("while", TOKEN_WHILE);
+    addKeyword("for", TOKEN_FOR);
+    addKeyword("print", TOKEN_PRINT);
+    addKeyword("input", TOKEN_INPUT);
+    addKeyword("return", TOKEN_RETURN);
+
+    LexerBackend scalar = {"scalar", scalarSkipSpace, scalarScanIdentifier, scalarScanDigits, scalarScanString};
+    lexer = scalar;
+#ifdef LEXER_HAVE_SIMD
+    const char *requested = getenv("EPIC_LEXER");
+    if (requested != NULL && strcmp(requested, "scalar") == 0) {
+        return;
+    }
+    LexerBackend sse2 = {"sse2", sse2SkipSpace, sse2ScanIdentifier, sse2ScanDigits, sse2ScanString};
+    lexer = sse2;
+    if (requested != NULL && strcmp(requested, "sse2") == 0) {
+        return;
+    }
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        LexerBackend avx2 = {"avx2", avx2SkipSpace, avx2ScanIdentifier, avx2ScanDigits, avx2ScanString};
+        lexer = avx2;
+    }
+#endif
+}
+
+// Most runs are a few bytes long, so check the first eight inline through
+// the class table before handing longer runs to the vector scanner.
+static inline const char *scanRun(const char *p, uint8_t cls, ScanFunction longRun) {
+    for (int i = 0; i < 8; i++, p++) {
+        if (!(charClass[(unsigned char)*p] & cls)) return p;
+    }
+    return longRun(p);
+}
+
+// Lexer: Get the next token. Inlined into tokenize(), its only caller.
+static inline Token getNextToken() {
     Token token;
-    token.lexeme[0] = '\0';
 
     // Skip whitespace
-    while (isspace(sourceCode[currentPos])) {
-        currentPos++;
-    }
+    currentPos = (size_t)(scanRun(sourceCode + currentPos, CHAR_SPACE, lexer.skipSpace) - sourceCode);
 
     // End of file
-    if (sourceCode[currentPos] == '\0') {
+    if (currentPos >= sourceLength || sourceCode[currentPos] == '\0') {
         token.type = TOKEN_EOF;
-        strcpy(token.lexeme, "EOF");
-        return token;
-    }
-    // Debug print
-    printf("DEBUG getNextToken: Current character: '%c' at position %d\n", 
-           sourceCode[currentPos], currentPos);
-    
-    // Logical operators
-    if (sourceCode[currentPos] == '&' && sourceCode[currentPos + 1] == '&') {
-        token.type = TOKEN_LOGICAL_OPERATOR;
-        strcpy(token.lexeme, "&&");
-        currentPos += 2;
-        return token;
-    } else if (sourceCode[currentPos] == '|' && sourceCode[currentPos + 1] == '|') {
-        token.type = TOKEN_LOGICAL_OPERATOR;
-        strcpy(token.lexeme, "||");
-        currentPos += 2;
-        return token;
-    } else if (sourceCode[currentPos] == '!') {
-        token.type = TOKEN_LOGICAL_OPERATOR;
-        strcpy(token.lexeme, "!");
-        currentPos++;
+        token.offset = (uint32_t)currentPos;
+        token.length = 0;
         return token;
     }
+    TRACE(TRACE_LEX, TRACE_VERBOSE, "getNextToken: Current character: '%c' at position %zu",
+          sourceCode[currentPos], currentPos);
 
-    // Keywords and identifiers
-    if (isalpha(sourceCode[currentPos]) || sourceCode[currentPos] == '_') {
-        int start = currentPos;
-        while (isalnum(sourceCode[currentPos]) || sourceCode[currentPos] == '_') {
-            currentPos++;
-        }
-        strncpy(token.lexeme, sourceCode + start, currentPos - start);
-        token.lexeme[currentPos - start] = '\0';
-
-        // Check for keywords
-        if (strcmp(token.lexeme, "var") == 0) token.type = TOKEN_VAR;
-        else if (strcmp(token.lexeme, "array") == 0) token.type = TOKEN_ARRAY;
-        else if (strcmp(token.lexeme, "action") == 0) token.type = TOKEN_ACTION;
-        else if (strcmp(token.lexeme, "main") == 0) token.type = TOKEN_MAIN;
-        else if (strcmp(token.lexeme, "if") == 0) token.type = TOKEN_IF;
-        else if (strcmp(token.lexeme, "elif") == 0) token.type = TOKEN_ELIF;
-        else if (strcmp(token.lexeme, "else") == 0) token.type = TOKEN_ELSE;
-        else if (strcmp(token.lexeme, "while") == 0) token.type = TOKEN_WHILE;
-        else if (strcmp(token.lexeme, "for") == 0) token.type = TOKEN_FOR;
-        else if (strcmp(token.lexeme, "print") == 0) token.type = TOKEN_PRINT;
-        else if (strcmp(token.lexeme, "input") == 0) token.type = TOKEN_INPUT;
-        else if (strcmp(token.lexeme, "return") == 0) token.type = TOKEN_RETURN;
-        else token.type = TOKEN_IDENTIFIER;
+    const char *start = sourceCode + currentPos;
+    unsigned char c = (unsigned char)*start;
+    token.offset = (uint32_t)currentPos;
+    token.length = 1;
 
+    // Keywords and identifiers
+    if (charClass[c] & CHAR_IDENT_START) {
+        const char *end = scanRun(start + 1, CHAR_IDENT, lexer.scanIdentifier);
+        token.length = (uint32_t)(end - start);
+        token.type = keywordType(start, token.length);
+        currentPos += token.length;
         return token;
     }
 
     // Numbers
-    if (isdigit(sourceCode[currentPos])) {
-        int start = currentPos;
-        while (isdigit(sourceCode[currentPos])) {
-            currentPos++;
-        }
-        strncpy(token.lexeme, sourceCode + start, currentPos - start);
-        token.lexeme[currentPos - start] = '\0';
+    if (charClass[c] & CHAR_DIGIT) {
+        const char *end = scanRun(start + 1, CHAR_DIGIT, lexer.scanDigits);
+        token.length = (uint32_t)(end - start);
         token.type = TOKEN_NUMBER;
+        currentPos += token.length;
         return token;
     }
 
     // String literals
-    if (sourceCode[currentPos] == '"') {
-        int start = ++currentPos;
-        while (sourceCode[currentPos] != '"' && sourceCode[currentPos] != '\0') {
-            currentPos++;
-        }
-        if (sourceCode[currentPos] == '\0') {
+    if (c == '"') {
+        const char *end = lexer.scanString(start + 1);
+        size_t close = (size_t)(end - sourceCode);
+        if (close >= sourceLength || *end == '\0') {
             error("Unterminated string literal");
         }
-        strncpy(token.lexeme, sourceCode + start, currentPos - start);
-        token.lexeme[currentPos - start] = '\0';
+        token.offset = (uint32_t)(currentPos + 1);
+        token.length = (uint32_t)(close - currentPos - 1);
         token.type = TOKEN_STRING_LITERAL;
-        currentPos++;
+        currentPos = close + 1;
         return token;
     }
 
     // Operators and punctuation
-    char c = sourceCode[currentPos++];
+    currentPos++;
     switch (c) {
+        case '&': case '|':
+            if (sourceCode[currentPos] != (char)c) {
+                error("Unexpected character");
+            }
+            token.type = TOKEN_LOGICAL_OPERATOR;
+            token.length = 2;
+            currentPos++;
+            break;
+        case '!':
+            if (sourceCode[currentPos] == '=') {  // Inequality (!=)
+                token.type = TOKEN_COMPARATOR;
+                token.length = 2;
+                currentPos++;
+            } else {
+                token.type = TOKEN_LOGICAL_OPERATOR;
+            }
+            break;
         case '+': case '-': case '*': case '/':
             token.type = TOKEN_OPERATOR;
-            token.lexeme[0] = c;
-            token.lexeme[1] = '\0';
             break;
         case '=':
 		    if (sourceCode[currentPos] == '=') {  // Check for equality operator (==)
 		        token.type = TOKEN_COMPARATOR;
-		        token.lexeme[0] = c;
-		        token.lexeme[1] = '=';
-		        token.lexeme[2] = '\0';
+		        token.length = 2;
 		        currentPos++;
 		    } else {  // Assignment operator (=)
 		        token.type = TOKEN_ASSIGN;
-		        token.lexeme[0] = c;
-		        token.lexeme[1] = '\0';
 		    }
 		    break;
-		case '!': case '<': case '>':
+		case '<': case '>':
 		    token.type = TOKEN_COMPARATOR;
-		    token.lexeme[0] = c;
-		    token.lexeme[1] = '\0';
 		    if (sourceCode[currentPos] == '=') {
-		        token.lexeme[1] = '=';
-		        token.lexeme[2] = '\0';
+		        token.length = 2;
 		        currentPos++;
 		    }
 		    break;
-        case '(': token.type = TOKEN_LPAREN; strcpy(token.lexeme, "("); break;
-        case ')': token.type = TOKEN_RPAREN; strcpy(token.lexeme, ")"); break;
-        case '[': token.type = TOKEN_LBRACKET; strcpy(token.lexeme, "["); break;
-        case ']': token.type = TOKEN_RBRACKET; strcpy(token.lexeme, "]"); break;
-        case '{': token.type = TOKEN_LBRACE; strcpy(token.lexeme, "{"); break;
-        case '}': token.type = TOKEN_RBRACE; strcpy(token.lexeme, "}"); break;
-        case ';': token.type = TOKEN_SEMICOLON; strcpy(token.lexeme, ";"); break;
-        case ',': token.type = TOKEN_COMMA; strcpy(token.lexeme, ","); break;
-        case '.': token.type = TOKEN_DOT; strcpy(token.lexeme, "."); break;
+        case '(': token.type = TOKEN_LPAREN; break;
+        case ')': token.type = TOKEN_RPAREN; break;
+        case '[': token.type = TOKEN_LBRACKET; break;
+        case ']': token.type = TOKEN_RBRACKET; break;
+        case '{': token.type = TOKEN_LBRACE; break;
+        case '}': token.type = TOKEN_RBRACE; break;
+        case ';': token.type = TOKEN_SEMICOLON; break;
+        case ',': token.type = TOKEN_COMMA; break;
+        case '.': token.type = TOKEN_DOT; break;
         default:
             error("Unexpected character");
     }
@@ -228,476 +754,8786 @@ Token getNextToken() {
 
 // Print token for debugging
 void printToken(Token token) {
-    printf("Token: %-15s Lexeme: %s\n", 
-        (token.type == TOKEN_VAR) ? "TOKEN_VAR" :
-        (token.type == TOKEN_ACTION) ? "TOKEN_ACTION" :
-        (token.type == TOKEN_MAIN) ? "TOKEN_MAIN" :
-        (token.type == TOKEN_IF) ? "TOKEN_IF" :
-        (token.type == TOKEN_ELIF) ? "TOKEN_ELIF" :
-        (token.type == TOKEN_ELSE) ? "TOKEN_ELSE" :
-        (token.type == TOKEN_IDENTIFIER) ? "TOKEN_IDENTIFIER" :
-        (token.type == TOKEN_NUMBER) ? "TOKEN_NUMBER" :
-        (token.type == TOKEN_OPERATOR) ? "TOKEN_OPERATOR" :
-        (token.type == TOKEN_LOGICAL_OPERATOR) ? "TOKEN_LOGICAL_OPERATOR" :
-        (token.type == TOKEN_EOF) ? "TOKEN_EOF" : "UNKNOWN",
-        token.lexeme);
-}
-
-// Current token
-Token currentToken;
-
-// Function prototypes for recursive-descent parsing
-void parseGameProgram();
-void parseMain();
-void parseStatements();
-void parseStatement();
-void parsePrint();
-void parseVarDecl();
-void parseAssign();
-void parseActionDecl();
-void parseExpression();
-void parseReturn();
-void parseControlFlow();
-void parseWhile();
-void parseCondition();
-void match(TokenType expectedType);
-void parseInput();
-void parseArguments();
-void parseArrayDecl();
-void parseArrayAccess();
-void parseArrayElements();
-void parseFor();
-void error(const char *message);
+    int length;
+    const char *text = tokenLexeme(token, &length);
+    printf("Token: %-15s Lexeme: %.*s\n", tokenTypeNames[token.type], length, text);
+}
 
-// Get the next token from the lexer
-void advance() {
-    currentToken = getNextToken();
+// Lex the source from `start` up to sourceLength onto the end of the token
+// buffer, ending with TOKEN_EOF
+void lexTokens(size_t start) {
+    currentPos = start;
+    Token token;
+    do {
+        token = getNextToken();
+        if (tokens.count == tokens.capacity) {
+            reserveTokens(tokens.capacity * 2);
+        }
+        tokens.types[tokens.count] = (uint8_t)token.type;
+        tokens.offsets[tokens.count] = token.offset;
+        tokens.lengths[tokens.count] = token.length;
+        tokens.count++;
+    } while (token.type != TOKEN_EOF);
 }
 
-// Match the current token and advance
-void match(TokenType expectedType) {
-    if (currentToken.type == expectedType) {
-        advance();
-    } else {
-        char errorMessage[100];
-        sprintf(errorMessage, "Expected token of type %d, but got '%s'", expectedType, currentToken.lexeme);
-        error(errorMessage);
+// Lex the whole source into the token buffer
+void tokenize() {
+    if (sourceLength > UINT32_MAX) {
+        error("Source file too large");
     }
-}
 
-// Error handling for parsing
-void error(const char *message) {
-    fprintf(stderr, "Syntax Error: %s\n", message);
-    exit(EXIT_FAILURE);
+    // Most programs average well over four bytes per token
+    tokens.count = 0;
+    reserveTokens(sourceLength / 4 + 16);
+    lexTokens(0);
+
+    stats.tokens = tokens.count;
+    TRACE(TRACE_LEX, TRACE_INFO, "%zu tokens (%s scanners)", tokens.count, lexer.name);
 }
 
-// Parse <GameProgram>
-void parseGameProgram() {
-    while (currentToken.type == TOKEN_ACTION || currentToken.type == TOKEN_MAIN) {
-        if (currentToken.type == TOKEN_ACTION) {
-            parseActionDecl();
-        } else if (currentToken.type == TOKEN_MAIN) {
-            parseMain();
-        }
+// Tally tokens per type. Done after lexing so tokenize() stays lean.
+void countTokenTypes() {
+    memset(stats.tokensByType, 0, sizeof(stats.tokensByType));
+    for (size_t i = 0; i < tokens.count; i++) {
+        stats.tokensByType[tokens.types[i]]++;
     }
+}
 
-    if (currentToken.type != TOKEN_EOF) {
-        error("Unexpected tokens at the end of the program");
+// Read a token back from the buffer. Reads past the end yield the EOF token.
+Token tokenAt(size_t index) {
+    if (index >= tokens.count) {
+        index = tokens.count - 1;
     }
+    Token token;
+    token.type = (TokenType)tokens.types[index];
+    token.offset = tokens.offsets[index];
+    token.length = tokens.lengths[index];
+    return token;
 }
 
-// Parse <Main>
-void parseMain() {
-    match(TOKEN_MAIN);
-    match(TOKEN_LBRACE);
-    parseStatements();
-    match(TOKEN_RBRACE);
+void freeTokens() {
+    free(tokens.types);
+    free(tokens.offsets);
+    free(tokens.lengths);
+    memset(&tokens, 0, sizeof(tokens));
 }
 
-// Parse <Statements>
-void parseStatements() {
-    while (currentToken.type == TOKEN_VAR || currentToken.type == TOKEN_PRINT || 
-           currentToken.type == TOKEN_IDENTIFIER || currentToken.type == TOKEN_RETURN ||
-           currentToken.type == TOKEN_IF || currentToken.type == TOKEN_WHILE || 
-           currentToken.type == TOKEN_FOR || currentToken.type == TOKEN_ACTION||
-		   currentToken.type == TOKEN_ARRAY || currentToken.type == TOKEN_ASSIGN) { 
-        parseStatement();
+
+// Current token and its index in the token buffer
+COMPILATION_LOCAL Token currentToken;
+COMPILATION_LOCAL size_t tokenIndex = 0;
+
+// AST node kinds. Children are 32-bit node indices, 0 meaning none, and
+// lists (statements, parameters, arguments, elements) are chained by `next`.
+// Slots and function indices are filled in by the resolver (see below).
+typedef enum {
+    AST_NONE,
+    AST_PROGRAM,     // a = first declaration
+    AST_ACTION,      // token = name, a = first parameter, b = first statement, c = slot count, d = function
+    AST_MAIN,        // token = 'main', b = first statement, c = slot count, d = function
+    AST_PARAM,       // token = name, b = slot
+    AST_VAR_DECL,    // token = name, a = initializer, b = slot
+    AST_ARRAY_DECL,  // token = name, a = size, b = first element, c = slot
+    AST_ASSIGN,      // token = target name, a = value, b = slot
+    AST_EXPR_STMT,   // a = expression (an action call)
+    AST_PRINT,       // a = expression
+    AST_RETURN,      // a = expression
+    AST_IF,          // a = condition, b = first statement, c = AST_IF (elif) or AST_BLOCK (else)
+    AST_BLOCK,       // b = first statement
+    AST_WHILE,       // a = condition, b = first statement
+    AST_FOR,         // a = initializer, b = first statement, c = condition, d = step
+    AST_NUMBER,      // token = literal, value in b (low) and c (high)
+    AST_STRING,      // token = literal
+    AST_IDENTIFIER,  // token = name, b = slot
+    AST_INPUT,       // a = prompt (AST_STRING) or 0
+    AST_BINARY,      // op, a = left, b = right
+    AST_UNARY,       // op, a = operand
+    AST_CALL,        // a = callee, b = first argument, c = function
+    AST_METHOD,      // token = method name, a = receiver, b = first argument
+    AST_INDEX,       // a = array, b = index
+    AST_KIND_COUNT
+} AstKind;
+
+const char *astKindNames[AST_KIND_COUNT] = {
+    "None", "Program", "Action", "Main", "Param", "VarDecl", "ArrayDecl", "Assign", "ExprStmt",
+    "Print", "Return", "If", "Block", "While", "For", "Number", "String", "Identifier", "Input",
+    "Binary", "Unary", "Call", "Method", "Index"
+};
+
+typedef enum {
+    OPERATOR_NONE,
+    OPERATOR_ADD, OPERATOR_SUB, OPERATOR_MUL, OPERATOR_DIV,
+    OPERATOR_EQ, OPERATOR_NE, OPERATOR_LT, OPERATOR_LE, OPERATOR_GT, OPERATOR_GE,
+    OPERATOR_AND, OPERATOR_OR, OPERATOR_NOT, OPERATOR_NEG,
+    OPERATOR_COUNT
+} Operator;
+
+const char *operatorNames[OPERATOR_COUNT] = {
+    "", "+", "-", "*", "/", "==", "!=", "<", "<=", ">", ">=", "&&", "||", "!", "-"
+};
+
+// Which of a, b, c, d hold child nodes; the rest hold slots or numbers
+enum { CHILD_A = 1, CHILD_B = 2, CHILD_C = 4, CHILD_D = 8 };
+
+const uint8_t astChildren[AST_KIND_COUNT] = {
+    [AST_PROGRAM] = CHILD_A, [AST_ACTION] = CHILD_A | CHILD_B, [AST_MAIN] = CHILD_B,
+    [AST_VAR_DECL] = CHILD_A, [AST_ARRAY_DECL] = CHILD_A | CHILD_B, [AST_ASSIGN] = CHILD_A,
+    [AST_EXPR_STMT] = CHILD_A, [AST_PRINT] = CHILD_A, [AST_RETURN] = CHILD_A,
+    [AST_IF] = CHILD_A | CHILD_B | CHILD_C, [AST_BLOCK] = CHILD_B, [AST_WHILE] = CHILD_A | CHILD_B,
+    [AST_FOR] = CHILD_A | CHILD_B | CHILD_C | CHILD_D, [AST_INPUT] = CHILD_A,
+    [AST_BINARY] = CHILD_A | CHILD_B, [AST_UNARY] = CHILD_A, [AST_CALL] = CHILD_A | CHILD_B,
+    [AST_METHOD] = CHILD_A | CHILD_B, [AST_INDEX] = CHILD_A | CHILD_B
+};
+
+// Node flags
+enum {
+    AST_FLAG_CALL = 1 << 0,   // AST_METHOD written with parentheses
+    AST_FLAG_FOLDED = 1 << 1  // AST_STRING built by the optimizer: a = offset in ast.text, b = length
+};
+
+typedef struct {
+    uint8_t kind;
+    uint8_t op;
+    uint16_t flags;
+    uint32_t token;   // Token index, for the lexeme and source position
+    uint32_t a, b, c, d;
+    uint32_t next;
+} AstNode;
+
+// Bump arena for AST nodes: one block, grown geometrically, freed at once.
+// Node 0 is reserved so that 0 can mean "no node".
+typedef struct {
+    AstNode *nodes;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t root;
+    char *text;             // Strings the optimizer builds by folding
+    uint32_t textLength;
+    uint32_t textCapacity;
+} AstArena;
+
+COMPILATION_LOCAL AstArena ast;
+
+void initAst(size_t expectedNodes) {
+    ast.capacity = expectedNodes < 64 ? 64 : (uint32_t)expectedNodes;
+    ast.nodes = malloc((size_t)ast.capacity * sizeof(AstNode));
+    if (ast.nodes == NULL) {
+        sourceOutOfMemory();
     }
+    memset(&ast.nodes[0], 0, sizeof(AstNode));
+    ast.count = 1;
+    ast.root = 0;
 }
 
-
-// Parse <Statement>
-void parseStatement() {
-    if (currentToken.type == TOKEN_VAR) {
-        parseVarDecl();
-    } else if (currentToken.type == TOKEN_ACTION) {
-        parseActionDecl();  // Allow action declarations within blocks
-    } else if (currentToken.type == TOKEN_PRINT) {
-		parsePrint();
-    }else if (currentToken.type == TOKEN_ARRAY) {
-		parseArrayDecl();
-    } else if (currentToken.type == TOKEN_FOR) {
-		parseFor();
-    } else if (currentToken.type == TOKEN_IDENTIFIER) {
-        // This can be an assignment or a function call
-        advance();  // Consume the identifier
-        if (currentToken.type == TOKEN_ASSIGN) {
-			parseAssign();
-        } else if (currentToken.type == TOKEN_LPAREN) {
-            // Function call
-            match(TOKEN_LPAREN);
-            // Handle arguments here (if necessary)
-            match(TOKEN_RPAREN);
-            match(TOKEN_SEMICOLON);
-        } else {
-            error("Unexpected token after identifier");
+uint32_t newNode(AstKind kind, uint32_t token) {
+    if (ast.count == ast.capacity) {
+        if (ast.capacity > UINT32_MAX / 2) {
+            error("Program too large");
         }
-    } else if (currentToken.type == TOKEN_RETURN) {
-		parseReturn();
-	} else if (currentToken.type == TOKEN_IF) {
-        parseControlFlow();
-    } else if (currentToken.type == TOKEN_WHILE) {
-        parseWhile();
-    } else {
-        error("Unexpected token in statement");
+        AstNode *grown = realloc(ast.nodes, (size_t)ast.capacity * 2 * sizeof(AstNode));
+        if (grown == NULL) {
+            sourceOutOfMemory();
+        }
+        ast.nodes = grown;
+        ast.capacity *= 2;
     }
+    uint32_t index = ast.count++;
+    AstNode *node = &ast.nodes[index];
+    memset(node, 0, sizeof(AstNode));
+    node->kind = (uint8_t)kind;
+    node->token = token;
+    return index;
 }
 
-//Parse <Print>
-void parsePrint(){
-    match(TOKEN_PRINT);
-    match(TOKEN_LPAREN);
-    parseExpression();
-    match(TOKEN_RPAREN);
-    match(TOKEN_SEMICOLON);
+// Make room for `length` more bytes of folded text; returns their offset
+uint32_t reserveAstText(uint32_t length) {
+    if (ast.textLength + length > ast.textCapacity) {
+        uint32_t capacity = ast.textCapacity;
+        while (capacity < ast.textLength + length) {
+            capacity = capacity ? capacity * 2 : 256;
+        }
+        char *grown = realloc(ast.text, capacity);
+        if (grown == NULL) {
+            sourceOutOfMemory();
+        }
+        ast.text = grown;
+        ast.textCapacity = capacity;
+    }
+    return ast.textLength;
 }
 
-
-// Parse <VarDecl>
-void parseVarDecl() {
-    match(TOKEN_VAR);
-    match(TOKEN_IDENTIFIER);
-    match(TOKEN_ASSIGN);
-    parseExpression();
-    match(TOKEN_SEMICOLON);
+// Release the whole tree in one step
+void freeAst() {
+    free(ast.text);
+    free(ast.nodes);
+    memset(&ast, 0, sizeof(ast));
 }
 
+#define NODE(index) (ast.nodes[index])
 
+// Contents of an AST_STRING, from the source or from the folded text
+const char *stringNodeText(uint32_t index, uint32_t *length) {
+    if (NODE(index).flags & AST_FLAG_FOLDED) {
+        *length = NODE(index).b;
+        return ast.text + NODE(index).a;
+    }
+    Token literal = tokenAt(NODE(index).token);
+    *length = literal.length;
+    return sourceCode + literal.offset;
+}
 
-// Parse <Assign>
-void parseAssign(){
-	match(TOKEN_ASSIGN);
-	parseExpression();
-    match(TOKEN_SEMICOLON);
+int64_t nodeNumber(uint32_t index) {
+    return (int64_t)((uint64_t)NODE(index).b | ((uint64_t)NODE(index).c << 32));
 }
 
-// Parse <ActionDecl>
-void parseActionDecl() {
-    match(TOKEN_ACTION);
-    match(TOKEN_IDENTIFIER);
-    match(TOKEN_LPAREN);
-    parseArguments();
-    match(TOKEN_RPAREN);
-    match(TOKEN_LBRACE);
-    parseStatements();
-    match(TOKEN_RBRACE);
+void setNodeNumber(uint32_t index, int64_t value) {
+    NODE(index).b = (uint32_t)(uint64_t)value;
+    NODE(index).c = (uint32_t)((uint64_t)value >> 32);
 }
 
-// Parse <Expression>
-void parseExpression() {
-    // Handle the first operand
-    if (currentToken.type == TOKEN_NUMBER || 
-        currentToken.type == TOKEN_STRING_LITERAL || 
-        currentToken.type == TOKEN_IDENTIFIER || 
-        currentToken.type == TOKEN_INPUT) {
-        
-        // Handle input
-        if (currentToken.type == TOKEN_INPUT) {
-            advance(); // Consume the 'input' token
-            match(TOKEN_LPAREN);
-            if (currentToken.type == TOKEN_STRING_LITERAL) {
-                advance(); // Consume prompt string
+// Appends to a `next`-linked list, tracking its first and last node
+typedef struct {
+    uint32_t first;
+    uint32_t last;
+} NodeList;
+
+void appendNode(NodeList *list, uint32_t node) {
+    if (list->first == 0) {
+        list->first = node;
+    } else {
+        NODE(list->last).next = node;
+    }
+    list->last = node;
+}
+
+// Kinds whose token is a name worth printing
+int astHasName(AstKind kind) {
+    switch (kind) {
+        case AST_ACTION: case AST_PARAM: case AST_VAR_DECL: case AST_ARRAY_DECL:
+        case AST_ASSIGN: case AST_IDENTIFIER: case AST_METHOD:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+#define SLOT_UNRESOLVED UINT32_MAX
+
+// Kinds that carry a variable slot
+int astSlotKind(AstKind kind) {
+    switch (kind) {
+        case AST_PARAM: case AST_VAR_DECL: case AST_ARRAY_DECL: case AST_ASSIGN: case AST_IDENTIFIER:
+            return 1;
+        default:
+            return 0;
+    }
+}
+
+void *growArray(void *items, uint32_t *capacity, size_t itemSize, uint32_t minimum);
+
+// Nodes still to visit in a walk over a whole tree. A long chain like
+// `a + b + ... + z` nests one node per operator, deeper than the native
+// stack goes, so these walks keep their own stack.
+typedef struct {
+    uint32_t *nodes;
+    uint32_t count;
+    uint32_t capacity;
+} NodeStack;
+
+void pushNode(NodeStack *stack, uint32_t value) {
+    if (stack->count == stack->capacity) {
+        stack->nodes = growArray(stack->nodes, &stack->capacity, sizeof(uint32_t), 64);
+    }
+    stack->nodes[stack->count++] = value;
+}
+
+// Push the child lists of a node, the first child last so it is visited first
+void pushChildren(NodeStack *stack, uint32_t index) {
+    AstNode *node = &NODE(index);
+    uint32_t children[4] = {node->a, node->b, node->c, node->d};
+    uint8_t mask = astChildren[node->kind];
+    for (int i = 3; i >= 0; i--) {
+        if ((mask & (CHILD_A << i)) && children[i] != 0) {
+            pushNode(stack, children[i]);
+        }
+    }
+}
+
+// Left-nested chains being optimized or compiled, innermost last. Walks
+// of operands nested in a chain push above it.
+COMPILATION_LOCAL NodeStack spine;
+
+// Print the tree for --dump-ast
+void printAst(uint32_t index, int depth) {
+    // Entries are node and depth pairs
+    NodeStack stack = {0};
+    if (index != 0) {
+        pushNode(&stack, index);
+        pushNode(&stack, (uint32_t)depth);
+    }
+    while (stack.count > 0) {
+        depth = (int)stack.nodes[--stack.count];
+        index = stack.nodes[--stack.count];
+        AstNode *node = &NODE(index);
+        Token token = tokenAt(node->token);
+        if (node->next != 0) {
+            pushNode(&stack, node->next);
+            pushNode(&stack, (uint32_t)depth);
+        }
+        printf("%*s%s", depth * 2, "", astKindNames[node->kind]);
+        if (node->op != OPERATOR_NONE) {
+            printf(" %s", operatorNames[node->op]);
+        }
+        if (node->kind == AST_NUMBER) {
+            printf(" %lld\n", (long long)nodeNumber(index));
+            continue;
+        }
+        if (node->kind == AST_STRING) {
+            uint32_t length;
+            const char *text = stringNodeText(index, &length);
+            printf(" \"%.*s\"", (int)length, text);
+        } else if (astHasName((AstKind)node->kind)) {
+            printf(" %.*s", (int)token.length, sourceCode + token.offset);
+        }
+        uint32_t slot = node->kind == AST_ARRAY_DECL ? node->c : node->b;
+        if (astSlotKind((AstKind)node->kind) && slot != SLOT_UNRESOLVED) {
+            printf(" @%u", slot);
+        }
+        printf("\n");
+        uint32_t children[4] = {node->a, node->b, node->c, node->d};
+        uint8_t mask = astChildren[node->kind];
+        for (int i = 3; i >= 0; i--) {
+            if ((mask & (CHILD_A << i)) && children[i] != 0) {
+                pushNode(&stack, children[i]);
+                pushNode(&stack, (uint32_t)depth + 1);
             }
-            match(TOKEN_RPAREN);
-        } else {
-            advance();  // Consume the token
         }
+    }
+    free(stack.nodes);
+}
 
-        // Handle potential array access
-        if (currentToken.type == TOKEN_LBRACKET) {
-            parseArrayAccess();
-        }
-
-        // Handle potential action/method calls and method chaining
-        while (currentToken.type == TOKEN_DOT || currentToken.type == TOKEN_LPAREN) {
-            if (currentToken.type == TOKEN_DOT) {
-                match(TOKEN_DOT);
-                if (currentToken.type == TOKEN_IDENTIFIER) {
-                    advance(); // Consume method name
-                    
-                    // Optional method call with parentheses
-                    if (currentToken.type == TOKEN_LPAREN) {
-                        match(TOKEN_LPAREN);
-                        // Optional arguments
-                        if (currentToken.type != TOKEN_RPAREN) {
-                            parseExpression(); // Parse first argument
-                            while (currentToken.type == TOKEN_COMMA) {
-                                match(TOKEN_COMMA);
-                                parseExpression();
-                            }
-                        }
-                        match(TOKEN_RPAREN);
-                    }
-                } else {
-                    error("Expected method name after '.'");
-                }
-            } 
-            // Handle action/function calls
-            else if (currentToken.type == TOKEN_LPAREN) {
-                match(TOKEN_LPAREN);
-                // Optional arguments
-                if (currentToken.type != TOKEN_RPAREN) {
-                    parseExpression(); // Parse first argument
-                    while (currentToken.type == TOKEN_COMMA) {
-                        match(TOKEN_COMMA);
-                        parseExpression();
-                    }
-                }
-                match(TOKEN_RPAREN);
+// Symbol table. Identifiers are interned while parsing, so the compiler
+// and VM only ever see small integers.
+typedef struct {
+    const char **text;
+    uint32_t *lengths;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t *slots;        // Open-addressed hash of name indices + 1
+    uint32_t slotCount;
+} NameTable;
+
+void *growArray(void *items, uint32_t *capacity, size_t itemSize, uint32_t minimum) {
+    uint32_t grown = *capacity < minimum ? minimum : *capacity * 2;
+    void *result = realloc(items, (size_t)grown * itemSize);
+    if (result == NULL) {
+        sourceOutOfMemory();
+    }
+    *capacity = grown;
+    return result;
+}
+
+uint32_t hashText(const char *text, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+        hash = (hash ^ (unsigned char)text[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Return the index of `text`, adding it the first time it is seen
+uint32_t internName(NameTable *table, const char *text, uint32_t length) {
+    if ((table->count + 1) * 2 > table->slotCount) {
+        uint32_t slotCount = table->slotCount ? table->slotCount * 2 : 64;
+        uint32_t *slots = calloc(slotCount, sizeof(uint32_t));
+        if (slots == NULL) {
+            sourceOutOfMemory();
+        }
+        for (uint32_t i = 0; i < table->count; i++) {
+            uint32_t slot = hashText(table->text[i], table->lengths[i]) & (slotCount - 1);
+            while (slots[slot] != 0) {
+                slot = (slot + 1) & (slotCount - 1);
             }
+            slots[slot] = i + 1;
         }
-    } 
-    // Handle parenthesized sub-expressions
-    else if (currentToken.type == TOKEN_LPAREN) {
-        match(TOKEN_LPAREN);
-        parseExpression();
-        match(TOKEN_RPAREN);
-    } 
-    else {
-        error("Invalid expression");
+        free(table->slots);
+        table->slots = slots;
+        table->slotCount = slotCount;
     }
 
-    // Handle operators and subsequent operands
-    while (currentToken.type == TOKEN_OPERATOR || 
-           currentToken.type == TOKEN_COMPARATOR || 
-           currentToken.type == TOKEN_LOGICAL_OPERATOR) {
-        advance();  // Consume the operator
-        parseExpression();  // Parse the next operand or sub-expression
+    uint32_t slot = hashText(text, length) & (table->slotCount - 1);
+    while (table->slots[slot] != 0) {
+        uint32_t index = table->slots[slot] - 1;
+        if (table->lengths[index] == length && memcmp(table->text[index], text, length) == 0) {
+            return index;
+        }
+        slot = (slot + 1) & (table->slotCount - 1);
+    }
+
+    if (table->count == table->capacity) {
+        uint32_t capacity = table->capacity;
+        table->text = growArray(table->text, &capacity, sizeof(const char *), 64);
+        table->lengths = growArray(table->lengths, &table->capacity, sizeof(uint32_t), 64);
     }
+    table->text[table->count] = text;
+    table->lengths[table->count] = length;
+    table->slots[slot] = table->count + 1;
+    return table->count++;
 }
 
-// Helper function to parse arguments for method calls or action calls
-void parseArguments() {
-    if (currentToken.type != TOKEN_RPAREN) { // If there are arguments
-        parseExpression(); // Parse the first argument
-        while (currentToken.type == TOKEN_COMMA) { // Handle additional arguments
-            match(TOKEN_COMMA);
-            parseExpression();
+COMPILATION_LOCAL NameTable names;
+
+uint32_t internToken(uint32_t token) {
+    Token at = tokenAt(token);
+    return internName(&names, sourceCode + at.offset, at.length);
+}
+
+void freeNameTable(NameTable *table) {
+    free(table->text);
+    free(table->lengths);
+    free(table->slots);
+    memset(table, 0, sizeof(*table));
+}
+
+// Scope resolution. While parsing, the variables in scope sit on a stack;
+// a variable's slot is its position above the first variable of the
+// enclosing action, so slots are reused once a block closes. Calls are
+// bound to function indices after parsing, when every action is known.
+typedef struct {
+    uint32_t name;
+    uint32_t depth;         // Block depth of the declaration
+} Local;
+
+// Later passes walk left-nested operator chains in loops but recurse into
+// blocks and other operands, so how deeply those nest is limited
+#define NESTING_MAX 1000
+
+typedef struct {
+    Local *locals;
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t functionBase;  // First local of the action being parsed
+    uint32_t depth;
+    uint32_t nesting;       // Blocks and actions around the current one
+    uint32_t slotCount;     // Most slots the current action needs at once
+    uint32_t *functions;    // AST_ACTION / AST_MAIN nodes, in declaration order
+    uint32_t functionCount;
+    uint32_t functionCapacity;
+    uint32_t *calls;        // AST_CALL nodes waiting for a function index
+    uint32_t callCount;
+    uint32_t callCapacity;
+} Resolver;
+
+COMPILATION_LOCAL Resolver resolver;
+
+// Per-action state saved while a nested action is parsed
+typedef struct {
+    uint32_t functionBase;
+    uint32_t depth;
+    uint32_t slotCount;
+} FunctionScope;
+
+FunctionScope beginFunction(uint32_t node) {
+    FunctionScope saved = {resolver.functionBase, resolver.depth, resolver.slotCount};
+    if (++resolver.nesting >= NESTING_MAX) {
+        error("Blocks nested too deeply");
+    }
+    if (resolver.functionCount == resolver.functionCapacity) {
+        resolver.functions = growArray(resolver.functions, &resolver.functionCapacity, sizeof(uint32_t), 16);
+    }
+    NODE(node).d = resolver.functionCount;
+    resolver.functions[resolver.functionCount++] = node;
+    resolver.functionBase = resolver.count;
+    resolver.depth = 0;
+    resolver.slotCount = 0;
+    return saved;
+}
+
+void endFunction(uint32_t node, FunctionScope saved) {
+    NODE(node).c = resolver.slotCount;
+    resolver.count = resolver.functionBase;
+    resolver.functionBase = saved.functionBase;
+    resolver.depth = saved.depth;
+    resolver.slotCount = saved.slotCount;
+    resolver.nesting--;
+}
+
+void beginScope() {
+    resolver.depth++;
+    if (++resolver.nesting >= NESTING_MAX) {
+        error("Blocks nested too deeply");
+    }
+}
+
+void endScope() {
+    resolver.depth--;
+    resolver.nesting--;
+    while (resolver.count > resolver.functionBase && resolver.locals[resolver.count - 1].depth > resolver.depth) {
+        resolver.count--;
+    }
+}
+
+// Give the name at `token` a slot in the current scope. Declaring a name
+// twice in the same scope reuses its slot.
+uint32_t declareLocal(uint32_t token) {
+    uint32_t name = internToken(token);
+    for (uint32_t i = resolver.count; i > resolver.functionBase && resolver.locals[i - 1].depth == resolver.depth; i--) {
+        if (resolver.locals[i - 1].name == name) {
+            return i - 1 - resolver.functionBase;
         }
     }
+    if (resolver.count == resolver.capacity) {
+        resolver.locals = growArray(resolver.locals, &resolver.capacity, sizeof(Local), 64);
+    }
+    resolver.locals[resolver.count].name = name;
+    resolver.locals[resolver.count].depth = resolver.depth;
+    resolver.count++;
+    uint32_t slot = resolver.count - 1 - resolver.functionBase;
+    if (slot + 1 > resolver.slotCount) {
+        resolver.slotCount = slot + 1;
+    }
+    return slot;
 }
 
+// Slot of the innermost visible variable named at `token`
+uint32_t resolveLocal(uint32_t token) {
+    uint32_t name = internToken(token);
+    for (uint32_t i = resolver.count; i > resolver.functionBase; i--) {
+        if (resolver.locals[i - 1].name == name) {
+            return i - 1 - resolver.functionBase;
+        }
+    }
+    return SLOT_UNRESOLVED;
+}
 
-//Parse <Return>
-void parseReturn(){
-    match(TOKEN_RETURN);
-    parseExpression();
-    match(TOKEN_SEMICOLON);
+void addCall(uint32_t call) {
+    if (resolver.callCount == resolver.callCapacity) {
+        resolver.calls = growArray(resolver.calls, &resolver.callCapacity, sizeof(uint32_t), 64);
+    }
+    resolver.calls[resolver.callCount++] = call;
 }
 
-//Parse <ControlFlow>
-void parseControlFlow() {
-    match(TOKEN_IF);
-    match(TOKEN_LPAREN);
-    parseCondition();  // Parse the condition
-    match(TOKEN_RPAREN);
-    match(TOKEN_LBRACE);
-    parseStatements();  // Parse the body of the if
-    match(TOKEN_RBRACE);
+void freeResolver() {
+    free(resolver.locals);
+    free(resolver.functions);
+    free(resolver.calls);
+    memset(&resolver, 0, sizeof(resolver));
+}
 
-    // Check for optional elif or else blocks
-    while (currentToken.type == TOKEN_ELIF) {
-        match(TOKEN_ELIF);
-        match(TOKEN_LPAREN);
-        parseCondition();  // Parse the condition
-        match(TOKEN_RPAREN);
-        match(TOKEN_LBRACE);
-        parseStatements();  // Parse the body of the elif
-        match(TOKEN_RBRACE);
+// Function prototypes for recursive-descent parsing. Each returns the AST
+// node it built (or the first node of a list).
+uint32_t parseGameProgram();
+uint32_t parseDeclarations();
+uint32_t parseMain();
+uint32_t parseStatements();
+uint32_t parseStatement();
+uint32_t parsePrint();
+uint32_t parseVarDecl();
+uint32_t parseAssign(uint32_t nameToken);
+uint32_t parseActionDecl();
+uint32_t parseParameters();
+uint32_t parseExpression();
+uint32_t parseReturn();
+uint32_t parseControlFlow();
+uint32_t parseWhile();
+uint32_t parseCondition();
+void match(TokenType expectedType);
+uint32_t parseInput();
+uint32_t parseArguments();
+uint32_t parseArrayDecl();
+uint32_t parseArrayAccess(uint32_t array);
+uint32_t parseArrayElements();
+uint32_t parseFor();
+void error(const char *message);
+
+// Move to the next token in the buffer
+void advance() {
+    if (tokenIndex + 1 < tokens.count) {
+        tokenIndex++;
     }
+    currentToken = tokenAt(tokenIndex);
+}
 
-    if (currentToken.type == TOKEN_ELSE) {
-        match(TOKEN_ELSE);
-        match(TOKEN_LBRACE);
-        parseStatements();  // Parse the body of the else
-        match(TOKEN_RBRACE);
+// Look at a token after the current one without consuming anything
+Token peekToken(size_t ahead) {
+    return tokenAt(tokenIndex + ahead);
+}
+
+// Match the current token and advance
+void match(TokenType expectedType) {
+    if (currentToken.type == expectedType) {
+        advance();
+    } else {
+        char errorMessage[160];
+        int length;
+        const char *text = tokenLexeme(currentToken, &length);
+        snprintf(errorMessage, sizeof(errorMessage), "Expected token of type %d, but got '%.*s'", expectedType, length, text);
+        error(errorMessage);
     }
 }
 
-// Parse <WhileStatement>
-void parseWhile() {
-    match(TOKEN_WHILE);
-    match(TOKEN_LPAREN);
-    parseCondition();  // Parse the condition
-    match(TOKEN_RPAREN);
+// Error handling for parsing
+void error(const char *message) {
+    failCompilation(stderr, "Syntax Error: %s", message);
+}
+
+// Parse <GameProgram>
+uint32_t parseGameProgram() {
+    uint32_t program = newNode(AST_PROGRAM, (uint32_t)tokenIndex);
+    uint32_t first = parseDeclarations();
+    NODE(program).a = first;
+    return program;
+}
+
+// Parse the actions and main blocks up to the end of the token buffer;
+// returns the first of them
+uint32_t parseDeclarations() {
+    NodeList declarations = {0, 0};
+    while (currentToken.type == TOKEN_ACTION || currentToken.type == TOKEN_MAIN) {
+        if (currentToken.type == TOKEN_ACTION) {
+            appendNode(&declarations, parseActionDecl());
+        } else if (currentToken.type == TOKEN_MAIN) {
+            appendNode(&declarations, parseMain());
+        }
+    }
+
+    if (currentToken.type != TOKEN_EOF) {
+        error("Unexpected tokens at the end of the program");
+    }
+    return declarations.first;
+}
+
+// Parse <Main>
+uint32_t parseMain() {
+    uint32_t node = newNode(AST_MAIN, (uint32_t)tokenIndex);
+    FunctionScope scope = beginFunction(node);
+    match(TOKEN_MAIN);
     match(TOKEN_LBRACE);
-    parseStatements();  // Parse the body of the loop
+    uint32_t body = parseStatements();
     match(TOKEN_RBRACE);
+    NODE(node).b = body;
+    endFunction(node, scope);
+    return node;
 }
 
-// Parse <Condition>
-void parseCondition() {
-    // Handle negative numbers
-    if (currentToken.type == TOKEN_OPERATOR && strcmp(currentToken.lexeme, "-") == 0) {
-        advance();  // Consume the '-'
-        if (currentToken.type == TOKEN_NUMBER) {
-            advance();  // Consume the number
-        } else {
-            error("Invalid condition: Expected a number after '-'.");
-        }
-    } 
-    // First operand (number, string, identifier, or sub-expression)
-    else if (currentToken.type == TOKEN_NUMBER || 
-             currentToken.type == TOKEN_STRING_LITERAL || 
-             currentToken.type == TOKEN_IDENTIFIER) {
-        advance();  // Consume the operand
-
-        // Handle dot notation (e.g., numbers.length)
-        while (currentToken.type == TOKEN_DOT) {
-            advance();  // Consume the '.'
-            if (currentToken.type == TOKEN_IDENTIFIER) {
-                advance();  // Consume the property/method name
-
-                // Handle method calls (e.g., length())
-                if (currentToken.type == TOKEN_LPAREN) {
-                    match(TOKEN_LPAREN);
-
-                    // Optionally parse arguments inside parentheses (not required for length())
-                    if (currentToken.type != TOKEN_RPAREN) {
-                        parseCondition();  // Parse the argument
-                        while (currentToken.type == TOKEN_COMMA) {
-                            advance();  // Consume ','
-                            parseCondition();  // Parse the next argument
-                        }
-                    }
+// Parse <Statements>
+uint32_t parseStatements() {
+    NodeList statements = {0, 0};
+    while (currentToken.type == TOKEN_VAR || currentToken.type == TOKEN_PRINT || 
+           currentToken.type == TOKEN_IDENTIFIER || currentToken.type == TOKEN_RETURN ||
+           currentToken.type == TOKEN_IF || currentToken.type == TOKEN_WHILE || 
+           currentToken.type == TOKEN_FOR || currentToken.type == TOKEN_ACTION||
+		   currentToken.type == TOKEN_ARRAY || currentToken.type == TOKEN_ASSIGN) { 
+        appendNode(&statements, parseStatement());
+    }
+    return statements.first;
+}
 
-                    match(TOKEN_RPAREN);  // Match closing ')'
-                }
-            } else {
-                error("Invalid dot notation: Expected identifier after '.'.");
-            }
-        }
-    } else if (currentToken.type == TOKEN_LPAREN) { // Handle parentheses for sub-conditions
-        match(TOKEN_LPAREN);
-        parseCondition();
-        match(TOKEN_RPAREN);
-    } else if (currentToken.type == TOKEN_LOGICAL_OPERATOR && strcmp(currentToken.lexeme, "!") == 0) {
-        advance();  // Consume the '!'
-        if (currentToken.type == TOKEN_LPAREN) {
+
+// Parse <Statement>
+uint32_t parseStatement() {
+    if (currentToken.type == TOKEN_VAR) {
+        return parseVarDecl();
+    } else if (currentToken.type == TOKEN_ACTION) {
+        return parseActionDecl();  // Allow action declarations within blocks
+    } else if (currentToken.type == TOKEN_PRINT) {
+		return parsePrint();
+    }else if (currentToken.type == TOKEN_ARRAY) {
+		return parseArrayDecl();
+    } else if (currentToken.type == TOKEN_FOR) {
+		return parseFor();
+    } else if (currentToken.type == TOKEN_IDENTIFIER) {
+        // This can be an assignment or a function call
+        uint32_t nameToken = (uint32_t)tokenIndex;
+        advance();  // Consume the identifier
+        if (currentToken.type == TOKEN_ASSIGN) {
+			return parseAssign(nameToken);
+        } else if (currentToken.type == TOKEN_LPAREN) {
+            // Function call
+            uint32_t statement = newNode(AST_EXPR_STMT, nameToken);
+            uint32_t call = newNode(AST_CALL, nameToken);
+            uint32_t callee = newNode(AST_IDENTIFIER, nameToken);
             match(TOKEN_LPAREN);
-            parseCondition();
+            uint32_t arguments = parseArguments();
             match(TOKEN_RPAREN);
+            match(TOKEN_SEMICOLON);
+            NODE(call).a = callee;
+            NODE(call).b = arguments;
+            NODE(callee).b = SLOT_UNRESOLVED;
+            NODE(statement).a = call;
+            addCall(call);
+            return statement;
         } else {
-            parseCondition();  // Parse the operand directly
+            error("Unexpected token after identifier");
         }
+    } else if (currentToken.type == TOKEN_RETURN) {
+		return parseReturn();
+	} else if (currentToken.type == TOKEN_IF) {
+        return parseControlFlow();
+    } else if (currentToken.type == TOKEN_WHILE) {
+        return parseWhile();
     } else {
-        error("Invalid condition: Expected operand or sub-condition.");
-    }
-
-    // Optional comparator or logical operator
-    while (currentToken.type == TOKEN_COMPARATOR || 
-           (currentToken.type == TOKEN_LOGICAL_OPERATOR && 
-            (strcmp(currentToken.lexeme, "&&") == 0 || strcmp(currentToken.lexeme, "||") == 0))) {
-        advance();  // Consume the operator
-        parseCondition();  // Parse the next condition
+        error("Unexpected token in statement");
     }
+    return 0;
 }
 
-
-// Parse <Input>
-void parseInput() {
-    match(TOKEN_INPUT);
+//Parse <Print>
+uint32_t parsePrint(){
+    uint32_t node = newNode(AST_PRINT, (uint32_t)tokenIndex);
+    match(TOKEN_PRINT);
     match(TOKEN_LPAREN);
-    if (currentToken.type == TOKEN_STRING_LITERAL) {
-        advance(); // Consume the string literal
-    } else {
-        error("Expected a string literal for input prompt");
-    }
+    uint32_t value = parseExpression();
     match(TOKEN_RPAREN);
     match(TOKEN_SEMICOLON);
+    NODE(node).a = value;
+    return node;
 }
 
-// Parse <ArrayDecl>
-void parseArrayDecl() {
-    match(TOKEN_ARRAY);
+
+// Parse <VarDecl>
+uint32_t parseVarDecl() {
+    match(TOKEN_VAR);
+    uint32_t node = newNode(AST_VAR_DECL, (uint32_t)tokenIndex);
     match(TOKEN_IDENTIFIER);
-    match(TOKEN_LBRACKET);
-    match(TOKEN_NUMBER); 
-    match(TOKEN_RBRACKET);
     match(TOKEN_ASSIGN);
-    match(TOKEN_LBRACE);
-    parseArrayElements();
-    match(TOKEN_RBRACE);
+    uint32_t value = parseExpression();
     match(TOKEN_SEMICOLON);
+    NODE(node).a = value;
+    NODE(node).b = declareLocal(NODE(node).token);  // After the initializer, which sees any outer name
+    return node;
 }
 
-// Parse <ArrayAccess>
 
-void parseArrayAccess(){
-	match(TOKEN_LBRACKET);
-    parseExpression(); 
-    match(TOKEN_RBRACKET); 
+
+// Parse <Assign>; the target identifier has already been consumed
+uint32_t parseAssign(uint32_t nameToken){
+    uint32_t node = newNode(AST_ASSIGN, nameToken);
+	match(TOKEN_ASSIGN);
+	uint32_t value = parseExpression();
+    match(TOKEN_SEMICOLON);
+    NODE(node).a = value;
+    NODE(node).b = resolveLocal(nameToken);
+    return node;
 }
 
-void parseArrayElements() {
-    if (currentToken.type != TOKEN_RPAREN) { // If there are arguments
-        parseExpression(); // Parse the first argument
-        while (currentToken.type == TOKEN_COMMA) { // Handle additional arguments
+// Parse <ActionDecl>
+uint32_t parseActionDecl() {
+    match(TOKEN_ACTION);
+    TRACE(TRACE_PARSE, TRACE_DEBUG, "action %.*s", (int)currentToken.length, sourceCode + currentToken.offset);
+    uint32_t node = newNode(AST_ACTION, (uint32_t)tokenIndex);
+    FunctionScope scope = beginFunction(node);
+    match(TOKEN_IDENTIFIER);
+    match(TOKEN_LPAREN);
+    uint32_t parameters = parseParameters();
+    match(TOKEN_RPAREN);
+    match(TOKEN_LBRACE);
+    uint32_t body = parseStatements();
+    match(TOKEN_RBRACE);
+    NODE(node).a = parameters;
+    NODE(node).b = body;
+    endFunction(node, scope);
+    return node;
+}
+
+// Parse the parameter names of an action; they take the first slots
+uint32_t parseParameters() {
+    NodeList parameters = {0, 0};
+    if (currentToken.type != TOKEN_RPAREN) {
+        appendNode(&parameters, newNode(AST_PARAM, (uint32_t)tokenIndex));
+        match(TOKEN_IDENTIFIER);
+        while (currentToken.type == TOKEN_COMMA) {
             match(TOKEN_COMMA);
-            parseExpression();
+            appendNode(&parameters, newNode(AST_PARAM, (uint32_t)tokenIndex));
+            match(TOKEN_IDENTIFIER);
+        }
+    }
+    for (uint32_t param = parameters.first; param != 0; param = NODE(param).next) {
+        uint32_t count = resolver.count;
+        NODE(param).b = declareLocal(NODE(param).token);
+        if (resolver.count == count) {
+            error("Duplicate parameter name");
         }
     }
+    return parameters.first;
 }
 
-void parseFor(){
-	match(TOKEN_FOR);
-	match(TOKEN_LPAREN);
-	parseVarDecl();
-	parseCondition();
-	match(TOKEN_SEMICOLON);
-	match(TOKEN_IDENTIFIER);
-	match(TOKEN_ASSIGN);
-	parseExpression();
-	match(TOKEN_RPAREN);
-	match(TOKEN_LBRACE);
-	parseStatements();  // Parse the body of the loop
-    match(TOKEN_RBRACE);
+// Expression parsing: operator precedence with explicit stacks instead of
+// one recursive call per operator, so long operator chains and deeply
+// nested parentheses use constant native stack. Only call arguments and
+// index expressions recurse. Operators waiting for their right operand
+// plus enclosing arguments and indexes count towards NESTING_MAX.
+typedef enum {
+    PREC_NONE,
+    PREC_OR,          // ||
+    PREC_AND,         // &&
+    PREC_EQUALITY,    // == !=
+    PREC_COMPARISON,  // < <= > >=
+    PREC_TERM,        // + -
+    PREC_FACTOR,      // * /
+    PREC_UNARY        // ! -
+} Precedence;
+
+typedef struct {
+    uint32_t node;        // Binary or unary node waiting for operands, 0 for '('
+    uint8_t precedence;
+} PendingOperator;
+
+// Stacks shared by nested parseExpression() calls; each call only touches
+// entries above the depth it started at.
+COMPILATION_LOCAL struct {
+    PendingOperator *operators;
+    size_t operatorCount;
+    size_t operatorCapacity;
+    uint32_t *operands;
+    size_t operandCount;
+    size_t operandCapacity;
+    size_t nesting;         // Pending operators and parseOperators() calls in progress
+} exprStack;
+
+void pushOperator(uint32_t node, Precedence precedence) {
+    if (node != 0 && ++exprStack.nesting >= NESTING_MAX) {
+        error("Expression nested too deeply");
+    }
+    if (exprStack.operatorCount == exprStack.operatorCapacity) {
+        exprStack.operatorCapacity = exprStack.operatorCapacity ? exprStack.operatorCapacity * 2 : 64;
+        exprStack.operators = realloc(exprStack.operators, exprStack.operatorCapacity * sizeof(PendingOperator));
+        if (exprStack.operators == NULL) {
+            sourceOutOfMemory();
+        }
+    }
+    exprStack.operators[exprStack.operatorCount].node = node;
+    exprStack.operators[exprStack.operatorCount].precedence = (uint8_t)precedence;
+    exprStack.operatorCount++;
 }
 
-// Main function to test the parser
-int main() {
-    // Specify the .epic file to be read
-    const char *filename = "Function.epic";
-
-    // Read the file content into sourceCode
-    readFile(filename);
-    
-    printf("Source code read from file:\n%s\n", sourceCode);
-    
-    // Print out all tokens before parsing
-    currentPos = 0;  // Reset current position
-    printf("TOKEN DUMP:\n");
-    Token debugToken;
-    do {
-        debugToken = getNextToken();
-        printToken(debugToken);
-    } while (debugToken.type != TOKEN_EOF);
-    
-    currentPos = 0;  // Reset again for parsing
-    
-    advance();  // Initialize the first token
-    parseGameProgram();
-    printf("Parsing completed successfully.\n");
-    return 0;
+void pushOperand(uint32_t node) {
+    if (exprStack.operandCount == exprStack.operandCapacity) {
+        exprStack.operandCapacity = exprStack.operandCapacity ? exprStack.operandCapacity * 2 : 64;
+        exprStack.operands = realloc(exprStack.operands, exprStack.operandCapacity * sizeof(uint32_t));
+        if (exprStack.operands == NULL) {
+            sourceOutOfMemory();
+        }
+    }
+    exprStack.operands[exprStack.operandCount++] = node;
+}
+
+void freeExpressionStacks() {
+    free(exprStack.operators);
+    free(exprStack.operands);
+    memset(&exprStack, 0, sizeof(exprStack));
+}
+
+// Map a binary operator token to its AST operator and precedence
+Operator binaryOperator(Token token, Precedence *precedence) {
+    *precedence = PREC_NONE;
+    if (token.type != TOKEN_OPERATOR && token.type != TOKEN_COMPARATOR &&
+        token.type != TOKEN_LOGICAL_OPERATOR) {
+        return OPERATOR_NONE;
+    }
+    const char *text = sourceCode + token.offset;
+    char second = token.length > 1 ? text[1] : '\0';
+    switch (text[0]) {
+        case '+': *precedence = PREC_TERM; return OPERATOR_ADD;
+        case '-': *precedence = PREC_TERM; return OPERATOR_SUB;
+        case '*': *precedence = PREC_FACTOR; return OPERATOR_MUL;
+        case '/': *precedence = PREC_FACTOR; return OPERATOR_DIV;
+        case '<': *precedence = PREC_COMPARISON; return second == '=' ? OPERATOR_LE : OPERATOR_LT;
+        case '>': *precedence = PREC_COMPARISON; return second == '=' ? OPERATOR_GE : OPERATOR_GT;
+        case '=': *precedence = PREC_EQUALITY; return OPERATOR_EQ;
+        case '!':
+            if (second == '=') {
+                *precedence = PREC_EQUALITY;
+                return OPERATOR_NE;
+            }
+            return OPERATOR_NONE;  // '!' is only a prefix operator
+        case '&': *precedence = PREC_AND; return OPERATOR_AND;
+        case '|': *precedence = PREC_OR; return OPERATOR_OR;
+    }
+    return OPERATOR_NONE;
+}
+
+// Pop the top pending operator and attach its operands
+void reduceOperator() {
+    uint32_t node = exprStack.operators[--exprStack.operatorCount].node;
+    exprStack.nesting--;
+    if (NODE(node).kind == AST_UNARY) {
+        NODE(node).a = exprStack.operands[exprStack.operandCount - 1];
+        exprStack.operands[exprStack.operandCount - 1] = node;
+    } else {
+        NODE(node).a = exprStack.operands[exprStack.operandCount - 2];
+        NODE(node).b = exprStack.operands[exprStack.operandCount - 1];
+        exprStack.operandCount--;
+        exprStack.operands[exprStack.operandCount - 1] = node;
+    }
 }
 
+// Parse a number, string or identifier operand
+uint32_t parseOperand() {
+    uint32_t node;
+    if (currentToken.type == TOKEN_NUMBER) {
+        node = newNode(AST_NUMBER, (uint32_t)tokenIndex);
+        int64_t value = 0;
+        for (uint32_t i = 0; i < currentToken.length; i++) {
+            int digit = sourceCode[currentToken.offset + i] - '0';
+            if (value > (INT64_MAX - digit) / 10) {
+                error("Number literal too large");
+            }
+            value = value * 10 + digit;
+        }
+        setNodeNumber(node, value);
+    } else if (currentToken.type == TOKEN_STRING_LITERAL) {
+        node = newNode(AST_STRING, (uint32_t)tokenIndex);
+    } else {
+        node = newNode(AST_IDENTIFIER, (uint32_t)tokenIndex);
+        NODE(node).b = resolveLocal((uint32_t)tokenIndex);
+    }
+    advance();  // Consume the token
+    return node;
+}
+
+// Handle array access, method calls and action calls after an operand
+uint32_t parsePostfix(uint32_t left) {
+    for (;;) {
+        if (currentToken.type == TOKEN_LBRACKET) {
+            left = parseArrayAccess(left);
+        } else if (currentToken.type == TOKEN_DOT) {
+            match(TOKEN_DOT);
+            if (currentToken.type != TOKEN_IDENTIFIER) {
+                error("Expected method name after '.'");
+            }
+            uint32_t method = newNode(AST_METHOD, (uint32_t)tokenIndex);
+            NODE(method).a = left;
+            advance(); // Consume method name
+
+            // Optional method call with parentheses
+            if (currentToken.type == TOKEN_LPAREN) {
+                match(TOKEN_LPAREN);
+                uint32_t arguments = parseArguments();  // Optional arguments
+                match(TOKEN_RPAREN);
+                NODE(method).b = arguments;
+                NODE(method).flags |= AST_FLAG_CALL;
+            }
+            left = method;
+        } else if (currentToken.type == TOKEN_LPAREN) {
+            uint32_t call = newNode(AST_CALL, (uint32_t)tokenIndex);
+            match(TOKEN_LPAREN);
+            uint32_t arguments = parseArguments();  // Optional arguments
+            match(TOKEN_RPAREN);
+            NODE(call).a = left;
+            NODE(call).b = arguments;
+            addCall(call);
+            left = call;
+        } else {
+            return left;
+        }
+    }
+}
+
+// Parse an expression with the usual precedence: || < && < == != <
+// < <= > >= < + - < * / < prefix ! -. Binary operators are left-associative.
+uint32_t parseOperators(const char *invalidOperand) {
+    size_t operatorBase = exprStack.operatorCount;
+    size_t operandBase = exprStack.operandCount;
+    if (++exprStack.nesting >= NESTING_MAX) {
+        error("Expression nested too deeply");
+    }
+
+    for (;;) {
+        // Prefix operators and opening parentheses
+        for (;;) {
+            if ((currentToken.type == TOKEN_OPERATOR && tokenIs(currentToken, "-")) ||
+                (currentToken.type == TOKEN_LOGICAL_OPERATOR && tokenIs(currentToken, "!"))) {
+                uint32_t node = newNode(AST_UNARY, (uint32_t)tokenIndex);
+                NODE(node).op = currentToken.type == TOKEN_OPERATOR ? OPERATOR_NEG : OPERATOR_NOT;
+                pushOperator(node, PREC_UNARY);
+                advance();
+            } else if (currentToken.type == TOKEN_LPAREN) {
+                pushOperator(0, PREC_NONE);
+                advance();
+            } else {
+                break;
+            }
+        }
+
+        // The operand itself
+        uint32_t operand;
+        if (currentToken.type == TOKEN_NUMBER ||
+            currentToken.type == TOKEN_STRING_LITERAL ||
+            currentToken.type == TOKEN_IDENTIFIER) {
+            operand = parseOperand();
+        } else if (currentToken.type == TOKEN_INPUT) {
+            operand = newNode(AST_INPUT, (uint32_t)tokenIndex);
+            advance(); // Consume the 'input' token
+            match(TOKEN_LPAREN);
+            if (currentToken.type == TOKEN_STRING_LITERAL) {
+                uint32_t prompt = parseOperand(); // Consume prompt string
+                NODE(operand).a = prompt;
+            }
+            match(TOKEN_RPAREN);
+        } else {
+            error(invalidOperand);
+            return 0;
+        }
+        pushOperand(parsePostfix(operand));
+
+        // Closing parentheses that belong to this expression
+        while (currentToken.type == TOKEN_RPAREN) {
+            size_t open = exprStack.operatorCount;
+            while (open > operatorBase && exprStack.operators[open - 1].node != 0) {
+                open--;
+            }
+            if (open == operatorBase) {
+                break;  // The ')' closes a call or statement around us
+            }
+            while (exprStack.operatorCount > open) {
+                reduceOperator();
+            }
+            exprStack.operatorCount--;  // Drop the '(' marker
+            advance();
+            exprStack.operands[exprStack.operandCount - 1] =
+                parsePostfix(exprStack.operands[exprStack.operandCount - 1]);
+        }
+
+        // A binary operator continues the expression
+        Precedence precedence;
+        Operator op = binaryOperator(currentToken, &precedence);
+        if (op == OPERATOR_NONE) {
+            break;
+        }
+        while (exprStack.operatorCount > operatorBase &&
+               exprStack.operators[exprStack.operatorCount - 1].precedence >= precedence) {
+            reduceOperator();
+        }
+        uint32_t node = newNode(AST_BINARY, (uint32_t)tokenIndex);
+        NODE(node).op = (uint8_t)op;
+        pushOperator(node, precedence);
+        advance();  // Consume the operator
+    }
+
+    while (exprStack.operatorCount > operatorBase) {
+        if (exprStack.operators[exprStack.operatorCount - 1].node == 0) {
+            match(TOKEN_RPAREN);  // Unclosed '('
+        }
+        reduceOperator();
+    }
+    uint32_t result = exprStack.operands[operandBase];
+    exprStack.operandCount = operandBase;
+    exprStack.nesting--;
+    return result;
+}
+
+// Parse <Expression>
+uint32_t parseExpression() {
+    return parseOperators("Invalid expression");
+}
+
+// Helper function to parse arguments for method calls or action calls
+uint32_t parseArguments() {
+    NodeList arguments = {0, 0};
+    if (currentToken.type != TOKEN_RPAREN) { // If there are arguments
+        appendNode(&arguments, parseExpression()); // Parse the first argument
+        while (currentToken.type == TOKEN_COMMA) { // Handle additional arguments
+            match(TOKEN_COMMA);
+            appendNode(&arguments, parseExpression());
+        }
+    }
+    return arguments.first;
+}
+
+
+//Parse <Return>
+uint32_t parseReturn(){
+    uint32_t node = newNode(AST_RETURN, (uint32_t)tokenIndex);
+    match(TOKEN_RETURN);
+    uint32_t value = parseExpression();
+    match(TOKEN_SEMICOLON);
+    NODE(node).a = value;
+    return node;
+}
+
+// Parse "(condition) { statements }" into an AST_IF or AST_WHILE node
+void parseGuardedBlock(uint32_t node) {
+    match(TOKEN_LPAREN);
+    uint32_t condition = parseCondition();  // Parse the condition
+    match(TOKEN_RPAREN);
+    match(TOKEN_LBRACE);
+    beginScope();
+    uint32_t body = parseStatements();  // Parse the body
+    endScope();
+    match(TOKEN_RBRACE);
+    NODE(node).a = condition;
+    NODE(node).b = body;
+}
+
+//Parse <ControlFlow>
+uint32_t parseControlFlow() {
+    uint32_t first = newNode(AST_IF, (uint32_t)tokenIndex);
+    match(TOKEN_IF);
+    parseGuardedBlock(first);
+
+    // Check for optional elif or else blocks; each hangs off the previous branch
+    uint32_t last = first;
+    while (currentToken.type == TOKEN_ELIF) {
+        uint32_t branch = newNode(AST_IF, (uint32_t)tokenIndex);
+        match(TOKEN_ELIF);
+        parseGuardedBlock(branch);
+        NODE(last).c = branch;
+        last = branch;
+    }
+
+    if (currentToken.type == TOKEN_ELSE) {
+        uint32_t block = newNode(AST_BLOCK, (uint32_t)tokenIndex);
+        match(TOKEN_ELSE);
+        match(TOKEN_LBRACE);
+        beginScope();
+        uint32_t body = parseStatements();  // Parse the body of the else
+        endScope();
+        match(TOKEN_RBRACE);
+        NODE(block).b = body;
+        NODE(last).c = block;
+    }
+    return first;
+}
+
+// Parse <WhileStatement>
+uint32_t parseWhile() {
+    uint32_t node = newNode(AST_WHILE, (uint32_t)tokenIndex);
+    match(TOKEN_WHILE);
+    parseGuardedBlock(node);
+    return node;
+}
+
+// Parse <Condition>: the same grammar as any other expression
+uint32_t parseCondition() {
+    return parseOperators("Invalid condition: Expected operand or sub-condition.");
+}
+
+
+// Parse <Input>
+uint32_t parseInput() {
+    uint32_t node = newNode(AST_INPUT, (uint32_t)tokenIndex);
+    match(TOKEN_INPUT);
+    match(TOKEN_LPAREN);
+    if (currentToken.type == TOKEN_STRING_LITERAL) {
+        uint32_t prompt = parseOperand(); // Consume the string literal
+        NODE(node).a = prompt;
+    } else {
+        error("Expected a string literal for input prompt");
+    }
+    match(TOKEN_RPAREN);
+    match(TOKEN_SEMICOLON);
+    return node;
+}
+
+// Parse <ArrayDecl>
+uint32_t parseArrayDecl() {
+    match(TOKEN_ARRAY);
+    uint32_t node = newNode(AST_ARRAY_DECL, (uint32_t)tokenIndex);
+    match(TOKEN_IDENTIFIER);
+    match(TOKEN_LBRACKET);
+    if (currentToken.type != TOKEN_NUMBER) {
+        match(TOKEN_NUMBER);
+    }
+    uint32_t size = parseOperand();
+    match(TOKEN_RBRACKET);
+    match(TOKEN_ASSIGN);
+    match(TOKEN_LBRACE);
+    uint32_t elements = parseArrayElements();
+    match(TOKEN_RBRACE);
+    match(TOKEN_SEMICOLON);
+    NODE(node).a = size;
+    NODE(node).b = elements;
+    NODE(node).c = declareLocal(NODE(node).token);
+    return node;
+}
+
+// Parse <ArrayAccess>
+uint32_t parseArrayAccess(uint32_t array){
+    uint32_t node = newNode(AST_INDEX, (uint32_t)tokenIndex);
+	match(TOKEN_LBRACKET);
+    uint32_t index = parseExpression(); 
+    match(TOKEN_RBRACKET); 
+    NODE(node).a = array;
+    NODE(node).b = index;
+    return node;
+}
+
+uint32_t parseArrayElements() {
+    NodeList elements = {0, 0};
+    if (currentToken.type != TOKEN_RPAREN) { // If there are arguments
+        appendNode(&elements, parseExpression()); // Parse the first argument
+        while (currentToken.type == TOKEN_COMMA) { // Handle additional arguments
+            match(TOKEN_COMMA);
+            appendNode(&elements, parseExpression());
+        }
+    }
+    return elements.first;
+}
+
+// Parse <ForStatement>; the loop variable is scoped to the loop
+uint32_t parseFor(){
+    uint32_t node = newNode(AST_FOR, (uint32_t)tokenIndex);
+	match(TOKEN_FOR);
+	match(TOKEN_LPAREN);
+    beginScope();
+	uint32_t initializer = parseVarDecl();
+	uint32_t condition = parseCondition();
+	match(TOKEN_SEMICOLON);
+	uint32_t step = newNode(AST_ASSIGN, (uint32_t)tokenIndex);
+    NODE(step).b = resolveLocal((uint32_t)tokenIndex);
+	match(TOKEN_IDENTIFIER);
+	match(TOKEN_ASSIGN);
+	uint32_t value = parseExpression();
+	match(TOKEN_RPAREN);
+	match(TOKEN_LBRACE);
+	uint32_t body = parseStatements();  // Parse the body of the loop
+    endScope();
+    match(TOKEN_RBRACE);
+    NODE(step).a = value;
+    NODE(node).a = initializer;
+    NODE(node).b = body;
+    NODE(node).c = condition;
+    NODE(node).d = step;
+    return node;
+}
+
+// Runtime values. Numbers are stored inline; strings and arrays are heap
+// objects owned by the VM's garbage collector. Comparisons and logical
+// operators produce the integers 0 and 1.
+typedef enum {
+    VAL_NIL, VAL_INT, VAL_DOUBLE, VAL_STRING, VAL_ARRAY
+} ValueType;
+
+typedef enum {
+    OBJ_STRING, OBJ_ARRAY
+} ObjectType;
+
+typedef struct Object {
+    uint8_t type;
+    uint8_t marked;
+    struct Object *nextObject;
+} Object;
+
+typedef struct {
+    uint8_t type;
+    union {
+        int64_t i;
+        double d;
+        Object *object;
+    } as;
+} Value;
+
+// Strings are immutable views of `length` bytes at `chars`, which are not
+// NUL-terminated. The bytes live in `owner`, which may be the string itself
+// or a string it was sliced from or appended to. An owner with spare
+// capacity lets `s + x` write x after s in place when s ends at `used`:
+// strings already handed out only ever see the bytes before their length.
+typedef struct String {
+    Object header;
+    uint32_t length;
+    uint32_t capacity;      // Owners only: bytes reserved at storage
+    uint32_t used;          // Owners only: bytes claimed by some string
+    uint8_t builder;        // Owners only: made by concatenation, so grow with slack
+    const char *chars;
+    struct String *owner;
+    char storage[];         // Owners only
+} String;
+
+// Arrays whose elements all share a number type store them unboxed; the
+// unboxed kinds reuse that element's value type
+typedef enum {
+    ARRAY_BOXED = VAL_NIL,
+    ARRAY_INT = VAL_INT,
+    ARRAY_DOUBLE = VAL_DOUBLE
+} ArrayKind;
+
+typedef struct {
+    Object header;
+    uint32_t length;
+    uint8_t kind;
+    union {
+        Value *items;       // ARRAY_BOXED
+        int64_t *ints;      // ARRAY_INT
+        double *doubles;    // ARRAY_DOUBLE
+    };
+} Array;
+
+#define NIL_VALUE ((Value){VAL_NIL, {.i = 0}})
+#define INT_VALUE(value) ((Value){VAL_INT, {.i = (value)}})
+#define DOUBLE_VALUE(value) ((Value){VAL_DOUBLE, {.d = (value)}})
+#define OBJECT_VALUE(kind, value) ((Value){(kind), {.object = (Object *)(value)}})
+#define AS_STRING(value) ((String *)(value).as.object)
+#define AS_ARRAY(value) ((Array *)(value).as.object)
+#define IS_NUMBER(value) ((value).type == VAL_INT || (value).type == VAL_DOUBLE)
+#define AS_NUMBER(value) ((value).type == VAL_INT ? (double)(value).as.i : (value).as.d)
+
+static inline Value arrayElement(const Array *array, uint32_t index) {
+    switch (array->kind) {
+        case ARRAY_INT: return INT_VALUE(array->ints[index]);
+        case ARRAY_DOUBLE: return DOUBLE_VALUE(array->doubles[index]);
+        default: return array->items[index];
+    }
+}
+
+static inline size_t arrayElementSize(const Array *array) {
+    return array->kind == ARRAY_BOXED ? sizeof(Value) : sizeof(int64_t);
+}
+
+// Bytecode. Each instruction is one 32-bit word: the opcode in the low 8
+// bits and a 24-bit operand above it. METHOD takes a second word holding
+// the argument count, SUM_ARRAY two more slot numbers.
+#define OPCODES(X) \
+    X(CONST)          /* push constants[operand] */ \
+    X(INT)            /* push the signed 24-bit operand */ \
+    X(POP) \
+    X(LOAD_LOCAL)     /* push frame slot[operand] */ \
+    X(STORE_LOCAL)    /* pop into frame slot[operand] */ \
+    X(ADD) X(SUB) X(MUL) X(DIV) X(NEG) X(NOT) \
+    X(EQ) X(NE) X(LT) X(LE) X(GT) X(GE) \
+    X(ADD_INT) X(SUB_INT) X(MUL_INT) X(DIV_INT) X(NEG_INT)  /* operands proven ints: no type checks */ \
+    X(EQ_INT) X(NE_INT) X(LT_INT) X(LE_INT) X(GT_INT) X(GE_INT) \
+    X(JUMP)           /* operand = target word */ \
+    X(JUMP_IF_FALSE)  /* pops the condition */ \
+    X(JUMP_IF_TRUE) \
+    X(CALL)           /* operand = function index; arguments become its first slots */ \
+    X(CALL_MEMO)      /* CALL through the callee's result cache */ \
+    X(TAIL_CALL)      /* return f(...): reuse the current frame */ \
+    X(RETURN) \
+    X(RETURN_NIL) \
+    X(PRINT) \
+    X(INPUT)          /* operand = 1 when a prompt is on the stack */ \
+    X(CONCAT)         /* operand = value count; joins their text into one string */ \
+    X(ARRAY)          /* operand = element count */ \
+    X(INDEX) \
+    X(INDEX_IN_BOUNDS) /* INDEX where a loop bound proved the index valid */ \
+    X(METHOD)         /* operand = method id, next word = argument count */ \
+    X(SUM_ARRAY)      /* operand = array slot, next words = total and index slots */
+
+#define OPCODE_ENUM(name) OP_##name,
+#define OPCODE_NAME(name) #name,
+
+typedef enum {
+    OPCODES(OPCODE_ENUM)
+    OPCODE_COUNT
+} Opcode;
+
+const char *opcodeNames[OPCODE_COUNT] = {
+    OPCODES(OPCODE_NAME)
+};
+
+#define OPERAND_MAX ((1u << 24) - 1)
+#define INSTRUCTION(op, operand) ((uint32_t)(op) | ((uint32_t)(operand) << 8))
+#define INSTRUCTION_OP(word) ((word) & 0xFF)
+#define INSTRUCTION_OPERAND(word) ((word) >> 8)
+#define INSTRUCTION_SIGNED(word) ((int32_t)(word) >> 8)
+
+// Words taken by an instruction, including trailing operand words
+static inline uint32_t instructionWords(Opcode op) {
+    return op == OP_METHOD ? 2 : op == OP_SUM_ARRAY ? 3 : 1;
+}
+
+// The unchecked forms inferTypes() gives arithmetic and comparisons on ints
+static inline int provenInt(Opcode op) {
+    return op >= OP_ADD_INT && op <= OP_GE_INT;
+}
+
+typedef enum {
+    METHOD_LENGTH, METHOD_STRIP, METHOD_LOWER, METHOD_UPPER, METHOD_COUNT
+} MethodId;
+
+const char *methodNames[METHOD_COUNT] = {"length", "strip", "lower", "upper"};
+
+int findMethod(uint32_t token) {
+    Token name = tokenAt(token);
+    for (int i = 0; i < METHOD_COUNT; i++) {
+        if (tokenIs(name, methodNames[i])) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// Pure actions with at most this many parameters get a result cache
+#define MEMO_MAX_ARGS 4
+#define MEMO_ENTRIES 4096   // Per action; direct-mapped, so the cache stays bounded
+
+// Where the code from `pc` on came from, for the profiler
+typedef struct {
+    uint32_t pc;
+    uint32_t line;
+} LineEntry;
+
+// A compiled action (or main)
+typedef struct {
+    uint32_t name;          // Index into the symbol table
+    uint32_t arity;
+    uint32_t slotCount;     // Parameters first, then locals
+    uint32_t *code;
+    uint32_t codeLength;
+    uint32_t codeCapacity;
+    uint32_t maxStack;      // Deepest operand stack the code can reach
+    uint32_t declaration;   // AST node
+    uint8_t memoize;        // Pure: calls go through a result cache
+    uint32_t hotness;       // Calls and loop back-edges, for the JIT
+    uint8_t *generic;       // Per pc: a JIT guard failed here, so leave it to the interpreter
+    struct JitCode *native; // Machine code, once hot
+    uint64_t calls;         // Times called while running
+    LineEntry *lines;       // Source lines by pc, in pc order; only kept for --profile
+    uint32_t lineCount;
+    uint32_t lineCapacity;
+} Function;
+
+typedef struct {
+    Function *functions;
+    uint32_t functionCount;
+    uint32_t functionCapacity;
+    Value *constants;
+    uint32_t constantCount;
+    uint32_t constantCapacity;
+    int32_t mainFunction;   // -1 when the program has no main
+    void *image;            // Mapped cache entry the code points into, if loaded from one
+    size_t imageSize;
+} Program;
+
+COMPILATION_LOCAL Program program;
+
+void compileError(uint32_t token, const char *format, ...) {
+    Token at = tokenAt(token);
+    char message[400];
+    va_list args;
+    va_start(args, format);
+    vsnprintf(message, sizeof(message), format, args);
+    va_end(args);
+    if (at.type != TOKEN_EOF) {
+        failCompilation(stderr, "Compile Error: %s (at '%.*s')", message,
+                        (int)(at.length > 40 ? 40 : at.length), sourceCode + at.offset);
+    }
+    failCompilation(stderr, "Compile Error: %s", message);
+}
+
+// Value formatting shared by print, string concatenation and methods
+const char *formatNumber(Value value, char *buffer, size_t size, size_t *length) {
+    int written;
+    if (value.type == VAL_INT) {
+        written = snprintf(buffer, size, "%lld", (long long)value.as.i);
+    } else {
+        written = snprintf(buffer, size, "%.15g", value.as.d);
+        if (strtod(buffer, NULL) != value.as.d) {
+            written = snprintf(buffer, size, "%.17g", value.as.d);
+        }
+        if (strspn(buffer, "-0123456789") == (size_t)written) {
+            written += snprintf(buffer + written, size - (size_t)written, ".0");
+        }
+    }
+    *length = (size_t)written;
+    return buffer;
+}
+
+// Text of a scalar value; arrays are handled by the callers
+const char *valueText(Value value, char *buffer, size_t size, size_t *length) {
+    switch (value.type) {
+        case VAL_STRING:
+            *length = AS_STRING(value)->length;
+            return AS_STRING(value)->chars;
+        case VAL_INT:
+        case VAL_DOUBLE:
+            return formatNumber(value, buffer, size, length);
+        case VAL_ARRAY:
+            *length = 7;
+            return "<array>";
+        default:
+            *length = 3;
+            return "nil";
+    }
+}
+
+void printValue(FILE *out, Value value) {
+    if (value.type == VAL_ARRAY) {
+        Array *array = AS_ARRAY(value);
+        fputc('[', out);
+        for (uint32_t i = 0; i < array->length; i++) {
+            if (i > 0) {
+                fputs(", ", out);
+            }
+            printValue(out, arrayElement(array, i));
+        }
+        fputc(']', out);
+        return;
+    }
+    char buffer[32];
+    size_t length;
+    const char *text = valueText(value, buffer, sizeof(buffer), &length);
+    fwrite(text, 1, length, out);
+}
+
+// Strings that belong to the program (constants) rather than the GC heap
+String *newConstantString(const char *chars, size_t length) {
+    String *string = malloc(sizeof(String) + length + 1);
+    if (string == NULL) {
+        sourceOutOfMemory();
+    }
+    string->header.type = OBJ_STRING;
+    string->header.marked = 1;
+    string->header.nextObject = NULL;
+    string->length = string->capacity = string->used = (uint32_t)length;
+    string->builder = 0;
+    memcpy(string->storage, chars, length);
+    string->storage[length] = '\0';
+    string->chars = string->storage;
+    string->owner = string;
+    return string;
+}
+
+uint32_t addConstant(Value value) {
+    if (program.constantCount == program.constantCapacity) {
+        program.constants = growArray(program.constants, &program.constantCapacity, sizeof(Value), 64);
+    }
+    program.constants[program.constantCount] = value;
+    return program.constantCount++;
+}
+
+// String literals are interned: equal literals share one constant, which
+// also lets equality stop at a pointer comparison
+COMPILATION_LOCAL NameTable literals;
+COMPILATION_LOCAL uint32_t *literalConstants;     // Per literal, its index in program.constants
+COMPILATION_LOCAL uint32_t literalCapacity;
+
+uint32_t addStringConstant(const char *text, uint32_t length) {
+    String *string = newConstantString(text, length);
+    uint32_t literal = internName(&literals, string->chars, length);
+    if (literal + 1 < literals.count) {
+        free(string);
+        stats.internedStrings++;
+        return literalConstants[literal];
+    }
+    if (literal == literalCapacity) {
+        literalConstants = growArray(literalConstants, &literalCapacity, sizeof(uint32_t), 64);
+    }
+    literalConstants[literal] = addConstant(OBJECT_VALUE(VAL_STRING, string));
+    return literalConstants[literal];
+}
+
+void freeProgram() {
+    for (uint32_t i = 0; i < program.constantCount; i++) {
+        if (program.constants[i].type == VAL_STRING) {
+            free(program.constants[i].as.object);
+        }
+    }
+    for (uint32_t i = 0; i < program.functionCount; i++) {
+        if (program.image == NULL) {
+            free(program.functions[i].code);
+        }
+        free(program.functions[i].lines);
+    }
+    if (program.image != NULL) {
+        munmap(program.image, program.imageSize);
+    }
+    free(program.constants);
+    free(program.functions);
+    memset(&program, 0, sizeof(program));
+    freeNameTable(&literals);
+    free(literalConstants);
+    literalConstants = NULL;
+    literalCapacity = 0;
+}
+
+// Optimizer: folds constant subexpressions (including string
+// concatenation), drops branches and loops whose condition is a constant,
+// drops statements after a return and applies algebraic identities. It
+// rewrites the AST in place before the bytecode compiler sees it.
+typedef enum {
+    SHAPE_UNKNOWN,
+    SHAPE_NUMBER,   // An int or a double, if it produces a value at all
+    SHAPE_INT,
+    SHAPE_BOOL      // The int 0 or 1
+} ValueShape;
+
+int isConstantNode(uint32_t index) {
+    return NODE(index).kind == AST_NUMBER || NODE(index).kind == AST_STRING;
+}
+
+int constantTruth(uint32_t index) {
+    if (NODE(index).kind == AST_NUMBER) {
+        return nodeNumber(index) != 0;
+    }
+    uint32_t length;
+    stringNodeText(index, &length);
+    return length != 0;
+}
+
+int isComparison(uint8_t op) {
+    return op >= OPERATOR_EQ && op <= OPERATOR_GE;
+}
+
+#define SHAPE_DEPTH_MAX 32  // Operands nested deeper than this count as unknown
+
+ValueShape shapeWithin(uint32_t index, int depth) {
+    AstNode *node = &NODE(index);
+    if (depth == SHAPE_DEPTH_MAX) {
+        return SHAPE_UNKNOWN;
+    }
+    switch (node->kind) {
+        case AST_NUMBER: {
+            int64_t value = nodeNumber(index);
+            return value == 0 || value == 1 ? SHAPE_BOOL : SHAPE_INT;
+        }
+        case AST_UNARY:
+            if (node->op == OPERATOR_NOT) {
+                return SHAPE_BOOL;
+            }
+            return shapeWithin(node->a, depth + 1) >= SHAPE_INT ? SHAPE_INT : SHAPE_NUMBER;
+        case AST_BINARY: {
+            if (isComparison(node->op) || node->op == OPERATOR_AND || node->op == OPERATOR_OR) {
+                return SHAPE_BOOL;
+            }
+            ValueShape left = shapeWithin(node->a, depth + 1), right = shapeWithin(node->b, depth + 1);
+            ValueShape both = left < right ? left : right;
+            if (both >= SHAPE_INT) {
+                return SHAPE_INT;
+            }
+            if (node->op == OPERATOR_ADD && both == SHAPE_UNKNOWN) {
+                return SHAPE_UNKNOWN;  // Could be a concatenation
+            }
+            return SHAPE_NUMBER;
+        }
+        case AST_METHOD:
+            return findMethod(node->token) == METHOD_LENGTH ? SHAPE_INT : SHAPE_UNKNOWN;
+        default:
+            return SHAPE_UNKNOWN;
+    }
+}
+
+ValueShape valueShape(uint32_t index) {
+    return shapeWithin(index, 0);
+}
+
+// Whether evaluating `index` can be skipped: no calls, input or anything
+// that could raise a runtime error. Like shapes, only looked for down to
+// SHAPE_DEPTH_MAX.
+int dropWithin(uint32_t index, int depth) {
+    AstNode *node = &NODE(index);
+    switch (node->kind) {
+        case AST_NUMBER: case AST_STRING: case AST_IDENTIFIER:
+            return 1;
+        case AST_UNARY:
+            return depth < SHAPE_DEPTH_MAX && dropWithin(node->a, depth + 1) &&
+                   (node->op == OPERATOR_NOT || valueShape(node->a) >= SHAPE_INT);
+        case AST_BINARY:
+            if (node->op == OPERATOR_DIV) {
+                return 0;
+            }
+            if (node->op != OPERATOR_EQ && node->op != OPERATOR_NE &&
+                node->op != OPERATOR_AND && node->op != OPERATOR_OR &&
+                (valueShape(node->a) < SHAPE_INT || valueShape(node->b) < SHAPE_INT)) {
+                return 0;
+            }
+            return depth < SHAPE_DEPTH_MAX && dropWithin(node->a, depth + 1) && dropWithin(node->b, depth + 1);
+        default:
+            return 0;
+    }
+}
+
+int canDrop(uint32_t index) {
+    return dropWithin(index, 0);
+}
+
+// Turn a node into a literal in place, keeping its token and list link
+void makeNumberNode(uint32_t index, int64_t value) {
+    AstNode *node = &NODE(index);
+    node->kind = AST_NUMBER;
+    node->op = OPERATOR_NONE;
+    node->flags = 0;
+    node->a = node->d = 0;
+    setNodeNumber(index, value);
+}
+
+// Text of a constant as it would print; numbers are formatted into `buffer`
+const char *constantText(uint32_t index, char *buffer, size_t size, uint32_t *length) {
+    if (NODE(index).kind == AST_STRING) {
+        return stringNodeText(index, length);
+    }
+    size_t written;
+    formatNumber(INT_VALUE(nodeNumber(index)), buffer, size, &written);
+    *length = (uint32_t)written;
+    return buffer;
+}
+
+int foldConcatenation(uint32_t index) {
+    char leftBuffer[32], rightBuffer[32];
+    uint32_t leftLength, rightLength;
+    uint32_t left = NODE(index).a, right = NODE(index).b;
+    constantText(left, leftBuffer, sizeof(leftBuffer), &leftLength);
+    constantText(right, rightBuffer, sizeof(rightBuffer), &rightLength);
+    if ((uint64_t)leftLength + rightLength > UINT32_MAX / 4) {
+        return 0;
+    }
+    // Reserve first: the operands may themselves live in the text pool
+    uint32_t offset = reserveAstText(leftLength + rightLength);
+    const char *leftText = constantText(left, leftBuffer, sizeof(leftBuffer), &leftLength);
+    const char *rightText = constantText(right, rightBuffer, sizeof(rightBuffer), &rightLength);
+    memcpy(ast.text + offset, leftText, leftLength);
+    memcpy(ast.text + offset + leftLength, rightText, rightLength);
+    ast.textLength += leftLength + rightLength;
+
+    AstNode *node = &NODE(index);
+    node->kind = AST_STRING;
+    node->op = OPERATOR_NONE;
+    node->flags = AST_FLAG_FOLDED;
+    node->a = offset;
+    node->b = leftLength + rightLength;
+    node->c = node->d = 0;
+    return 1;
+}
+
+// Fold a binary node whose operands are both constants
+int foldConstantBinary(uint32_t index) {
+    uint8_t op = NODE(index).op;
+    uint32_t left = NODE(index).a, right = NODE(index).b;
+    int numbers = NODE(left).kind == AST_NUMBER && NODE(right).kind == AST_NUMBER;
+
+    if (op == OPERATOR_AND || op == OPERATOR_OR) {
+        int result = op == OPERATOR_AND ? constantTruth(left) && constantTruth(right)
+                                        : constantTruth(left) || constantTruth(right);
+        makeNumberNode(index, result);
+        return 1;
+    }
+    if (op == OPERATOR_ADD && !numbers) {
+        return foldConcatenation(index);
+    }
+    if (isComparison(op)) {
+        int order;
+        if (numbers) {
+            int64_t x = nodeNumber(left), y = nodeNumber(right);
+            order = (x > y) - (x < y);
+        } else if (NODE(left).kind == AST_STRING && NODE(right).kind == AST_STRING) {
+            uint32_t xLength, yLength;
+            const char *x = stringNodeText(left, &xLength);
+            const char *y = stringNodeText(right, &yLength);
+            order = memcmp(x, y, xLength < yLength ? xLength : yLength);
+            if (order == 0) {
+                order = (xLength > yLength) - (xLength < yLength);
+            }
+            order = (order > 0) - (order < 0);
+        } else if (op == OPERATOR_EQ || op == OPERATOR_NE) {
+            order = 1;  // A number never equals a string
+        } else {
+            return 0;   // Leave the type error to run time
+        }
+        int result = op == OPERATOR_EQ ? order == 0 : op == OPERATOR_NE ? order != 0 :
+                     op == OPERATOR_LT ? order < 0 : op == OPERATOR_LE ? order <= 0 :
+                     op == OPERATOR_GT ? order > 0 : order >= 0;
+        makeNumberNode(index, result);
+        return 1;
+    }
+    if (!numbers) {
+        return 0;
+    }
+
+    // Same wrapping integer arithmetic as the VM
+    uint64_t x = (uint64_t)nodeNumber(left), y = (uint64_t)nodeNumber(right);
+    int64_t result;
+    switch (op) {
+        case OPERATOR_ADD: result = (int64_t)(x + y); break;
+        case OPERATOR_SUB: result = (int64_t)(x - y); break;
+        case OPERATOR_MUL: result = (int64_t)(x * y); break;
+        default:
+            if (y == 0) {
+                return 0;  // Division by zero stays a runtime error
+            }
+            result = (int64_t)y == -1 ? (int64_t)(0 - x) : (int64_t)x / (int64_t)y;
+            break;
+    }
+    makeNumberNode(index, result);
+    return 1;
+}
+
+int isNumberLiteral(uint32_t index, int64_t value) {
+    return NODE(index).kind == AST_NUMBER && nodeNumber(index) == value;
+}
+
+// Algebraic identities. Only applied where the kept operand is known to
+// produce a number, so that e.g. `s + 0` on a string still concatenates.
+uint32_t simplifyBinary(uint32_t index) {
+    AstNode *node = &NODE(index);
+    uint32_t left = node->a, right = node->b;
+    switch (node->op) {
+        case OPERATOR_MUL:
+            if (isNumberLiteral(right, 1) && valueShape(left) >= SHAPE_NUMBER) return left;
+            if (isNumberLiteral(left, 1) && valueShape(right) >= SHAPE_NUMBER) return right;
+            if ((isNumberLiteral(right, 0) && valueShape(left) >= SHAPE_INT && canDrop(left)) ||
+                (isNumberLiteral(left, 0) && valueShape(right) >= SHAPE_INT && canDrop(right))) {
+                makeNumberNode(index, 0);
+            }
+            break;
+        case OPERATOR_DIV:
+            if (isNumberLiteral(right, 1) && valueShape(left) >= SHAPE_NUMBER) return left;
+            break;
+        case OPERATOR_SUB:
+            if (isNumberLiteral(right, 0) && valueShape(left) >= SHAPE_NUMBER) return left;
+            break;
+        case OPERATOR_ADD:
+            // x + 0 is not x for a double -0.0, so only for ints
+            if (isNumberLiteral(right, 0) && valueShape(left) >= SHAPE_INT) return left;
+            if (isNumberLiteral(left, 0) && valueShape(right) >= SHAPE_INT) return right;
+            break;
+        case OPERATOR_AND:
+        case OPERATOR_OR: {
+            // A constant left side either decides the result or passes
+            // the right side through (when that is already 0 or 1)
+            if (!isConstantNode(left)) {
+                break;
+            }
+            int decides = constantTruth(left) == (node->op == OPERATOR_OR);
+            if (decides) {
+                makeNumberNode(index, node->op == OPERATOR_OR);
+            } else if (valueShape(right) == SHAPE_BOOL) {
+                return right;
+            }
+            break;
+        }
+        default:
+            break;
+    }
+    return index;
+}
+
+uint32_t optimizeExpression(uint32_t index);
+
+// Optimize every expression of a `next`-linked list, relinking replacements
+uint32_t optimizeExpressionList(uint32_t first) {
+    NodeList list = {0, 0};
+    while (first != 0) {
+        uint32_t next = NODE(first).next;
+        appendNode(&list, optimizeExpression(first));
+        first = next;
+    }
+    if (list.last != 0) {
+        NODE(list.last).next = 0;
+    }
+    return list.first;
+}
+
+// Returns the node that replaces `index` (often `index` itself). The
+// operators of a left-nested chain are optimized innermost first in a
+// loop; only their other operands recurse.
+uint32_t optimizeExpression(uint32_t index) {
+    uint32_t base = spine.count;
+    while (NODE(index).kind == AST_BINARY || NODE(index).kind == AST_UNARY ||
+           NODE(index).kind == AST_METHOD || NODE(index).kind == AST_INDEX) {
+        pushNode(&spine, index);
+        index = NODE(index).a;
+    }
+    if (NODE(index).kind == AST_CALL) {
+        NODE(index).b = optimizeExpressionList(NODE(index).b);
+    }
+    uint32_t result = index;
+    while (spine.count > base) {
+        index = spine.nodes[--spine.count];
+        NODE(index).a = result;
+        switch (NODE(index).kind) {
+            case AST_BINARY: {
+                uint32_t right = optimizeExpression(NODE(index).b);
+                NODE(index).b = right;
+                if (isConstantNode(result) && isConstantNode(right) && foldConstantBinary(index)) {
+                    result = index;
+                } else {
+                    result = simplifyBinary(index);
+                }
+                break;
+            }
+            case AST_UNARY: {
+                uint32_t operand = result;
+                result = index;
+                if (NODE(index).op == OPERATOR_NOT && isConstantNode(operand)) {
+                    makeNumberNode(index, !constantTruth(operand));
+                } else if (NODE(index).op == OPERATOR_NEG && NODE(operand).kind == AST_NUMBER) {
+                    makeNumberNode(index, (int64_t)(0 - (uint64_t)nodeNumber(operand)));
+                } else if (NODE(index).op == OPERATOR_NEG && NODE(operand).kind == AST_UNARY &&
+                           NODE(operand).op == OPERATOR_NEG && valueShape(NODE(operand).a) >= SHAPE_NUMBER) {
+                    result = NODE(operand).a;
+                }
+                break;
+            }
+            case AST_METHOD:
+                NODE(index).b = optimizeExpressionList(NODE(index).b);
+                result = index;
+                break;
+            default:
+                NODE(index).b = optimizeExpression(NODE(index).b);
+                result = index;
+                break;
+        }
+    }
+    return result;
+}
+
+int isLogical(uint32_t index) {
+    AstNode *node = &NODE(index);
+    return (node->kind == AST_UNARY && node->op == OPERATOR_NOT) ||
+           (node->kind == AST_BINARY && (node->op == OPERATOR_AND || node->op == OPERATOR_OR));
+}
+
+// Conditions are only tested for truth, so `x && 1`, `1 && x`, `x || 0`
+// and `!!x` reduce to x there even when x is not 0 or 1
+uint32_t optimizeCondition(uint32_t index) {
+    index = optimizeExpression(index);
+    uint32_t base = spine.count;
+    while (isLogical(index)) {
+        pushNode(&spine, index);
+        index = NODE(index).a;
+    }
+    uint32_t result = index;
+    while (spine.count > base) {
+        index = spine.nodes[--spine.count];
+        NODE(index).a = result;
+        if (NODE(index).kind == AST_UNARY) {
+            result = NODE(result).kind == AST_UNARY && NODE(result).op == OPERATOR_NOT ? NODE(result).a : index;
+            continue;
+        }
+        uint32_t left = result;
+        uint32_t right = optimizeCondition(NODE(index).b);
+        NODE(index).b = right;
+        int neutral = NODE(index).op == OPERATOR_AND;  // Truth value that passes the other side through
+        if (isConstantNode(left) && constantTruth(left) == neutral) {
+            result = right;
+        } else if (isConstantNode(right) && constantTruth(right) == neutral) {
+            result = left;
+        } else {
+            result = index;
+        }
+    }
+    return result;
+}
+
+uint32_t optimizeStatements(uint32_t first);
+
+// Optimize an if/elif/else arm. Returns the arm to keep: an AST_IF, an
+// AST_BLOCK (possibly a former elif whose condition is always true) or 0.
+uint32_t optimizeBranch(uint32_t index) {
+    if (index == 0) {
+        return 0;
+    }
+    if (NODE(index).kind == AST_BLOCK) {
+        uint32_t body = optimizeStatements(NODE(index).b);
+        NODE(index).b = body;
+        return body != 0 ? index : 0;
+    }
+
+    uint32_t condition = optimizeCondition(NODE(index).a);
+    NODE(index).a = condition;
+    if (isConstantNode(condition)) {
+        if (!constantTruth(condition)) {
+            return optimizeBranch(NODE(index).c);
+        }
+        uint32_t body = optimizeStatements(NODE(index).b);
+        AstNode *node = &NODE(index);
+        node->kind = AST_BLOCK;
+        node->a = node->c = 0;
+        node->b = body;
+        return body != 0 ? index : 0;
+    }
+    uint32_t body = optimizeStatements(NODE(index).b);
+    NODE(index).b = body;
+    uint32_t otherwise = optimizeBranch(NODE(index).c);
+    NODE(index).c = otherwise;
+    return index;
+}
+
+// Append the statements of a list to `out`
+void appendStatements(NodeList *out, uint32_t first) {
+    while (first != 0) {
+        uint32_t next = NODE(first).next;
+        appendNode(out, first);
+        first = next;
+    }
+}
+
+uint32_t optimizeStatements(uint32_t first) {
+    NodeList out = {0, 0};
+    uint32_t index = first;
+    while (index != 0) {
+        uint32_t next = NODE(index).next;
+        AstNode *node = &NODE(index);
+        switch (node->kind) {
+            case AST_VAR_DECL: case AST_ASSIGN: case AST_PRINT: case AST_RETURN: case AST_EXPR_STMT: {
+                uint32_t value = optimizeExpression(node->a);
+                NODE(index).a = value;
+                appendNode(&out, index);
+                break;
+            }
+            case AST_ARRAY_DECL:
+                NODE(index).b = optimizeExpressionList(node->b);
+                appendNode(&out, index);
+                break;
+            case AST_IF: {
+                uint32_t kept = optimizeBranch(index);
+                if (kept != 0 && NODE(kept).kind == AST_BLOCK) {
+                    appendStatements(&out, NODE(kept).b);
+                } else if (kept != 0) {
+                    appendNode(&out, kept);
+                }
+                break;
+            }
+            case AST_WHILE: {
+                uint32_t condition = optimizeCondition(node->a);
+                NODE(index).a = condition;
+                if (isConstantNode(condition) && !constantTruth(condition)) {
+                    break;  // Never runs
+                }
+                NODE(index).b = optimizeStatements(NODE(index).b);
+                appendNode(&out, index);
+                break;
+            }
+            case AST_FOR: {
+                uint32_t initializer = NODE(index).a;
+                uint32_t value = optimizeExpression(NODE(initializer).a);
+                NODE(initializer).a = value;
+                uint32_t condition = optimizeCondition(NODE(index).c);
+                NODE(index).c = condition;
+                if (isConstantNode(condition) && !constantTruth(condition)) {
+                    appendNode(&out, initializer);  // Only the initializer runs
+                    break;
+                }
+                uint32_t step = NODE(index).d;
+                uint32_t stepValue = optimizeExpression(NODE(step).a);
+                NODE(step).a = stepValue;
+                NODE(index).b = optimizeStatements(NODE(index).b);
+                appendNode(&out, index);
+                break;
+            }
+            default:
+                appendNode(&out, index);  // Nested actions are optimized on their own
+                break;
+        }
+        // Nothing after a return in the same list can run
+        if (out.last != 0 && NODE(out.last).kind == AST_RETURN) {
+            break;
+        }
+        index = next;
+    }
+    if (out.last != 0) {
+        NODE(out.last).next = 0;
+    }
+    return out.first;
+}
+
+// Nodes reachable from a list, not counting nested actions (each action
+// is counted once on its own)
+uint64_t countNodes(uint32_t first) {
+    uint64_t count = 0;
+    NodeStack stack = {0};
+    pushNode(&stack, first);
+    while (stack.count > 0) {
+        for (uint32_t index = stack.nodes[--stack.count]; index != 0; index = NODE(index).next) {
+            if (NODE(index).kind != AST_ACTION) {
+                count++;
+                pushChildren(&stack, index);
+            }
+        }
+    }
+    free(stack.nodes);
+    return count;
+}
+
+uint64_t countProgramNodes() {
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < resolver.functionCount; i++) {
+        uint32_t function = resolver.functions[i];
+        count += 1 + countNodes(NODE(function).a) + countNodes(NODE(function).b);
+    }
+    return count;
+}
+
+void optimizeProgram() {
+    uint64_t before = countProgramNodes();
+    for (uint32_t i = 0; i < resolver.functionCount; i++) {
+        uint32_t function = resolver.functions[i];
+        NODE(function).b = optimizeStatements(NODE(function).b);
+    }
+    stats.nodesRemoved = before - countProgramNodes();
+}
+
+// Bytecode compiler: walks the AST of each action and main
+typedef struct {
+    Function *function;
+    uint32_t depth;  // Operand stack depth at the current instruction
+    int memoize;     // Cache the results of pure actions
+    int tailCalls;   // Compile `return f(...)` to reuse the frame
+    int specialize;  // Give arithmetic and comparisons on proven ints unchecked instructions
+    int hostCalls;   // An embedding host may call any action with any arguments
+    uint32_t boundedCount;          // Enclosing loops that prove array[index] in bounds
+    uint32_t boundedArrays[16];
+    uint32_t boundedIndexes[16];
+    uint32_t *functionsByName;      // While binding calls; freed by resetCompilation() after an error
+    uint32_t *lineStarts;           // Offset of each source line, when recording lines for --profile
+    uint32_t lineCount;
+} CompileState;
+
+COMPILATION_LOCAL CompileState compiler;
+
+void compileStatements(uint32_t first);
+void compileExpression(uint32_t index);
+
+// Append one word; `stackEffect` keeps the depth bookkeeping for maxStack
+uint32_t emit(uint32_t word, int stackEffect) {
+    Function *function = compiler.function;
+    if (function->codeLength == function->codeCapacity) {
+        function->code = growArray(function->code, &function->codeCapacity, sizeof(uint32_t), 64);
+    }
+    compiler.depth = (uint32_t)((int)compiler.depth + stackEffect);
+    if (compiler.depth > function->maxStack) {
+        function->maxStack = compiler.depth;
+    }
+    function->code[function->codeLength] = word;
+    return function->codeLength++;
+}
+
+// Index the start of every source line, so markLine() can find lines
+void indexLines() {
+    uint32_t capacity = 0;
+    const char *at = sourceCode, *end = sourceCode + sourceLength;
+    do {
+        if (compiler.lineCount == capacity) {
+            compiler.lineStarts = growArray(compiler.lineStarts, &capacity, sizeof(uint32_t), 256);
+        }
+        compiler.lineStarts[compiler.lineCount++] = (uint32_t)(at - sourceCode);
+        at = memchr(at, '\n', (size_t)(end - at));
+    } while (at != NULL && ++at < end);
+}
+
+// Record that the code emitted from here on comes from the line of `token`
+void markLine(uint32_t token) {
+    if (compiler.lineStarts == NULL) {
+        return;
+    }
+    uint32_t offset = tokens.offsets[token];
+    uint32_t low = 0, high = compiler.lineCount;
+    while (high - low > 1) {
+        uint32_t middle = (low + high) / 2;
+        if (compiler.lineStarts[middle] <= offset) {
+            low = middle;
+        } else {
+            high = middle;
+        }
+    }
+    Function *function = compiler.function;
+    LineEntry *last = function->lineCount > 0 ? &function->lines[function->lineCount - 1] : NULL;
+    if (last != NULL && (last->line == low + 1 || last->pc == function->codeLength)) {
+        last->line = low + 1;
+        return;
+    }
+    if (function->lineCount == function->lineCapacity) {
+        function->lines = growArray(function->lines, &function->lineCapacity, sizeof(LineEntry), 16);
+    }
+    function->lines[function->lineCount++] = (LineEntry){function->codeLength, low + 1};
+}
+
+uint32_t emitOp(Opcode op, uint32_t operand, int stackEffect) {
+    if (operand > OPERAND_MAX) {
+        compileError(NODE(compiler.function->declaration).token, "Action too large to compile");
+    }
+    return emit(INSTRUCTION(op, operand), stackEffect);
+}
+
+// Emit a forward jump whose target is filled in by patchJump()
+uint32_t emitJump(Opcode op) {
+    return emitOp(op, 0, op == OP_JUMP ? 0 : -1);
+}
+
+void patchJump(uint32_t at) {
+    uint32_t target = compiler.function->codeLength;
+    if (target > OPERAND_MAX) {
+        compileError(NODE(compiler.function->declaration).token, "Action too large to compile");
+    }
+    Function *function = compiler.function;
+    function->code[at] = INSTRUCTION(INSTRUCTION_OP(function->code[at]), target);
+}
+
+void emitInteger(int64_t value) {
+    if (value >= -(1 << 23) && value < (1 << 23)) {
+        emit(INSTRUCTION(OP_INT, (uint32_t)value & OPERAND_MAX), 1);
+    } else {
+        emitOp(OP_CONST, addConstant(INT_VALUE(value)), 1);
+    }
+}
+
+uint32_t countList(uint32_t first) {
+    uint32_t count = 0;
+    for (; first != 0; first = NODE(first).next) {
+        count++;
+    }
+    return count;
+}
+
+// Compile `condition` and jump when it is false. && || ! become jumps
+// instead of materialised 0/1 values. Returns the jumps to patch.
+typedef struct {
+    uint32_t *at;
+    uint32_t count;
+    uint32_t capacity;
+} JumpList;
+
+void addJump(JumpList *list, uint32_t at) {
+    if (list->count == list->capacity) {
+        list->at = growArray(list->at, &list->capacity, sizeof(uint32_t), 8);
+    }
+    list->at[list->count++] = at;
+}
+
+void patchJumps(JumpList *list) {
+    for (uint32_t i = 0; i < list->count; i++) {
+        patchJump(list->at[i]);
+    }
+    free(list->at);
+    memset(list, 0, sizeof(*list));
+}
+
+void compileBranch(uint32_t index, int jumpWhen, JumpList *jumps) {
+    AstNode *node = &NODE(index);
+    if (node->kind == AST_UNARY && node->op == OPERATOR_NOT) {
+        compileBranch(node->a, !jumpWhen, jumps);
+        return;
+    }
+    if (node->kind == AST_BINARY && (node->op == OPERATOR_AND || node->op == OPERATOR_OR)) {
+        // Jumping when the whole && is false: any operand false suffices.
+        // Jumping when it is true needs a local skip past the last one.
+        // A left-nested chain `a && b && c` is taken as one list, pushed
+        // last operand first.
+        uint8_t op = node->op;
+        int shortCircuit = op == OPERATOR_AND ? 0 : 1;
+        uint32_t base = spine.count;
+        for (; NODE(index).kind == AST_BINARY && NODE(index).op == op; index = NODE(index).a) {
+            pushNode(&spine, NODE(index).b);
+        }
+        pushNode(&spine, index);
+        if (jumpWhen == shortCircuit) {
+            while (spine.count > base) {
+                compileBranch(spine.nodes[--spine.count], jumpWhen, jumps);
+            }
+        } else {
+            JumpList skip = {0};
+            while (spine.count > base + 1) {
+                compileBranch(spine.nodes[--spine.count], shortCircuit, &skip);
+            }
+            compileBranch(spine.nodes[--spine.count], jumpWhen, jumps);
+            patchJumps(&skip);
+        }
+        return;
+    }
+    if (node->kind == AST_NUMBER || node->kind == AST_STRING) {
+        // A constant side of && or || either always jumps or never does
+        if (constantTruth(index) == jumpWhen) {
+            addJump(jumps, emitJump(OP_JUMP));
+        }
+        return;
+    }
+    compileExpression(index);
+    addJump(jumps, emitJump(jumpWhen ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE));
+}
+
+// Bounds-check elimination. In
+//     for (var i = N; i < a.length(); i = i + K) { ... }
+// with constants N >= 0 and K >= 1, where the body never stores to i or a,
+// i is an int inside a's bounds whenever the body runs.
+int isLocal(uint32_t index, uint32_t slot) {
+    return index != 0 && NODE(index).kind == AST_IDENTIFIER && NODE(index).b == slot && slot != SLOT_UNRESOLVED;
+}
+
+int isConstantAtLeast(uint32_t index, int64_t minimum) {
+    return index != 0 && NODE(index).kind == AST_NUMBER && nodeNumber(index) >= minimum;
+}
+
+// Whether a statement in the list starting at `index` can store to `slot`
+int storesSlot(uint32_t index, uint32_t slot) {
+    for (; index != 0; index = NODE(index).next) {
+        AstNode *node = &NODE(index);
+        switch (node->kind) {
+            case AST_VAR_DECL: case AST_ASSIGN:
+                if (node->b == slot) {
+                    return 1;
+                }
+                break;
+            case AST_ARRAY_DECL:
+                if (node->c == slot) {
+                    return 1;
+                }
+                break;
+            case AST_IF:
+                if (storesSlot(node->b, slot) || storesSlot(node->c, slot)) {
+                    return 1;
+                }
+                break;
+            case AST_BLOCK: case AST_WHILE:
+                if (storesSlot(node->b, slot)) {
+                    return 1;
+                }
+                break;
+            case AST_FOR:
+                if (storesSlot(node->a, slot) || storesSlot(node->b, slot) || storesSlot(node->d, slot)) {
+                    return 1;
+                }
+                break;
+            default:
+                break;
+        }
+    }
+    return 0;
+}
+
+// Match the loop shape above; `step` receives K
+int boundedLoop(uint32_t loop, uint32_t *array, uint32_t *position, int64_t *step) {
+    uint32_t init = NODE(loop).a, condition = NODE(loop).c, increment = NODE(loop).d;
+    if (init == 0 || condition == 0 || increment == 0) {
+        return 0;
+    }
+    if ((NODE(init).kind != AST_VAR_DECL && NODE(init).kind != AST_ASSIGN) || !isConstantAtLeast(NODE(init).a, 0)) {
+        return 0;
+    }
+    uint32_t i = NODE(init).b;
+    if (NODE(condition).kind != AST_BINARY || NODE(condition).op != OPERATOR_LT || !isLocal(NODE(condition).a, i)) {
+        return 0;
+    }
+    uint32_t bound = NODE(condition).b;
+    if (NODE(bound).kind != AST_METHOD || findMethod(NODE(bound).token) != METHOD_LENGTH || NODE(bound).b != 0 ||
+        NODE(NODE(bound).a).kind != AST_IDENTIFIER) {
+        return 0;
+    }
+    uint32_t a = NODE(NODE(bound).a).b;
+    uint32_t sum = NODE(increment).a;
+    if (NODE(increment).kind != AST_ASSIGN || NODE(increment).b != i || NODE(sum).kind != AST_BINARY ||
+        NODE(sum).op != OPERATOR_ADD || !isLocal(NODE(sum).a, i) || !isConstantAtLeast(NODE(sum).b, 1)) {
+        return 0;
+    }
+    if (a == SLOT_UNRESOLVED || a == i || storesSlot(NODE(loop).b, i) || storesSlot(NODE(loop).b, a)) {
+        return 0;
+    }
+    *array = a;
+    *position = i;
+    *step = nodeNumber(NODE(sum).b);
+    return 1;
+}
+
+int provenInBounds(uint32_t container, uint32_t position) {
+    for (uint32_t i = 0; i < compiler.boundedCount; i++) {
+        if (isLocal(container, compiler.boundedArrays[i]) && isLocal(position, compiler.boundedIndexes[i])) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// A bounded loop whose body is only `total = total + a[i]` (either order)
+// with step 1 is a reduction SUM_ARRAY can run in one go. Returns the
+// total's slot, or SLOT_UNRESOLVED.
+uint32_t reductionSlot(uint32_t loop, uint32_t array, uint32_t position, int64_t step) {
+    uint32_t body = NODE(loop).b;
+    if (step != 1 || body == 0 || NODE(body).next != 0 || NODE(body).kind != AST_ASSIGN) {
+        return SLOT_UNRESOLVED;
+    }
+    uint32_t total = NODE(body).b, sum = NODE(body).a;
+    if (total == array || total == position || NODE(sum).kind != AST_BINARY || NODE(sum).op != OPERATOR_ADD) {
+        return SLOT_UNRESOLVED;
+    }
+    uint32_t left = NODE(sum).a, right = NODE(sum).b;
+    uint32_t element = isLocal(left, total) ? right : isLocal(right, total) ? left : 0;
+    if (element == 0 || NODE(element).kind != AST_INDEX || !isLocal(NODE(element).a, array) ||
+        !isLocal(NODE(element).b, position)) {
+        return SLOT_UNRESOLVED;
+    }
+    return total;
+}
+
+void compileArguments(uint32_t first) {
+    for (; first != 0; first = NODE(first).next) {
+        compileExpression(first);
+    }
+}
+
+#define CONCAT_MAX 16   // Values joined by one CONCAT; longer chains take several
+
+int isAddition(uint32_t index) {
+    return NODE(index).kind == AST_BINARY && NODE(index).op == OPERATOR_ADD;
+}
+
+// Operators that compile their first operand first and leave it on the
+// stack: a left-nested chain of them compiles in a loop
+int compilesLeftFirst(uint32_t index) {
+    AstNode *node = &NODE(index);
+    if (node->kind == AST_BINARY) {
+        return node->op != OPERATOR_AND && node->op != OPERATOR_OR;
+    }
+    return node->kind == AST_UNARY || node->kind == AST_METHOD || node->kind == AST_INDEX;
+}
+
+// Everything but the operators above
+void compileOperand(uint32_t index) {
+    AstNode *node = &NODE(index);
+    switch (node->kind) {
+        case AST_NUMBER:
+            emitInteger(nodeNumber(index));
+            break;
+        case AST_STRING: {
+            uint32_t length;
+            const char *text = stringNodeText(index, &length);
+            emitOp(OP_CONST, addStringConstant(text, length), 1);
+            break;
+        }
+        case AST_IDENTIFIER:
+            emitOp(OP_LOAD_LOCAL, node->b, 1);
+            break;
+        case AST_INPUT:
+            if (node->a != 0) {
+                compileExpression(node->a);
+                emitOp(OP_INPUT, 1, 0);
+            } else {
+                emitOp(OP_INPUT, 0, 1);
+            }
+            break;
+        case AST_BINARY: {
+            // && and ||: materialise 0/1 with a branch to the constant that decides
+            uint8_t op = node->op;
+            JumpList decided = {0};
+            compileBranch(index, op == OPERATOR_OR, &decided);
+            emitInteger(op == OPERATOR_OR ? 0 : 1);
+            uint32_t end = emitJump(OP_JUMP);
+            compiler.depth--;
+            patchJumps(&decided);
+            emitInteger(op == OPERATOR_OR ? 1 : 0);
+            patchJump(end);
+            break;
+        }
+        case AST_CALL: {
+            uint32_t function = node->c;
+            uint32_t argumentCount = countList(node->b);
+            compileArguments(node->b);
+            emitOp(program.functions[function].memoize ? OP_CALL_MEMO : OP_CALL, function, 1 - (int)argumentCount);
+            break;
+        }
+        default:
+            compileError(node->token, "Unsupported expression");
+    }
+}
+
+// The operators of a left-nested chain are emitted innermost first after
+// its first operand, so only their other operands recurse.
+//
+// `"Total: " + a + b`: from the first string literal on, a left-nested
+// run of `+` can only concatenate, so it compiles to CONCAT, which sizes
+// the result once instead of copying the text so far at every `+`.
+void compileExpression(uint32_t index) {
+    uint32_t base = spine.count;
+    while (compilesLeftFirst(index)) {
+        pushNode(&spine, index);
+        index = NODE(index).a;
+    }
+    compileOperand(index);
+
+    int concatenating = NODE(index).kind == AST_STRING;
+    uint32_t joined = 1;    // Values on the stack for the next CONCAT
+    while (spine.count > base) {
+        index = spine.nodes[--spine.count];
+        AstNode *node = &NODE(index);
+        uint32_t right = node->b;
+        if (node->kind == AST_UNARY) {
+            emitOp(node->op == OPERATOR_NEG ? OP_NEG : OP_NOT, 0, 0);
+        } else if (node->kind == AST_METHOD) {
+            uint32_t argumentCount = countList(right);
+            compileArguments(right);
+            emitOp(OP_METHOD, (uint32_t)findMethod(NODE(index).token), -(int)argumentCount);
+            emit(argumentCount, 0);
+        } else if (node->kind == AST_INDEX) {
+            int inBounds = provenInBounds(node->a, right);
+            compileExpression(right);
+            emitOp(inBounds ? OP_INDEX_IN_BOUNDS : OP_INDEX, 0, -1);
+            stats.boundsChecksRemoved += (uint64_t)inBounds;
+        } else if (node->op == OPERATOR_ADD && (concatenating || NODE(right).kind == AST_STRING)) {
+            concatenating = 1;
+            compileExpression(right);
+            int last = spine.count == base || !isAddition(spine.nodes[spine.count - 1]);
+            if (++joined == CONCAT_MAX || last) {
+                emitOp(OP_CONCAT, joined, 1 - (int)joined);
+                joined = 1;
+            }
+            continue;
+        } else {
+            static const Opcode binaryOps[OPERATOR_COUNT] = {
+                [OPERATOR_ADD] = OP_ADD, [OPERATOR_SUB] = OP_SUB, [OPERATOR_MUL] = OP_MUL,
+                [OPERATOR_DIV] = OP_DIV, [OPERATOR_EQ] = OP_EQ, [OPERATOR_NE] = OP_NE,
+                [OPERATOR_LT] = OP_LT, [OPERATOR_LE] = OP_LE, [OPERATOR_GT] = OP_GT,
+                [OPERATOR_GE] = OP_GE
+            };
+            uint8_t op = node->op;
+            compileExpression(right);
+            emitOp(binaryOps[op], 0, -1);
+        }
+        concatenating = 0;
+    }
+}
+
+void compileIf(uint32_t index) {
+    JumpList otherwise = {0};
+    compileBranch(NODE(index).a, 0, &otherwise);
+    compileStatements(NODE(index).b);
+    uint32_t elseBranch = NODE(index).c;
+    if (elseBranch == 0) {
+        patchJumps(&otherwise);
+        return;
+    }
+    uint32_t end = emitJump(OP_JUMP);
+    patchJumps(&otherwise);
+    if (NODE(elseBranch).kind == AST_IF) {
+        compileIf(elseBranch);
+    } else {
+        compileStatements(NODE(elseBranch).b);
+    }
+    patchJump(end);
+}
+
+// Loops: the body comes first and the condition is tested at the bottom,
+// so each iteration runs one conditional jump
+void compileLoop(uint32_t condition, uint32_t body, uint32_t step) {
+    uint32_t entry = emitJump(OP_JUMP);
+    uint32_t top = compiler.function->codeLength;
+    compileStatements(body);
+    if (step != 0) {
+        markLine(NODE(step).token);
+        compileExpression(NODE(step).a);
+        emitOp(OP_STORE_LOCAL, NODE(step).b, -1);
+    }
+    patchJump(entry);
+    markLine(NODE(condition).token);
+    JumpList again = {0};
+    compileBranch(condition, 1, &again);
+    for (uint32_t i = 0; i < again.count; i++) {
+        Function *function = compiler.function;
+        function->code[again.at[i]] = INSTRUCTION(INSTRUCTION_OP(function->code[again.at[i]]), top);
+    }
+    free(again.at);
+}
+
+void compileStatement(uint32_t index) {
+    AstNode *node = &NODE(index);
+    markLine(node->token);
+    switch (node->kind) {
+        case AST_VAR_DECL:
+            compileExpression(node->a);
+            emitOp(OP_STORE_LOCAL, node->b, -1);
+            break;
+        case AST_ARRAY_DECL: {
+            int64_t size = nodeNumber(node->a);
+            uint32_t count = countList(node->b);
+            compileArguments(node->b);
+            for (int64_t i = count; i < size; i++) {
+                emitInteger(0);
+            }
+            emitOp(OP_ARRAY, (uint32_t)size, 1 - (int)size);
+            emitOp(OP_STORE_LOCAL, NODE(index).c, -1);
+            break;
+        }
+        case AST_ASSIGN:
+            compileExpression(node->a);
+            emitOp(OP_STORE_LOCAL, NODE(index).b, -1);
+            break;
+        case AST_EXPR_STMT:
+            compileExpression(node->a);
+            emitOp(OP_POP, 0, -1);
+            break;
+        case AST_PRINT:
+            compileExpression(node->a);
+            emitOp(OP_PRINT, 0, -1);
+            break;
+        case AST_RETURN:
+            if (compiler.tailCalls && NODE(node->a).kind == AST_CALL) {
+                uint32_t call = node->a;
+                compileArguments(NODE(call).b);
+                emitOp(OP_TAIL_CALL, NODE(call).c, -(int)countList(NODE(call).b));
+                break;
+            }
+            compileExpression(node->a);
+            emitOp(OP_RETURN, 0, -1);
+            break;
+        case AST_IF:
+            compileIf(index);
+            break;
+        case AST_WHILE:
+            compileLoop(node->a, node->b, 0);
+            break;
+        case AST_FOR: {
+            uint32_t condition = node->c, body = node->b, step = node->d;
+            uint32_t array, position;
+            int64_t increment;
+            int bounded = boundedLoop(index, &array, &position, &increment);
+            compileStatement(node->a);
+            if (!bounded) {
+                compileLoop(condition, body, step);
+                break;
+            }
+            uint32_t total = reductionSlot(index, array, position, increment);
+            if (total != SLOT_UNRESOLVED) {
+                emitOp(OP_SUM_ARRAY, array, 0);
+                emit(total, 0);
+                emit(position, 0);
+                stats.vectorizedLoops++;
+            }
+            uint32_t saved = compiler.boundedCount;
+            if (saved < sizeof(compiler.boundedArrays) / sizeof(compiler.boundedArrays[0])) {
+                compiler.boundedArrays[saved] = array;
+                compiler.boundedIndexes[saved] = position;
+                compiler.boundedCount++;
+            }
+            compileLoop(condition, body, step);
+            compiler.boundedCount = saved;
+            break;
+        }
+        case AST_ACTION:
+            break;  // Compiled separately as its own function
+        default:
+            compileError(node->token, "Unsupported statement");
+    }
+}
+
+void compileStatements(uint32_t first) {
+    for (; first != 0; first = NODE(first).next) {
+        compileStatement(first);
+    }
+}
+
+// Create a Function for every action the parser declared, then bind each
+// call to its callee. Both happen before anything runs, so the VM never
+// looks a name up.
+void bindFunctions() {
+    memset(&program, 0, sizeof(program));
+    program.mainFunction = -1;
+    uint32_t mainName = internName(&names, "main", 4);
+    for (uint32_t i = 0; i < resolver.functionCount; i++) {
+        if (NODE(resolver.functions[i]).kind != AST_MAIN) {
+            internToken(NODE(resolver.functions[i]).token);  // Actions nobody calls are not interned yet
+        }
+    }
+    uint32_t nameCount = names.count;  // Names interned below cannot be actions
+    uint32_t *byName = compiler.functionsByName = malloc(((size_t)nameCount + 1) * sizeof(uint32_t));
+    program.functions = calloc(resolver.functionCount + 1, sizeof(Function));
+    if (byName == NULL || program.functions == NULL) {
+        sourceOutOfMemory();
+    }
+    program.functionCount = program.functionCapacity = resolver.functionCount;
+    for (uint32_t i = 0; i < nameCount; i++) {
+        byName[i] = UINT32_MAX;
+    }
+
+    for (uint32_t i = 0; i < resolver.functionCount; i++) {
+        uint32_t index = resolver.functions[i];
+        Function *function = &program.functions[i];
+        function->declaration = index;
+        function->arity = countList(NODE(index).a);
+        function->slotCount = NODE(index).c;
+        if (NODE(index).kind == AST_MAIN) {
+            if (program.mainFunction >= 0) {
+                compileError(NODE(index).token, "Duplicate main block");
+            }
+            program.mainFunction = (int32_t)i;
+            function->name = mainName;
+            continue;
+        }
+        function->name = internToken(NODE(index).token);
+        if (byName[function->name] != UINT32_MAX) {
+            compileError(NODE(index).token, "Duplicate action");
+        }
+        byName[function->name] = i;
+    }
+
+    for (uint32_t i = 0; i < resolver.callCount; i++) {
+        uint32_t call = resolver.calls[i];
+        uint32_t callee = NODE(call).a;
+        if (NODE(callee).kind != AST_IDENTIFIER) {
+            compileError(NODE(call).token, "Only actions can be called");
+        }
+        Token name = tokenAt(NODE(callee).token);
+        uint32_t symbol = internToken(NODE(callee).token);
+        uint32_t function = symbol < nameCount ? byName[symbol] : UINT32_MAX;
+        if (function == UINT32_MAX) {
+            compileError(NODE(callee).token, "Undefined action '%.*s'", (int)name.length, sourceCode + name.offset);
+        }
+        uint32_t argumentCount = countList(NODE(call).b);
+        if (argumentCount != program.functions[function].arity) {
+            compileError(NODE(callee).token, "Action '%.*s' expects %u arguments but got %u",
+                         (int)name.length, sourceCode + name.offset, program.functions[function].arity, argumentCount);
+        }
+        NODE(call).c = function;
+    }
+    free(byName);
+    compiler.functionsByName = NULL;
+}
+
+// A reference that cannot be compiled: a name the parser could not resolve
+// to a variable, an unknown method or an array that cannot be built
+int badReference(uint32_t index) {
+    AstNode *node = &NODE(index);
+    switch (node->kind) {
+        case AST_IDENTIFIER: case AST_ASSIGN:
+            return node->b == SLOT_UNRESOLVED;
+        case AST_METHOD:
+            return findMethod(node->token) < 0;
+        case AST_ARRAY_DECL:
+            return (uint64_t)nodeNumber(node->a) < countList(node->b) || nodeNumber(node->a) > OPERAND_MAX;
+        default:
+            return 0;
+    }
+}
+
+// The rest of resolution, once calls are bound. Checked on the tree as
+// parsed, before the optimizer can drop the code a mistake is in, so a
+// program fails the same way with or without it. The first mistake in the
+// source is reported.
+void checkReferences() {
+    uint32_t first = 0;
+    NodeStack stack = {0};
+    for (uint32_t i = 0; i < resolver.functionCount; i++) {
+        pushNode(&stack, NODE(resolver.functions[i]).b);
+    }
+    while (stack.count > 0) {
+        for (uint32_t index = stack.nodes[--stack.count]; index != 0; index = NODE(index).next) {
+            AstNode *node = &NODE(index);
+            if (node->kind == AST_ACTION) {
+                continue;  // Checked as its own function
+            }
+            if (badReference(index) && (first == 0 || node->token < NODE(first).token)) {
+                first = index;
+            }
+            if (node->kind == AST_CALL) {
+                pushNode(&stack, node->b);  // The callee is bound, not compiled
+            } else {
+                pushChildren(&stack, index);
+            }
+        }
+    }
+    free(stack.nodes);
+    if (first == 0) {
+        return;
+    }
+    AstNode *node = &NODE(first);
+    Token name = tokenAt(node->token);
+    if (node->kind == AST_METHOD) {
+        compileError(node->token, "Unknown method '%.*s'", (int)name.length, sourceCode + name.offset);
+    }
+    if (node->kind == AST_ARRAY_DECL) {
+        compileError(node->token, nodeNumber(node->a) > OPERAND_MAX ? "Array too large"
+                                                                    : "Array has more initializers than its size");
+    }
+    compileError(node->token, "Undefined variable '%.*s'", (int)name.length, sourceCode + name.offset);
+}
+
+// Purity: an action is pure when it neither prints nor reads input and
+// only calls pure actions. Variables are all local and arrays cannot be
+// modified, so there is no other state a call could change.
+typedef struct {
+    uint32_t caller;
+    uint32_t callee;
+} CallEdge;
+
+typedef struct {
+    CallEdge *edges;
+    uint32_t count;
+    uint32_t capacity;
+} CallGraph;
+
+// Record the effects of one action body and the calls it makes
+void scanEffects(uint32_t first, uint32_t function, uint8_t *pure, CallGraph *graph) {
+    NodeStack stack = {0};
+    pushNode(&stack, first);
+    while (stack.count > 0) {
+        for (uint32_t index = stack.nodes[--stack.count]; index != 0; index = NODE(index).next) {
+            AstNode *node = &NODE(index);
+            if (node->kind == AST_ACTION) {
+                continue;  // Scanned as its own function
+            }
+            if (node->kind == AST_PRINT || node->kind == AST_INPUT) {
+                pure[function] = 0;
+            }
+            if (node->kind == AST_CALL) {
+                if (graph->count == graph->capacity) {
+                    graph->edges = growArray(graph->edges, &graph->capacity, sizeof(CallEdge), 64);
+                }
+                graph->edges[graph->count].caller = function;
+                graph->edges[graph->count].callee = node->c;
+                graph->count++;
+            }
+            pushChildren(&stack, index);
+        }
+    }
+    free(stack.nodes);
+}
+
+void findPureActions() {
+    uint8_t *pure = malloc(program.functionCount + 1);
+    if (pure == NULL) {
+        sourceOutOfMemory();
+    }
+    CallGraph graph = {0};
+    for (uint32_t i = 0; i < program.functionCount; i++) {
+        pure[i] = 1;
+        scanEffects(NODE(program.functions[i].declaration).b, i, pure, &graph);
+    }
+    // Impurity flows from callees to callers until nothing changes
+    int changed = 1;
+    while (changed) {
+        changed = 0;
+        for (uint32_t i = 0; i < graph.count; i++) {
+            if (pure[graph.edges[i].caller] && !pure[graph.edges[i].callee]) {
+                pure[graph.edges[i].caller] = 0;
+                changed = 1;
+            }
+        }
+    }
+    stats.memoizedActions = 0;
+    for (uint32_t i = 0; i < program.functionCount; i++) {
+        Function *function = &program.functions[i];
+        function->memoize = pure[i] && (int32_t)i != program.mainFunction && function->arity <= MEMO_MAX_ARGS;
+        stats.memoizedActions += function->memoize;
+        if (function->memoize) {
+            TRACE(TRACE_OPT, TRACE_DEBUG, "memoizing %.*s", (int)names.lengths[function->name], names.text[function->name]);
+        }
+    }
+    free(graph.edges);
+    free(pure);
+}
+
+// Compile every function bindFunctions() created
+void compileProgram() {
+    stats.boundsChecksRemoved = 0;
+    stats.internedStrings = 0;
+    stats.vectorizedLoops = 0;
+    if (compiler.memoize) {
+        findPureActions();
+    }
+
+    for (uint32_t i = 0; i < program.functionCount; i++) {
+        compiler.function = &program.functions[i];
+        compiler.depth = 0;
+        compileStatements(NODE(compiler.function->declaration).b);
+        emitOp(OP_RETURN_NIL, 0, 0);
+    }
+}
+
+uint64_t programWords() {
+    uint64_t words = 0;
+    for (uint32_t i = 0; i < program.functionCount; i++) {
+        words += program.functions[i].codeLength;
+    }
+    return words;
+}
+
+// Print the bytecode for --dump-bytecode
+void printBytecode() {
+    for (uint32_t f = 0; f < program.functionCount; f++) {
+        Function *function = &program.functions[f];
+        printf("== %.*s (arity %u, slots %u, max stack %u) ==\n", (int)names.lengths[function->name],
+               names.text[function->name], function->arity, function->slotCount, function->maxStack);
+        for (uint32_t pc = 0; pc < function->codeLength; pc++) {
+            uint32_t word = function->code[pc];
+            Opcode op = (Opcode)INSTRUCTION_OP(word);
+            printf("%6u  %-14s", pc, opcodeNames[op]);
+            switch (op) {
+                case OP_CONST:
+                    printf(" %u (", INSTRUCTION_OPERAND(word));
+                    printValue(stdout, program.constants[INSTRUCTION_OPERAND(word)]);
+                    printf(")");
+                    break;
+                case OP_INT:
+                    printf(" %d", INSTRUCTION_SIGNED(word));
+                    break;
+                case OP_CALL: case OP_CALL_MEMO: case OP_TAIL_CALL: {
+                    uint32_t name = program.functions[INSTRUCTION_OPERAND(word)].name;
+                    printf(" %.*s", (int)names.lengths[name], names.text[name]);
+                    break;
+                }
+                case OP_METHOD:
+                    printf(" %s/%u", methodNames[INSTRUCTION_OPERAND(word)], function->code[++pc]);
+                    break;
+                case OP_SUM_ARRAY:
+                    printf(" %u %u %u", INSTRUCTION_OPERAND(word), function->code[pc + 1], function->code[pc + 2]);
+                    pc += 2;
+                    break;
+                case OP_LOAD_LOCAL: case OP_STORE_LOCAL:
+                case OP_JUMP: case OP_JUMP_IF_FALSE: case OP_JUMP_IF_TRUE:
+                case OP_INPUT: case OP_CONCAT: case OP_ARRAY:
+                    printf(" %u", INSTRUCTION_OPERAND(word));
+                    break;
+                default:
+                    break;
+            }
+            printf("\n");
+        }
+    }
+}
+
+void visitDepth(int32_t *depth, uint32_t *work, uint32_t *count, uint32_t pc, int32_t value) {
+    if (depth[pc] < 0) {
+        depth[pc] = value;
+        work[(*count)++] = pc;
+    }
+}
+
+// Operand stack depth before each instruction; -1 where unreachable
+int32_t *stackDepths(Function *function) {
+    int32_t *depth = malloc(function->codeLength * sizeof(int32_t));
+    uint32_t *work = malloc(function->codeLength * sizeof(uint32_t));
+    if (depth == NULL || work == NULL) {
+        sourceOutOfMemory();
+    }
+    for (uint32_t pc = 0; pc < function->codeLength; pc++) {
+        depth[pc] = -1;
+    }
+    uint32_t count = 0;
+    visitDepth(depth, work, &count, 0, 0);
+    while (count > 0) {
+        uint32_t pc = work[--count];
+        uint32_t word = function->code[pc];
+        uint32_t operand = INSTRUCTION_OPERAND(word);
+        uint32_t next = pc + 1;
+        int32_t after = depth[pc];
+        switch ((Opcode)INSTRUCTION_OP(word)) {
+            case OP_CONST: case OP_INT: case OP_LOAD_LOCAL:
+                after++;
+                break;
+            case OP_POP: case OP_STORE_LOCAL: case OP_PRINT: case OP_INDEX: case OP_INDEX_IN_BOUNDS:
+            case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+            case OP_EQ: case OP_NE: case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+            case OP_ADD_INT: case OP_SUB_INT: case OP_MUL_INT: case OP_DIV_INT:
+            case OP_EQ_INT: case OP_NE_INT: case OP_LT_INT: case OP_LE_INT: case OP_GT_INT: case OP_GE_INT:
+                after--;
+                break;
+            case OP_JUMP:
+                next = operand;
+                break;
+            case OP_JUMP_IF_FALSE: case OP_JUMP_IF_TRUE:
+                after--;
+                visitDepth(depth, work, &count, operand, after);
+                break;
+            case OP_CALL: case OP_CALL_MEMO:
+                after += 1 - (int32_t)program.functions[operand].arity;
+                break;
+            case OP_INPUT:
+                after += operand ? 0 : 1;
+                break;
+            case OP_CONCAT: case OP_ARRAY:
+                after += 1 - (int32_t)operand;
+                break;
+            case OP_METHOD:
+                after -= (int32_t)function->code[pc + 1];
+                next = pc + 2;
+                break;
+            case OP_SUM_ARRAY:
+                next = pc + 3;
+                break;
+            case OP_TAIL_CALL: case OP_RETURN: case OP_RETURN_NIL:
+                continue;
+            default:
+                break;
+        }
+        visitDepth(depth, work, &count, next, after);
+    }
+    free(work);
+    return depth;
+}
+
+// Type inference. Every slot and operand gets the set of value types it
+// can hold at each instruction, one bit per type, from a flow-sensitive
+// analysis of the bytecode: a store replaces a slot's set and the sets
+// meet where control flow joins, at block entries. Parameters take the
+// types of the arguments of every call (any type when an embedding host
+// may call the action) and calls the types their callee returns, so the
+// actions of a program are analysed together until nothing changes.
+// Arithmetic and comparisons whose operands can only be ints are then
+// rewritten to their unchecked forms.
+typedef uint8_t TypeSet;
+
+#define TYPE_BIT(type) ((TypeSet)(1u << (type)))
+#define TYPES_INT TYPE_BIT(VAL_INT)
+#define TYPES_NUMBER (TYPE_BIT(VAL_INT) | TYPE_BIT(VAL_DOUBLE))
+#define TYPES_ANY ((TypeSet)((1u << (VAL_ARRAY + 1)) - 1))
+#define TYPE_STATE_LIMIT (16u << 20)   // Bytes of block states per action; larger actions keep their checks
+
+typedef struct {
+    TypeSet *parameters;        // Function f's from parameterStart[f], joined over its calls
+    uint32_t *parameterStart;
+    TypeSet *returns;           // Per function
+    uint32_t *callers;          // Function f's from callerStart[f]: actions that call it
+    uint32_t *callerStart;
+    uint8_t *pending;           // To analyse (again)
+} TypeInference;
+
+// One action's analysis. Block b starts at starts[b] and holds the sets on
+// entry at states[b * width]; block[pc] is the block starting at pc.
+typedef struct {
+    Function *function;
+    uint32_t width;             // Slots, then the deepest operand stack
+    uint32_t *block;
+    uint32_t *starts;
+    TypeSet *states;
+    uint8_t *reached;
+    uint8_t *queued;
+    uint32_t *work;
+    uint32_t workCount;
+} TypeFlow;
+
+// Result types of + - * / on operands of types `a` and `b`; operand types
+// they reject give none
+TypeSet arithmeticTypes(Opcode op, TypeSet a, TypeSet b) {
+    TypeSet types = 0;
+    if ((a & TYPES_INT) && (b & TYPES_INT)) {
+        types |= TYPES_INT;
+    }
+    if (((a | b) & TYPE_BIT(VAL_DOUBLE)) && (a & TYPES_NUMBER) && (b & TYPES_NUMBER)) {
+        types |= TYPE_BIT(VAL_DOUBLE);
+    }
+    if (op == OP_ADD && ((a | b) & TYPE_BIT(VAL_STRING)) && a != 0 && b != 0) {
+        types |= TYPE_BIT(VAL_STRING);
+    }
+    return types;
+}
+
+// Widen what function f returns, and have its callers look again
+void widenReturn(TypeInference *inference, uint32_t f, TypeSet types) {
+    if ((inference->returns[f] | types) == inference->returns[f]) {
+        return;
+    }
+    inference->returns[f] |= types;
+    for (uint32_t i = inference->callerStart[f]; i < inference->callerStart[f + 1]; i++) {
+        inference->pending[inference->callers[i]] = 1;
+    }
+}
+
+// A call to `callee` with its arguments just below `top`
+void passArguments(TypeInference *inference, uint32_t callee, const TypeSet *top) {
+    uint32_t arity = program.functions[callee].arity;
+    TypeSet *parameters = &inference->parameters[inference->parameterStart[callee]];
+    for (uint32_t i = 0; i < arity; i++) {
+        TypeSet types = top[(int32_t)i - (int32_t)arity];
+        if ((parameters[i] | types) != parameters[i]) {
+            parameters[i] |= types;
+            inference->pending[callee] = 1;
+        }
+    }
+}
+
+// Flow into the block at `pc` with the slots and operands below `top`
+void joinBlock(TypeFlow *flow, uint32_t pc, const TypeSet *current, const TypeSet *top) {
+    uint32_t target = flow->block[pc];
+    TypeSet *into = &flow->states[(size_t)target * flow->width];
+    int changed = !flow->reached[target];
+    flow->reached[target] = 1;
+    for (uint32_t i = 0; i < (uint32_t)(top - current); i++) {
+        if ((into[i] | current[i]) != into[i]) {
+            into[i] |= current[i];
+            changed = 1;
+        }
+    }
+    if (changed && !flow->queued[target]) {
+        flow->queued[target] = 1;
+        flow->work[flow->workCount++] = target;
+    }
+}
+
+// Arithmetic and comparisons that check their operands' types
+static inline int typeChecked(Opcode op) {
+    return (op >= OP_ADD && op <= OP_NEG) || (op >= OP_EQ && op <= OP_GE);
+}
+
+// An action too large to analyse passes and returns anything
+void assumeAnyTypes(TypeInference *inference, uint32_t f) {
+    Function *function = &program.functions[f];
+    for (uint32_t pc = 0; pc < function->codeLength; pc += instructionWords((Opcode)INSTRUCTION_OP(function->code[pc]))) {
+        Opcode op = (Opcode)INSTRUCTION_OP(function->code[pc]);
+        uint32_t callee = INSTRUCTION_OPERAND(function->code[pc]);
+        if (op == OP_CALL || op == OP_CALL_MEMO || op == OP_TAIL_CALL) {
+            TypeSet *parameters = &inference->parameters[inference->parameterStart[callee]];
+            for (uint32_t i = 0; i < program.functions[callee].arity; i++) {
+                if (parameters[i] != TYPES_ANY) {
+                    parameters[i] = TYPES_ANY;
+                    inference->pending[callee] = 1;
+                }
+            }
+        }
+    }
+    widenReturn(inference, f, TYPES_ANY);
+}
+
+// Analyse function f with what is known so far of its parameters and of
+// what its callees return. With `rewrite` (once that is final), also give
+// the operations on proven ints their unchecked forms.
+void inferFunctionTypes(TypeInference *inference, uint32_t f, int rewrite) {
+    Function *function = &program.functions[f];
+    uint32_t length = function->codeLength;
+    TypeFlow flow = {.function = function, .width = function->slotCount + function->maxStack};
+    int32_t *depth = stackDepths(function);
+    flow.block = malloc(((size_t)length + 1) * sizeof(uint32_t));
+    if (flow.block == NULL) {
+        sourceOutOfMemory();
+    }
+    // Blocks start at pc 0 and at jump targets
+    for (uint32_t pc = 0; pc <= length; pc++) {
+        flow.block[pc] = pc == 0 ? 0 : UINT32_MAX;
+    }
+    for (uint32_t pc = 0; pc < length; pc += instructionWords((Opcode)INSTRUCTION_OP(function->code[pc]))) {
+        Opcode op = (Opcode)INSTRUCTION_OP(function->code[pc]);
+        if (depth[pc] >= 0 && (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE)) {
+            flow.block[INSTRUCTION_OPERAND(function->code[pc])] = 0;
+        }
+    }
+    uint32_t blockCount = 0;
+    for (uint32_t pc = 0; pc < length; pc++) {
+        if (flow.block[pc] != UINT32_MAX) {
+            flow.block[pc] = blockCount++;
+        }
+    }
+    if (length == 0 || (uint64_t)(blockCount + 1) * flow.width > TYPE_STATE_LIMIT) {
+        TRACE(TRACE_OPT, TRACE_INFO, "%.*s is too large for type inference", (int)names.lengths[function->name],
+              names.text[function->name]);
+        free(flow.block);
+        free(depth);
+        assumeAnyTypes(inference, f);
+        return;
+    }
+    flow.starts = malloc(blockCount * sizeof(uint32_t));
+    flow.work = malloc(blockCount * sizeof(uint32_t));
+    flow.states = calloc((size_t)(blockCount + 1) * flow.width + 1, 1);
+    flow.reached = calloc(blockCount, 2);
+    if (flow.starts == NULL || flow.work == NULL || flow.states == NULL || flow.reached == NULL) {
+        sourceOutOfMemory();
+    }
+    flow.queued = flow.reached + blockCount;
+    for (uint32_t pc = 0; pc < length; pc++) {
+        if (flow.block[pc] != UINT32_MAX) {
+            flow.starts[flow.block[pc]] = pc;
+        }
+    }
+
+    // On entry the parameters hold the arguments; other slots hold nil,
+    // or after a tail call whatever the frame's last action left there
+    TypeSet *current = &flow.states[(size_t)blockCount * flow.width];
+    memcpy(current, &inference->parameters[inference->parameterStart[f]], function->arity);
+    memset(current + function->arity, TYPES_ANY, function->slotCount - function->arity);
+    joinBlock(&flow, 0, current, current + function->slotCount);
+
+    // Walk blocks off the work list until their entry states settle, then,
+    // when rewriting, each reached block once more
+    uint32_t nextRewrite = 0;
+    for (;;) {
+        uint32_t b;
+        if (flow.workCount > 0) {
+            b = flow.work[--flow.workCount];
+            flow.queued[b] = 0;
+        } else if (rewrite && nextRewrite < blockCount) {
+            b = nextRewrite++;
+            if (!flow.reached[b]) {
+                continue;
+            }
+        } else {
+            break;
+        }
+        int rewriting = nextRewrite > 0;
+        uint32_t pc = flow.starts[b];
+        memcpy(current, &flow.states[(size_t)b * flow.width], flow.width);
+        TypeSet *sp = current + function->slotCount + depth[pc];
+        for (;;) {
+            uint32_t word = function->code[pc];
+            Opcode op = (Opcode)INSTRUCTION_OP(word);
+            uint32_t operand = INSTRUCTION_OPERAND(word);
+            int ends = 0;
+            if (rewriting && typeChecked(op) &&
+                (op == OP_NEG ? sp[-1] == TYPES_INT : sp[-1] == TYPES_INT && sp[-2] == TYPES_INT)) {
+                function->code[pc] = INSTRUCTION(op == OP_NEG ? OP_NEG_INT : op <= OP_DIV ? op - OP_ADD + OP_ADD_INT
+                                                                                          : op - OP_EQ + OP_EQ_INT, 0);
+            }
+            switch (op) {
+                case OP_CONST:
+                    *sp++ = TYPE_BIT(program.constants[operand].type);
+                    break;
+                case OP_INT:
+                    *sp++ = TYPES_INT;
+                    break;
+                case OP_POP: case OP_PRINT:
+                    sp--;
+                    break;
+                case OP_LOAD_LOCAL:
+                    *sp++ = current[operand];
+                    break;
+                case OP_STORE_LOCAL:
+                    current[operand] = *--sp;
+                    break;
+                case OP_ADD: case OP_SUB: case OP_MUL: case OP_DIV:
+                    sp[-2] = arithmeticTypes(op, sp[-2], sp[-1]);
+                    sp--;
+                    break;
+                case OP_NEG:
+                    sp[-1] &= TYPES_NUMBER;
+                    break;
+                case OP_NOT: case OP_NEG_INT:
+                    sp[-1] = TYPES_INT;
+                    break;
+                case OP_EQ: case OP_NE: case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+                case OP_ADD_INT: case OP_SUB_INT: case OP_MUL_INT: case OP_DIV_INT:
+                case OP_EQ_INT: case OP_NE_INT: case OP_LT_INT: case OP_LE_INT: case OP_GT_INT: case OP_GE_INT:
+                    sp[-2] = TYPES_INT;
+                    sp--;
+                    break;
+                case OP_JUMP:
+                    joinBlock(&flow, operand, current, sp);
+                    ends = 1;
+                    break;
+                case OP_JUMP_IF_FALSE: case OP_JUMP_IF_TRUE:
+                    sp--;
+                    joinBlock(&flow, operand, current, sp);
+                    break;
+                case OP_CALL: case OP_CALL_MEMO:
+                    passArguments(inference, operand, sp);
+                    sp -= program.functions[operand].arity;
+                    *sp++ = inference->returns[operand];
+                    break;
+                case OP_TAIL_CALL:
+                    passArguments(inference, operand, sp);
+                    widenReturn(inference, f, inference->returns[operand]);
+                    ends = 1;
+                    break;
+                case OP_RETURN:
+                    widenReturn(inference, f, sp[-1]);
+                    ends = 1;
+                    break;
+                case OP_RETURN_NIL:
+                    widenReturn(inference, f, TYPE_BIT(VAL_NIL));
+                    ends = 1;
+                    break;
+                case OP_INPUT:
+                    sp -= operand;
+                    *sp++ = TYPES_ANY & ~TYPE_BIT(VAL_ARRAY);
+                    break;
+                case OP_CONCAT:
+                    sp -= operand;
+                    *sp++ = TYPE_BIT(VAL_STRING);
+                    break;
+                case OP_ARRAY:
+                    sp -= operand;
+                    *sp++ = TYPE_BIT(VAL_ARRAY);
+                    break;
+                case OP_INDEX: case OP_INDEX_IN_BOUNDS:
+                    sp--;
+                    sp[-1] = TYPES_ANY;
+                    break;
+                case OP_METHOD:
+                    sp -= function->code[pc + 1];
+                    sp[-1] = operand == METHOD_LENGTH ? TYPES_INT : TYPE_BIT(VAL_STRING);
+                    break;
+                case OP_SUM_ARRAY: {
+                    // An int total stays one only over an array of ints
+                    TypeSet *total = &current[function->code[pc + 1]];
+                    *total |= *total & TYPES_INT ? TYPE_BIT(VAL_DOUBLE) : 0;
+                    break;
+                }
+                default:
+                    break;
+            }
+            pc += instructionWords(op);
+            if (ends || pc >= length) {
+                break;
+            }
+            if (flow.block[pc] != UINT32_MAX) {
+                joinBlock(&flow, pc, current, sp);
+                break;
+            }
+        }
+    }
+    free(flow.block);
+    free(flow.starts);
+    free(flow.work);
+    free(flow.states);
+    free(flow.reached);
+    free(depth);
+}
+
+// Arithmetic and comparisons in the program as compiled (or loaded), and
+// how many of them are unchecked, for the stats
+void countTypedOperations() {
+    stats.specializedOperations = stats.checkedOperations = 0;
+    for (uint32_t f = 0; f < program.functionCount; f++) {
+        Function *function = &program.functions[f];
+        for (uint32_t pc = 0; pc < function->codeLength;
+             pc += instructionWords((Opcode)INSTRUCTION_OP(function->code[pc]))) {
+            Opcode op = (Opcode)INSTRUCTION_OP(function->code[pc]);
+            stats.specializedOperations += (uint64_t)provenInt(op);
+            stats.checkedOperations += (uint64_t)typeChecked(op);
+        }
+    }
+    TRACE(TRACE_OPT, TRACE_INFO, "specialized %llu of %llu arithmetic and comparison instructions",
+          (unsigned long long)stats.specializedOperations,
+          (unsigned long long)(stats.specializedOperations + stats.checkedOperations));
+}
+
+void inferTypes() {
+    TypeInference inference;
+    uint32_t count = program.functionCount;
+    inference.parameterStart = malloc(((size_t)count + 1) * sizeof(uint32_t));
+    inference.callerStart = calloc((size_t)count + 2, sizeof(uint32_t));
+    inference.returns = calloc((size_t)count + 1, 1);
+    inference.pending = malloc((size_t)count + 1);
+    if (inference.parameterStart == NULL || inference.callerStart == NULL || inference.returns == NULL ||
+        inference.pending == NULL) {
+        sourceOutOfMemory();
+    }
+    uint32_t parameterCount = 0, callCount = 0;
+    for (uint32_t f = 0; f < count; f++) {
+        inference.parameterStart[f] = parameterCount;
+        parameterCount += program.functions[f].arity;
+        inference.pending[f] = 1;
+    }
+    inference.parameterStart[count] = parameterCount;
+    inference.parameters = malloc((size_t)parameterCount + 1);
+    if (inference.parameters == NULL) {
+        sourceOutOfMemory();
+    }
+    memset(inference.parameters, compiler.hostCalls ? TYPES_ANY : 0, parameterCount);
+
+    // Callers by callee, each caller once per call it makes
+    for (int pass = 0; pass < 2; pass++) {
+        for (uint32_t f = 0; f < count; f++) {
+            Function *function = &program.functions[f];
+            for (uint32_t pc = 0; pc < function->codeLength;
+                 pc += instructionWords((Opcode)INSTRUCTION_OP(function->code[pc]))) {
+                Opcode op = (Opcode)INSTRUCTION_OP(function->code[pc]);
+                if (op == OP_CALL || op == OP_CALL_MEMO || op == OP_TAIL_CALL) {
+                    uint32_t callee = INSTRUCTION_OPERAND(function->code[pc]);
+                    if (pass == 0) {
+                        inference.callerStart[callee + 2]++;
+                    } else {
+                        inference.callers[inference.callerStart[callee + 1]++] = f;
+                    }
+                }
+            }
+        }
+        if (pass == 0) {
+            for (uint32_t f = 0; f < count; f++) {
+                inference.callerStart[f + 2] += inference.callerStart[f + 1];
+            }
+            callCount = inference.callerStart[count + 1];
+            inference.callers = malloc(((size_t)callCount + 1) * sizeof(uint32_t));
+            if (inference.callers == NULL) {
+                sourceOutOfMemory();
+            }
+        }
+    }
+
+    int again = 1;
+    while (again) {
+        again = 0;
+        for (uint32_t f = 0; f < count; f++) {
+            if (inference.pending[f]) {
+                inference.pending[f] = 0;
+                inferFunctionTypes(&inference, f, 0);
+                again = 1;
+            }
+        }
+    }
+    for (uint32_t f = 0; f < count; f++) {
+        inferFunctionTypes(&inference, f, 1);
+    }
+    free(inference.parameters);
+    free(inference.parameterStart);
+    free(inference.returns);
+    free(inference.callers);
+    free(inference.callerStart);
+    free(inference.pending);
+}
+
+// Baseline JIT for x86-64. An action that has been called or has looped
+// JIT_THRESHOLD times is translated, one instruction at a time, into
+// machine code that works on the interpreter's own frame: rbx holds the
+// slots and every operand sits at a fixed offset from them, so native code
+// can be entered and left at any instruction. Integer arithmetic,
+// comparisons, branches and reads from unboxed arrays run natively behind
+// type guards; any other
+// instruction exits to the interpreter. A failed guard deoptimizes: the
+// interpreter redoes the instruction, the code is dropped, and the next
+// compile leaves that instruction to the interpreter.
+#if defined(__x86_64__) && !defined(EPIC_NO_JIT)
+#define EPIC_JIT 1
+#endif
+
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000   // Calls plus loop back-edges before an action is compiled
+#endif
+
+// Runs from `target` to the first exit and returns the pc to resume at,
+// shifted left once, with bit 0 set when a guard failed
+typedef uint32_t (*JitFunction)(Value *slots, const uint8_t *target);
+
+typedef struct JitCode {
+    JitFunction run;
+    uint8_t *code;
+    size_t mappedSize;
+    uint32_t codeSize;
+    uint32_t *entries;      // Native offset of each pc; UINT32_MAX where unreachable
+    int32_t *depth;         // Operand stack depth at each pc
+} JitCode;
+
+typedef struct {
+    int enabled;
+    int dump;               // Print each compiled action to stderr
+} JitState;
+
+JitState jit;
+
+#ifdef EPIC_JIT
+enum { RAX, RCX, RDX, RBX };
+
+// A rel32 waiting for its target: a pc's code, or a pc's deopt exit
+typedef struct {
+    uint32_t at;
+    uint32_t pc;
+    uint8_t deopt;
+} JitFixup;
+
+typedef struct {
+    uint8_t *bytes;
+    uint32_t length;
+    uint32_t capacity;
+    JitFixup *fixups;
+    uint32_t fixupCount;
+    uint32_t fixupCapacity;
+} JitBuffer;
+
+void jitBytes(JitBuffer *buffer, const void *bytes, uint32_t count) {
+    while (buffer->length + count > buffer->capacity) {
+        buffer->bytes = growArray(buffer->bytes, &buffer->capacity, 1, 4096);
+    }
+    memcpy(buffer->bytes + buffer->length, bytes, count);
+    buffer->length += count;
+}
+
+void jitByte(JitBuffer *buffer, uint8_t byte) {
+    jitBytes(buffer, &byte, 1);
+}
+
+void jitWord(JitBuffer *buffer, uint32_t word) {
+    uint8_t bytes[4] = {(uint8_t)word, (uint8_t)(word >> 8), (uint8_t)(word >> 16), (uint8_t)(word >> 24)};
+    jitBytes(buffer, bytes, 4);
+}
+
+// `opcode` with a ModRM operand of [rbx + disp32] addressing a slot's
+// type (offset 0) or payload (offset 8)
+void jitSlot(JitBuffer *buffer, const char *opcode, uint32_t opcodeLength, int reg, uint32_t slot, size_t offset) {
+    jitBytes(buffer, opcode, opcodeLength);
+    jitByte(buffer, (uint8_t)(0x80 | (reg << 3) | RBX));
+    jitWord(buffer, slot * (uint32_t)sizeof(Value) + (uint32_t)offset);
+}
+
+#define TYPE_OF 0
+#define PAYLOAD_OF offsetof(Value, as)
+
+// Branch to `pc` (or to its deopt exit) once the code is laid out
+void jitBranch(JitBuffer *buffer, const char *opcode, uint32_t opcodeLength, uint32_t pc, int deopt) {
+    jitBytes(buffer, opcode, opcodeLength);
+    if (buffer->fixupCount == buffer->fixupCapacity) {
+        buffer->fixups = growArray(buffer->fixups, &buffer->fixupCapacity, sizeof(JitFixup), 64);
+    }
+    buffer->fixups[buffer->fixupCount++] = (JitFixup){buffer->length, pc, (uint8_t)deopt};
+    jitWord(buffer, 0);
+}
+
+void jitPatch(JitBuffer *buffer, uint32_t at, uint32_t target) {
+    uint32_t relative = target - (at + 4);
+    memcpy(buffer->bytes + at, &relative, 4);
+}
+
+// Leave for the interpreter at `pc`; `epilogue` restores rbx and returns
+void jitExit(JitBuffer *buffer, uint32_t exit, uint32_t epilogue) {
+    jitByte(buffer, 0xB8);                   // mov eax, exit
+    jitWord(buffer, exit);
+    jitByte(buffer, 0xE9);                   // jmp epilogue
+    jitWord(buffer, epilogue - (buffer->length + 4));
+}
+
+void jitGuardInt(JitBuffer *buffer, uint32_t slot, uint32_t pc) {
+    jitSlot(buffer, "\x80", 1, 7, slot, TYPE_OF);   // cmp byte [slot], VAL_INT
+    jitByte(buffer, VAL_INT);
+    jitBranch(buffer, "\x0F\x85", 2, pc, 1);        // jne deopt
+}
+
+// rax = a.payload <op> b.payload, stored back into a
+void jitIntBinary(JitBuffer *buffer, const char *opcode, uint32_t opcodeLength, uint32_t a, uint32_t b) {
+    jitSlot(buffer, "\x48\x8B", 2, RAX, a, PAYLOAD_OF);     // mov rax, [a]
+    jitSlot(buffer, opcode, opcodeLength, RAX, b, PAYLOAD_OF);
+    jitSlot(buffer, "\x48\x89", 2, RAX, a, PAYLOAD_OF);     // mov [a], rax
+}
+
+// Store the flag `setcc` computed as an int payload
+void jitStoreFlag(JitBuffer *buffer, uint8_t setcc, uint32_t slot) {
+    uint8_t bytes[] = {0x0F, setcc, 0xC0, 0x0F, 0xB6, 0xC0};  // setcc al; movzx eax, al
+    jitBytes(buffer, bytes, sizeof(bytes));
+    jitSlot(buffer, "\x48\x89", 2, RAX, slot, PAYLOAD_OF);
+}
+
+void jitCopy(JitBuffer *buffer, uint32_t to, uint32_t from) {
+    jitSlot(buffer, "\x0F\x10", 2, 0, from, 0);    // movups xmm0, [from]
+    jitSlot(buffer, "\x0F\x11", 2, 0, to, 0);      // movups [to], xmm0
+}
+
+void dumpBytes(const char *label, const uint8_t *bytes, uint32_t start, uint32_t end) {
+    fprintf(stderr, "%-22s", label);
+    for (uint32_t i = start; i < end; i++) {
+        fprintf(stderr, " %02x", bytes[i]);
+    }
+    fputc('\n', stderr);
+}
+
+// --dump-jit: the bytes generated for each instruction
+void dumpNative(Function *function, JitCode *native, uint32_t stubs) {
+    fprintf(stderr, "== jit %.*s (%u bytes) ==\n", (int)names.lengths[function->name],
+            names.text[function->name], native->codeSize);
+    char label[32] = "entry";
+    uint32_t start = 0;
+    for (uint32_t pc = 0; pc <= function->codeLength; pc++) {
+        uint32_t end = pc < function->codeLength ? native->entries[pc] : stubs;
+        if (end == UINT32_MAX) {
+            continue;
+        }
+        if (end > start) {
+            dumpBytes(label, native->code, start, end);
+        }
+        if (pc < function->codeLength) {
+            snprintf(label, sizeof(label), "%6u  %s", pc, opcodeNames[INSTRUCTION_OP(function->code[pc])]);
+        }
+        start = end;
+    }
+    dumpBytes("exits", native->code, stubs, native->codeSize);
+}
+
+// Translate `function` to machine code; returns 0 when it stays interpreted
+int compileNative(Function *function) {
+    JitBuffer buffer = {0};
+    int32_t *depth = stackDepths(function);
+    uint32_t *entries = malloc(((size_t)function->codeLength + 1) * sizeof(uint32_t));
+    if (entries == NULL) {
+        sourceOutOfMemory();
+    }
+
+    // push rbx; mov rbx, rdi; jmp rsi -- then the shared epilogue
+    jitBytes(&buffer, "\x53\x48\x89\xFB\xFF\xE6", 6);
+    uint32_t epilogue = buffer.length;
+    jitBytes(&buffer, "\x5B\xC3", 2);                 // pop rbx; ret
+
+    for (uint32_t pc = 0; pc < function->codeLength; pc++) {
+        uint32_t word = function->code[pc];
+        Opcode op = (Opcode)INSTRUCTION_OP(word);
+        uint32_t operand = INSTRUCTION_OPERAND(word);
+        entries[pc] = UINT32_MAX;
+        if (depth[pc] < 0) {
+            for (uint32_t extra = 1; extra < instructionWords(op); extra++) {
+                entries[++pc] = UINT32_MAX;
+            }
+            continue;
+        }
+        entries[pc] = buffer.length;
+        uint32_t top = function->slotCount + (uint32_t)depth[pc];
+        uint32_t a = top - 2, b = top - 1;
+        if (function->generic != NULL && function->generic[pc]) {
+            op = OPCODE_COUNT;   // Deoptimized here before: leave it to the interpreter
+        }
+        switch (op) {
+            case OP_CONST: {
+                uint64_t address = (uint64_t)(uintptr_t)&program.constants[operand];
+                jitBytes(&buffer, "\x48\xB8", 2);                 // mov rax, &constant
+                jitBytes(&buffer, &address, 8);
+                jitBytes(&buffer, "\x0F\x10\x00", 3);             // movups xmm0, [rax]
+                jitSlot(&buffer, "\x0F\x11", 2, 0, top, 0);
+                break;
+            }
+            case OP_INT:
+                jitSlot(&buffer, "\x48\xC7", 2, 0, top, TYPE_OF);  // mov qword [top], imm32
+                jitWord(&buffer, VAL_INT);
+                jitSlot(&buffer, "\x48\xC7", 2, 0, top, PAYLOAD_OF);
+                jitWord(&buffer, (uint32_t)INSTRUCTION_SIGNED(word));
+                break;
+            case OP_POP:
+                break;
+            case OP_LOAD_LOCAL:
+                jitCopy(&buffer, top, operand);
+                break;
+            case OP_STORE_LOCAL:
+                jitCopy(&buffer, operand, b);
+                break;
+            case OP_ADD: case OP_SUB: case OP_MUL:
+            case OP_ADD_INT: case OP_SUB_INT: case OP_MUL_INT:
+                if (!provenInt(op)) {
+                    jitGuardInt(&buffer, a, pc);
+                    jitGuardInt(&buffer, b, pc);
+                }
+                if (op == OP_MUL || op == OP_MUL_INT) {
+                    jitIntBinary(&buffer, "\x48\x0F\xAF", 3, a, b);   // imul rax, [b]
+                } else {
+                    jitIntBinary(&buffer, op == OP_ADD || op == OP_ADD_INT ? "\x48\x03" : "\x48\x2B", 2, a, b);
+                }
+                break;
+            case OP_DIV: case OP_DIV_INT:
+                // Zero and -1 divisors go to the interpreter for its error and wrap-around
+                if (!provenInt(op)) {
+                    jitGuardInt(&buffer, a, pc);
+                    jitGuardInt(&buffer, b, pc);
+                }
+                jitSlot(&buffer, "\x48\x8B", 2, RCX, b, PAYLOAD_OF);  // mov rcx, [b]
+                jitBytes(&buffer, "\x48\x85\xC9", 3);                 // test rcx, rcx
+                jitBranch(&buffer, "\x0F\x84", 2, pc, 1);
+                jitBytes(&buffer, "\x48\x83\xF9\xFF", 4);             // cmp rcx, -1
+                jitBranch(&buffer, "\x0F\x84", 2, pc, 1);
+                jitSlot(&buffer, "\x48\x8B", 2, RAX, a, PAYLOAD_OF);
+                jitBytes(&buffer, "\x48\x99\x48\xF7\xF9", 5);         // cqo; idiv rcx
+                jitSlot(&buffer, "\x48\x89", 2, RAX, a, PAYLOAD_OF);
+                break;
+            case OP_NEG: case OP_NEG_INT:
+                if (!provenInt(op)) {
+                    jitGuardInt(&buffer, b, pc);
+                }
+                jitSlot(&buffer, "\x48\xF7", 2, 3, b, PAYLOAD_OF);    // neg qword [b]
+                break;
+            case OP_NOT:
+                jitGuardInt(&buffer, b, pc);
+                jitSlot(&buffer, "\x48\x83", 2, 7, b, PAYLOAD_OF);    // cmp qword [b], 0
+                jitByte(&buffer, 0);
+                jitStoreFlag(&buffer, 0x94, b);                       // sete
+                break;
+            case OP_EQ: case OP_NE: case OP_LT: case OP_LE: case OP_GT: case OP_GE:
+            case OP_EQ_INT: case OP_NE_INT: case OP_LT_INT: case OP_LE_INT: case OP_GT_INT: case OP_GE_INT: {
+                static const uint8_t setcc[] = {0x94, 0x95, 0x9C, 0x9E, 0x9F, 0x9D};
+                if (!provenInt(op)) {
+                    jitGuardInt(&buffer, a, pc);
+                    jitGuardInt(&buffer, b, pc);
+                }
+                jitSlot(&buffer, "\x48\x8B", 2, RAX, a, PAYLOAD_OF);
+                jitSlot(&buffer, "\x48\x3B", 2, RAX, b, PAYLOAD_OF);  // cmp rax, [b]
+                jitStoreFlag(&buffer, setcc[provenInt(op) ? op - OP_EQ_INT : op - OP_EQ], a);
+                break;
+            }
+            case OP_INDEX: case OP_INDEX_IN_BOUNDS: {
+                // Unboxed arrays only: the element's type is the array's kind
+                uint8_t kind[] = {0x0F, 0xB6, 0x50, (uint8_t)offsetof(Array, kind)};        // movzx edx, byte [rax + kind]
+                uint8_t length[] = {0x8B, 0x70, (uint8_t)offsetof(Array, length)};          // mov esi, [rax + length]
+                uint8_t load[] = {0x48, 0x8B, 0x40, (uint8_t)offsetof(Array, ints),         // mov rax, [rax + ints]
+                                  0x48, 0x8B, 0x04, 0xC8};                                  // mov rax, [rax + rcx*8]
+                jitSlot(&buffer, "\x80", 1, 7, a, TYPE_OF);
+                jitByte(&buffer, VAL_ARRAY);
+                jitBranch(&buffer, "\x0F\x85", 2, pc, 1);
+                jitSlot(&buffer, "\x48\x8B", 2, RAX, a, PAYLOAD_OF);
+                jitBytes(&buffer, kind, sizeof(kind));
+                jitBytes(&buffer, "\x85\xD2", 2);                         // test edx, edx
+                jitBranch(&buffer, "\x0F\x84", 2, pc, 1);
+                jitSlot(&buffer, "\x48\x8B", 2, RCX, b, PAYLOAD_OF);
+                if (op == OP_INDEX) {
+                    // Negative indexes compare as huge unsigned ones
+                    jitGuardInt(&buffer, b, pc);
+                    jitBytes(&buffer, length, sizeof(length));
+                    jitBytes(&buffer, "\x48\x39\xF1", 3);                 // cmp rcx, rsi
+                    jitBranch(&buffer, "\x0F\x83", 2, pc, 1);              // jae deopt
+                }
+                jitBytes(&buffer, load, sizeof(load));
+                jitSlot(&buffer, "\x48\x89", 2, RDX, a, TYPE_OF);
+                jitSlot(&buffer, "\x48\x89", 2, RAX, a, PAYLOAD_OF);
+                break;
+            }
+            case OP_JUMP:
+                jitBranch(&buffer, "\xE9", 1, operand, 0);
+                break;
+            case OP_JUMP_IF_FALSE: case OP_JUMP_IF_TRUE:
+                jitGuardInt(&buffer, b, pc);
+                jitSlot(&buffer, "\x48\x83", 2, 7, b, PAYLOAD_OF);
+                jitByte(&buffer, 0);
+                jitBranch(&buffer, op == OP_JUMP_IF_FALSE ? "\x0F\x84" : "\x0F\x85", 2, operand, 0);
+                break;
+            default:
+                // Calls, returns, I/O and heap values stay in the interpreter
+                jitExit(&buffer, pc << 1, epilogue);
+                break;
+        }
+        for (uint32_t extra = 1; extra < instructionWords((Opcode)INSTRUCTION_OP(word)); extra++) {
+            entries[++pc] = UINT32_MAX;
+        }
+    }
+
+    // One deopt exit per guarded instruction, after the code
+    uint32_t stubs = buffer.length;
+    uint32_t *deoptExits = malloc(((size_t)function->codeLength + 1) * sizeof(uint32_t));
+    if (deoptExits == NULL) {
+        sourceOutOfMemory();
+    }
+    for (uint32_t pc = 0; pc < function->codeLength; pc++) {
+        deoptExits[pc] = UINT32_MAX;
+    }
+    for (uint32_t i = 0; i < buffer.fixupCount; i++) {
+        JitFixup fixup = buffer.fixups[i];
+        if (fixup.deopt && deoptExits[fixup.pc] == UINT32_MAX) {
+            deoptExits[fixup.pc] = buffer.length;
+            jitExit(&buffer, fixup.pc << 1 | 1, epilogue);
+        }
+        jitPatch(&buffer, fixup.at, fixup.deopt ? deoptExits[fixup.pc] : entries[fixup.pc]);
+    }
+    free(deoptExits);
+    free(buffer.fixups);
+
+    // Write the code, then flip the pages to read+execute
+    long pageSize = sysconf(_SC_PAGESIZE);
+    size_t mappedSize = (buffer.length + (size_t)pageSize - 1) / (size_t)pageSize * (size_t)pageSize;
+    uint8_t *code = mmap(NULL, mappedSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    JitCode *native = malloc(sizeof(JitCode));
+    if (code == MAP_FAILED || native == NULL) {
+        TRACE(TRACE_JIT, TRACE_INFO, "cannot map code for %.*s", (int)names.lengths[function->name], names.text[function->name]);
+        if (code != MAP_FAILED) {
+            munmap(code, mappedSize);
+        }
+        free(native);
+        free(buffer.bytes);
+        free(entries);
+        free(depth);
+        return 0;
+    }
+    memcpy(code, buffer.bytes, buffer.length);
+    free(buffer.bytes);
+    if (mprotect(code, mappedSize, PROT_READ | PROT_EXEC) != 0) {
+        munmap(code, mappedSize);
+        free(native);
+        free(entries);
+        free(depth);
+        return 0;
+    }
+
+    native->run = (JitFunction)(void *)code;
+    native->code = code;
+    native->mappedSize = mappedSize;
+    native->codeSize = buffer.length;
+    native->entries = entries;
+    native->depth = depth;
+    function->native = native;
+    stats.jitCompiles++;
+    stats.jitCodeBytes += buffer.length;
+    TRACE(TRACE_JIT, TRACE_INFO, "compiled %.*s: %u instructions, %u bytes", (int)names.lengths[function->name],
+          names.text[function->name], function->codeLength, buffer.length);
+    if (jit.dump) {
+        dumpNative(function, native, stubs);
+    }
+    return 1;
+}
+#endif
+
+void releaseNative(Function *function) {
+    JitCode *native = function->native;
+    if (native == NULL) {
+        return;
+    }
+    munmap(native->code, native->mappedSize);
+    free(native->entries);
+    free(native->depth);
+    free(native);
+    function->native = NULL;
+}
+
+// A guard failed at `pc`: drop the code and leave that instruction to the
+// interpreter when the action gets hot again
+void deoptimize(Function *function, uint32_t pc) {
+    stats.jitDeopts++;
+    TRACE(TRACE_JIT, TRACE_DEBUG, "deoptimizing %.*s at %u (%s)", (int)names.lengths[function->name],
+          names.text[function->name], pc, opcodeNames[INSTRUCTION_OP(function->code[pc])]);
+    if (function->generic == NULL) {
+        function->generic = calloc(function->codeLength, 1);
+        if (function->generic == NULL) {
+            sourceOutOfMemory();
+        }
+    }
+    function->generic[pc] = 1;
+    releaseNative(function);
+    function->hotness = 0;
+}
+
+// Program I/O. print() appends to a buffer that goes out with one writev
+// when it would overflow, at every newline when line buffered (the default
+// on a terminal), and before input() reads, so prompts always come first.
+// Text too large for the buffer is sent in the same writev rather than
+// copied. input() reads stdin in large blocks and hands out lines from them.
+// Fibers on several threads share stdout, so their buffers only overflow
+// up to the last newline: the partial line stays (growing the buffer past
+// its capacity if need be) and another thread's lines never land inside it.
+#define OUTPUT_BUFFER_SIZE (64u << 10)
+#define INPUT_BLOCK_SIZE (64u << 10)
+
+typedef struct {
+    char *data;
+    size_t length;
+    size_t capacity;        // 0: every print is written at once
+    int lineBuffered;
+    int wholeLines;         // Only write complete lines when the buffer fills
+    size_t allocated;       // Bytes at `data`; more than `capacity` while a long line is held
+} OutputBuffer;
+
+typedef struct {
+    char *data;
+    size_t start;           // First byte not yet handed out
+    size_t length;
+    size_t capacity;
+    int eof;
+    int routed;             // Lines are delivered by the fiber scheduler instead of read from stdin
+} InputBuffer;
+
+COMPILATION_LOCAL OutputBuffer output = {NULL, 0, OUTPUT_BUFFER_SIZE, 0, 0, 0};
+COMPILATION_LOCAL InputBuffer input;
+pthread_mutex_t outputLock = PTHREAD_MUTEX_INITIALIZER;    // Fibers on several threads share stdout
+
+// Write the buffered bytes followed by `extra`, retrying short writes
+void writeOutput(const char *extra, size_t extraLength) {
+    struct iovec parts[2] = {{output.data, output.length}, {(void *)extra, extraLength}};
+    struct iovec *next = parts;
+    int count = 2;
+    while (count > 0) {
+        if (next->iov_len == 0) {
+            next++;
+            count--;
+            continue;
+        }
+        pthread_mutex_lock(&outputLock);
+        ssize_t written = writev(STDOUT_FILENO, next, count);
+        pthread_mutex_unlock(&outputLock);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;  // Output is gone (e.g. a closed pipe); drop it like stdio would
+        }
+        stats.outputWrites++;
+        for (size_t left = (size_t)written; left > 0; next++, count--) {
+            size_t step = left < next->iov_len ? left : next->iov_len;
+            next->iov_base = (char *)next->iov_base + step;
+            next->iov_len -= step;
+            left -= step;
+            if (next->iov_len > 0) {
+                break;
+            }
+        }
+    }
+    output.length = 0;
+}
+
+void flushOutput() {
+    if (output.length > 0) {
+        writeOutput(NULL, 0);
+    }
+}
+
+// Write the buffered lines and keep the partial line after the last one.
+// The bytes before `from` are already known to hold no newline.
+void flushLines(size_t from) {
+    size_t end = output.length;
+    while (end > from && output.data[end - 1] != '\n') {
+        end--;
+    }
+    if (end == from) {
+        return;
+    }
+    size_t rest = output.length - end;
+    output.length = end;
+    writeOutput(NULL, 0);
+    memmove(output.data, output.data + end, rest);
+    output.length = rest;
+}
+
+void bufferOutput(const char *bytes, size_t length) {
+    if (length == 0) {
+        return;
+    }
+    if (output.wholeLines) {
+        size_t from = output.length > output.capacity ? output.length : 0;     // A held partial line
+        if (output.length + length > output.allocated) {
+            size_t allocated = output.allocated > 0 ? output.allocated : (output.capacity > 0 ? output.capacity : 256);
+            while (allocated < output.length + length) {
+                allocated *= 2;
+            }
+            char *data = realloc(output.data, allocated);
+            if (data == NULL) {
+                sourceOutOfMemory();
+            }
+            output.data = data;
+            output.allocated = allocated;
+        }
+        memcpy(output.data + output.length, bytes, length);
+        output.length += length;
+        if (output.length > output.capacity) {
+            flushLines(from);
+        }
+        return;
+    }
+    if (output.length + length > output.capacity) {
+        if (length > output.capacity / 2) {
+            writeOutput(bytes, length);
+            return;
+        }
+        flushOutput();
+    }
+    if (output.data == NULL) {
+        output.data = malloc(output.capacity);
+        if (output.data == NULL) {
+            sourceOutOfMemory();
+        }
+    }
+    memcpy(output.data + output.length, bytes, length);
+    output.length += length;
+}
+
+void outputValue(Value value) {
+    if (value.type == VAL_ARRAY) {
+        Array *array = AS_ARRAY(value);
+        bufferOutput("[", 1);
+        for (uint32_t i = 0; i < array->length; i++) {
+            if (i > 0) {
+                bufferOutput(", ", 2);
+            }
+            outputValue(arrayElement(array, i));
+        }
+        bufferOutput("]", 1);
+        return;
+    }
+    char buffer[32];
+    size_t length;
+    const char *text = valueText(value, buffer, sizeof(buffer), &length);
+    bufferOutput(text, length);
+}
+
+void endOutputLine() {
+    bufferOutput("\n", 1);
+    stats.linesPrinted++;
+    if (output.lineBuffered) {
+        flushOutput();
+    }
+}
+
+// Next line of stdin without its line ending, or NULL at end of input. The
+// line is NUL-terminated and stays valid until the next call.
+char *readInputLine(size_t *length) {
+    if (input.data == NULL && input.routed) {
+        return NULL;
+    }
+    if (input.data == NULL) {
+        input.capacity = INPUT_BLOCK_SIZE + 1;
+        input.data = malloc(input.capacity);
+        if (input.data == NULL) {
+            sourceOutOfMemory();
+        }
+    }
+    for (;;) {
+        char *start = input.data + input.start;
+        char *newline = memchr(start, '\n', input.length - input.start);
+        if (newline != NULL || (input.eof && input.start < input.length)) {
+            char *end = newline != NULL ? newline : input.data + input.length;
+            input.start = (size_t)(end - input.data) + (newline != NULL);
+            if (end > start && end[-1] == '\r') {
+                end--;
+            }
+            *end = '\0';
+            *length = (size_t)(end - start);
+            stats.linesRead++;
+            return start;
+        }
+        if (input.eof || input.routed) {
+            return NULL;
+        }
+        // Keep the partial line, then read more after it
+        input.length -= input.start;
+        memmove(input.data, input.data + input.start, input.length);
+        input.start = 0;
+        if (input.capacity - input.length < INPUT_BLOCK_SIZE) {
+            input.capacity *= 2;
+            input.data = realloc(input.data, input.capacity);
+            if (input.data == NULL) {
+                sourceOutOfMemory();
+            }
+        }
+        // Whoever is typing should see everything printed so far first
+        flushOutput();
+        ssize_t got = read(STDIN_FILENO, input.data + input.length, input.capacity - input.length - 1);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            input.eof = 1;
+        } else {
+            input.length += (size_t)got;
+            stats.inputReads++;
+        }
+    }
+}
+
+// Whether input() can return without waiting for more routed input
+int inputReady() {
+    return input.eof || (input.data != NULL && memchr(input.data + input.start, '\n', input.length - input.start) != NULL);
+}
+
+// Add delivered text to the end of an input buffer
+void appendInput(InputBuffer *buffer, const char *text, size_t length) {
+    if (buffer->start > 0 && buffer->length + length + 1 > buffer->capacity) {
+        buffer->length -= buffer->start;
+        memmove(buffer->data, buffer->data + buffer->start, buffer->length);
+        buffer->start = 0;
+    }
+    if (buffer->length + length + 1 > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity : 256;
+        while (capacity < buffer->length + length + 1) {
+            capacity *= 2;
+        }
+        char *data = realloc(buffer->data, capacity);
+        if (data == NULL) {
+            sourceOutOfMemory();
+        }
+        buffer->data = data;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->length, text, length);
+    buffer->length += length;
+}
+
+void closeProgramIo() {
+    flushOutput();
+    free(output.data);
+    free(input.data);
+    output.data = NULL;
+    output.allocated = 0;
+    memset(&input, 0, sizeof(input));
+}
+
+// Virtual machine. The value stack and the frames start small and grow
+// up to these limits, so an idle program costs a few kilobytes.
+#define VM_STACK_SIZE (1u << 20)    // Values, shared by all frames
+#define VM_MAX_FRAMES (1u << 18)
+#define VM_INITIAL_STACK 1024
+#define VM_INITIAL_FRAMES 64
+#define FIBER_STACK 64        // A fiber's VM starts smaller still
+#define FIBER_FRAMES 4
+#define FIBER_BUDGET 10000
+#define FIBER_MAX (1u << 24)
+
+typedef struct {
+    Function *function;
+    const uint32_t *ip;
+    Value *slots;           // Parameters and locals; the operand stack follows
+    Value *memoKey;         // Copy of the arguments of a cached call, else NULL
+    Function *memoFunction; // Whose cache the result goes to (tail calls replace `function`)
+} CallFrame;
+
+// One cached call of a pure action
+typedef struct {
+    Value args[MEMO_MAX_ARGS];
+    Value result;
+    uint8_t used;
+} MemoEntry;
+
+// Why execute() returned
+typedef enum {
+    RUN_FINISHED,           // main returned
+    RUN_BUDGET,             // The budget ran out at a call or loop back-edge
+    RUN_INPUT               // input() found no line delivered yet
+} RunStatus;
+
+typedef struct {
+    Value *stack;
+    Value *stackTop;
+    Value *stackEnd;
+    CallFrame *frames;
+    uint32_t frameCount;
+    uint32_t frameCapacity;
+    MemoEntry **memo;       // Result cache per function, allocated on first use
+    Object *objects;
+    size_t bytesAllocated;
+    size_t nextCollection;
+    int64_t budget;         // Instructions left before yielding: loops count their length, calls one
+    int profiling;          // Count calls per action
+    size_t heapLimit;       // Live heap allowed; allocating past it is a runtime error
+    int heapExhausted;      // That error happened
+    Value *roots;           // Values an embedding host holds, kept alive by the collector
+    size_t rootCount;
+    Value result;           // What the entry action returned
+} VM;
+
+// The running program's VM. Each thread runs one at a time; the fiber
+// scheduler swaps them in and out.
+COMPILATION_LOCAL VM vm;
+
+void finishProfile();
+
+// Like compile errors, a runtime error returns to `failure.recover` when
+// it is set (a fiber ends; the others keep running) and otherwise exits.
+void runtimeError(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(failure.message, sizeof(failure.message), format, args);
+    va_end(args);
+    if (vm.frameCount > 0 && length >= 0 && (size_t)length < sizeof(failure.message)) {
+        uint32_t name = vm.frames[vm.frameCount - 1].function->name;
+        snprintf(failure.message + length, sizeof(failure.message) - (size_t)length, " (in %.*s)",
+                 (int)names.lengths[name], names.text[name]);
+    }
+    if (failure.recover != NULL) {
+        longjmp(*failure.recover, 1);
+    }
+    flushOutput();
+    fprintf(stderr, "Runtime Error: %s\n", failure.message);
+    finishProfile();
+    exit(EXIT_FAILURE);
+}
+
+void collectGarbage();
+
+// Allocate a GC-managed object. Anything the caller still needs must be
+// reachable from the VM stack, since this may collect.
+void *allocateObject(size_t size, ObjectType type) {
+    if (vm.bytesAllocated + size > vm.nextCollection) {
+        collectGarbage();
+    }
+    if (vm.bytesAllocated + size > vm.heapLimit) {
+        collectGarbage();
+        if (vm.bytesAllocated + size > vm.heapLimit) {
+            vm.heapExhausted = 1;
+            runtimeError("Memory budget exceeded");
+        }
+    }
+    Object *object = malloc(size);
+    if (object == NULL) {
+        runtimeError("Out of memory");
+    }
+    object->type = (uint8_t)type;
+    object->marked = 0;
+    object->nextObject = vm.objects;
+    vm.objects = object;
+    vm.bytesAllocated += size;
+    stats.allocations++;
+    return object;
+}
+
+// A string owning room for `capacity` bytes, of which the first `length`
+// are its own; the caller fills them in
+String *reserveString(size_t length, size_t capacity) {
+    if (capacity > UINT32_MAX) {
+        runtimeError("String too long");
+    }
+    String *string = allocateObject(sizeof(String) + capacity + 1, OBJ_STRING);
+    string->length = string->used = (uint32_t)length;
+    string->capacity = (uint32_t)capacity;
+    string->builder = 0;
+    string->chars = string->storage;
+    string->owner = string;
+    stats.bytesCopied += length;
+    return string;
+}
+
+String *newString(const char *chars, size_t length) {
+    String *string = reserveString(length, length);
+    memcpy(string->storage, chars, length);
+    return string;
+}
+
+// A string sharing `length` bytes at `chars` with `source`, which stays
+// reachable through it
+String *viewString(String *source, const char *chars, size_t length) {
+    String *view = allocateObject(sizeof(String), OBJ_STRING);
+    view->length = (uint32_t)length;
+    view->capacity = view->used = 0;
+    view->builder = 0;
+    view->chars = chars;
+    view->owner = source->owner;
+    return view;
+}
+
+// The empty string and every single character exist once, as constants,
+// so `s[i]` and `input()` of an empty line never allocate
+String *internedStrings[257];
+
+String *internedString(const char *chars, size_t length) {
+    uint32_t slot = length == 0 ? 256 : (unsigned char)chars[0];
+    if (internedStrings[slot] == NULL) {
+        internedStrings[slot] = newConstantString(chars, length);
+    }
+    stats.internedStrings++;
+    return internedStrings[slot];
+}
+
+// Create every interned string up front, so threads running programs at
+// once only ever read the table
+void internAllStrings() {
+    for (uint32_t i = 0; i < 256; i++) {
+        char c = (char)i;
+        internedString(&c, 1);
+    }
+    internedString("", 0);
+}
+
+void freeInternedStrings() {
+    for (uint32_t i = 0; i < 257; i++) {
+        free(internedStrings[i]);
+        internedStrings[i] = NULL;
+    }
+}
+
+void markValue(Value value) {
+    if (value.type != VAL_STRING && value.type != VAL_ARRAY) {
+        return;
+    }
+    Object *object = value.as.object;
+    if (object->marked) {
+        return;
+    }
+    object->marked = 1;
+    if (object->type == OBJ_STRING) {
+        // Constants are always marked, and fibers on other threads share them
+        Object *owner = &((String *)object)->owner->header;
+        if (!owner->marked) {
+            owner->marked = 1;
+        }
+    } else if (((Array *)object)->kind == ARRAY_BOXED) {
+        Array *array = (Array *)object;
+        for (uint32_t i = 0; i < array->length; i++) {
+            markValue(array->items[i]);
+        }
+    }
+}
+
+size_t objectSize(Object *object) {
+    if (object->type == OBJ_STRING) {
+        String *string = (String *)object;
+        return sizeof(String) + (string->owner == string ? string->capacity + 1 : 0);
+    }
+    return sizeof(Array) + ((Array *)object)->length * arrayElementSize((Array *)object);
+}
+
+void freeObject(Object *object) {
+    if (object->type == OBJ_ARRAY) {
+        free(((Array *)object)->items);
+    }
+    free(object);
+}
+
+// Mark-and-sweep over everything allocated since the program started
+void collectGarbage() {
+    for (Value *slot = vm.stack; slot < vm.stackTop; slot++) {
+        markValue(*slot);
+    }
+    for (size_t i = 0; i < vm.rootCount; i++) {
+        markValue(vm.roots[i]);
+    }
+    for (uint32_t f = 0; vm.memo != NULL && f < program.functionCount; f++) {
+        for (uint32_t i = 0; vm.memo[f] != NULL && i < MEMO_ENTRIES; i++) {
+            MemoEntry *entry = &vm.memo[f][i];
+            if (entry->used) {
+                for (uint32_t arg = 0; arg < program.functions[f].arity; arg++) {
+                    markValue(entry->args[arg]);
+                }
+                markValue(entry->result);
+            }
+        }
+    }
+
+    Object **link = &vm.objects;
+    while (*link != NULL) {
+        Object *object = *link;
+        if (object->marked) {
+            object->marked = 0;
+            link = &object->nextObject;
+        } else {
+            *link = object->nextObject;
+            vm.bytesAllocated -= objectSize(object);
+            freeObject(object);
+        }
+    }
+    vm.nextCollection = vm.bytesAllocated * 2 > (1u << 20) ? vm.bytesAllocated * 2 : (1u << 20);
+}
+
+int isTruthy(Value value) {
+    switch (value.type) {
+        case VAL_NIL: return 0;
+        case VAL_INT: return value.as.i != 0;
+        case VAL_DOUBLE: return value.as.d != 0;
+        case VAL_STRING: return AS_STRING(value)->length != 0;
+        default: return 1;
+    }
+}
+
+int valuesEqual(Value a, Value b) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        if (a.type == VAL_INT && b.type == VAL_INT) {
+            return a.as.i == b.as.i;
+        }
+        return AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    if (a.type != b.type) {
+        return 0;
+    }
+    if (a.type == VAL_STRING) {
+        String *x = AS_STRING(a), *y = AS_STRING(b);
+        return x->length == y->length && (x->chars == y->chars || memcmp(x->chars, y->chars, x->length) == 0);
+    }
+    return a.type == VAL_NIL || a.as.object == b.as.object;
+}
+
+// Ordering for < <= > >=: numbers numerically, strings byte-wise
+int compareValues(Value a, Value b, const char *op) {
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        if (a.type == VAL_INT && b.type == VAL_INT) {
+            return (a.as.i > b.as.i) - (a.as.i < b.as.i);
+        }
+        double x = AS_NUMBER(a), y = AS_NUMBER(b);
+        return (x > y) - (x < y);
+    }
+    if (a.type == VAL_STRING && b.type == VAL_STRING) {
+        String *x = AS_STRING(a), *y = AS_STRING(b);
+        uint32_t length = x->length < y->length ? x->length : y->length;
+        int order = memcmp(x->chars, y->chars, length);
+        if (order == 0) {
+            order = (x->length > y->length) - (x->length < y->length);
+        }
+        return order;
+    }
+    runtimeError("Operands of '%s' must be two numbers or two strings", op);
+    return 0;
+}
+
+// "a" + b + ...: the `count` values are still on the stack while the result
+// is built. When the first is a string ending where its owner's claimed
+// bytes end, the rest is written after it in place; otherwise the result
+// gets one exact-size allocation, or room to grow when the first value was
+// itself built by concatenation, as in `s = s + x` inside a loop.
+Value concatenateValues(const Value *values, uint32_t count) {
+    char buffers[CONCAT_MAX][32];
+    const char *texts[CONCAT_MAX];
+    size_t lengths[CONCAT_MAX];
+    size_t total = 0, added = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (values[i].type == VAL_ARRAY) {
+            runtimeError("Cannot concatenate an array");
+        }
+        texts[i] = valueText(values[i], buffers[i], sizeof(buffers[i]), &lengths[i]);
+        total += lengths[i];
+        added += i > 0 ? lengths[i] : 0;
+    }
+
+    size_t capacity = total;
+    if (values[0].type == VAL_STRING) {
+        String *left = AS_STRING(values[0]);
+        String *owner = left->owner;
+        if (added == 0) {
+            return values[0];
+        }
+        if (left->chars + left->length == owner->storage + owner->used && owner->capacity - owner->used >= added) {
+            char *end = owner->storage + owner->used;
+            for (uint32_t i = 1; i < count; i++) {
+                memcpy(end, texts[i], lengths[i]);
+                end += lengths[i];
+            }
+            owner->used += (uint32_t)added;
+            stats.bytesCopied += added;
+            stats.inPlaceAppends++;
+            return OBJECT_VALUE(VAL_STRING, viewString(left, left->chars, total));
+        }
+        if (owner->builder && total < UINT32_MAX / 2) {
+            capacity = total * 2;
+        }
+    }
+    String *result = reserveString(total, capacity);
+    result->builder = 1;
+    char *end = result->storage;
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(end, texts[i], lengths[i]);
+        end += lengths[i];
+    }
+    return OBJECT_VALUE(VAL_STRING, result);
+}
+
+Value concatenate(Value a, Value b) {
+    Value values[2] = {a, b};
+    return concatenateValues(values, 2);
+}
+
+Value arithmetic(Opcode op, Value a, Value b) {
+    if (a.type == VAL_INT && b.type == VAL_INT) {
+        uint64_t x = (uint64_t)a.as.i, y = (uint64_t)b.as.i;
+        switch (op) {
+            case OP_ADD: return INT_VALUE((int64_t)(x + y));
+            case OP_SUB: return INT_VALUE((int64_t)(x - y));
+            case OP_MUL: return INT_VALUE((int64_t)(x * y));
+            default:
+                if (b.as.i == 0) {
+                    runtimeError("Division by zero");
+                }
+                if (b.as.i == -1) {
+                    return INT_VALUE((int64_t)(0 - x));
+                }
+                return INT_VALUE(a.as.i / b.as.i);
+        }
+    }
+    if (op == OP_ADD && (a.type == VAL_STRING || b.type == VAL_STRING)) {
+        return concatenate(a, b);
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        runtimeError("Operands of '%s' must be numbers", op == OP_ADD ? "+" : op == OP_SUB ? "-" : op == OP_MUL ? "*" : "/");
+    }
+    double x = AS_NUMBER(a), y = AS_NUMBER(b);
+    switch (op) {
+        case OP_ADD: return DOUBLE_VALUE(x + y);
+        case OP_SUB: return DOUBLE_VALUE(x - y);
+        case OP_MUL: return DOUBLE_VALUE(x * y);
+        default:
+            if (y == 0) {
+                runtimeError("Division by zero");
+            }
+            return DOUBLE_VALUE(x / y);
+    }
+}
+
+// input(): numbers typed by the user become numbers, anything else a string
+Value readInput() {
+    size_t length = 0;
+    char *line = readInputLine(&length);
+
+    Value value = NIL_VALUE;
+    if (length > 0 && strspn(line, "+-0123456789.eE") == length) {
+        char *end;
+        errno = 0;
+        long long integer = strtoll(line, &end, 10);
+        if (*end == '\0' && errno == 0) {
+            value = INT_VALUE(integer);
+        } else {
+            errno = 0;
+            double number = strtod(line, &end);
+            if (*end == '\0') {
+                value = DOUBLE_VALUE(number);
+            }
+        }
+        errno = 0;
+    }
+    if (value.type == VAL_NIL) {
+        value = OBJECT_VALUE(VAL_STRING, length > 0 ? newString(line, length) : internedString("", 0));
+    }
+    return value;
+}
+
+// Receiver and arguments are on the stack at `args`
+Value callMethod(MethodId method, Value *args, uint32_t argumentCount) {
+    Value receiver = args[0];
+    if (argumentCount != 0) {
+        runtimeError("%s() takes no arguments", methodNames[method]);
+    }
+    if (method == METHOD_LENGTH) {
+        if (receiver.type == VAL_ARRAY) {
+            return INT_VALUE(AS_ARRAY(receiver)->length);
+        }
+        if (receiver.type == VAL_STRING) {
+            return INT_VALUE(AS_STRING(receiver)->length);
+        }
+        runtimeError("length() needs a string or an array");
+    }
+    if (receiver.type == VAL_ARRAY) {
+        runtimeError("%s() needs a string", methodNames[method]);
+    }
+
+    char buffer[32];
+    size_t length;
+    const char *text = valueText(receiver, buffer, sizeof(buffer), &length);
+    // A string result shares the receiver's bytes where it can, so a chain
+    // like `.strip().lower()` copies at most once
+    if (method == METHOD_STRIP) {
+        size_t start = 0;
+        while (start < length && (charClass[(unsigned char)text[start]] & CHAR_SPACE)) start++;
+        while (length > start && (charClass[(unsigned char)text[length - 1]] & CHAR_SPACE)) length--;
+        if (receiver.type != VAL_STRING) {
+            return OBJECT_VALUE(VAL_STRING, newString(text + start, length - start));
+        }
+        if (start == 0 && length == AS_STRING(receiver)->length) {
+            return receiver;
+        }
+        if (length - start <= 1) {
+            return OBJECT_VALUE(VAL_STRING, internedString(text + start, length - start));
+        }
+        return OBJECT_VALUE(VAL_STRING, viewString(AS_STRING(receiver), text + start, length - start));
+    }
+    int (*convert)(int) = method == METHOD_LOWER ? tolower : toupper;
+    size_t same = 0;
+    while (same < length && convert((unsigned char)text[same]) == (unsigned char)text[same]) {
+        same++;
+    }
+    if (same == length && receiver.type == VAL_STRING) {
+        return receiver;
+    }
+    String *result = reserveString(length, length);
+    memcpy(result->storage, text, same);
+    for (size_t i = same; i < length; i++) {
+        result->storage[i] = (char)convert((unsigned char)text[i]);
+    }
+    return OBJECT_VALUE(VAL_STRING, result);
+}
+
+// Build an array from `count` values still on the stack. When they all
+// share a number type the array stores them unboxed.
+Array *newArray(const Value *elements, uint32_t count) {
+    uint8_t kind = count > 0 && IS_NUMBER(elements[0]) ? elements[0].type : ARRAY_BOXED;
+    for (uint32_t i = 1; i < count && kind != ARRAY_BOXED; i++) {
+        if (elements[i].type != kind) {
+            kind = ARRAY_BOXED;
+        }
+    }
+    Array *array = allocateObject(sizeof(Array), OBJ_ARRAY);
+    array->length = 0;
+    array->kind = kind;
+    array->items = NULL;
+    size_t elementSize = arrayElementSize(array);
+    vm.bytesAllocated += count * elementSize;
+    void *storage = malloc((count ? count : 1) * elementSize);
+    if (storage == NULL) {
+        runtimeError("Out of memory");
+    }
+    if (kind == ARRAY_BOXED) {
+        memcpy(storage, elements, count * sizeof(Value));
+        array->items = storage;
+    } else {
+        array->ints = storage;
+        for (uint32_t i = 0; i < count; i++) {
+            array->ints[i] = elements[i].as.i;   // Same bits for doubles
+        }
+    }
+    array->length = count;
+    return array;
+}
+
+// container[position]. Indexing a string allocates, so the caller syncs
+// the stack first.
+Value indexValue(Value container, Value position) {
+    if (position.type != VAL_INT) {
+        runtimeError("Array index must be an integer");
+    }
+    if (container.type == VAL_ARRAY) {
+        Array *array = AS_ARRAY(container);
+        if (position.as.i < 0 || position.as.i >= array->length) {
+            runtimeError("Array index %lld out of bounds (length %u)", (long long)position.as.i, array->length);
+        }
+        return arrayElement(array, (uint32_t)position.as.i);
+    }
+    if (container.type == VAL_STRING) {
+        String *string = AS_STRING(container);
+        if (position.as.i < 0 || position.as.i >= string->length) {
+            runtimeError("String index %lld out of bounds (length %u)", (long long)position.as.i, string->length);
+        }
+        return OBJECT_VALUE(VAL_STRING, internedString(string->chars + position.as.i, 1));
+    }
+    runtimeError("Only arrays and strings can be indexed");
+    return NIL_VALUE;
+}
+
+// Wrapping sum of an int array's elements, for SUM_ARRAY. Integer addition
+// wraps the same way in any order, so the vector versions keep several
+// partial sums.
+typedef uint64_t (*SumFunction)(const int64_t *values, uint32_t count);
+
+uint64_t scalarSumInts(const int64_t *values, uint32_t count) {
+    uint64_t sum = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        sum += (uint64_t)values[i];
+    }
+    return sum;
+}
+
+#ifdef LEXER_HAVE_SIMD
+uint64_t sse2SumInts(const int64_t *values, uint32_t count) {
+    __m128i low = _mm_setzero_si128(), high = _mm_setzero_si128();
+    uint32_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        low = _mm_add_epi64(low, _mm_loadu_si128((const __m128i *)(values + i)));
+        high = _mm_add_epi64(high, _mm_loadu_si128((const __m128i *)(values + i + 2)));
+    }
+    uint64_t lanes[2];
+    _mm_storeu_si128((__m128i *)lanes, _mm_add_epi64(low, high));
+    return lanes[0] + lanes[1] + scalarSumInts(values + i, count - i);
+}
+
+__attribute__((target("avx2")))
+uint64_t avx2SumInts(const int64_t *values, uint32_t count) {
+    __m256i low = _mm256_setzero_si256(), high = _mm256_setzero_si256();
+    uint32_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        low = _mm256_add_epi64(low, _mm256_loadu_si256((const __m256i *)(values + i)));
+        high = _mm256_add_epi64(high, _mm256_loadu_si256((const __m256i *)(values + i + 4)));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, _mm256_add_epi64(low, high));
+    return lanes[0] + lanes[1] + lanes[2] + lanes[3] + scalarSumInts(values + i, count - i);
+}
+#endif
+
+SumFunction sumInts = scalarSumInts;
+
+void selectSumInts() {
+#ifdef LEXER_HAVE_SIMD
+    sumInts = sse2SumInts;
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        sumInts = avx2SumInts;
+    }
+#endif
+}
+
+// SUM_ARRAY: run `for (...; i < a.length(); i = i + 1) { total = total + a[i]; }`
+// in one step when a holds numbers, leaving i at the end so the loop
+// itself finds nothing left to do. Doubles are added in order, since
+// floating-point addition does not reassociate.
+void sumArray(Value *array, Value *total, Value *index) {
+    if (array->type != VAL_ARRAY || index->type != VAL_INT || !IS_NUMBER(*total)) {
+        return;
+    }
+    Array *elements = AS_ARRAY(*array);
+    if (elements->kind == ARRAY_BOXED || index->as.i < 0 || index->as.i >= elements->length) {
+        return;
+    }
+    uint32_t start = (uint32_t)index->as.i;
+    if (elements->kind == ARRAY_INT && total->type == VAL_INT) {
+        total->as.i = (int64_t)((uint64_t)total->as.i + sumInts(elements->ints + start, elements->length - start));
+    } else {
+        double sum = AS_NUMBER(*total);
+        for (uint32_t i = start; i < elements->length; i++) {
+            sum += elements->kind == ARRAY_INT ? (double)elements->ints[i] : elements->doubles[i];
+        }
+        *total = DOUBLE_VALUE(sum);
+    }
+    index->as.i = elements->length;
+}
+
+// Memo keys compare strictly: 2 and 2.0 are different arguments because
+// they can produce different results
+int sameArgument(Value a, Value b) {
+    if (a.type != b.type) {
+        return 0;
+    }
+    switch (a.type) {
+        case VAL_NIL: return 1;
+        case VAL_INT: return a.as.i == b.as.i;
+        case VAL_DOUBLE: return memcmp(&a.as.d, &b.as.d, sizeof(double)) == 0;
+        case VAL_STRING: return valuesEqual(a, b);
+        default: return a.as.object == b.as.object;
+    }
+}
+
+uint64_t hashArgument(Value value) {
+    uint64_t bits;
+    switch (value.type) {
+        case VAL_INT: bits = (uint64_t)value.as.i; break;
+        case VAL_DOUBLE: memcpy(&bits, &value.as.d, sizeof(bits)); break;
+        case VAL_STRING: bits = hashText(AS_STRING(value)->chars, AS_STRING(value)->length); break;
+        case VAL_ARRAY: bits = (uint64_t)(uintptr_t)value.as.object; break;
+        default: bits = 0; break;
+    }
+    bits = (bits ^ (bits >> 30) ^ value.type) * 0xbf58476d1ce4e5b9ull;
+    return bits ^ (bits >> 27);
+}
+
+// The cache line for these arguments, allocating the cache if needed
+MemoEntry *memoEntry(Function *function, const Value *args) {
+    uint32_t index = (uint32_t)(function - program.functions);
+    if (vm.memo == NULL) {
+        vm.memo = calloc(program.functionCount, sizeof(MemoEntry *));
+        if (vm.memo == NULL) {
+            runtimeError("Out of memory");
+        }
+    }
+    if (vm.memo[index] == NULL) {
+        vm.memo[index] = calloc(MEMO_ENTRIES, sizeof(MemoEntry));
+        if (vm.memo[index] == NULL) {
+            runtimeError("Out of memory");
+        }
+    }
+    uint64_t hash = index;
+    for (uint32_t i = 0; i < function->arity; i++) {
+        hash = hash * 31 + hashArgument(args[i]);
+    }
+    return &vm.memo[index][hash & (MEMO_ENTRIES - 1)];
+}
+
+int memoMatches(MemoEntry *entry, Function *function, const Value *args) {
+    if (!entry->used) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < function->arity; i++) {
+        if (!sameArgument(entry->args[i], args[i])) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void storeMemo(Function *function, const Value *key, Value result) {
+    MemoEntry *entry = memoEntry(function, key);
+    memcpy(entry->args, key, function->arity * sizeof(Value));
+    entry->result = result;
+    entry->used = 1;
+}
+
+void initVM(uint32_t stackSize, uint32_t frameCapacity) {
+    memset(&vm, 0, sizeof(vm));
+    vm.stack = malloc(stackSize * sizeof(Value));
+    vm.frames = malloc(frameCapacity * sizeof(CallFrame));
+    if (vm.stack == NULL || vm.frames == NULL) {
+        sourceOutOfMemory();
+    }
+    vm.stackTop = vm.stack;
+    vm.stackEnd = vm.stack + stackSize;
+    vm.frameCapacity = frameCapacity;
+    vm.nextCollection = 1u << 20;
+    vm.budget = INT64_MAX;
+    vm.heapLimit = SIZE_MAX;
+}
+
+// Make room for `count` values from `at` on, moving the stack when it has
+// to grow; returns where `at` is now. Values below `at` or the top are
+// kept, and the frames follow the move.
+Value *reserveStack(Value *at, size_t count) {
+    size_t used = (size_t)(at - vm.stack);
+    size_t live = (size_t)((at > vm.stackTop ? at : vm.stackTop) - vm.stack);
+    if (used + count > VM_STACK_SIZE) {
+        runtimeError("Stack overflow");
+    }
+    size_t capacity = (size_t)(vm.stackEnd - vm.stack);
+    while (capacity < used + count) {
+        capacity *= 2;
+    }
+    if (capacity > VM_STACK_SIZE) {
+        capacity = VM_STACK_SIZE;
+    }
+    Value *stack = malloc(capacity * sizeof(Value));
+    if (stack == NULL) {
+        sourceOutOfMemory();
+    }
+    memcpy(stack, vm.stack, live * sizeof(Value));
+    for (uint32_t i = 0; i < vm.frameCount; i++) {
+        CallFrame *frame = &vm.frames[i];
+        frame->slots = stack + (frame->slots - vm.stack);
+        if (frame->memoKey != NULL) {
+            frame->memoKey = stack + (frame->memoKey - vm.stack);
+        }
+    }
+    vm.stackTop = stack + (vm.stackTop - vm.stack);
+    free(vm.stack);
+    vm.stack = stack;
+    vm.stackEnd = stack + capacity;
+    return stack + used;
+}
+
+// Double the frames. The profiler's signal handler may read them at any
+// point, so the old array stays whole until the new one is in place.
+void growFrames() {
+    if (vm.frameCapacity == VM_MAX_FRAMES) {
+        runtimeError("Stack overflow");
+    }
+    uint32_t capacity = vm.frameCapacity * 2 < VM_MAX_FRAMES ? vm.frameCapacity * 2 : VM_MAX_FRAMES;
+    CallFrame *frames = malloc(capacity * sizeof(CallFrame));
+    if (frames == NULL) {
+        sourceOutOfMemory();
+    }
+    memcpy(frames, vm.frames, vm.frameCount * sizeof(CallFrame));
+    CallFrame *old = vm.frames;
+    vm.frames = frames;
+    free(old);
+    vm.frameCapacity = capacity;
+}
+
+void freeVM() {
+    Object *object = vm.objects;
+    while (object != NULL) {
+        Object *next = object->nextObject;
+        freeObject(object);
+        object = next;
+    }
+    for (uint32_t i = 0; vm.memo != NULL && i < program.functionCount; i++) {
+        free(vm.memo[i]);
+    }
+    free(vm.memo);
+    free(vm.stack);
+    free(vm.frames);
+    memset(&vm, 0, sizeof(vm));
+}
+
+// Sampling profiler (--profile=FILE). A SIGPROF timer interrupts the
+// running program every PROFILE_INTERVAL_US of CPU time, and the handler
+// copies the VM's frames (function and resume point of each) into a table
+// of distinct stacks, counting how often each was seen. It only reads the
+// frames and writes memory allocated beforehand. Callers' resume points
+// are exact; the innermost frame's is where the interpreter last stored
+// it, which it does at every call, loop back-edge and runtime call, so
+// samples land on the right action and loop. When the program ends the
+// stacks are written in folded form, one "main:3;fib:7;fib:5 42" line
+// each, with source lines, and a table of calls and time per action goes
+// to stderr.
+#define PROFILE_INTERVAL_US 1000
+#define PROFILE_MAX_DEPTH 64            // Frames kept per sample: the outermost and innermost half
+#define PROFILE_STACKS (1u << 16)       // Distinct stacks; further ones are dropped
+#define PROFILE_WORDS (1u << 22)        // Frame words across all distinct stacks
+
+typedef struct {
+    uint64_t hash;
+    uint32_t start;         // First word in profiler.words: function, ip, function, ip, ...
+    uint32_t depth;         // Frames, outermost first
+    uint8_t truncated;      // Frames in the middle were left out
+    uint64_t samples;
+} ProfileStack;
+
+typedef struct {
+    volatile sig_atomic_t active;
+    const char *path;
+    uintptr_t *words;
+    uint32_t used;
+    ProfileStack *stacks;
+    uint32_t stackCount;
+    uint32_t *slots;        // Open-addressed hash of stack indices + 1
+    uint64_t samples;
+    uint64_t dropped;       // Samples whose stack did not fit
+    double cpuSeconds;      // Process CPU time when sampling started, then while it ran
+} Profiler;
+
+double cpuSeconds() {
+    struct timespec now;
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+Profiler profiler;
+
+void profileSignal(int signal) {
+    (void)signal;
+    uint32_t count = vm.frameCount;
+    if (!profiler.active || count == 0 || count > VM_MAX_FRAMES) {
+        return;
+    }
+    uint32_t depth = count > PROFILE_MAX_DEPTH ? PROFILE_MAX_DEPTH : count;
+    uint32_t skipped = count - depth;
+    uintptr_t frame[2 * PROFILE_MAX_DEPTH];
+    uint64_t hash = skipped > 0;
+    for (uint32_t i = 0; i < depth; i++) {
+        CallFrame *at = &vm.frames[i < PROFILE_MAX_DEPTH / 2 ? i : i + skipped];
+        frame[2 * i] = (uintptr_t)at->function;
+        frame[2 * i + 1] = (uintptr_t)at->ip;
+        hash = (hash ^ frame[2 * i]) * 0x9E3779B97F4A7C15ull;
+        hash = (hash ^ frame[2 * i + 1]) * 0x9E3779B97F4A7C15ull;
+    }
+    profiler.samples++;
+    uint32_t slot = (uint32_t)(hash >> 32) & (2 * PROFILE_STACKS - 1);
+    while (profiler.slots[slot] != 0) {
+        ProfileStack *stack = &profiler.stacks[profiler.slots[slot] - 1];
+        if (stack->hash == hash && stack->depth == depth && stack->truncated == (skipped > 0) &&
+            memcmp(&profiler.words[stack->start], frame, 2 * depth * sizeof(uintptr_t)) == 0) {
+            stack->samples++;
+            return;
+        }
+        slot = (slot + 1) & (2 * PROFILE_STACKS - 1);
+    }
+    if (profiler.stackCount == PROFILE_STACKS || PROFILE_WORDS - profiler.used < 2 * depth) {
+        profiler.dropped++;
+        return;
+    }
+    ProfileStack *stack = &profiler.stacks[profiler.stackCount++];
+    *stack = (ProfileStack){hash, profiler.used, depth, skipped > 0, 1};
+    memcpy(&profiler.words[profiler.used], frame, 2 * depth * sizeof(uintptr_t));
+    profiler.used += 2 * depth;
+    profiler.slots[slot] = profiler.stackCount;
+}
+
+// Start sampling; the VM must be initialized
+void startProfiler(const char *path) {
+    profiler.path = path;
+    profiler.words = malloc(PROFILE_WORDS * sizeof(uintptr_t));
+    profiler.stacks = malloc(PROFILE_STACKS * sizeof(ProfileStack));
+    profiler.slots = calloc(2 * PROFILE_STACKS, sizeof(uint32_t));
+    if (profiler.words == NULL || profiler.stacks == NULL || profiler.slots == NULL) {
+        sourceOutOfMemory();
+    }
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = profileSignal;
+    action.sa_flags = SA_RESTART;   // Program I/O carries on across samples
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGPROF, &action, NULL);
+    profiler.active = 1;
+    profiler.cpuSeconds = cpuSeconds();
+    struct itimerval timer = {{0, PROFILE_INTERVAL_US}, {0, PROFILE_INTERVAL_US}};
+    setitimer(ITIMER_PROF, &timer, NULL);
+}
+
+// Function index of a sampled frame, or -1 when the sample caught the
+// frame half written
+int64_t sampledFunction(uintptr_t function) {
+    uintptr_t base = (uintptr_t)program.functions;
+    if (function < base || (function - base) % sizeof(Function) != 0 ||
+        (function - base) / sizeof(Function) >= program.functionCount) {
+        return -1;
+    }
+    return (int64_t)((function - base) / sizeof(Function));
+}
+
+// Source line of the instruction before a sampled resume point; 0 if unknown
+uint32_t sampledLine(Function *function, uintptr_t ip) {
+    uintptr_t code = (uintptr_t)function->code;
+    if (ip < code || ip > code + function->codeLength * sizeof(uint32_t) || function->lineCount == 0) {
+        return 0;
+    }
+    uint32_t pc = ip > code ? (uint32_t)((ip - code) / sizeof(uint32_t)) - 1 : 0;
+    uint32_t line = 0;
+    for (uint32_t i = 0; i < function->lineCount && function->lines[i].pc <= pc; i++) {
+        line = function->lines[i].line;
+    }
+    return line;
+}
+
+// A sampled stack as folded text: "main:3;fib:7;fib:5", outermost first
+char *foldStack(ProfileStack *stack) {
+    char *text = NULL;
+    size_t length = 0;
+    FILE *out = open_memstream(&text, &length);
+    if (out == NULL) {
+        sourceOutOfMemory();
+    }
+    for (uint32_t i = 0; i < stack->depth; i++) {
+        int64_t f = sampledFunction(profiler.words[stack->start + 2 * i]);
+        if (i > 0) {
+            fputc(';', out);
+        }
+        if (stack->truncated && i == PROFILE_MAX_DEPTH / 2) {
+            fprintf(out, "[truncated];");
+        }
+        if (f < 0) {
+            fprintf(out, "[unknown]");
+            continue;
+        }
+        Function *function = &program.functions[f];
+        uint32_t line = sampledLine(function, profiler.words[stack->start + 2 * i + 1]);
+        fprintf(out, "%.*s", (int)names.lengths[function->name], names.text[function->name]);
+        if (line > 0) {
+            fprintf(out, ":%u", line);
+        }
+    }
+    fclose(out);
+    return text;
+}
+
+typedef struct {
+    char *text;
+    uint64_t samples;
+} FoldedStack;
+
+int compareFoldedStacks(const void *a, const void *b) {
+    return strcmp(((const FoldedStack *)a)->text, ((const FoldedStack *)b)->text);
+}
+
+// Folded stacks for flame graph tools, one line per distinct stack of
+// lines (several resume points can share a line), in name order
+void writeFoldedStacks(FILE *out) {
+    FoldedStack *folded = malloc(((size_t)profiler.stackCount + 1) * sizeof(FoldedStack));
+    if (folded == NULL) {
+        sourceOutOfMemory();
+    }
+    for (uint32_t s = 0; s < profiler.stackCount; s++) {
+        folded[s] = (FoldedStack){foldStack(&profiler.stacks[s]), profiler.stacks[s].samples};
+    }
+    qsort(folded, profiler.stackCount, sizeof(FoldedStack), compareFoldedStacks);
+    for (uint32_t s = 0; s < profiler.stackCount; s++) {
+        uint64_t samples = folded[s].samples;
+        while (s + 1 < profiler.stackCount && strcmp(folded[s].text, folded[s + 1].text) == 0) {
+            free(folded[s].text);
+            samples += folded[++s].samples;
+        }
+        fprintf(out, "%s %llu\n", folded[s].text, (unsigned long long)samples);
+        free(folded[s].text);
+    }
+    free(folded);
+}
+
+typedef struct {
+    uint32_t function;
+    uint64_t self;          // Samples with the action innermost
+    uint64_t total;         // Samples with the action anywhere on the stack
+} ActionProfile;
+
+int compareActionProfiles(const void *a, const void *b) {
+    const ActionProfile *x = a, *y = b;
+    if (x->self != y->self) {
+        return x->self < y->self ? 1 : -1;
+    }
+    if (x->total != y->total) {
+        return x->total < y->total ? 1 : -1;
+    }
+    return x->function < y->function ? -1 : x->function > y->function;
+}
+
+// Per action: calls, and time spent in it (self) and below it (total)
+void printActionProfile(FILE *out) {
+    uint32_t count = program.functionCount;
+    ActionProfile *actions = calloc((size_t)count + 1, sizeof(ActionProfile));
+    uint32_t *seen = calloc((size_t)count + 1, sizeof(uint32_t));
+    if (actions == NULL || seen == NULL) {
+        sourceOutOfMemory();
+    }
+    for (uint32_t f = 0; f < count; f++) {
+        actions[f].function = f;
+    }
+    for (uint32_t s = 0; s < profiler.stackCount; s++) {
+        ProfileStack *stack = &profiler.stacks[s];
+        for (uint32_t i = 0; i < stack->depth; i++) {
+            int64_t f = sampledFunction(profiler.words[stack->start + 2 * i]);
+            if (f < 0) {
+                continue;
+            }
+            if (seen[f] != s + 1) {     // Recursion counts once per sample
+                seen[f] = s + 1;
+                actions[f].total += stack->samples;
+            }
+            if (i + 1 == stack->depth) {
+                actions[f].self += stack->samples;
+            }
+        }
+    }
+    qsort(actions, count, sizeof(ActionProfile), compareActionProfiles);
+
+    // The timer ticks no faster than the kernel's clock, so each sample
+    // stands for its share of the CPU time actually used
+    double samples = profiler.samples > 0 ? (double)profiler.samples : 1;
+    double interval = profiler.cpuSeconds * 1000 / samples;
+    fprintf(out, "Profile: %llu samples over %.1f ms of CPU time", (unsigned long long)profiler.samples,
+            profiler.cpuSeconds * 1000);
+    if (profiler.dropped > 0) {
+        fprintf(out, " (%llu not recorded: too many distinct stacks)", (unsigned long long)profiler.dropped);
+    }
+    fprintf(out, "\n%-24s %12s %10s %7s %10s %7s\n", "action", "calls", "self ms", "self%", "total ms", "total%");
+    for (uint32_t i = 0; i < count; i++) {
+        Function *function = &program.functions[actions[i].function];
+        if (function->calls == 0 && actions[i].total == 0) {
+            continue;
+        }
+        fprintf(out, "%-24.*s %12llu %10.1f %6.1f%% %10.1f %6.1f%%\n",
+                (int)names.lengths[function->name], names.text[function->name], (unsigned long long)function->calls,
+                (double)actions[i].self * interval, 100.0 * (double)actions[i].self / samples,
+                (double)actions[i].total * interval, 100.0 * (double)actions[i].total / samples);
+    }
+    free(seen);
+    free(actions);
+}
+
+// Stop sampling, write the folded stacks and report per action. Also
+// called on a runtime error, which ends the program.
+void finishProfile() {
+    if (!profiler.active) {
+        return;
+    }
+    struct itimerval stop = {{0, 0}, {0, 0}};
+    setitimer(ITIMER_PROF, &stop, NULL);
+    profiler.active = 0;
+    profiler.cpuSeconds = cpuSeconds() - profiler.cpuSeconds;
+    FILE *out = fopen(profiler.path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error opening profile file: %s\n", profiler.path);
+    } else {
+        writeFoldedStacks(out);
+        fclose(out);
+    }
+    printActionProfile(stderr);
+    free(profiler.words);
+    free(profiler.stacks);
+    free(profiler.slots);
+    memset(&profiler, 0, sizeof(profiler));
+}
+
+// Dispatch: computed goto where the compiler supports labels as values,
+// a switch everywhere else
+#if defined(__GNUC__) && !defined(EPIC_NO_COMPUTED_GOTO)
+#define VM_COMPUTED_GOTO 1
+#endif
+
+// Push a frame for `function` whose arguments are the top `arity` values,
+// growing the stack or the frames as needed (the stack may move, so
+// callers reload their pointers from the frame and vm.stackTop). Locals
+// start out nil so the collector never sees stale slots.
+static inline CallFrame *pushFrame(Function *function, Value *sp) {
+    Value *slots = sp - function->arity;
+    if (vm.frameCount == vm.frameCapacity) {
+        growFrames();
+    }
+    if (slots + function->slotCount + function->maxStack > vm.stackEnd) {
+        slots = reserveStack(slots, function->slotCount + function->maxStack);
+        sp = slots + function->arity;
+    }
+    for (Value *slot = sp; slot < slots + function->slotCount; slot++) {
+        *slot = NIL_VALUE;
+    }
+    CallFrame *frame = &vm.frames[vm.frameCount++];
+    frame->function = function;
+    frame->ip = function->code;
+    frame->slots = slots;
+    frame->memoKey = NULL;
+    vm.stackTop = slots + function->slotCount;
+    return frame;
+}
+
+// Run `entry`, or with NULL resume the frames left by a yield, until main
+// returns or vm.budget runs out. Loop back-edges use up the length of the
+// loop and calls one each. In a fiber, input() with no line delivered yet
+// yields before it starts, so it runs again on resuming.
+RunStatus execute(Function *entry) {
+    CallFrame *frame = entry != NULL ? pushFrame(entry, vm.stackTop) : &vm.frames[vm.frameCount - 1];
+    Value *sp = vm.stackTop;
+    Value *slots = frame->slots;
+    const uint32_t *ip = frame->ip;
+    int64_t budget = vm.budget;     // Kept in a register; stored back on leaving
+    uint32_t word;
+    Value result;
+
+#define SYNC() (vm.stackTop = sp, frame->ip = ip)
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(distance) (sp[-1 - (distance)])
+#define OPERAND() INSTRUCTION_OPERAND(word)
+#define SPEND(cost) do { \
+        budget -= (cost); \
+        if (budget < 0) { \
+            SYNC(); \
+            vm.budget = budget; \
+            return RUN_BUDGET; \
+        } \
+    } while (0)
+#ifdef EPIC_JIT
+// Calls and loop back-edges heat an action up; once it has machine code,
+// the frame continues there
+#define JIT_CHECK() do { \
+        if (frame->function->native != NULL || \
+            (jit.enabled && ++frame->function->hotness == JIT_THRESHOLD && compileNative(frame->function))) { \
+            goto enterNative; \
+        } \
+    } while (0)
+#define JIT_RESUME() do { if (frame->function->native != NULL) goto enterNative; } while (0)
+#else
+#define JIT_CHECK() ((void)0)
+#define JIT_RESUME() ((void)0)
+#endif
+
+#ifdef VM_COMPUTED_GOTO
+#define OPCODE_LABEL(name) &&op_##name,
+    static void *dispatchTable[OPCODE_COUNT] = { OPCODES(OPCODE_LABEL) };
+#define DISPATCH() do { word = *ip++; goto *dispatchTable[INSTRUCTION_OP(word)]; } while (0)
+#define CASE(name) op_##name:
+#define NEXT() DISPATCH()
+    DISPATCH();
+#else
+#define CASE(name) case OP_##name:
+#define NEXT() break
+    for (;;) {
+    word = *ip++;
+    switch (INSTRUCTION_OP(word)) {
+#endif
+
+    CASE(CONST) {
+        PUSH(program.constants[OPERAND()]);
+        NEXT();
+    }
+    CASE(INT) {
+        PUSH(INT_VALUE(INSTRUCTION_SIGNED(word)));
+        NEXT();
+    }
+    CASE(POP) {
+        sp--;
+        NEXT();
+    }
+    CASE(LOAD_LOCAL) {
+        PUSH(slots[OPERAND()]);
+        NEXT();
+    }
+    CASE(STORE_LOCAL) {
+        slots[OPERAND()] = POP();
+        NEXT();
+    }
+    CASE(ADD) {
+        Value b = PEEK(0), a = PEEK(1);
+        if (a.type == VAL_INT && b.type == VAL_INT) {
+            sp[-2].as.i = (int64_t)((uint64_t)a.as.i + (uint64_t)b.as.i);
+        } else {
+            SYNC();
+            sp[-2] = arithmetic(OP_ADD, a, b);
+        }
+        sp--;
+        NEXT();
+    }
+    CASE(SUB) {
+        Value b = PEEK(0), a = PEEK(1);
+        if (a.type == VAL_INT && b.type == VAL_INT) {
+            sp[-2].as.i = (int64_t)((uint64_t)a.as.i - (uint64_t)b.as.i);
+        } else {
+            SYNC();
+            sp[-2] = arithmetic(OP_SUB, a, b);
+        }
+        sp--;
+        NEXT();
+    }
+    CASE(MUL) {
+        SYNC();
+        sp[-2] = arithmetic(OP_MUL, PEEK(1), PEEK(0));
+        sp--;
+        NEXT();
+    }
+    CASE(DIV) {
+        SYNC();
+        sp[-2] = arithmetic(OP_DIV, PEEK(1), PEEK(0));
+        sp--;
+        NEXT();
+    }
+    CASE(NEG) {
+        Value a = PEEK(0);
+        if (a.type == VAL_INT) {
+            sp[-1].as.i = (int64_t)(0 - (uint64_t)a.as.i);
+        } else if (a.type == VAL_DOUBLE) {
+            sp[-1].as.d = -a.as.d;
+        } else {
+            SYNC();
+            runtimeError("Operand of '-' must be a number");
+        }
+        NEXT();
+    }
+    CASE(NOT) {
+        sp[-1] = INT_VALUE(!isTruthy(PEEK(0)));
+        NEXT();
+    }
+    CASE(EQ) {
+        Value b = PEEK(0), a = PEEK(1);
+        sp[-2] = INT_VALUE(a.type == VAL_INT && b.type == VAL_INT ? a.as.i == b.as.i : valuesEqual(a, b));
+        sp--;
+        NEXT();
+    }
+    CASE(NE) {
+        Value b = PEEK(0), a = PEEK(1);
+        sp[-2] = INT_VALUE(a.type == VAL_INT && b.type == VAL_INT ? a.as.i != b.as.i : !valuesEqual(a, b));
+        sp--;
+        NEXT();
+    }
+#define COMPARE(name, cmp, text) \
+    CASE(name) { \
+        Value b = PEEK(0), a = PEEK(1); \
+        int result; \
+        if (a.type == VAL_INT && b.type == VAL_INT) { \
+            result = a.as.i cmp b.as.i; \
+        } else { \
+            SYNC(); \
+            result = compareValues(a, b, text) cmp 0; \
+        } \
+        sp[-2] = INT_VALUE(result); \
+        sp--; \
+        NEXT(); \
+    }
+    COMPARE(LT, <, "<")
+    COMPARE(LE, <=, "<=")
+    COMPARE(GT, >, ">")
+    COMPARE(GE, >=, ">=")
+#undef COMPARE
+    // Operands that type inference proved to be ints
+#define INT_BINARY(name, expression) \
+    CASE(name) { \
+        uint64_t x = (uint64_t)sp[-2].as.i, y = (uint64_t)sp[-1].as.i; \
+        sp[-2] = INT_VALUE(expression); \
+        sp--; \
+        NEXT(); \
+    }
+    INT_BINARY(ADD_INT, (int64_t)(x + y))
+    INT_BINARY(SUB_INT, (int64_t)(x - y))
+    INT_BINARY(MUL_INT, (int64_t)(x * y))
+    INT_BINARY(EQ_INT, x == y)
+    INT_BINARY(NE_INT, x != y)
+    INT_BINARY(LT_INT, (int64_t)x < (int64_t)y)
+    INT_BINARY(LE_INT, (int64_t)x <= (int64_t)y)
+    INT_BINARY(GT_INT, (int64_t)x > (int64_t)y)
+    INT_BINARY(GE_INT, (int64_t)x >= (int64_t)y)
+#undef INT_BINARY
+    CASE(DIV_INT) {
+        int64_t x = sp[-2].as.i, y = sp[-1].as.i;
+        if (y == 0) {
+            SYNC();
+            runtimeError("Division by zero");
+        }
+        sp[-2].as.i = y == -1 ? (int64_t)(0 - (uint64_t)x) : x / y;
+        sp--;
+        NEXT();
+    }
+    CASE(NEG_INT) {
+        sp[-1].as.i = (int64_t)(0 - (uint64_t)sp[-1].as.i);
+        NEXT();
+    }
+    CASE(JUMP) {
+        const uint32_t *from = ip;
+        ip = frame->function->code + OPERAND();
+        if (ip < from) {
+            frame->ip = ip;     // Loops show up in profiles at their back-edge
+            SPEND(from - ip);
+            JIT_CHECK();
+        }
+        NEXT();
+    }
+    CASE(JUMP_IF_FALSE) {
+        Value condition = POP();
+        if (condition.type == VAL_INT ? condition.as.i == 0 : !isTruthy(condition)) {
+            const uint32_t *from = ip;
+            ip = frame->function->code + OPERAND();
+            if (ip < from) {
+                frame->ip = ip;
+                SPEND(from - ip);
+                JIT_CHECK();
+            }
+        }
+        NEXT();
+    }
+    CASE(JUMP_IF_TRUE) {
+        Value condition = POP();
+        if (condition.type == VAL_INT ? condition.as.i != 0 : isTruthy(condition)) {
+            const uint32_t *from = ip;
+            ip = frame->function->code + OPERAND();
+            if (ip < from) {
+                frame->ip = ip;
+                SPEND(from - ip);
+                JIT_CHECK();
+            }
+        }
+        NEXT();
+    }
+    CASE(CALL) {
+        SYNC();
+        frame = pushFrame(&program.functions[OPERAND()], sp);
+        if (vm.profiling) {
+            frame->function->calls++;
+        }
+        sp = vm.stackTop;
+        slots = frame->slots;
+        ip = frame->function->code;
+        SPEND(1);
+        JIT_CHECK();
+        NEXT();
+    }
+    CASE(CALL_MEMO) {
+        Function *callee = &program.functions[OPERAND()];
+        Value *args = sp - callee->arity;
+        if (vm.profiling) {
+            callee->calls++;
+        }
+        SYNC();
+        MemoEntry *entry = memoEntry(callee, args);
+        if (memoMatches(entry, callee, args)) {
+            stats.memoHits++;
+            sp = args;
+            PUSH(entry->result);
+            NEXT();
+        }
+        stats.memoMisses++;
+        // The arguments stay below the frame as the key; the callee gets
+        // its own copy, which it may overwrite
+        if (sp + callee->arity + callee->slotCount + callee->maxStack > vm.stackEnd) {
+            sp = reserveStack(sp, callee->arity + callee->slotCount + callee->maxStack);
+            args = sp - callee->arity;
+        }
+        memcpy(sp, args, callee->arity * sizeof(Value));
+        sp += callee->arity;
+        frame = pushFrame(callee, sp);
+        frame->memoKey = frame->slots - callee->arity;
+        frame->memoFunction = callee;
+        sp = vm.stackTop;
+        slots = frame->slots;
+        ip = callee->code;
+        SPEND(1);
+        JIT_CHECK();
+        NEXT();
+    }
+    CASE(TAIL_CALL) {
+        // return f(...): the callee takes over this frame's slots
+        Function *callee = &program.functions[OPERAND()];
+        uint32_t arity = callee->arity;
+        Value *args = sp - arity;
+        if (vm.profiling) {
+            callee->calls++;
+        }
+        uint32_t key = 0;   // Values kept below the callee's slots
+        if (callee->memoize) {
+            SYNC();
+            MemoEntry *entry = memoEntry(callee, args);
+            if (memoMatches(entry, callee, args)) {
+                stats.memoHits++;
+                result = entry->result;
+                goto returnResult;
+            }
+            stats.memoMisses++;
+            key = frame->memoKey == NULL ? arity : 0;
+        }
+        if ((callee != frame->function || key > 0) && slots + key + callee->slotCount + callee->maxStack > vm.stackEnd) {
+            SYNC();
+            reserveStack(slots, key + callee->slotCount + callee->maxStack);
+            slots = frame->slots;
+            sp = vm.stackTop;
+            args = sp - arity;
+        }
+        if (key > 0) {
+            // A frame without a key of its own keeps the arguments below
+            // the callee's slots, as CALL_MEMO does, so that the result
+            // fills the callee's cache
+            memmove(slots + arity, args, arity * sizeof(Value));
+            memcpy(slots, slots + arity, arity * sizeof(Value));
+            frame->memoKey = slots;
+            frame->memoFunction = callee;
+            slots += arity;
+            frame->slots = slots;
+        } else {
+            for (uint32_t i = 0; i < arity; i++) {
+                slots[i] = args[i];
+            }
+        }
+        // Slots below the old top already hold values; only ones above it
+        // need clearing for the collector
+        Value *top = sp > slots + arity ? sp : slots + arity;
+        sp = slots + callee->slotCount;
+        while (top < sp) {
+            *top++ = NIL_VALUE;
+        }
+        frame->function = callee;
+        ip = callee->code;
+        SPEND(1);
+        JIT_CHECK();
+        NEXT();
+    }
+    CASE(RETURN) {
+        result = POP();
+        goto returnResult;
+    }
+    CASE(RETURN_NIL) {
+        result = NIL_VALUE;
+    returnResult:
+        sp = slots;
+        if (frame->memoKey != NULL) {
+            sp = frame->memoKey;
+            storeMemo(frame->memoFunction, sp, result);
+        }
+        vm.frameCount--;
+        if (vm.frameCount == 0) {
+            vm.stackTop = sp;
+            vm.budget = budget;
+            vm.result = result;
+            return RUN_FINISHED;
+        }
+        frame--;
+        slots = frame->slots;
+        ip = frame->ip;
+        PUSH(result);
+        JIT_RESUME();
+        NEXT();
+    }
+    CASE(PRINT) {
+        outputValue(PEEK(0));
+        endOutputLine();
+        sp--;
+        NEXT();
+    }
+    CASE(INPUT) {
+        if (input.routed && !inputReady()) {
+            ip--;
+            SYNC();
+            vm.budget = budget;
+            return RUN_INPUT;
+        }
+        if (OPERAND()) {
+            outputValue(PEEK(0));
+            sp--;
+        }
+        SYNC();
+        Value line = readInput();
+        PUSH(line);
+        NEXT();
+    }
+    CASE(CONCAT) {
+        uint32_t count = OPERAND();
+        SYNC();
+        Value result = concatenateValues(sp - count, count);
+        sp -= count;
+        PUSH(result);
+        NEXT();
+    }
+    CASE(ARRAY) {
+        uint32_t count = OPERAND();
+        SYNC();
+        Array *array = newArray(sp - count, count);
+        sp -= count;
+        PUSH(OBJECT_VALUE(VAL_ARRAY, array));
+        NEXT();
+    }
+    CASE(INDEX) {
+        SYNC();
+        sp[-2] = indexValue(PEEK(1), PEEK(0));
+        sp--;
+        NEXT();
+    }
+    CASE(INDEX_IN_BOUNDS) {
+        // The loop bound proved the index an int inside the container
+        Value container = PEEK(1);
+        if (container.type == VAL_ARRAY) {
+            sp[-2] = arrayElement(AS_ARRAY(container), (uint32_t)PEEK(0).as.i);
+        } else {
+            SYNC();
+            sp[-2] = indexValue(container, PEEK(0));
+        }
+        sp--;
+        NEXT();
+    }
+    CASE(SUM_ARRAY) {
+        sumArray(&slots[OPERAND()], &slots[ip[0]], &slots[ip[1]]);
+        ip += 2;
+        NEXT();
+    }
+    CASE(METHOD) {
+        uint32_t argumentCount = *ip++;
+        SYNC();
+        Value *args = sp - argumentCount - 1;
+        Value result = callMethod((MethodId)OPERAND(), args, argumentCount);
+        sp = args;
+        PUSH(result);
+        NEXT();
+    }
+
+#ifdef EPIC_JIT
+    enterNative: {
+        // Run until the code exits; the stack depth there is static
+        Function *function = frame->function;
+        JitCode *native = function->native;
+        stats.jitEntries++;
+        uint32_t exit = native->run(slots, native->code + native->entries[ip - function->code]);
+        uint32_t pc = exit >> 1;
+        ip = function->code + pc;
+        sp = slots + function->slotCount + native->depth[pc];
+        if (exit & 1) {
+            deoptimize(function, pc);
+        }
+        NEXT();
+    }
+#endif
+
+#ifndef VM_COMPUTED_GOTO
+    }
+    }
+#endif
+#undef SYNC
+#undef PUSH
+#undef POP
+#undef PEEK
+#undef OPERAND
+#undef SPEND
+#undef JIT_CHECK
+#undef JIT_RESUME
+#undef CASE
+#undef NEXT
+}
+
+// Run main, if the program has one, profiling it when `profilePath` is set
+void runProgram(const char *profilePath) {
+    if (program.mainFunction < 0) {
+        return;
+    }
+    fflush(stdout);     // Dumps go through stdio; the program's own output does not
+    selectSumInts();
+    initVM(VM_INITIAL_STACK, VM_INITIAL_FRAMES);
+    if (profilePath != NULL) {
+        vm.profiling = 1;
+        startProfiler(profilePath);
+    }
+    program.functions[program.mainFunction].calls = 1;
+    execute(&program.functions[program.mainFunction]);
+    closeProgramIo();
+    finishProfile();
+    freeVM();
+    freeInternedStrings();
+    for (uint32_t i = 0; i < program.functionCount; i++) {
+        releaseNative(&program.functions[i]);
+        free(program.functions[i].generic);
+        program.functions[i].generic = NULL;
+    }
+}
+
+// Command-line options
+typedef struct {
+    const char *inputPath;
+    int dumpSource;
+    int dumpTokens;
+    int dumpAst;
+    int dumpBytecode;
+    int checkOnly;          // Stop after parsing
+    int noOptimize;
+    int noMemo;
+    int noTailCalls;
+    int noSpecialize;
+    int noJit;
+    int dumpJit;
+    int printStats;
+    const char *statsPath;  // NULL writes the summary to stderr
+    const char *emitCPath;  // Write C instead of running
+    size_t outputBuffer;    // Bytes of print output held before writing
+    int lineBuffered;       // Write print output at every newline
+    const char **inputs;    // Every file or directory named on the command line
+    uint32_t inputCount;
+    uint32_t jobs;          // Batch or parser threads; 0 = one per CPU
+    const char *editsPath;  // Edits to apply after parsing
+    const char *cachePath;  // Directory of compiled programs
+    const char *profilePath; // Folded stacks of the running program
+    int batch;              // Compile many files without running them
+    uint32_t fibers;        // Run this many copies of the inputs as fibers; 0 = run one program
+    uint64_t budget;        // Instructions a fiber runs before giving up its worker
+    const char *fiberStatsPath; // One JSON line per fiber
+} Options;
+
+Options options;
+
+// Ahead-of-time C backend (--emit-c). The bytecode of every reachable
+// action becomes a run of labels inside one C function built on
+// epic_runtime.h: calls push a frame and jump, returns dispatch on the
+// call site, and operands live at fixed offsets from the frame, so the
+// generated program keeps the VM's stack layout, limits and errors
+// without an interpreter loop.
+
+// A C string literal; octal escapes keep every byte exact
+void emitCString(FILE *out, const char *text, size_t length) {
+    fputc('"', out);
+    for (size_t i = 0; i < length; i++) {
+        unsigned char c = (unsigned char)text[i];
+        if (c == '"' || c == '\\' || c == '?') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20 || c >= 0x7F) {
+            fprintf(out, "\\%03o", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+void emitCConstant(FILE *out, uint32_t index) {
+    Value value = program.constants[index];
+    fprintf(out, "    epicConstants[%u] = ", index);
+    if (value.type == VAL_STRING) {
+        fprintf(out, "epicConstantString(");
+        emitCString(out, AS_STRING(value)->chars, AS_STRING(value)->length);
+        fprintf(out, ", %u);\n", AS_STRING(value)->length);
+    } else if (value.type == VAL_INT) {
+        fprintf(out, "EPIC_INT_VALUE((int64_t)UINT64_C(%llu));\n", (unsigned long long)value.as.i);
+    } else if (value.type == VAL_DOUBLE && value.as.d - value.as.d == 0) {
+        fprintf(out, "EPIC_DOUBLE_VALUE(%a);\n", value.as.d);
+    } else if (value.type == VAL_DOUBLE) {
+        fprintf(out, "EPIC_DOUBLE_VALUE(%s);\n", value.as.d != value.as.d ? "0.0 / 0.0" : value.as.d > 0 ? "1.0 / 0.0" : "-1.0 / 0.0");
+    } else {
+        fprintf(out, "EPIC_NIL_VALUE;\n");
+    }
+}
+
+// Translate one action. `top` is the operand stack depth before each
+// instruction, so stack slot n of the operand stack is s[slotCount + n].
+void emitCFunction(FILE *out, uint32_t f, const int32_t *depth, uint32_t *sites) {
+    Function *function = &program.functions[f];
+    uint8_t *target = calloc(function->codeLength + 1, 1);
+    if (target == NULL) {
+        sourceOutOfMemory();
+    }
+    target[0] = 1;
+    for (uint32_t pc = 0; pc < function->codeLength; pc++) {
+        Opcode op = (Opcode)INSTRUCTION_OP(function->code[pc]);
+        if (depth[pc] >= 0 && (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE)) {
+            target[INSTRUCTION_OPERAND(function->code[pc])] = 1;
+        }
+        pc += instructionWords(op) - 1;
+    }
+
+    fprintf(out, "\n    // %.*s\n", (int)names.lengths[function->name], names.text[function->name]);
+    for (uint32_t pc = 0; pc < function->codeLength; pc++) {
+        uint32_t word = function->code[pc];
+        Opcode op = (Opcode)INSTRUCTION_OP(word);
+        uint32_t operand = INSTRUCTION_OPERAND(word);
+        if (depth[pc] < 0) {
+            pc += instructionWords(op) - 1;
+            continue;
+        }
+        if (target[pc]) {
+            fprintf(out, "f%u_%u:;\n", f, pc);
+        }
+        uint32_t top = function->slotCount + (uint32_t)depth[pc];
+        uint32_t a = top - 2, b = top - 1;   // Binary operands
+        switch (op) {
+            case OP_CONST:
+                fprintf(out, "    s[%u] = epicConstants[%u];\n", top, operand);
+                break;
+            case OP_INT:
+                fprintf(out, "    s[%u] = EPIC_INT_VALUE(%d);\n", top, INSTRUCTION_SIGNED(word));
+                break;
+            case OP_POP:
+                break;
+            case OP_LOAD_LOCAL:
+                fprintf(out, "    s[%u] = s[%u];\n", top, operand);
+                break;
+            case OP_STORE_LOCAL:
+                fprintf(out, "    s[%u] = s[%u];\n", operand, b);
+                break;
+            case OP_ADD:
+                fprintf(out, "    EPIC_ARITH(EPIC_OP_ADD, +, s[%u], s[%u], s + %u);\n", a, b, top);
+                break;
+            case OP_SUB:
+                fprintf(out, "    EPIC_ARITH(EPIC_OP_SUB, -, s[%u], s[%u], s + %u);\n", a, b, top);
+                break;
+            case OP_MUL:
+                fprintf(out, "    EPIC_ARITH(EPIC_OP_MUL, *, s[%u], s[%u], s + %u);\n", a, b, top);
+                break;
+            case OP_DIV:
+                fprintf(out, "    EPIC_SYNC(s + %u);\n    s[%u] = epicArithmetic(EPIC_OP_DIV, s[%u], s[%u]);\n", top, a, a, b);
+                break;
+            case OP_NEG:
+                fprintf(out, "    s[%u] = epicNegate(s[%u]);\n", b, b);
+                break;
+            case OP_NOT:
+                fprintf(out, "    s[%u] = EPIC_INT_VALUE(!EPIC_TRUTHY(s[%u]));\n", b, b);
+                break;
+            case OP_EQ: case OP_NE:
+                fprintf(out, "    EPIC_EQUAL(%d, s[%u], s[%u]);\n", op == OP_NE, a, b);
+                break;
+            case OP_LT: case OP_LE: case OP_GT: case OP_GE: {
+                const char *cmp = op == OP_LT ? "<" : op == OP_LE ? "<=" : op == OP_GT ? ">" : ">=";
+                fprintf(out, "    EPIC_COMPARE(%s, \"%s\", s[%u], s[%u]);\n", cmp, cmp, a, b);
+                break;
+            }
+            case OP_ADD_INT: case OP_SUB_INT: case OP_MUL_INT: {
+                const char *arith = op == OP_ADD_INT ? "+" : op == OP_SUB_INT ? "-" : "*";
+                fprintf(out, "    s[%u].as.i = (int64_t)((uint64_t)s[%u].as.i %s (uint64_t)s[%u].as.i);\n", a, a, arith, b);
+                break;
+            }
+            case OP_DIV_INT:
+                fprintf(out, "    if (s[%u].as.i == 0 || s[%u].as.i == -1) {\n        EPIC_SYNC(s + %u);\n"
+                             "        s[%u] = epicArithmetic(EPIC_OP_DIV, s[%u], s[%u]);\n"
+                             "    } else {\n        s[%u].as.i /= s[%u].as.i;\n    }\n",
+                        b, b, top, a, a, b, a, b);
+                break;
+            case OP_NEG_INT:
+                fprintf(out, "    s[%u].as.i = (int64_t)(0 - (uint64_t)s[%u].as.i);\n", b, b);
+                break;
+            case OP_EQ_INT: case OP_NE_INT: case OP_LT_INT: case OP_LE_INT: case OP_GT_INT: case OP_GE_INT: {
+                static const char *comparisons[] = {"==", "!=", "<", "<=", ">", ">="};
+                fprintf(out, "    s[%u] = EPIC_INT_VALUE(s[%u].as.i %s s[%u].as.i);\n", a, a, comparisons[op - OP_EQ_INT], b);
+                break;
+            }
+            case OP_JUMP:
+                fprintf(out, "    goto f%u_%u;\n", f, operand);
+                break;
+            case OP_JUMP_IF_FALSE: case OP_JUMP_IF_TRUE:
+                fprintf(out, "    if (%sEPIC_TRUTHY(s[%u])) goto f%u_%u;\n", op == OP_JUMP_IF_FALSE ? "!" : "", b, f, operand);
+                break;
+            case OP_CALL: case OP_CALL_MEMO: {
+                uint32_t site = ++*sites;
+                uint32_t args = top - program.functions[operand].arity;
+                if (op == OP_CALL) {
+                    fprintf(out, "    s = epicPushFrame(%u, s + %u, %u);\n    goto f%u_0;\nr%u:;\n",
+                            operand, top, site, operand, site);
+                } else {
+                    fprintf(out, "    if (!epicMemoLookup(%u, s + %u)) {\n"
+                                 "        s = epicPushMemoFrame(%u, s + %u, %u);\n        goto f%u_0;\n    }\nr%u:;\n",
+                            operand, args, operand, top, site, operand, site);
+                }
+                break;
+            }
+            case OP_TAIL_CALL: {
+                uint32_t args = top - program.functions[operand].arity;
+                if (program.functions[operand].memoize) {
+                    fprintf(out, "    if (epicMemoLookup(%u, s + %u)) {\n        result = s[%u];\n        goto epic_return;\n    }\n",
+                            operand, args, args);
+                }
+                fprintf(out, "    s = epicTailCall(%u, %d, s, s + %u);\n    goto f%u_0;\n",
+                        operand, program.functions[operand].memoize, top, operand);
+                break;
+            }
+            case OP_RETURN:
+                fprintf(out, "    result = s[%u];\n    goto epic_return;\n", b);
+                break;
+            case OP_RETURN_NIL:
+                fprintf(out, "    result = EPIC_NIL_VALUE;\n    goto epic_return;\n");
+                break;
+            case OP_PRINT:
+                fprintf(out, "    epicPrint(s[%u]);\n", b);
+                break;
+            case OP_INPUT:
+                if (operand) {
+                    fprintf(out, "    epicPrintValue(stdout, s[%u]);\n", b);
+                    top--;
+                }
+                fprintf(out, "    EPIC_SYNC(s + %u);\n    s[%u] = epicInput();\n", top, top);
+                break;
+            case OP_CONCAT:
+                fprintf(out, "    EPIC_SYNC(s + %u);\n    s[%u] = epicConcatenateValues(s + %u, %u);\n", top, top - operand, top - operand, operand);
+                break;
+            case OP_ARRAY:
+                fprintf(out, "    EPIC_SYNC(s + %u);\n    s[%u] = epicArray(s + %u, %u);\n", top, top - operand, top - operand, operand);
+                break;
+            case OP_INDEX:
+                fprintf(out, "    EPIC_SYNC(s + %u);\n    s[%u] = epicIndex(s[%u], s[%u]);\n", top, a, a, b);
+                break;
+            case OP_INDEX_IN_BOUNDS:
+                fprintf(out, "    if (s[%u].type == EPIC_ARRAY) {\n        s[%u] = epicArrayElement(EPIC_AS_ARRAY(s[%u]), (uint32_t)s[%u].as.i);\n"
+                             "    } else {\n        EPIC_SYNC(s + %u);\n        s[%u] = epicIndex(s[%u], s[%u]);\n    }\n",
+                        a, a, a, b, top, a, a, b);
+                break;
+            case OP_SUM_ARRAY:
+                fprintf(out, "    epicSumArray(&s[%u], &s[%u], &s[%u]);\n", operand, function->code[pc + 1], function->code[pc + 2]);
+                pc += 2;
+                break;
+            case OP_METHOD: {
+                uint32_t argumentCount = function->code[++pc];
+                uint32_t receiver = top - argumentCount - 1;
+                fprintf(out, "    EPIC_SYNC(s + %u);\n    s[%u] = epicMethod(%u, s + %u, %u);\n",
+                        top, receiver, operand, receiver, argumentCount);
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    free(target);
+}
+
+// Write the program as a C translation unit for --emit-c
+void emitCProgram(FILE *out) {
+    fprintf(out, "// Generated by EpicCompiler --emit-c from %s\n#include \"epic_runtime.h\"\n\n", options.inputPath);
+    if (program.mainFunction < 0) {
+        fprintf(out, "int main(void) {\n    return 0;\n}\n");
+        return;
+    }
+
+    // Only actions reachable from main are translated
+    uint8_t *reachable = calloc(program.functionCount, 1);
+    int32_t **depths = calloc(program.functionCount, sizeof(int32_t *));
+    uint32_t *work = malloc(program.functionCount * sizeof(uint32_t));
+    if (reachable == NULL || depths == NULL || work == NULL) {
+        sourceOutOfMemory();
+    }
+    uint32_t count = 0;
+    reachable[program.mainFunction] = 1;
+    work[count++] = (uint32_t)program.mainFunction;
+    while (count > 0) {
+        Function *function = &program.functions[work[--count]];
+        int32_t *depth = depths[function - program.functions] = stackDepths(function);
+        for (uint32_t pc = 0; pc < function->codeLength; pc++) {
+            Opcode op = (Opcode)INSTRUCTION_OP(function->code[pc]);
+            uint32_t callee = INSTRUCTION_OPERAND(function->code[pc]);
+            if (depth[pc] >= 0 && (op == OP_CALL || op == OP_CALL_MEMO || op == OP_TAIL_CALL) && !reachable[callee]) {
+                reachable[callee] = 1;
+                work[count++] = callee;
+            }
+            pc += instructionWords(op) - 1;
+        }
+    }
+
+    fprintf(out, "static const EpicFunction epicFunctions[%u] = {\n", program.functionCount);
+    for (uint32_t f = 0; f < program.functionCount; f++) {
+        Function *function = &program.functions[f];
+        fprintf(out, "    {");
+        emitCString(out, names.text[function->name], names.lengths[function->name]);
+        fprintf(out, ", %u, %u, %u},\n", function->arity, function->slotCount, function->maxStack);
+    }
+    fprintf(out, "};\n\nstatic EpicValue epicConstants[%u];\n\n", program.constantCount ? program.constantCount : 1);
+
+    fprintf(out, "static void epicRun(void) {\n    EpicValue *s;\n    EpicValue result;\n");
+    for (uint32_t i = 0; i < program.constantCount; i++) {
+        emitCConstant(out, i);
+    }
+    fprintf(out, "    epicInit(epicFunctions, %u);\n    s = epicPushFrame(%d, epic.stack, 0);\n    goto f%d_0;\n",
+            program.functionCount, program.mainFunction, program.mainFunction);
+
+    uint32_t sites = 0;
+    for (uint32_t f = 0; f < program.functionCount; f++) {
+        if (reachable[f]) {
+            emitCFunction(out, f, depths[f], &sites);
+        }
+    }
+
+    fprintf(out, "\nepic_return: {\n        EpicFrame *done = epicReturn(result);\n"
+                 "        if (epic.frameCount == 0) {\n            return;\n        }\n"
+                 "        s = epic.frames[epic.frameCount - 1].slots;\n        switch (done->returnSite) {\n");
+    for (uint32_t site = 1; site <= sites; site++) {
+        fprintf(out, "            case %u: goto r%u;\n", site, site);
+    }
+    fprintf(out, "        }\n    }\n}\n\nint main(void) {\n    epicRun();\n    fflush(stdout);\n    return 0;\n}\n");
+
+    for (uint32_t f = 0; f < program.functionCount; f++) {
+        free(depths[f]);
+    }
+    free(depths);
+    free(reachable);
+    free(work);
+}
+
+void writeCProgram() {
+    FILE *out = fopen(options.emitCPath, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error opening output file: %s\n", options.emitCPath);
+        exit(EXIT_FAILURE);
+    }
+    emitCProgram(out);
+    fclose(out);
+}
+
+void usage(FILE *out) {
+    fprintf(out,
+        "Usage: EpicCompiler [options] [file.epic | -]\n"
+        "       EpicCompiler [options] file.epic... | directory...\n"
+        "  Several files, or any directory (searched for .epic files), are compiled\n"
+        "  in parallel without being run, with one combined report.\n"
+        "  --dump-source        Echo the source before lexing\n"
+        "  --dump-tokens        Print every token\n"
+        "  --dump-ast           Print the syntax tree\n"
+        "  --dump-bytecode      Print the compiled bytecode\n"
+        "  --check              Parse only; do not compile or run\n"
+        "  --no-opt             Compile the program without optimizing it\n"
+        "  --no-memo            Do not cache the results of pure actions\n"
+        "  --no-tail-calls      Compile return f(...) as an ordinary call\n"
+        "  --no-specialize      Keep type checks on arithmetic and comparisons of proven ints\n"
+        "  --no-jit             Never compile hot actions to machine code\n"
+        "  --dump-jit           Print the machine code of each action the JIT compiles\n"
+        "  --emit-c=FILE        Write the program as C (build with epic_runtime.h) instead of running it\n"
+        "  --output-buffer=N    Hold up to N bytes of output between writes (default 65536, 0 = none)\n"
+        "  --line-buffered      Write output at every newline (the default on a terminal)\n"
+        "  --jobs=N             Threads for batch compilation or for parsing a large file\n"
+        "                       (default: one per CPU)\n"
+        "  --edits=FILE         Apply the edits in FILE after parsing, reparsing only what they touch\n"
+        "  --cache=DIR          Keep compiled programs in DIR and reuse them while the source is unchanged\n"
+        "  --profile=FILE       Sample the running program: folded stacks to FILE, time per action to stderr\n"
+        "  --fibers=N           Run N copies of the inputs at once as fibers on --jobs threads; stdin\n"
+        "                       lines \"ID text\" go to fiber ID's input()\n"
+        "  --budget=N           Instructions a fiber runs before another gets its thread (default 10000)\n"
+        "  --fiber-stats=FILE   Write one JSON line of counters and timings per fiber\n"
+        "  --stats[=FILE]       Write a JSON summary of counters and timings\n"
+        "  --trace=LEVEL        Trace level: off, info, debug, verbose (or 0-3)\n"
+        "  --trace-cats=LIST    Comma-separated trace categories: io, lex, parse, opt, jit, all\n");
+}
+
+int parseTraceLevel(const char *text) {
+    const char *names[] = {"off", "info", "debug", "verbose"};
+    for (int i = 0; i < 4; i++) {
+        if (strcmp(text, names[i]) == 0) {
+            return i;
+        }
+    }
+    if (text[0] >= '0' && text[0] <= '3' && text[1] == '\0') {
+        return text[0] - '0';
+    }
+    return -1;
+}
+
+int parseTraceCategories(const char *list, unsigned *mask) {
+    *mask = 0;
+    while (*list != '\0') {
+        size_t length = strcspn(list, ",");
+        int found = 0;
+        if (lexemeEquals(list, length, "all")) {
+            *mask = TRACE_ALL;
+            found = 1;
+        }
+        for (size_t i = 0; i < TRACE_CATEGORY_COUNT; i++) {
+            if (lexemeEquals(list, length, traceCategoryNames[i])) {
+                *mask |= 1u << i;
+                found = 1;
+            }
+        }
+        if (!found) {
+            return 0;
+        }
+        list += length;
+        if (*list == ',') {
+            list++;
+        }
+    }
+    return 1;
+}
+
+void parseCommandLine(int argc, char **argv) {
+    options.inputPath = "Function.epic";
+    options.outputBuffer = OUTPUT_BUFFER_SIZE;
+    options.budget = FIBER_BUDGET;
+    options.inputs = malloc((size_t)argc * sizeof(const char *));
+    if (options.inputs == NULL) {
+        sourceOutOfMemory();
+    }
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        if (strcmp(arg, "--dump-source") == 0) {
+            options.dumpSource = 1;
+        } else if (strcmp(arg, "--dump-tokens") == 0) {
+            options.dumpTokens = 1;
+        } else if (strcmp(arg, "--dump-ast") == 0) {
+            options.dumpAst = 1;
+        } else if (strcmp(arg, "--dump-bytecode") == 0) {
+            options.dumpBytecode = 1;
+        } else if (strcmp(arg, "--check") == 0) {
+            options.checkOnly = 1;
+        } else if (strcmp(arg, "--no-opt") == 0) {
+            options.noOptimize = 1;
+        } else if (strcmp(arg, "--no-memo") == 0) {
+            options.noMemo = 1;
+        } else if (strcmp(arg, "--no-tail-calls") == 0) {
+            options.noTailCalls = 1;
+        } else if (strcmp(arg, "--no-specialize") == 0) {
+            options.noSpecialize = 1;
+        } else if (strcmp(arg, "--no-jit") == 0) {
+            options.noJit = 1;
+        } else if (strcmp(arg, "--dump-jit") == 0) {
+            options.dumpJit = 1;
+        } else if (strncmp(arg, "--emit-c=", 9) == 0) {
+            options.emitCPath = arg + 9;
+        } else if (strncmp(arg, "--output-buffer=", 16) == 0) {
+            char *end;
+            errno = 0;
+            unsigned long long size = strtoull(arg + 16, &end, 10);
+            if (end == arg + 16 || *end != '\0' || errno != 0 || size > (1ull << 30)) {
+                fprintf(stderr, "Invalid output buffer size: %s\n", arg + 16);
+                exit(EXIT_FAILURE);
+            }
+            options.outputBuffer = (size_t)size;
+        } else if (strcmp(arg, "--line-buffered") == 0) {
+            options.lineBuffered = 1;
+        } else if (strncmp(arg, "--jobs=", 7) == 0) {
+            char *end;
+            long jobs = strtol(arg + 7, &end, 10);
+            if (end == arg + 7 || *end != '\0' || jobs < 1 || jobs > 1024) {
+                fprintf(stderr, "Invalid job count: %s\n", arg + 7);
+                exit(EXIT_FAILURE);
+            }
+            options.jobs = (uint32_t)jobs;
+        } else if (strncmp(arg, "--edits=", 8) == 0) {
+            options.editsPath = arg + 8;
+        } else if (strncmp(arg, "--cache=", 8) == 0) {
+            options.cachePath = arg + 8;
+        } else if (strncmp(arg, "--profile=", 10) == 0) {
+            options.profilePath = arg + 10;
+        } else if (strncmp(arg, "--fibers=", 9) == 0) {
+            char *end;
+            errno = 0;
+            unsigned long count = strtoul(arg + 9, &end, 10);
+            if (end == arg + 9 || *end != '\0' || errno != 0 || count < 1 || count > FIBER_MAX) {
+                fprintf(stderr, "Invalid fiber count: %s\n", arg + 9);
+                exit(EXIT_FAILURE);
+            }
+            options.fibers = (uint32_t)count;
+        } else if (strncmp(arg, "--budget=", 9) == 0) {
+            char *end;
+            errno = 0;
+            unsigned long long budget = strtoull(arg + 9, &end, 10);
+            if (end == arg + 9 || *end != '\0' || errno != 0 || budget < 1 || budget > (1ull << 40)) {
+                fprintf(stderr, "Invalid budget: %s\n", arg + 9);
+                exit(EXIT_FAILURE);
+            }
+            options.budget = budget;
+        } else if (strncmp(arg, "--fiber-stats=", 14) == 0) {
+            options.fiberStatsPath = arg + 14;
+        } else if (strcmp(arg, "--stats") == 0) {
+            options.printStats = 1;
+        } else if (strncmp(arg, "--stats=", 8) == 0) {
+            options.printStats = 1;
+            options.statsPath = arg + 8;
+        } else if (strncmp(arg, "--trace=", 8) == 0) {
+            traceLevel = parseTraceLevel(arg + 8);
+            if (traceLevel < 0) {
+                fprintf(stderr, "Unknown trace level: %s\n", arg + 8);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strncmp(arg, "--trace-cats=", 13) == 0) {
+            if (!parseTraceCategories(arg + 13, &traceMask)) {
+                fprintf(stderr, "Unknown trace category in: %s\n", arg + 13);
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp(arg, "--help") == 0) {
+            usage(stdout);
+            exit(0);
+        } else if (arg[0] == '-' && arg[1] != '\0') {
+            fprintf(stderr, "Unknown option: %s\n", arg);
+            usage(stderr);
+            exit(EXIT_FAILURE);
+        } else {
+            options.inputs[options.inputCount++] = arg;
+        }
+    }
+    if (options.inputCount > 0) {
+        options.inputPath = options.inputs[0];
+    }
+    struct stat info;
+    options.batch = options.inputCount > 1 ||
+                    (options.inputCount == 1 && stat(options.inputPath, &info) == 0 && S_ISDIR(info.st_mode));
+#if !EPIC_TRACE
+    if (traceLevel != TRACE_OFF) {
+        fprintf(stderr, "Tracing was disabled at compile time (EPIC_TRACE=0)\n");
+    }
+#endif
+}
+
+void printJsonString(FILE *out, const char *text) {
+    fputc('"', out);
+    for (; *text != '\0'; text++) {
+        unsigned char c = (unsigned char)*text;
+        if (c == '"' || c == '\\') {
+            fprintf(out, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+double perSecond(double amount, double seconds) {
+    return seconds > 0 ? amount / seconds : 0;
+}
+
+// Emit the counters and timings as one JSON object
+void printStats(FILE *out) {
+    countTokenTypes();
+    fprintf(out, "{\"file\": ");
+    printJsonString(out, options.inputPath);
+    fprintf(out, ", \"lexer\": \"%s\"", lexer.name);
+    fprintf(out, ", \"bytes_read\": %llu", (unsigned long long)stats.bytesRead);
+    fprintf(out, ", \"tokens\": %llu", (unsigned long long)stats.tokens);
+    fprintf(out, ", \"tokens_by_type\": {");
+    for (int i = 0; i < TOKEN_TYPE_COUNT; i++) {
+        fprintf(out, "%s\"%s\": %llu", i > 0 ? ", " : "", tokenTypeNames[i], (unsigned long long)stats.tokensByType[i]);
+    }
+    fprintf(out, "}, \"parse_nodes\": %llu", (unsigned long long)stats.parseNodes);
+    fprintf(out, ", \"parse_threads\": %llu, \"parse_chunks\": %llu",
+            (unsigned long long)stats.parseThreads, (unsigned long long)stats.parseChunks);
+    fprintf(out, ", \"edits\": %llu, \"incremental_reparses\": %llu, \"full_reparses\": %llu",
+            (unsigned long long)stats.edits, (unsigned long long)stats.incrementalReparses,
+            (unsigned long long)stats.fullReparses);
+    fprintf(out, ", \"relexed_tokens\": %llu, \"reparsed_nodes\": %llu, \"edit_seconds\": %.6f",
+            (unsigned long long)stats.relexedTokens, (unsigned long long)stats.reparsedNodes, stats.editSeconds);
+    fprintf(out, ", \"cache\": \"%s\", \"cache_seconds\": %.6f",
+            stats.cache != NULL ? stats.cache : "off", stats.cacheSeconds);
+    fprintf(out, ", \"ast_bytes\": %llu, \"ast_bytes_per_source_byte\": %.3f",
+            (unsigned long long)stats.astBytes, perSecond((double)stats.astBytes, (double)stats.bytesRead));
+    fprintf(out, ", \"bytecode_words\": %llu", (unsigned long long)stats.bytecodeWords);
+    fprintf(out, ", \"optimizer_nodes_removed\": %llu, \"optimizer_instructions_removed\": %llu",
+            (unsigned long long)stats.nodesRemoved, (unsigned long long)stats.instructionsRemoved);
+    fprintf(out, ", \"memoized_actions\": %llu, \"memo_hits\": %llu, \"memo_misses\": %llu",
+            (unsigned long long)stats.memoizedActions, (unsigned long long)stats.memoHits,
+            (unsigned long long)stats.memoMisses);
+    fprintf(out, ", \"bounds_checks_removed\": %llu, \"vectorized_loops\": %llu",
+            (unsigned long long)stats.boundsChecksRemoved, (unsigned long long)stats.vectorizedLoops);
+    fprintf(out, ", \"specialized_operations\": %llu, \"checked_operations\": %llu, \"specialized_fraction\": %.3f",
+            (unsigned long long)stats.specializedOperations, (unsigned long long)stats.checkedOperations,
+            perSecond((double)stats.specializedOperations,
+                      (double)(stats.specializedOperations + stats.checkedOperations)));
+    fprintf(out, ", \"jit_compiled_actions\": %llu, \"jit_code_bytes\": %llu, \"jit_entries\": %llu, \"jit_deopts\": %llu",
+            (unsigned long long)stats.jitCompiles, (unsigned long long)stats.jitCodeBytes,
+            (unsigned long long)stats.jitEntries, (unsigned long long)stats.jitDeopts);
+    fprintf(out, ", \"allocations\": %llu, \"string_bytes_copied\": %llu, \"in_place_appends\": %llu, \"interned_strings\": %llu",
+            (unsigned long long)stats.allocations, (unsigned long long)stats.bytesCopied,
+            (unsigned long long)stats.inPlaceAppends, (unsigned long long)stats.internedStrings);
+    fprintf(out, ", \"lines_printed\": %llu, \"output_writes\": %llu, \"lines_read\": %llu, \"input_reads\": %llu",
+            (unsigned long long)stats.linesPrinted, (unsigned long long)stats.outputWrites,
+            (unsigned long long)stats.linesRead, (unsigned long long)stats.inputReads);
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(out, ", \"peak_rss_kb\": %ld", usage.ru_maxrss);  // Kilobytes on Linux
+    fprintf(out, ", \"read_seconds\": %.6f, \"lex_seconds\": %.6f, \"parse_seconds\": %.6f",
+            stats.readSeconds, stats.lexSeconds, stats.parseSeconds);
+    fprintf(out, ", \"compile_seconds\": %.6f, \"execute_seconds\": %.6f",
+            stats.compileSeconds, stats.executeSeconds);
+    fprintf(out, ", \"lex_mb_per_second\": %.2f, \"tokens_per_second\": %.0f, \"parse_mb_per_second\": %.2f}\n",
+            perSecond((double)stats.bytesRead / 1e6, stats.lexSeconds),
+            perSecond((double)stats.tokens, stats.lexSeconds),
+            perSecond((double)stats.bytesRead / 1e6, stats.parseSeconds));
+}
+
+void writeStats(void (*print)(FILE *)) {
+    if (options.statsPath == NULL) {
+        print(stderr);
+        return;
+    }
+    FILE *out = fopen(options.statsPath, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error opening stats file: %s\n", options.statsPath);
+        return;
+    }
+    print(out);
+    fclose(out);
+}
+
+// Threads to use for a batch or a parallel parse
+uint32_t jobCount() {
+    if (options.jobs != 0) {
+        return options.jobs;
+    }
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (uint32_t)cpus : 1;
+}
+
+// Parallel parsing of one large file. A pre-scan splits the source before
+// `action` and `main` keywords at brace depth 0, skipping string literals,
+// and worker threads lex and parse the chunks into their own token
+// buffers, arenas and resolvers. The chunks are then appended in source
+// order with token, node and function indices rebased, which rebuilds the
+// exact tables a sequential parse would. When any chunk fails the file is
+// parsed again on one thread, so diagnostics are those of the sequential
+// parser.
+#define PARALLEL_PARSE_MIN (256 * 1024)  // Smaller files parse faster on one thread
+#define CHUNKS_PER_THREAD 4               // Spare chunks even out uneven actions
+
+typedef struct {
+    size_t start;           // Source bytes [start, end) of the chunk
+    size_t end;
+    TokenBuffer tokens;     // The chunk's tables, moved out of the worker
+    AstArena ast;
+    Resolver resolver;
+    NameTable names;
+    uint32_t first;         // First declaration
+    double lexSeconds;
+} ParseChunk;
+
+typedef struct {
+    const char *source;
+    ParseChunk *chunks;
+    uint32_t chunkCount;
+    uint32_t next;          // Next chunk to take, advanced atomically
+    int failed;             // Set once any chunk has an error
+} ParallelParse;
+
+// Find up to `most` chunk starts at least `spacing` bytes apart. The first
+// chunk starts at 0; every other one at a top-level `action` or `main`.
+uint32_t splitSource(size_t *starts, uint32_t most, size_t spacing) {
+    uint32_t count = 1;
+    int64_t depth = 0;
+    starts[0] = 0;
+    for (size_t i = 0; i < sourceLength && count < most; i++) {
+        char c = sourceCode[i];
+        if (c == '"') {
+            do {
+                i++;
+            } while (i < sourceLength && sourceCode[i] != '"' && sourceCode[i] != '\0');
+            if (i >= sourceLength || sourceCode[i] == '\0') {
+                break;
+            }
+        } else if (c == '\0') {
+            break;
+        } else if (c == '{') {
+            depth++;
+        } else if (c == '}') {
+            depth--;
+        } else if (depth == 0 && (c == 'a' || c == 'm') && i >= starts[count - 1] + spacing &&
+                   !(charClass[(unsigned char)sourceCode[i - 1]] & CHAR_IDENT)) {
+            const char *word = c == 'a' ? "action" : "main";
+            size_t length = strlen(word);
+            if (i + length <= sourceLength && memcmp(sourceCode + i, word, length) == 0 &&
+                !(charClass[(unsigned char)sourceCode[i + length]] & CHAR_IDENT)) {
+                starts[count++] = i;
+            }
+        }
+    }
+    return count;
+}
+
+// Lex and parse one chunk on this thread, then move its tables into the
+// chunk
+void parseChunk(ParallelParse *job, ParseChunk *chunk) {
+    double start = nowSeconds();
+    sourceCode = job->source;
+    sourceLength = chunk->end;
+    tokens.count = 0;
+    reserveTokens((chunk->end - chunk->start) / 4 + 16);
+    lexTokens(chunk->start);
+    chunk->lexSeconds = nowSeconds() - start;
+
+    initAst(tokens.count / 2);
+    tokenIndex = 0;
+    currentToken = tokenAt(0);
+    chunk->first = parseDeclarations();
+
+    chunk->tokens = tokens;
+    chunk->ast = ast;
+    chunk->resolver = resolver;
+    chunk->names = names;
+    memset(&tokens, 0, sizeof(tokens));
+    memset(&ast, 0, sizeof(ast));
+    memset(&resolver, 0, sizeof(resolver));
+    memset(&names, 0, sizeof(names));
+}
+
+void *parallelParseWorker(void *argument) {
+    ParallelParse *job = argument;
+    size_t length = sourceLength;
+    jmp_buf *outer = failure.recover;
+    jmp_buf recover;
+    failure.recover = &recover;
+    if (setjmp(recover) == 0) {
+        for (;;) {
+            uint32_t next = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED);
+            if (next >= job->chunkCount || __atomic_load_n(&job->failed, __ATOMIC_RELAXED)) {
+                break;
+            }
+            parseChunk(job, &job->chunks[next]);
+        }
+    } else {
+        __atomic_store_n(&job->failed, 1, __ATOMIC_RELAXED);
+        freeTokens();
+        freeAst();
+        freeResolver();
+        freeNameTable(&names);
+    }
+    freeExpressionStacks();
+    failure.recover = outer;
+    sourceLength = length;
+    return NULL;
+}
+
+// Append the chunks to this thread's (empty) tables. Returns 0 when the
+// result would be too large, for the sequential parser to report.
+int mergeChunks(ParallelParse *job) {
+    uint64_t tokenCount = 1, nodeCount = 2;
+    for (uint32_t i = 0; i < job->chunkCount; i++) {
+        tokenCount += job->chunks[i].tokens.count - 1;
+        nodeCount += job->chunks[i].ast.count - 1;
+    }
+    if (nodeCount > UINT32_MAX / 2) {
+        return 0;
+    }
+    reserveTokens(tokenCount);
+    tokens.count = 0;
+    initAst(nodeCount);
+    uint32_t program = newNode(AST_PROGRAM, 0);
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < job->chunkCount; i++) {
+        ParseChunk *chunk = &job->chunks[i];
+        uint32_t tokenBase = (uint32_t)tokens.count;
+        uint32_t nodeBase = ast.count - 1;
+        uint32_t functionBase = resolver.functionCount;
+
+        // Every chunk but the last drops its EOF token
+        size_t count = chunk->tokens.count - (i + 1 < job->chunkCount);
+        memcpy(tokens.types + tokens.count, chunk->tokens.types, count * sizeof(uint8_t));
+        memcpy(tokens.offsets + tokens.count, chunk->tokens.offsets, count * sizeof(uint32_t));
+        memcpy(tokens.lengths + tokens.count, chunk->tokens.lengths, count * sizeof(uint32_t));
+        tokens.count += count;
+
+        for (uint32_t n = 1; n < chunk->ast.count; n++) {
+            AstNode node = chunk->ast.nodes[n];
+            uint8_t children = astChildren[node.kind];
+            node.token += tokenBase;
+            if ((children & CHILD_A) && node.a != 0) node.a += nodeBase;
+            if ((children & CHILD_B) && node.b != 0) node.b += nodeBase;
+            if ((children & CHILD_C) && node.c != 0) node.c += nodeBase;
+            if ((children & CHILD_D) && node.d != 0) node.d += nodeBase;
+            if (node.next != 0) node.next += nodeBase;
+            if (node.kind == AST_ACTION || node.kind == AST_MAIN) node.d += functionBase;
+            ast.nodes[ast.count++] = node;
+        }
+
+        uint32_t first = chunk->first + nodeBase;
+        if (last == 0) {
+            NODE(program).a = first;
+        } else {
+            NODE(last).next = first;
+        }
+        for (last = first; NODE(last).next != 0; last = NODE(last).next) {
+        }
+
+        for (uint32_t f = 0; f < chunk->resolver.functionCount; f++) {
+            if (resolver.functionCount == resolver.functionCapacity) {
+                resolver.functions = growArray(resolver.functions, &resolver.functionCapacity, sizeof(uint32_t), 16);
+            }
+            resolver.functions[resolver.functionCount++] = chunk->resolver.functions[f] + nodeBase;
+        }
+        for (uint32_t c = 0; c < chunk->resolver.callCount; c++) {
+            addCall(chunk->resolver.calls[c] + nodeBase);
+        }
+        for (uint32_t name = 0; name < chunk->names.count; name++) {
+            internName(&names, chunk->names.text[name], chunk->names.lengths[name]);
+        }
+    }
+    ast.root = program;
+    return 1;
+}
+
+void freeParseChunk(ParseChunk *chunk) {
+    free(chunk->tokens.types);
+    free(chunk->tokens.offsets);
+    free(chunk->tokens.lengths);
+    free(chunk->ast.nodes);
+    free(chunk->ast.text);
+    free(chunk->resolver.locals);
+    free(chunk->resolver.functions);
+    free(chunk->resolver.calls);
+    freeNameTable(&chunk->names);
+}
+
+// Lex and parse the source on several threads. Returns 0, with nothing
+// built, when the file is too small to split or a chunk failed.
+int parseInParallel() {
+    uint32_t threads = jobCount();
+    if (options.batch || threads < 2 || sourceLength < PARALLEL_PARSE_MIN || sourceLength > UINT32_MAX) {
+        return 0;
+    }
+    uint32_t most = threads * CHUNKS_PER_THREAD;
+    size_t *starts = malloc(most * sizeof(size_t));
+    if (starts == NULL) {
+        sourceOutOfMemory();
+    }
+    uint32_t count = splitSource(starts, most, sourceLength / most);
+    if (count < 2) {
+        free(starts);
+        return 0;
+    }
+
+    double start = nowSeconds();
+    ParallelParse job = {sourceCode, calloc(count, sizeof(ParseChunk)), count, 0, 0};
+    pthread_t *workers = malloc(threads * sizeof(pthread_t));
+    if (job.chunks == NULL || workers == NULL) {
+        sourceOutOfMemory();
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        job.chunks[i].start = starts[i];
+        job.chunks[i].end = i + 1 < count ? starts[i + 1] : sourceLength;
+    }
+    free(starts);
+    if (threads > count) {
+        threads = count;
+    }
+    uint32_t started = 1;
+    for (; started < threads; started++) {
+        if (pthread_create(&workers[started], NULL, parallelParseWorker, &job) != 0) {
+            break;
+        }
+    }
+    parallelParseWorker(&job);
+    for (uint32_t i = 1; i < started; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    free(workers);
+
+    int parsed = !job.failed && mergeChunks(&job);
+    double lexSeconds = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        lexSeconds += job.chunks[i].lexSeconds;
+        freeParseChunk(&job.chunks[i]);
+    }
+    free(job.chunks);
+    if (!parsed) {
+        TRACE(TRACE_PARSE, TRACE_INFO, "parallel parse failed; parsing again sequentially");
+        freeTokens();
+        freeAst();
+        freeResolver();
+        freeNameTable(&names);
+        return 0;
+    }
+
+    // Lexing and parsing overlap, so the lexer's share of the time is its
+    // per-thread average
+    stats.tokens = tokens.count;
+    stats.parseThreads = started;
+    stats.parseChunks = count;
+    stats.lexSeconds = lexSeconds / started;
+    stats.parseSeconds = nowSeconds() - start - stats.lexSeconds;
+    TRACE(TRACE_PARSE, TRACE_INFO, "parsed %u chunks on %u threads", count, started);
+    return 1;
+}
+
+// Incremental reparsing (--edits). While edits are applied, the document
+// is kept as one span of text per top-level declaration, in source order,
+// in an append-only edit buffer. An edit appends the new text of the
+// declarations it touches, lexes only that text onto the end of the token
+// buffer and parses it into new AST nodes, then splices the result into
+// the declaration list, the function and call tables and the spans. Every
+// other token, node and name is reused where it is.
+//
+// Text that lexes but does not parse stays a span of its own, holding its
+// syntax error and no declarations, so that typing through invalid states
+// stays incremental. This gives the errors of a full parse because every
+// span boundary follows '}' or white space, where no token can continue,
+// and the full parser starts each span at the top level too. An edit is
+// parsed with the whole document instead when the splice could differ:
+// a lexer error (the full lexer reports those before any syntax error), a
+// syntax error at the end of the span (the full parser would read on), a
+// span that would not end at a safe boundary, or a buffer out of room or
+// mostly garbage. When that full parse fails, its spans are rebuilt the
+// same way where that gives the same error.
+typedef struct {
+    uint32_t node;          // AST_ACTION or AST_MAIN, 0 for text without declarations
+    uint32_t start;         // Offset of the text in the edit buffer
+    uint32_t length;        // Bytes up to the next declaration's first token
+    uint32_t tokens;
+    uint32_t functions;     // Entries in resolver.functions: itself and its nested actions
+    uint32_t calls;         // Entries in resolver.calls
+    char *error;            // The syntax error of text that does not parse
+} DeclarationSpan;
+
+typedef struct {
+    int active;             // The source buffer is the edit buffer
+    int valid;              // The spans hold a parsed document; otherwise it is the text [0, used)
+    size_t length;          // Bytes in the document
+    size_t used;
+    size_t capacity;
+    DeclarationSpan *spans;
+    uint32_t spanCount;
+    uint32_t spanCapacity;
+    uint32_t errorSpans;    // Spans holding a syntax error
+    size_t garbageTokens;   // Tokens no declaration uses any more
+} EditDocument;
+
+COMPILATION_LOCAL EditDocument document;
+
+void freeSpans(uint32_t first, uint32_t count) {
+    for (uint32_t i = first; i < first + count; i++) {
+        if (document.spans[i].error != NULL) {
+            free(document.spans[i].error);
+            document.errorSpans--;
+        }
+    }
+}
+
+uint32_t declarationToken(uint32_t node) {
+    return NODE(node).kind == AST_ACTION ? NODE(node).token - 1 : NODE(node).token;  // 'action' precedes the name
+}
+
+// Append a span for each declaration in the list from `first`. Their text
+// runs from `start` to `end` in the buffer, their tokens end at `endToken`
+// and their calls start at resolver.calls[call].
+void addSpans(uint32_t first, size_t start, size_t end, uint32_t endToken, uint32_t call) {
+    for (uint32_t node = first; node != 0; node = NODE(node).next) {
+        uint32_t next = NODE(node).next;
+        size_t spanEnd = next != 0 ? tokens.offsets[declarationToken(next)] : end;
+        if (document.spanCount == document.spanCapacity) {
+            document.spans = growArray(document.spans, &document.spanCapacity, sizeof(DeclarationSpan), 64);
+        }
+        DeclarationSpan *span = &document.spans[document.spanCount++];
+        span->node = node;
+        span->start = (uint32_t)start;
+        span->length = (uint32_t)(spanEnd - start);
+        span->tokens = (next != 0 ? declarationToken(next) : endToken) - declarationToken(node);
+        span->functions = (next != 0 ? NODE(next).d : resolver.functionCount) - NODE(node).d;
+        span->calls = 0;
+        span->error = NULL;
+        while (call < resolver.callCount && resolver.calls[call] >= node &&
+               (next == 0 || resolver.calls[call] < next)) {
+            span->calls++;
+            call++;
+        }
+        start = spanEnd;
+    }
+}
+
+// Replace items [at, at + removed) with the `added` items at the end of
+// the array; returns the new count
+uint32_t spliceTail(void *items, size_t itemSize, uint32_t count, uint32_t at, uint32_t removed, uint32_t added) {
+    char *base = items;
+    uint32_t rest = count - added - at - removed;
+    char *moved = malloc((size_t)added * itemSize + 1);
+    if (moved == NULL) {
+        sourceOutOfMemory();
+    }
+    memcpy(moved, base + (size_t)(count - added) * itemSize, (size_t)added * itemSize);
+    if (added != removed) {
+        memmove(base + (size_t)(at + added) * itemSize, base + (size_t)(at + removed) * itemSize, (size_t)rest * itemSize);
+    }
+    memcpy(base + (size_t)at * itemSize, moved, (size_t)added * itemSize);
+    free(moved);
+    return at + added + rest;
+}
+
+// Copy `count` bytes of the document, starting `skip` bytes into span k
+char *copyDocument(char *dest, uint32_t k, size_t skip, size_t count) {
+    if (!document.valid) {
+        memcpy(dest, source.data + skip, count);
+        return dest + count;
+    }
+    while (count > 0) {
+        DeclarationSpan *span = &document.spans[k++];
+        if (skip >= span->length) {
+            skip -= span->length;
+            continue;
+        }
+        size_t length = span->length - skip < count ? span->length - skip : count;
+        memcpy(dest, source.data + span->start + skip, length);
+        dest += length;
+        count -= length;
+        skip = 0;
+    }
+    return dest;
+}
+
+// Room for the document and as many bytes again of edits
+size_t editCapacity(size_t length) {
+    size_t capacity = length * 2 + SOURCE_CHUNK;
+    return capacity < UINT32_MAX - SOURCE_PADDING ? capacity : UINT32_MAX - SOURCE_PADDING;
+}
+
+char *newEditBuffer(size_t capacity) {
+    char *text = calloc(capacity + SOURCE_PADDING, 1);
+    if (text == NULL) {
+        sourceOutOfMemory();
+    }
+    return text;
+}
+
+// The first syntax error in the document, NULL when it parses
+const char *documentError() {
+    for (uint32_t i = 0; document.errorSpans > 0 && i < document.spanCount; i++) {
+        if (document.spans[i].error != NULL) {
+            return document.spans[i].error;
+        }
+    }
+    return NULL;
+}
+
+enum { REGION_PARSED, REGION_SYNTAX_ERROR, REGION_FAILED };
+
+// Lex the buffer from `start` to `end` onto the end of the token buffer
+// and parse it as declarations, the first of which goes to `*first`. A
+// syntax error leaves its message in failure.message.
+int parseRegion(size_t start, size_t end, uint32_t *first) {
+    size_t savedLength = sourceLength;
+    volatile int lexed = 0;
+    jmp_buf *outer = failure.recover;
+    jmp_buf recover;
+    failure.recover = &recover;
+    if (setjmp(recover) != 0) {
+        failure.recover = outer;
+        sourceLength = savedLength;
+        return lexed && tokenIndex + 1 < tokens.count ? REGION_SYNTAX_ERROR : REGION_FAILED;
+    }
+    sourceLength = end;
+    tokenIndex = tokens.count;
+    lexTokens(start);
+    lexed = 1;
+    currentToken = tokenAt(tokenIndex);
+    *first = parseDeclarations();
+    failure.recover = outer;
+    sourceLength = savedLength;
+    return REGION_PARSED;
+}
+
+// Forget the functions and calls of a parse that stopped at an error
+void dropPartialParse(uint32_t functionStart, uint32_t callStart) {
+    resolver.functionCount = functionStart;
+    resolver.callCount = callStart;
+    resolver.count = resolver.functionBase = resolver.depth = resolver.nesting = resolver.slotCount = 0;
+    freeExpressionStacks();
+}
+
+// Keep text with no declarations (white space, or text with a syntax error)
+// as one span
+void addTextSpan(size_t start, size_t length, const char *error) {
+    if (document.spanCount == document.spanCapacity) {
+        document.spans = growArray(document.spans, &document.spanCapacity, sizeof(DeclarationSpan), 64);
+    }
+    DeclarationSpan *span = &document.spans[document.spanCount++];
+    memset(span, 0, sizeof(*span));
+    span->start = (uint32_t)start;
+    span->length = (uint32_t)length;
+    if (error != NULL) {
+        if ((span->error = strdup(error)) == NULL) {
+            sourceOutOfMemory();
+        }
+        document.errorSpans++;
+    }
+}
+
+// The nearest declaration before span k (step -1) or after it (step 1)
+uint32_t neighbourDeclaration(uint32_t k, int step) {
+    for (int64_t i = (int64_t)k + step; i >= 0 && i < document.spanCount; i += step) {
+        if (document.spans[i].node != 0) {
+            return document.spans[i].node;
+        }
+    }
+    return 0;
+}
+
+// Lex and parse the whole edit buffer; returns 0 after an error
+int parseDocument() {
+    jmp_buf *outer = failure.recover;
+    jmp_buf recover;
+    failure.recover = &recover;
+    if (setjmp(recover) != 0) {
+        failure.recover = outer;
+        return 0;
+    }
+    double start = nowSeconds();
+    tokenize();
+    stats.lexSeconds = nowSeconds() - start;
+    start = nowSeconds();
+    initAst(tokens.count / 2);
+    tokenIndex = 0;
+    currentToken = tokenAt(0);
+    ast.root = parseGameProgram();
+    stats.parseSeconds = nowSeconds() - start;
+    stats.parseThreads = stats.parseChunks = 1;
+    addSpans(NODE(ast.root).a, 0, document.used, (uint32_t)tokens.count - 1, 0);
+    failure.recover = outer;
+    return 1;
+}
+
+// After a full parse failed with `message`, rebuild the spans by parsing
+// the text between top-level keywords on its own, so that the next edits
+// are incremental again. They are kept only if they give the same error.
+void recoverSpans(const char *message) {
+    freeResolver();
+    freeNameTable(&names);
+    freeExpressionStacks();
+    freeAst();
+    freeTokens();
+    uint32_t most = (uint32_t)(document.used / 6 + 2);  // "main{}" is the shortest declaration
+    size_t *starts = malloc(most * sizeof(size_t));
+    if (starts == NULL) {
+        sourceOutOfMemory();
+    }
+    uint32_t count = splitSource(starts, most, 1), kept = 1;
+    for (uint32_t i = 1; i < count; i++) {
+        char before = sourceCode[starts[i] - 1];
+        if (before == '}' || (charClass[(unsigned char)before] & CHAR_SPACE)) {
+            starts[kept++] = starts[i];
+        }
+    }
+
+    reserveTokens(sourceLength / 4 + 16);
+    initAst(tokens.capacity / 2);
+    ast.root = newNode(AST_PROGRAM, 0);
+    int recovered = sourceLength > starts[kept - 1];
+    for (uint32_t i = 0; i < kept && recovered; i++) {
+        size_t end = i + 1 < kept ? starts[i + 1] : document.used;
+        uint32_t tokenStart = (uint32_t)tokens.count;
+        uint32_t functionStart = resolver.functionCount;
+        uint32_t callStart = resolver.callCount;
+        uint32_t first = 0;
+        int status = parseRegion(starts[i], i + 1 < kept ? end : sourceLength, &first);
+        if (status == REGION_FAILED) {
+            recovered = 0;
+        } else if (status == REGION_SYNTAX_ERROR) {
+            dropPartialParse(functionStart, callStart);
+            addTextSpan(starts[i], end - starts[i], failure.message);
+            document.garbageTokens += tokens.count - tokenStart;
+        } else if (first != 0) {
+            addSpans(first, starts[i], end, (uint32_t)tokens.count - 1, callStart);
+        } else {
+            addTextSpan(starts[i], end - starts[i], NULL);
+        }
+    }
+    free(starts);
+
+    const char *error = recovered ? documentError() : NULL;
+    if (error == NULL || strcmp(error, message) != 0) {
+        freeSpans(0, document.spanCount);
+        document.spanCount = 0;
+        return;
+    }
+    uint32_t last = 0;
+    for (uint32_t i = 0; i < document.spanCount; i++) {
+        uint32_t node = document.spans[i].node;
+        if (node != 0) {
+            if (last != 0) {
+                NODE(last).next = node;
+            } else {
+                NODE(ast.root).a = node;
+            }
+            last = node;
+        }
+    }
+    if (last != 0) {
+        NODE(last).next = 0;
+    }
+    document.valid = 1;
+    TRACE(TRACE_PARSE, TRACE_DEBUG, "recovered %u spans", document.spanCount);
+}
+
+// Parse `text`, the whole document, from scratch; it becomes the edit buffer
+void reparseDocument(char *text, size_t length, size_t capacity) {
+    freeResolver();
+    freeNameTable(&names);
+    freeExpressionStacks();
+    freeAst();
+    freeTokens();
+    closeSource();
+    source.data = text;
+    source.size = length;
+    source.mappedSize = 0;
+    sourceCode = text;
+    sourceLength = findSourceEnd(text, length);
+    freeSpans(0, document.spanCount);
+    document.valid = 0;
+    document.length = length;
+    document.used = length;
+    document.capacity = capacity;
+    document.spanCount = 0;
+    document.garbageTokens = 0;
+
+    if (!parseDocument()) {
+        char message[sizeof(failure.message)];
+        snprintf(message, sizeof(message), "%s", failure.message);
+        recoverSpans(message);
+        failCompilation(stderr, "%s", message);
+    }
+    document.valid = 1;
+}
+
+// Copy the source into an edit buffer and parse it
+void beginEditing() {
+    size_t length = source.size;
+    size_t capacity = editCapacity(length);
+    if (capacity < length) {
+        error("Source file too large");
+    }
+    char *text = newEditBuffer(capacity);
+    memcpy(text, source.data, length);
+    document.active = 1;
+    reparseDocument(text, length, capacity);
+}
+
+// Reparse only the declarations an edit touches. Returns 0, with the spans
+// unchanged, when the whole document has to be parsed instead.
+int reparseIncrementally(size_t offset, size_t removed, const char *text, size_t length) {
+    if (document.spanCount == 0 || memchr(text, '\0', length) != NULL) {
+        return 0;
+    }
+
+    // Spans [first, last] cover the edit
+    uint32_t first = 0, functionAt = 0, callAt = 0;
+    size_t regionStart = 0;
+    while (first + 1 < document.spanCount && regionStart + document.spans[first].length <= offset) {
+        regionStart += document.spans[first].length;
+        functionAt += document.spans[first].functions;
+        callAt += document.spans[first].calls;
+        first++;
+    }
+    uint32_t last = first;
+    size_t regionLength = document.spans[first].length;
+    uint32_t oldFunctions = document.spans[first].functions;
+    uint32_t oldCalls = document.spans[first].calls;
+    size_t oldTokens = document.spans[first].tokens;
+    while (last + 1 < document.spanCount && regionStart + regionLength < offset + removed) {
+        last++;
+        regionLength += document.spans[last].length;
+        oldFunctions += document.spans[last].functions;
+        oldCalls += document.spans[last].calls;
+        oldTokens += document.spans[last].tokens;
+    }
+    size_t newLength = regionLength - removed + length;
+    if (document.used + 1 + newLength > document.capacity ||
+        document.garbageTokens + oldTokens > tokens.count / 2) {
+        return 0;
+    }
+
+    // The new text of the region goes after the text in use and a zero
+    // byte, which stops the lexer's scanners
+    char *region = source.data + document.used + 1;
+    char *at = copyDocument(region, first, 0, offset - regionStart);
+    memcpy(at, text, length);
+    copyDocument(at + length, first, offset + removed - regionStart, regionStart + regionLength - offset - removed);
+
+    // The last span's text is lexed up to its last '}', like the whole
+    // file's; any other must end at a safe boundary
+    size_t lexEnd = newLength;
+    if (last + 1 == document.spanCount) {
+        lexEnd = findSourceEnd(region, newLength);
+        if (newLength == 0 || region[lexEnd - 1] != '}') {
+            return 0;
+        }
+    } else if (newLength > 0 && region[newLength - 1] != '}' &&
+               !(charClass[(unsigned char)region[newLength - 1]] & CHAR_SPACE)) {
+        return 0;
+    }
+
+    size_t regionOffset = (size_t)(region - source.data);
+    uint32_t tokenStart = (uint32_t)tokens.count;
+    uint32_t nodeStart = ast.count;
+    uint32_t functionStart = resolver.functionCount;
+    uint32_t callStart = resolver.callCount;
+    uint32_t parsed = 0;
+    int status = newLength > 0 ? parseRegion(regionOffset, regionOffset + lexEnd, &parsed) : REGION_PARSED;
+    if (status == REGION_FAILED) {
+        return 0;  // The full parse rebuilds every table
+    }
+
+    // Splice the new spans in place of the old ones
+    uint32_t before = neighbourDeclaration(first, -1);
+    uint32_t after = neighbourDeclaration(last, 1);
+    uint32_t spanStart = document.spanCount;
+    if (status == REGION_SYNTAX_ERROR) {
+        dropPartialParse(functionStart, callStart);
+        parsed = 0;
+    }
+    if (parsed != 0) {
+        addSpans(parsed, regionOffset, regionOffset + newLength, (uint32_t)tokens.count - 1, callStart);
+    } else if (newLength > 0) {
+        addTextSpan(regionOffset, newLength, status == REGION_SYNTAX_ERROR ? failure.message : NULL);
+    }
+    uint32_t added = document.spanCount - spanStart;
+    freeSpans(first, last - first + 1);
+    document.spanCount = spliceTail(document.spans, sizeof(DeclarationSpan), document.spanCount,
+                                    first, last - first + 1, added);
+    // Functions after the new ones only move when their number changed
+    uint32_t newFunctions = resolver.functionCount - functionStart;
+    resolver.functionCount = spliceTail(resolver.functions, sizeof(uint32_t), resolver.functionCount,
+                                        functionAt, oldFunctions, newFunctions);
+    uint32_t moved = newFunctions == oldFunctions ? functionAt + newFunctions : resolver.functionCount;
+    for (uint32_t i = functionAt; i < moved; i++) {
+        NODE(resolver.functions[i]).d = i;
+    }
+    resolver.callCount = spliceTail(resolver.calls, sizeof(uint32_t), resolver.callCount,
+                                    callAt, oldCalls, resolver.callCount - callStart);
+    if (before != 0) {
+        NODE(before).next = parsed != 0 ? parsed : after;
+    } else {
+        NODE(ast.root).a = parsed != 0 ? parsed : after;
+    }
+    if (parsed != 0) {
+        NODE(document.spans[first + added - 1].node).next = after;
+    }
+
+    document.used += 1 + newLength;
+    document.garbageTokens += oldTokens + 1;
+    if (status == REGION_SYNTAX_ERROR) {
+        document.garbageTokens += tokens.count - tokenStart - 1;
+    }
+    stats.relexedTokens += tokens.count - tokenStart;
+    stats.reparsedNodes += ast.count - nodeStart;
+    return 1;
+}
+
+// Apply one edit, replacing `removed` bytes at `offset` with `text`, and
+// parse the result. Errors go through failCompilation(); the document
+// keeps the edit either way.
+void applyEdit(size_t offset, size_t removed, const char *text, size_t length) {
+    double start = nowSeconds();
+    size_t size = document.length;
+    if (offset > size || removed > size - offset) {
+        failCompilation(stderr, "Edit out of range: %zu bytes at %zu in a %zu byte document", removed, offset, size);
+    }
+    stats.edits++;
+    if (document.valid && reparseIncrementally(offset, removed, text, length)) {
+        document.length = size - removed + length;
+        stats.incrementalReparses++;
+    } else {
+        TRACE(TRACE_PARSE, TRACE_DEBUG, "edit at %zu: parsing the whole document", offset);
+        size_t newLength = size - removed + length;
+        size_t capacity = editCapacity(newLength);
+        if (capacity < newLength) {
+            error("Source file too large");
+        }
+        char *flat = newEditBuffer(capacity);
+        copyDocument(flat, 0, 0, offset);
+        memcpy(flat + offset, text, length);
+        copyDocument(flat + offset + length, 0, offset + removed, size - offset - removed);
+        stats.fullReparses++;
+        reparseDocument(flat, newLength, capacity);
+    }
+    stats.editSeconds += nowSeconds() - start;
+}
+
+// Apply an edit, or start editing when `text` is NULL; returns 0 after an
+// error
+int tryEdit(size_t offset, size_t removed, const char *text, size_t length) {
+    jmp_buf *outer = failure.recover;
+    jmp_buf recover;
+    failure.recover = &recover;
+    if (setjmp(recover) == 0) {
+        if (text == NULL) {
+            beginEditing();
+        } else {
+            applyEdit(offset, removed, text, length);
+        }
+        failure.recover = outer;
+        return 1;
+    }
+    failure.recover = outer;
+    return 0;
+}
+
+// Apply the edits in `path` in order. Each is a line "OFFSET REMOVED
+// INSERTED" followed by INSERTED bytes of text and a newline. An edit that
+// leaves errors is reported once the next one is applied; errors left by
+// the last edit end the compilation.
+void applyEditsFile(const char *path) {
+    FILE *in = fopen(path, "rb");
+    if (in == NULL) {
+        failCompilation(stderr, "Error opening edits file: %s", path);
+    }
+    size_t size = 0, capacity = SOURCE_CHUNK;
+    char *data = malloc(capacity);
+    size_t got;
+    while (data != NULL && (got = fread(data + size, 1, capacity - size, in)) > 0) {
+        size += got;
+        if (size == capacity) {
+            capacity *= 2;
+            char *grown = realloc(data, capacity);
+            if (grown == NULL) {
+                free(data);
+            }
+            data = grown;
+        }
+    }
+    fclose(in);
+    if (data == NULL) {
+        sourceOutOfMemory();
+    }
+
+    char pending[sizeof(failure.message)] = "";
+    if (!tryEdit(0, 0, NULL, 0)) {
+        snprintf(pending, sizeof(pending), "%s", failure.message);
+    }
+    uint32_t edit = 0;
+    const char *p = data, *end = data + size;
+    while (p < end) {
+        char *next;
+        unsigned long long values[3];
+        int valid = 1;
+        for (int i = 0; i < 3 && valid; i++) {
+            values[i] = strtoull(p, &next, 10);
+            valid = next != p;
+            p = next;
+        }
+        if (!valid || p >= end || *p != '\n' || values[2] > (unsigned long long)(end - p - 1)) {
+            free(data);
+            failCompilation(stderr, "Malformed edit %u in %s", edit + 1, path);
+        }
+        const char *text = p + 1;
+        p = text + values[2];
+        if (p < end && *p == '\n') {
+            p++;
+        }
+        if (pending[0] != '\0' && edit > 0) {  // The file's own errors are not reported once edited
+            fprintf(stderr, "Edit %u: %s\n", edit, pending);
+            pending[0] = '\0';
+        }
+        edit++;
+        const char *problem = tryEdit((size_t)values[0], (size_t)values[1], text, (size_t)values[2])
+                                  ? documentError() : failure.message;
+        if (problem != NULL) {
+            snprintf(pending, sizeof(pending), "%s", problem);
+        }
+    }
+    free(data);
+    TRACE(TRACE_PARSE, TRACE_INFO, "%u edits: %llu incremental, %llu full", edit,
+          (unsigned long long)stats.incrementalReparses, (unsigned long long)stats.fullReparses);
+    if (pending[0] != '\0') {
+        failCompilation(stderr, "%s", pending);
+    }
+}
+
+// Compiled program cache (--cache=DIR). A program that compiles is written
+// to DIR as an image: a header, then the function table, the constants,
+// the bytecode and the text of names and string constants, all as offsets
+// from the start of the file, so an entry is position-independent and is
+// mapped read-only as it is. The entry's name is a hash of the source and
+// of the options that change the bytecode; its header records those and
+// the version of the compiler that wrote it, and a checksum of the rest. An
+// entry from another version is stale and a damaged one corrupt; either is
+// compiled again and replaced. Loading builds only the small tables the VM
+// indexes by pointer; every instruction runs from the mapping.
+#define CACHE_FORMAT 1
+#define CACHE_BYTE_ORDER 0x01020304u
+
+// Bump with any change to the opcodes or their operands, to what the
+// compiler emits for a program or to the image layout (which also bumps
+// CACHE_FORMAT), so entries written before it are stale
+#define COMPILER_VERSION "1.0"
+
+typedef struct {
+    char magic[8];          // "EPICIMG"
+    uint32_t format;        // CACHE_FORMAT
+    uint32_t byteOrder;     // CACHE_BYTE_ORDER as written
+    uint64_t version;       // Hash of COMPILER_VERSION
+    uint64_t sourceHash;
+    uint64_t sourceLength;
+    uint32_t flags;         // Options the bytecode depends on
+    int32_t mainFunction;
+    uint64_t size;          // Of the whole file
+    uint64_t checksum;      // Of everything after the header
+    uint32_t functionCount;
+    uint32_t constantCount;
+    uint64_t functions;     // Section offsets
+    uint64_t constants;
+    uint64_t code;
+    uint64_t text;
+    uint64_t codeWords;
+    uint64_t textBytes;
+} ImageHeader;
+
+typedef struct {
+    uint64_t name;          // Offset into the text
+    uint32_t nameLength;
+    uint32_t arity;
+    uint32_t slotCount;
+    uint32_t maxStack;
+    uint64_t code;          // First word in the code
+    uint32_t codeLength;
+    uint32_t memoize;
+} ImageFunction;
+
+typedef struct {
+    uint32_t type;          // VAL_INT, VAL_DOUBLE or VAL_STRING
+    uint32_t length;        // Strings: bytes at `as.text`, followed by a NUL
+    union {
+        int64_t i;
+        double d;
+        uint64_t text;
+    } as;
+} ImageConstant;
+
+// 64-bit hash of a byte range, eight bytes at a time
+uint64_t hashBytes(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    hash ^= (uint64_t)length * 0xFF51AFD7ED558CCDull;
+    while (length >= 8) {
+        uint64_t word;
+        memcpy(&word, bytes, 8);
+        hash = (hash ^ word) * 0x9E3779B97F4A7C15ull;
+        hash ^= hash >> 29;
+        bytes += 8;
+        length -= 8;
+    }
+    uint64_t tail = 0;
+    memcpy(&tail, bytes, length);
+    hash = (hash ^ tail) * 0x9E3779B97F4A7C15ull;
+    return hash ^ (hash >> 32);
+}
+
+uint32_t cacheFlags() {
+    return (options.noOptimize ? 1u : 0) | (options.noMemo ? 2u : 0) | (options.noTailCalls ? 4u : 0) |
+           (options.noSpecialize ? 8u : 0);
+}
+
+// The entry for this source, DIR/<hash>.epicc; the caller frees it
+char *cacheEntryPath(uint64_t sourceHash) {
+    uint32_t flags = cacheFlags();
+    char *path = malloc(strlen(options.cachePath) + 24);
+    if (path == NULL) {
+        sourceOutOfMemory();
+    }
+    sprintf(path, "%s/%016llx.epicc", options.cachePath,
+            (unsigned long long)hashBytes(sourceHash, &flags, sizeof(flags)));
+    return path;
+}
+
+static inline uint64_t alignImage(uint64_t offset) {
+    return (offset + 7) & ~(uint64_t)7;
+}
+
+// Whether `count` items of `size` bytes at `offset` lie inside `limit`
+int imageFits(uint64_t offset, uint64_t count, uint64_t size, uint64_t limit) {
+    return offset <= limit && count <= (limit - offset) / size;
+}
+
+// Check an entry and make it the program. Returns the verdict for the
+// stats; only "hit" installs anything.
+const char *loadImage(void *image, size_t size, uint64_t sourceHash) {
+    const ImageHeader *header = image;
+    const char *base = image;
+    if (size < sizeof(ImageHeader) || memcmp(header->magic, "EPICIMG", 8) != 0 ||
+        header->byteOrder != CACHE_BYTE_ORDER) {
+        return "corrupt";
+    }
+    if (header->format != CACHE_FORMAT || header->version != hashBytes(0, COMPILER_VERSION, sizeof(COMPILER_VERSION)) ||
+        header->sourceHash != sourceHash || header->sourceLength != sourceLength || header->flags != cacheFlags()) {
+        return "stale";
+    }
+    if (header->size != size ||
+        !imageFits(header->functions, header->functionCount, sizeof(ImageFunction), size) ||
+        !imageFits(header->constants, header->constantCount, sizeof(ImageConstant), size) ||
+        !imageFits(header->code, header->codeWords, sizeof(uint32_t), size) ||
+        !imageFits(header->text, header->textBytes, 1, size) ||
+        header->mainFunction < -1 || header->mainFunction >= (int64_t)header->functionCount ||
+        hashBytes(0, base + sizeof(ImageHeader), size - sizeof(ImageHeader)) != header->checksum) {
+        return "corrupt";
+    }
+    const ImageFunction *functions = (const ImageFunction *)(base + header->functions);
+    const ImageConstant *constants = (const ImageConstant *)(base + header->constants);
+    for (uint32_t i = 0; i < header->functionCount; i++) {
+        if (!imageFits(functions[i].code, functions[i].codeLength, 1, header->codeWords) ||
+            !imageFits(functions[i].name, functions[i].nameLength, 1, header->textBytes)) {
+            return "corrupt";
+        }
+    }
+    for (uint32_t i = 0; i < header->constantCount; i++) {
+        if (constants[i].type == VAL_STRING ? !imageFits(constants[i].as.text, (uint64_t)constants[i].length + 1, 1, header->textBytes)
+                                            : constants[i].type != VAL_INT && constants[i].type != VAL_DOUBLE) {
+            return "corrupt";
+        }
+    }
+
+    uint32_t count = header->functionCount;
+    program.functions = calloc((size_t)count + 1, sizeof(Function));
+    program.constants = malloc(((size_t)header->constantCount + 1) * sizeof(Value));
+    names.text = malloc(((size_t)count + 1) * sizeof(const char *));
+    names.lengths = malloc(((size_t)count + 1) * sizeof(uint32_t));
+    if (program.functions == NULL || program.constants == NULL || names.text == NULL || names.lengths == NULL) {
+        sourceOutOfMemory();
+    }
+    program.functionCount = program.functionCapacity = count;
+    program.constantCapacity = header->constantCount + 1;
+    program.mainFunction = header->mainFunction;
+    program.image = image;
+    program.imageSize = size;
+    names.count = names.capacity = count;
+    const uint32_t *code = (const uint32_t *)(base + header->code);
+    const char *text = base + header->text;
+    for (uint32_t i = 0; i < count; i++) {
+        Function *function = &program.functions[i];
+        names.text[i] = text + functions[i].name;
+        names.lengths[i] = functions[i].nameLength;
+        function->name = i;
+        function->arity = functions[i].arity;
+        function->slotCount = functions[i].slotCount;
+        function->maxStack = functions[i].maxStack;
+        function->code = (uint32_t *)(code + functions[i].code);  // Never written once compiled
+        function->codeLength = functions[i].codeLength;
+        function->memoize = (uint8_t)functions[i].memoize;
+        stats.memoizedActions += function->memoize;
+    }
+    for (uint32_t i = 0; i < header->constantCount; i++) {
+        Value value = {(uint8_t)constants[i].type, {.i = constants[i].as.i}};
+        if (value.type == VAL_STRING) {
+            // A constant string without storage: its bytes stay in the mapping
+            String *string = malloc(sizeof(String));
+            if (string == NULL) {
+                sourceOutOfMemory();
+            }
+            memset(string, 0, sizeof(String));
+            string->header.type = OBJ_STRING;
+            string->header.marked = 1;
+            string->length = string->capacity = string->used = constants[i].length;
+            string->chars = text + constants[i].as.text;
+            string->owner = string;
+            value.as.object = (Object *)string;
+        }
+        program.constants[program.constantCount++] = value;
+    }
+    return "hit";
+}
+
+// Map and load the entry for the source; returns 0 when it has to be
+// compiled
+int loadCachedProgram(uint64_t sourceHash) {
+    char *path = cacheEntryPath(sourceHash);
+    int fd = open(path, O_RDONLY);
+    stats.cache = "miss";
+    TRACE(TRACE_IO, TRACE_DEBUG, "looking for %s", path);
+    free(path);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat info;
+    void *image = MAP_FAILED;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        image = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if (image == MAP_FAILED) {
+        stats.cache = "corrupt";
+        return 0;
+    }
+    stats.cache = loadImage(image, (size_t)info.st_size, sourceHash);
+    TRACE(TRACE_IO, TRACE_INFO, "cache %s", stats.cache);
+    if (program.image != image) {
+        munmap(image, (size_t)info.st_size);
+        return 0;
+    }
+    stats.bytecodeWords = programWords();
+    countTypedOperations();
+    return 1;
+}
+
+// Write the compiled program as the source's entry, replacing any entry
+// there. The image goes to a temporary file first, so readers only ever
+// map a complete one. Failing to write only costs the next start its
+// speedup.
+void storeCachedProgram(uint64_t sourceHash) {
+    uint64_t textBytes = 0;
+    for (uint32_t i = 0; i < program.functionCount; i++) {
+        textBytes += names.lengths[program.functions[i].name] + 1;
+    }
+    for (uint32_t i = 0; i < program.constantCount; i++) {
+        if (program.constants[i].type == VAL_STRING) {
+            textBytes += AS_STRING(program.constants[i])->length + 1;
+        } else if (program.constants[i].type != VAL_INT && program.constants[i].type != VAL_DOUBLE) {
+            return;
+        }
+    }
+    ImageHeader layout = {.magic = "EPICIMG", .format = CACHE_FORMAT, .byteOrder = CACHE_BYTE_ORDER};
+    layout.functions = alignImage(sizeof(ImageHeader));
+    layout.constants = alignImage(layout.functions + (uint64_t)program.functionCount * sizeof(ImageFunction));
+    layout.code = alignImage(layout.constants + (uint64_t)program.constantCount * sizeof(ImageConstant));
+    layout.codeWords = programWords();
+    layout.text = alignImage(layout.code + layout.codeWords * sizeof(uint32_t));
+    layout.textBytes = textBytes;
+    layout.size = alignImage(layout.text + textBytes);
+    char *image = calloc(1, layout.size);
+    if (image == NULL) {
+        return;
+    }
+
+    ImageHeader *header = (ImageHeader *)image;
+    *header = layout;
+    header->version = hashBytes(0, COMPILER_VERSION, sizeof(COMPILER_VERSION));
+    header->sourceHash = sourceHash;
+    header->sourceLength = sourceLength;
+    header->flags = cacheFlags();
+    header->mainFunction = program.mainFunction;
+    header->functionCount = program.functionCount;
+    header->constantCount = program.constantCount;
+    ImageFunction *functions = (ImageFunction *)(image + layout.functions);
+    ImageConstant *constants = (ImageConstant *)(image + layout.constants);
+    uint32_t *code = (uint32_t *)(image + layout.code);
+    uint64_t words = 0, text = 0;
+    for (uint32_t i = 0; i < program.functionCount; i++) {
+        Function *function = &program.functions[i];
+        functions[i] = (ImageFunction){text, names.lengths[function->name], function->arity, function->slotCount,
+                                       function->maxStack, words, function->codeLength, function->memoize};
+        memcpy(image + layout.text + text, names.text[function->name], names.lengths[function->name]);
+        text += names.lengths[function->name] + 1;
+        memcpy(code + words, function->code, (size_t)function->codeLength * sizeof(uint32_t));
+        words += function->codeLength;
+    }
+    for (uint32_t i = 0; i < program.constantCount; i++) {
+        Value value = program.constants[i];
+        constants[i].type = value.type;
+        constants[i].as.i = value.as.i;
+        if (value.type == VAL_STRING) {
+            String *string = AS_STRING(value);
+            constants[i].length = string->length;
+            constants[i].as.text = text;
+            memcpy(image + layout.text + text, string->chars, string->length);
+            text += string->length + 1;
+        }
+    }
+    header->checksum = hashBytes(0, image + sizeof(ImageHeader), layout.size - sizeof(ImageHeader));
+
+    char *path = cacheEntryPath(sourceHash);
+    char *temporary = malloc(strlen(path) + 8);
+    if (temporary == NULL) {
+        free(path);
+        free(image);
+        return;
+    }
+    sprintf(temporary, "%s.XXXXXX", path);
+    mkdir(options.cachePath, 0777);
+    int fd = mkstemp(temporary);
+    size_t written = 0;
+    if (fd >= 0) {
+        fchmod(fd, 0644);
+        while (written < layout.size) {
+            ssize_t count = write(fd, image + written, layout.size - written);
+            if (count <= 0) {
+                break;
+            }
+            written += (size_t)count;
+        }
+        if (close(fd) != 0 || written < layout.size || rename(temporary, path) != 0) {
+            unlink(temporary);
+            written = 0;
+        }
+    }
+    TRACE(TRACE_IO, TRACE_INFO, "%s %s", written > 0 ? "cached" : "cannot write", path);
+    free(temporary);
+    free(path);
+    free(image);
+}
+
+void compileLoadedSource();
+
+// Read, lex and parse `path`, then compile it unless --check. Errors go
+// through failCompilation().
+void compileSource(const char *path) {
+    // Read the file content into sourceCode ("-" reads standard input)
+    double start = nowSeconds();
+    readFile(path);
+    stats.readSeconds = nowSeconds() - start;
+    compileLoadedSource();
+}
+
+// Compile the source that readFile() or copySource() loaded
+void compileLoadedSource() {
+    double start;
+    if (options.dumpSource) {
+        printf("Source code read from file:\n%.*s\n", (int)sourceLength, sourceCode);
+    }
+
+    // A cached build of this exact source skips everything up to running it
+    uint64_t sourceHash = 0;
+    int cached = options.cachePath != NULL && !options.checkOnly && options.editsPath == NULL &&
+                 !options.dumpTokens && !options.dumpAst && options.profilePath == NULL;  // Images keep no lines
+    if (cached) {
+        start = nowSeconds();
+        sourceHash = hashBytes(0, sourceCode, sourceLength);
+        int loaded = loadCachedProgram(sourceHash);
+        stats.cacheSeconds = nowSeconds() - start;
+        if (loaded) {
+            if (options.dumpBytecode) {
+                printBytecode();
+            }
+            return;
+        }
+    }
+
+    // Lex the whole file once; the dump and the parser share the buffer.
+    // Large files are lexed and parsed in chunks on several threads. Edits
+    // start from the file as read, whether or not it parses.
+    if (options.editsPath != NULL) {
+        applyEditsFile(options.editsPath);
+    }
+    start = nowSeconds();
+    int parsed = document.active || parseInParallel();
+    if (!parsed) {
+        tokenize();
+        stats.lexSeconds = nowSeconds() - start;
+    }
+
+    if (options.dumpTokens && !document.active) {  // Edited tokens are not in source order
+        printf("TOKEN DUMP:\n");
+        for (size_t i = 0; i < tokens.count; i++) {
+            printToken(tokenAt(i));
+        }
+    }
+
+    if (!parsed) {
+        start = nowSeconds();
+        initAst(tokens.count / 2);
+        tokenIndex = 0;
+        currentToken = tokenAt(0);  // Initialize the first token
+        ast.root = parseGameProgram();
+        stats.parseSeconds = nowSeconds() - start;
+        stats.parseThreads = stats.parseChunks = 1;
+    }
+    stats.parseNodes = ast.count - 1;
+    stats.astBytes = (uint64_t)ast.count * sizeof(AstNode);
+    if (options.checkOnly && !options.batch) {
+        printf("Parsing completed successfully.\n");
+    }
+
+    if (options.dumpAst) {
+        printAst(ast.root, 0);
+    }
+
+    if (!options.checkOnly) {
+        start = nowSeconds();
+        compiler.tailCalls = !options.noTailCalls;
+        compiler.specialize = !options.noSpecialize;
+        if (options.profilePath != NULL && !document.active) {  // Edited token offsets are not source lines
+            indexLines();
+        }
+        bindFunctions();
+        checkReferences();
+        if (!options.noOptimize) {
+            // What the optimizer saved takes a compile of the tree as
+            // parsed, so it is only sized for --stats and the opt trace
+            int sized = options.printStats || (traceLevel >= TRACE_INFO && (traceMask & TRACE_OPT));
+            uint64_t unoptimizedWords = 0;
+            if (sized) {
+                compiler.memoize = 0;
+                compileProgram();
+                unoptimizedWords = programWords();
+                freeProgram();
+                bindFunctions();
+            }
+            optimizeProgram();
+            compiler.memoize = !options.noMemo;
+            compileProgram();
+            if (sized) {
+                stats.instructionsRemoved = unoptimizedWords - programWords();
+            }
+            TRACE(TRACE_OPT, TRACE_INFO, "removed %llu nodes and %llu instructions",
+                  (unsigned long long)stats.nodesRemoved, (unsigned long long)stats.instructionsRemoved);
+        } else {
+            compiler.memoize = !options.noMemo;
+            compileProgram();
+        }
+        if (compiler.specialize) {
+            inferTypes();
+        }
+        stats.compileSeconds = nowSeconds() - start;
+        stats.bytecodeWords = programWords();
+        countTypedOperations();
+
+        if (cached) {
+            start = nowSeconds();
+            storeCachedProgram(sourceHash);
+            stats.cacheSeconds += nowSeconds() - start;
+        }
+        if (options.dumpBytecode) {
+            printBytecode();
+        }
+    }
+}
+
+// Free everything the last compilation built, so the thread can start
+// another
+void resetCompilation() {
+    freeProgram();
+    freeResolver();
+    freeNameTable(&names);
+    freeExpressionStacks();
+    freeAst();
+    freeTokens();
+    closeSource();
+    free(spine.nodes);
+    memset(&spine, 0, sizeof(spine));
+    free(compiler.functionsByName);
+    free(compiler.lineStarts);
+    memset(&compiler, 0, sizeof(compiler));
+    freeSpans(0, document.spanCount);
+    free(document.spans);
+    memset(&document, 0, sizeof(document));
+    memset(&stats, 0, sizeof(stats));
+    memset(&currentToken, 0, sizeof(currentToken));
+    currentPos = 0;
+    tokenIndex = 0;
+}
+
+// Batch compilation. Inputs are expanded to a list of files, which worker
+// threads compile with work stealing: each worker starts with an even
+// slice and takes files from the back of its own queue, and once that is
+// empty it steals from the front of the fullest other queue. Diagnostics
+// are reported afterwards in input order.
+typedef struct {
+    char *path;
+    char *message;          // First error, NULL when the file compiled
+    uint64_t bytes;
+    uint64_t tokens;
+    uint64_t words;
+    uint64_t specialized;   // Arithmetic and comparisons left unchecked
+    uint64_t checked;
+} BatchFile;
+
+typedef struct {
+    pthread_mutex_t lock;
+    size_t head;            // Files [head, tail) are still to do
+    size_t tail;
+    uint64_t steals;        // Files this worker took from others
+} WorkQueue;
+
+typedef struct {
+    BatchFile *files;
+    uint32_t fileCount;
+    uint32_t fileCapacity;
+    WorkQueue *queues;
+    uint32_t workerCount;
+    double seconds;
+} Batch;
+
+Batch batch;
+
+void addBatchFile(const char *path) {
+    if (batch.fileCount == batch.fileCapacity) {
+        batch.files = growArray(batch.files, &batch.fileCapacity, sizeof(BatchFile), 64);
+    }
+    BatchFile *file = &batch.files[batch.fileCount++];
+    memset(file, 0, sizeof(*file));
+    file->path = strdup(path);
+    if (file->path == NULL) {
+        sourceOutOfMemory();
+    }
+}
+
+int comparePaths(const void *a, const void *b) {
+    return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+// Add `path`, or every .epic file below it when it is a directory, in
+// name order so reports do not depend on the file system
+void addBatchInput(const char *path) {
+    struct stat info;
+    DIR *directory;
+    if (stat(path, &info) != 0 || !S_ISDIR(info.st_mode) || (directory = opendir(path)) == NULL) {
+        addBatchFile(path);
+        return;
+    }
+    char **entries = NULL;
+    uint32_t count = 0, capacity = 0;
+    struct dirent *entry;
+    while ((entry = readdir(directory)) != NULL) {
+        const char *name = entry->d_name;
+        size_t length = strlen(name);
+        if (name[0] == '.') {
+            continue;
+        }
+        char *child = malloc(strlen(path) + length + 2);
+        if (child == NULL) {
+            sourceOutOfMemory();
+        }
+        sprintf(child, "%s/%s", path, name);
+        int isEpic = length > 5 && strcmp(name + length - 5, ".epic") == 0;
+        if (!isEpic && (stat(child, &info) != 0 || !S_ISDIR(info.st_mode))) {
+            free(child);
+            continue;
+        }
+        if (count == capacity) {
+            entries = growArray(entries, &capacity, sizeof(char *), 64);
+        }
+        entries[count++] = child;
+    }
+    closedir(directory);
+    qsort(entries, count, sizeof(char *), comparePaths);
+    for (uint32_t i = 0; i < count; i++) {
+        addBatchInput(entries[i]);
+        free(entries[i]);
+    }
+    free(entries);
+}
+
+void compileBatchFile(BatchFile *file) {
+    jmp_buf recover;
+    failure.recover = &recover;
+    if (setjmp(recover) == 0) {
+        compileSource(file->path);
+    } else {
+        file->message = strdup(failure.message);
+    }
+    failure.recover = NULL;
+    file->bytes = stats.bytesRead;
+    file->tokens = stats.tokens;
+    file->words = stats.bytecodeWords;
+    file->specialized = stats.specializedOperations;
+    file->checked = stats.checkedOperations;
+    resetCompilation();
+}
+
+int takeWork(uint32_t worker, size_t *next) {
+    WorkQueue *own = &batch.queues[worker];
+    pthread_mutex_lock(&own->lock);
+    int found = own->head < own->tail;
+    if (found) {
+        *next = --own->tail;
+    }
+    pthread_mutex_unlock(&own->lock);
+    if (found) {
+        return 1;
+    }
+    for (;;) {
+        // The fullest queue may have shrunk by the time it is locked
+        // again, in which case look for another
+        uint32_t victim = worker;
+        size_t most = 0;
+        for (uint32_t i = 0; i < batch.workerCount; i++) {
+            if (i == worker) {
+                continue;
+            }
+            pthread_mutex_lock(&batch.queues[i].lock);
+            size_t left = batch.queues[i].tail - batch.queues[i].head;
+            pthread_mutex_unlock(&batch.queues[i].lock);
+            if (left > most) {
+                victim = i;
+                most = left;
+            }
+        }
+        if (victim == worker) {
+            return 0;
+        }
+        WorkQueue *other = &batch.queues[victim];
+        pthread_mutex_lock(&other->lock);
+        found = other->head < other->tail;
+        if (found) {
+            *next = other->head++;
+        }
+        pthread_mutex_unlock(&other->lock);
+        if (found) {
+            own->steals++;
+            return 1;
+        }
+    }
+}
+
+void *batchWorker(void *argument) {
+    uint32_t worker = (uint32_t)(uintptr_t)argument;
+    size_t next;
+    while (takeWork(worker, &next)) {
+        compileBatchFile(&batch.files[next]);
+    }
+    return NULL;
+}
+
+void printBatchStats(FILE *out) {
+    uint64_t failed = 0, bytes = 0, tokenCount = 0, words = 0, steals = 0, specialized = 0, checked = 0;
+    for (uint32_t i = 0; i < batch.fileCount; i++) {
+        failed += batch.files[i].message != NULL;
+        bytes += batch.files[i].bytes;
+        tokenCount += batch.files[i].tokens;
+        words += batch.files[i].words;
+        specialized += batch.files[i].specialized;
+        checked += batch.files[i].checked;
+    }
+    for (uint32_t i = 0; i < batch.workerCount; i++) {
+        steals += batch.queues[i].steals;
+    }
+    fprintf(out, "{\"files\": %u, \"failed\": %llu, \"threads\": %u, \"steals\": %llu", batch.fileCount,
+            (unsigned long long)failed, batch.workerCount, (unsigned long long)steals);
+    fprintf(out, ", \"bytes_read\": %llu, \"tokens\": %llu, \"bytecode_words\": %llu", (unsigned long long)bytes,
+            (unsigned long long)tokenCount, (unsigned long long)words);
+    fprintf(out, ", \"specialized_operations\": %llu, \"checked_operations\": %llu", (unsigned long long)specialized,
+            (unsigned long long)checked);
+    fprintf(out, ", \"seconds\": %.6f, \"files_per_second\": %.1f, \"mb_per_second\": %.2f, \"tokens_per_second\": %.0f}\n",
+            batch.seconds, perSecond(batch.fileCount, batch.seconds), perSecond((double)bytes / 1e6, batch.seconds),
+            perSecond((double)tokenCount, batch.seconds));
+}
+
+// Compile every input; returns the number of files that failed
+uint32_t compileBatch() {
+    for (uint32_t i = 0; i < options.inputCount; i++) {
+        addBatchInput(options.inputs[i]);
+    }
+    // Compile only: dumps from many threads would interleave
+    options.dumpSource = options.dumpTokens = options.dumpAst = options.dumpBytecode = 0;
+    options.editsPath = NULL;  // Offsets belong to one file
+
+    uint32_t workers = jobCount();
+    if (workers > batch.fileCount) {
+        workers = batch.fileCount > 0 ? batch.fileCount : 1;
+    }
+    batch.workerCount = workers;
+    batch.queues = calloc(workers, sizeof(WorkQueue));
+    pthread_t *threads = malloc(workers * sizeof(pthread_t));
+    if (batch.queues == NULL || threads == NULL) {
+        sourceOutOfMemory();
+    }
+    for (uint32_t i = 0; i < workers; i++) {
+        pthread_mutex_init(&batch.queues[i].lock, NULL);
+        batch.queues[i].head = (size_t)batch.fileCount * i / workers;
+        batch.queues[i].tail = (size_t)batch.fileCount * (i + 1) / workers;
+    }
+
+    double start = nowSeconds();
+    uint32_t started = 1;
+    for (; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, batchWorker, (void *)(uintptr_t)started) != 0) {
+            break;  // The threads that did start steal the rest
+        }
+    }
+    batchWorker((void *)(uintptr_t)0);
+    for (uint32_t i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    batch.seconds = nowSeconds() - start;
+
+    uint32_t failed = 0;
+    uint64_t bytes = 0;
+    for (uint32_t i = 0; i < batch.fileCount; i++) {
+        if (batch.files[i].message != NULL) {
+            fprintf(stderr, "%s: %s\n", batch.files[i].path, batch.files[i].message);
+            failed++;
+        }
+        bytes += batch.files[i].bytes;
+    }
+    printf("Compiled %u files (%u failed) on %u threads in %.3fs: %.0f files/s, %.2f MB/s\n",
+           batch.fileCount, failed, workers, batch.seconds, perSecond(batch.fileCount, batch.seconds),
+           perSecond((double)bytes / 1e6, batch.seconds));
+    if (options.printStats) {
+        writeStats(printBatchStats);
+    }
+
+    for (uint32_t i = 0; i < workers; i++) {
+        pthread_mutex_destroy(&batch.queues[i].lock);
+    }
+    for (uint32_t i = 0; i < batch.fileCount; i++) {
+        free(batch.files[i].path);
+        free(batch.files[i].message);
+    }
+    free(batch.files);
+    free(batch.queues);
+    free(threads);
+    return failed;
+}
+
+// Fibers (--fibers=N). N copies of the input programs (fiber i runs input
+// i % count) run at once as green threads: each is a VM of its own, with
+// frames and a value stack that start small and grow, while the compiled
+// program is shared. Worker threads run fibers in slices. A slice ends
+// when the fiber's budget is spent (checked at calls and loop back-edges),
+// when main returns, or when input() finds no line yet, and the fiber
+// either goes to the back of its worker's run queue or waits for input.
+// Workers take fibers from the front of their own queue, so ready fibers
+// take turns, and an idle worker steals the longest-waiting fiber of the
+// fullest queue. A router thread reads stdin lines "ID text" and hands
+// "text" to fiber ID, waking it if it waits; at the end of stdin every
+// fiber's input() sees end of input as well.
+typedef enum {
+    FIBER_READY,
+    FIBER_RUNNING,
+    FIBER_WAITING,          // For a line of input
+    FIBER_FINISHED,
+    FIBER_FAILED
+} FiberState;
+
+const char *fiberStateNames[] = {"ready", "running", "waiting", "finished", "failed"};
+
+// A compiled input, kept while the compilation state moves on to the next
+typedef struct {
+    const char *path;
+    Program program;
+    NameTable names;
+    SourceBuffer source;
+} Script;
+
+// Take the program just compiled, its symbols and its source out of the
+// compilation state, which resetCompilation() can then clear
+void detachScript(Script *script) {
+    script->program = program;
+    script->names = names;
+    script->source = source;
+    memset(&program, 0, sizeof(program));
+    memset(&names, 0, sizeof(names));
+    memset(&source, 0, sizeof(source));
+}
+
+void freeScript(Script *script) {
+    program = script->program;
+    names = script->names;
+    source = script->source;
+    resetCompilation();
+}
+
+typedef struct {
+    uint32_t script;
+    FiberState state;
+    VM vm;                  // Empty until the first slice
+    InputBuffer input;      // Lines for input(); only the worker running the fiber touches it
+    InputBuffer inbox;      // Lines delivered since, under fiberRun.inputLock
+    int closed;             // No more lines will come
+    char *error;
+    uint64_t slices;
+    uint64_t budgetYields;
+    uint64_t inputWaits;
+    uint64_t instructions;  // Budget used: loop lengths and calls
+    double runSeconds;
+    double waitSeconds;     // Ready but not running
+    double longestWait;
+    double readySince;
+    size_t stackCapacity;   // Largest the VM grew to, in values
+    uint32_t frameCapacity;
+    size_t heapBytes;       // Most live heap seen at the end of a slice
+} Fiber;
+
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t *fibers;       // Ring of fiber indices, room for every fiber
+    uint32_t head;
+    uint32_t count;
+    uint64_t slices;
+    uint64_t steals;        // Fibers this worker took from others
+} RunQueue;
+
+typedef struct {
+    Script *scripts;
+    uint32_t scriptCount;
+    Fiber *fibers;
+    uint32_t fiberCount;
+    RunQueue *queues;
+    uint32_t workerCount;
+    uint32_t mask;          // Ring size - 1
+    uint32_t ready;         // Fibers in the queues
+    uint32_t sleeping;      // Workers waiting for one
+    uint32_t live;          // Fibers not finished or failed
+    uint32_t nextQueue;     // Where the router puts fibers it wakes
+    int done;               // The router must not touch the fibers any more
+    pthread_mutex_t idleLock;
+    pthread_cond_t wake;
+    pthread_mutex_t inputLock;
+    double seconds;
+} FiberRun;
+
+FiberRun fiberRun;
+
+void pushFiber(uint32_t queueIndex, uint32_t index) {
+    RunQueue *queue = &fiberRun.queues[queueIndex];
+    pthread_mutex_lock(&queue->lock);
+    queue->fibers[(queue->head + queue->count) & fiberRun.mask] = index;
+    __atomic_store_n(&queue->count, queue->count + 1, __ATOMIC_RELAXED);   // Thieves peek at it unlocked
+    pthread_mutex_unlock(&queue->lock);
+    // Pairs with the check in takeFiber: either the sleeper sees the new
+    // count or this sees the sleeper
+    __atomic_add_fetch(&fiberRun.ready, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&fiberRun.sleeping, __ATOMIC_SEQ_CST) > 0) {
+        pthread_mutex_lock(&fiberRun.idleLock);
+        pthread_cond_signal(&fiberRun.wake);
+        pthread_mutex_unlock(&fiberRun.idleLock);
+    }
+}
+
+int popFiber(RunQueue *queue, uint32_t *index) {
+    pthread_mutex_lock(&queue->lock);
+    int found = queue->count > 0;
+    if (found) {
+        *index = queue->fibers[queue->head];
+        queue->head = (queue->head + 1) & fiberRun.mask;
+        __atomic_store_n(&queue->count, queue->count - 1, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&fiberRun.ready, 1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
+
+// Next fiber for `worker`, waiting while none is ready; 0 once all are done
+int takeFiber(uint32_t worker, uint32_t *index) {
+    RunQueue *own = &fiberRun.queues[worker];
+    for (;;) {
+        if (popFiber(own, index)) {
+            return 1;
+        }
+        uint32_t victim = worker, most = 0;
+        for (uint32_t i = 0; i < fiberRun.workerCount; i++) {
+            uint32_t count = __atomic_load_n(&fiberRun.queues[i].count, __ATOMIC_RELAXED);
+            if (i != worker && count > most) {
+                victim = i;
+                most = count;
+            }
+        }
+        if (victim != worker) {
+            if (popFiber(&fiberRun.queues[victim], index)) {
+                own->steals++;
+                return 1;
+            }
+            continue;   // Emptied meanwhile; look again
+        }
+        flushOutput();
+        pthread_mutex_lock(&fiberRun.idleLock);
+        __atomic_add_fetch(&fiberRun.sleeping, 1, __ATOMIC_SEQ_CST);
+        while (__atomic_load_n(&fiberRun.ready, __ATOMIC_SEQ_CST) == 0 && fiberRun.live > 0) {
+            pthread_cond_wait(&fiberRun.wake, &fiberRun.idleLock);
+        }
+        __atomic_sub_fetch(&fiberRun.sleeping, 1, __ATOMIC_SEQ_CST);
+        int finished = fiberRun.live == 0;
+        pthread_mutex_unlock(&fiberRun.idleLock);
+        if (finished) {
+            return 0;
+        }
+    }
+}
+
+// Free what a fiber holds once it will not run again
+void retireFiber(Fiber *fiber, FiberState state) {
+    fiber->stackCapacity = (size_t)(vm.stackEnd - vm.stack);
+    fiber->frameCapacity = vm.frameCapacity;
+    freeVM();
+    free(input.data);
+    memset(&input, 0, sizeof(input));
+    pthread_mutex_lock(&fiberRun.inputLock);
+    fiber->state = state;
+    free(fiber->inbox.data);
+    memset(&fiber->inbox, 0, sizeof(fiber->inbox));
+    pthread_mutex_unlock(&fiberRun.inputLock);
+    pthread_mutex_lock(&fiberRun.idleLock);
+    if (--fiberRun.live == 0) {
+        pthread_cond_broadcast(&fiberRun.wake);
+    }
+    pthread_mutex_unlock(&fiberRun.idleLock);
+}
+
+// Run one slice of a fiber on this worker, then requeue, park or retire it
+void runSlice(uint32_t worker, uint32_t index) {
+    Fiber *fiber = &fiberRun.fibers[index];
+    Script *script = &fiberRun.scripts[fiber->script];
+    double start = nowSeconds();
+    double waited = start - fiber->readySince;
+    fiber->waitSeconds += waited;
+    if (waited > fiber->longestWait) {
+        fiber->longestWait = waited;
+    }
+
+    pthread_mutex_lock(&fiberRun.inputLock);
+    fiber->state = FIBER_RUNNING;
+    if (fiber->inbox.length > 0) {
+        appendInput(&fiber->input, fiber->inbox.data, fiber->inbox.length);
+        fiber->inbox.length = 0;
+    }
+    fiber->input.eof = fiber->closed;
+    pthread_mutex_unlock(&fiberRun.inputLock);
+
+    program = script->program;
+    names = script->names;
+    vm = fiber->vm;
+    input = fiber->input;
+    input.routed = 1;
+    Function *entry = NULL;
+    if (vm.stack == NULL) {
+        if (program.mainFunction < 0) {
+            retireFiber(fiber, FIBER_FINISHED);
+            return;
+        }
+        initVM(FIBER_STACK, FIBER_FRAMES);
+        entry = &program.functions[program.mainFunction];
+    }
+    vm.budget = (int64_t)options.budget;
+
+    jmp_buf recover;
+    RunStatus status = RUN_FINISHED;
+    int failed = 0;
+    failure.recover = &recover;
+    if (setjmp(recover) == 0) {
+        status = execute(entry);
+        fiber->instructions += options.budget - (uint64_t)vm.budget;
+    } else {
+        failed = 1;
+    }
+    failure.recover = NULL;
+
+    fiber->slices++;
+    fiberRun.queues[worker].slices++;
+    if (vm.bytesAllocated > fiber->heapBytes) {
+        fiber->heapBytes = vm.bytesAllocated;
+    }
+    double end = nowSeconds();
+    fiber->runSeconds += end - start;
+    if (failed) {
+        fiber->error = strdup(failure.message);
+        retireFiber(fiber, FIBER_FAILED);
+        return;
+    }
+    if (status == RUN_FINISHED) {
+        retireFiber(fiber, FIBER_FINISHED);
+        return;
+    }
+    // Another worker may run the next slice, so what this one printed goes
+    // out first. Finished fibers' output can wait for the buffer to fill.
+    flushOutput();
+    fiber->vm = vm;
+    fiber->input = input;
+    fiber->readySince = end;
+    // Out of input, wait unless a line (or the end) arrived meanwhile
+    int wait = 0;
+    if (status == RUN_BUDGET) {
+        fiber->budgetYields++;
+    } else {
+        fiber->inputWaits++;
+    }
+    pthread_mutex_lock(&fiberRun.inputLock);
+    if (status == RUN_INPUT) {
+        wait = fiber->inbox.length == 0 && !fiber->closed;
+    }
+    fiber->state = wait ? FIBER_WAITING : FIBER_READY;
+    pthread_mutex_unlock(&fiberRun.inputLock);
+    if (!wait) {
+        pushFiber(worker, index);
+    }
+}
+
+void *fiberWorker(void *argument) {
+    uint32_t worker = (uint32_t)(uintptr_t)argument;
+    output.capacity = options.outputBuffer;
+    output.lineBuffered = options.lineBuffered || isatty(STDOUT_FILENO);
+    output.wholeLines = 1;
+    uint32_t index;
+    while (takeFiber(worker, &index)) {
+        runSlice(worker, index);
+    }
+    flushOutput();
+    free(output.data);
+    output.data = NULL;
+    output.allocated = 0;
+    memset(&program, 0, sizeof(program));
+    memset(&names, 0, sizeof(names));
+    return NULL;
+}
+
+// Hand `length` bytes of input to a fiber (or, with `close`, end its
+// input), waking it if it waits
+void deliverInput(uint32_t index, const char *text, size_t length, int close) {
+    Fiber *fiber = &fiberRun.fibers[index];
+    int wake = 0;
+    uint32_t queue = 0;
+    pthread_mutex_lock(&fiberRun.inputLock);
+    if (!fiberRun.done && fiber->state != FIBER_FINISHED && fiber->state != FIBER_FAILED) {
+        if (close) {
+            fiber->closed = 1;
+        } else {
+            appendInput(&fiber->inbox, text, length);
+        }
+        if (fiber->state == FIBER_WAITING) {
+            fiber->state = FIBER_READY;
+            fiber->readySince = nowSeconds();
+            queue = fiberRun.nextQueue++ % fiberRun.workerCount;
+            wake = 1;
+        }
+    }
+    pthread_mutex_unlock(&fiberRun.inputLock);
+    if (wake) {
+        pushFiber(queue, index);
+    }
+}
+
+void *routeFiberInput(void *argument) {
+    (void)argument;
+    char *line = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&line, &capacity, stdin)) >= 0) {
+        char *text;
+        errno = 0;
+        unsigned long index = strtoul(line, &text, 10);
+        if (text == line || errno != 0 || index >= fiberRun.fiberCount || (*text != ' ' && *text != '\n')) {
+            fprintf(stderr, "Input for no fiber: %.*s\n", (int)strcspn(line, "\n"), line);
+            continue;
+        }
+        if (*text == ' ') {
+            text++;
+        }
+        if (line[length - 1] != '\n') {
+            line[length++] = '\n';  // getline leaves room for the NUL this replaces
+        }
+        deliverInput((uint32_t)index, text, (size_t)(line + length - text), 0);
+    }
+    free(line);
+    for (uint32_t i = 0; i < fiberRun.fiberCount; i++) {
+        deliverInput(i, NULL, 0, 1);
+    }
+    return NULL;
+}
+
+void printFiberStats(FILE *out) {
+    uint64_t failed = 0, slices = 0, budgetYields = 0, inputWaits = 0, instructions = 0, steals = 0;
+    double waitSeconds = 0, longestWait = 0;
+    for (uint32_t i = 0; i < fiberRun.fiberCount; i++) {
+        Fiber *fiber = &fiberRun.fibers[i];
+        failed += fiber->state == FIBER_FAILED;
+        slices += fiber->slices;
+        budgetYields += fiber->budgetYields;
+        inputWaits += fiber->inputWaits;
+        instructions += fiber->instructions;
+        waitSeconds += fiber->waitSeconds;
+        if (fiber->longestWait > longestWait) {
+            longestWait = fiber->longestWait;
+        }
+    }
+    for (uint32_t i = 0; i < fiberRun.workerCount; i++) {
+        steals += fiberRun.queues[i].steals;
+    }
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    fprintf(out, "{\"fibers\": %u, \"scripts\": %u, \"failed\": %llu, \"threads\": %u, \"budget\": %llu",
+            fiberRun.fiberCount, fiberRun.scriptCount, (unsigned long long)failed, fiberRun.workerCount,
+            (unsigned long long)options.budget);
+    fprintf(out, ", \"slices\": %llu, \"budget_yields\": %llu, \"input_waits\": %llu, \"steals\": %llu",
+            (unsigned long long)slices, (unsigned long long)budgetYields, (unsigned long long)inputWaits,
+            (unsigned long long)steals);
+    fprintf(out, ", \"instructions\": %llu, \"mean_wait_seconds\": %.6f, \"longest_wait_seconds\": %.6f",
+            (unsigned long long)instructions, slices > 0 ? waitSeconds / (double)slices : 0.0, longestWait);
+    fprintf(out, ", \"seconds\": %.6f, \"slices_per_second\": %.0f, \"peak_rss_kb\": %ld}\n", fiberRun.seconds,
+            perSecond((double)slices, fiberRun.seconds), usage.ru_maxrss);
+}
+
+void writeFiberStats(const char *path) {
+    FILE *out = fopen(path, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Error opening fiber stats file: %s\n", path);
+        return;
+    }
+    for (uint32_t i = 0; i < fiberRun.fiberCount; i++) {
+        Fiber *fiber = &fiberRun.fibers[i];
+        fprintf(out, "{\"fiber\": %u, \"script\": ", i);
+        printJsonString(out, fiberRun.scripts[fiber->script].path);
+        fprintf(out, ", \"state\": \"%s\", \"slices\": %llu, \"budget_yields\": %llu, \"input_waits\": %llu",
+                fiberStateNames[fiber->state], (unsigned long long)fiber->slices,
+                (unsigned long long)fiber->budgetYields, (unsigned long long)fiber->inputWaits);
+        fprintf(out, ", \"instructions\": %llu, \"run_seconds\": %.6f, \"wait_seconds\": %.6f",
+                (unsigned long long)fiber->instructions, fiber->runSeconds, fiber->waitSeconds);
+        fprintf(out, ", \"longest_wait_seconds\": %.6f, \"stack_values\": %zu, \"frames\": %u, \"heap_bytes\": %zu",
+                fiber->longestWait, fiber->stackCapacity, fiber->frameCapacity, fiber->heapBytes);
+        if (fiber->error != NULL) {
+            fprintf(out, ", \"error\": ");
+            printJsonString(out, fiber->error);
+        }
+        fprintf(out, "}\n");
+    }
+    fclose(out);
+}
+
+// Compile every input once, run the fibers to the end; returns how many failed
+uint32_t runFibers() {
+    if (options.profilePath != NULL) {
+        fprintf(stderr, "--profile cannot be combined with --fibers\n");
+        exit(EXIT_FAILURE);
+    }
+    // Result caches are per VM and too large to give every fiber
+    options.noMemo = 1;
+    if (options.inputCount == 0) {
+        addBatchInput(options.inputPath);
+    }
+    for (uint32_t i = 0; i < options.inputCount; i++) {
+        addBatchInput(options.inputs[i]);
+    }
+    fiberRun.scriptCount = batch.fileCount;
+    fiberRun.scripts = calloc(batch.fileCount, sizeof(Script));
+    if (fiberRun.scripts == NULL) {
+        sourceOutOfMemory();
+    }
+    for (uint32_t i = 0; i < batch.fileCount; i++) {
+        Script *script = &fiberRun.scripts[i];
+        script->path = batch.files[i].path;
+        compileSource(script->path);
+        detachScript(script);
+        resetCompilation();
+    }
+
+    uint32_t count = options.fibers;
+    uint32_t workers = jobCount() < count ? jobCount() : count;
+    uint32_t ring = 1;
+    while (ring < count) {
+        ring *= 2;
+    }
+    fiberRun.fibers = calloc(count, sizeof(Fiber));
+    fiberRun.queues = calloc(workers, sizeof(RunQueue));
+    pthread_t *threads = malloc((workers + 1) * sizeof(pthread_t));
+    if (fiberRun.fibers == NULL || fiberRun.queues == NULL || threads == NULL) {
+        sourceOutOfMemory();
+    }
+    fiberRun.fiberCount = fiberRun.live = count;
+    fiberRun.workerCount = workers;
+    fiberRun.mask = ring - 1;
+    pthread_mutex_init(&fiberRun.idleLock, NULL);
+    pthread_mutex_init(&fiberRun.inputLock, NULL);
+    pthread_cond_init(&fiberRun.wake, NULL);
+    double start = nowSeconds();
+    for (uint32_t i = 0; i < workers; i++) {
+        RunQueue *queue = &fiberRun.queues[i];
+        pthread_mutex_init(&queue->lock, NULL);
+        queue->fibers = malloc(ring * sizeof(uint32_t));
+        if (queue->fibers == NULL) {
+            sourceOutOfMemory();
+        }
+        // An even share each, in order, to start with
+        for (uint32_t f = (uint32_t)((uint64_t)count * i / workers); f < (uint64_t)count * (i + 1) / workers; f++) {
+            fiberRun.fibers[f].script = f % fiberRun.scriptCount;
+            fiberRun.fibers[f].readySince = start;
+            queue->fibers[queue->count++] = f;
+        }
+        fiberRun.ready += queue->count;
+    }
+
+    // Shared tables are filled before any fiber can race to fill them
+    selectSumInts();
+    internAllStrings();
+    pthread_t router;
+    if (pthread_create(&router, NULL, routeFiberInput, NULL) != 0) {
+        fprintf(stderr, "Cannot start the input thread\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(router);     // Blocked in read until stdin ends, which need never happen
+    uint32_t started = 1;
+    for (; started < workers; started++) {
+        if (pthread_create(&threads[started], NULL, fiberWorker, (void *)(uintptr_t)started) != 0) {
+            break;  // The threads that did start steal the rest
+        }
+    }
+    fiberWorker((void *)(uintptr_t)0);
+    for (uint32_t i = 1; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    fiberRun.seconds = nowSeconds() - start;
+    pthread_mutex_lock(&fiberRun.inputLock);
+    fiberRun.done = 1;
+    pthread_mutex_unlock(&fiberRun.inputLock);
+
+    uint32_t failed = 0;
+    uint64_t slices = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        Fiber *fiber = &fiberRun.fibers[i];
+        if (fiber->error != NULL) {
+            fprintf(stderr, "Fiber %u (%s): Runtime Error: %s\n", i, fiberRun.scripts[fiber->script].path,
+                    fiber->error);
+            failed++;
+        }
+        slices += fiber->slices;
+    }
+    fprintf(stderr, "Ran %u fibers (%u failed) on %u threads in %.3fs: %llu slices, %.0f slices/s\n", count,
+            failed, workers, fiberRun.seconds, (unsigned long long)slices,
+            perSecond((double)slices, fiberRun.seconds));
+    if (options.printStats) {
+        writeStats(printFiberStats);
+    }
+    if (options.fiberStatsPath != NULL) {
+        writeFiberStats(options.fiberStatsPath);
+    }
+
+    for (uint32_t i = 0; i < count; i++) {
+        free(fiberRun.fibers[i].error);
+    }
+    for (uint32_t i = 0; i < workers; i++) {
+        pthread_mutex_destroy(&fiberRun.queues[i].lock);
+        free(fiberRun.queues[i].fibers);
+    }
+    for (uint32_t i = 0; i < fiberRun.scriptCount; i++) {
+        freeScript(&fiberRun.scripts[i]);
+    }
+    freeInternedStrings();
+    for (uint32_t i = 0; i < batch.fileCount; i++) {
+        free(batch.files[i].path);
+    }
+    free(batch.files);
+    free(fiberRun.scripts);
+    free(fiberRun.fibers);
+    free(fiberRun.queues);
+    free(threads);
+    return failed;
+}
+
+// Embedding (epic.h; build with -DEPIC_LIBRARY). A program keeps its
+// compiled script, which variable each action parameter binds to, and the
+// values main left in its top-level variables. Those values are frozen:
+// marked for good and never appended to in place, so every instance set
+// shares them as it shares constants. An instance set is a VM and a table
+// of values stored by variable: variable v of instance i is at
+// values[v * count + i], and the results follow the last variable. The
+// table is the VM's root set, and a batch swaps the VM in once for all its
+// instances.
+struct EpicProgram {
+    Script script;
+    uint32_t variableCount;
+    uint32_t *variableNames;    // Symbol of each variable
+    uint32_t *variableSlots;    // Its slot in main
+    Value *initial;             // What main left in each
+    Object *objects;            // Frozen objects, reachable from `initial`
+    uint32_t *bindings;         // Variable of each action parameter, UINT32_MAX if none
+    uint32_t *bindingStart;     // Per function, its first binding
+};
+
+struct EpicInstances {
+    const EpicProgram *program;
+    uint32_t count;
+    VM vm;
+    Value *values;
+    char **errors;              // Per instance, allocated at the first error
+};
+
+pthread_once_t embeddingReady = PTHREAD_ONCE_INIT;
+
+// Shared tables, filled once before any thread compiles or runs
+void initEmbedding() {
+    initLexer();
+    selectSumInts();
+    internAllStrings();
+}
+
+// Collect main's top-level variables and bind each action parameter to
+// the one of the same name, while the syntax tree is still there
+void bindVariables(EpicProgram *result) {
+    uint32_t capacity = 0;
+    if (program.mainFunction >= 0) {
+        uint32_t statement = NODE(program.functions[program.mainFunction].declaration).b;
+        for (; statement != 0; statement = NODE(statement).next) {
+            AstNode *node = &NODE(statement);
+            if (node->kind != AST_VAR_DECL && node->kind != AST_ARRAY_DECL) {
+                continue;
+            }
+            uint32_t name = internToken(node->token);
+            uint32_t slot = node->kind == AST_ARRAY_DECL ? node->c : node->b;
+            uint32_t variable = 0;
+            while (variable < result->variableCount && result->variableNames[variable] != name) {
+                variable++;
+            }
+            if (variable == result->variableCount) {
+                if (result->variableCount == capacity) {
+                    uint32_t grown = capacity;
+                    result->variableNames = growArray(result->variableNames, &grown, sizeof(uint32_t), 16);
+                    result->variableSlots = growArray(result->variableSlots, &capacity, sizeof(uint32_t), 16);
+                }
+                result->variableNames[result->variableCount++] = name;
+            }
+            result->variableSlots[variable] = slot;
+        }
+    }
+
+    uint32_t parameters = 0;
+    for (uint32_t i = 0; i < program.functionCount; i++) {
+        parameters += program.functions[i].arity;
+    }
+    result->bindings = malloc(((size_t)parameters + 1) * sizeof(uint32_t));
+    result->bindingStart = malloc(((size_t)program.functionCount + 1) * sizeof(uint32_t));
+    if (result->bindings == NULL || result->bindingStart == NULL) {
+        sourceOutOfMemory();
+    }
+    uint32_t next = 0;
+    for (uint32_t i = 0; i < program.functionCount; i++) {
+        result->bindingStart[i] = next;
+        if ((int32_t)i == program.mainFunction) {
+            continue;
+        }
+        for (uint32_t parameter = NODE(program.functions[i].declaration).a; parameter != 0;
+             parameter = NODE(parameter).next) {
+            uint32_t name = internToken(NODE(parameter).token);
+            uint32_t variable = 0;
+            while (variable < result->variableCount && result->variableNames[variable] != name) {
+                variable++;
+            }
+            result->bindings[next++] = variable < result->variableCount ? variable : UINT32_MAX;
+        }
+    }
+    result->bindingStart[program.functionCount] = next;
+}
+
+// Run main in a VM of its own and keep what it leaves in the variables
+void runMain(EpicProgram *result) {
+    result->initial = calloc(result->variableCount + 1, sizeof(Value));
+    if (result->initial == NULL) {
+        sourceOutOfMemory();
+    }
+    if (program.mainFunction < 0) {
+        return;
+    }
+    Function *main = &program.functions[program.mainFunction];
+    execute(main);
+    if (vm.frames[0].function == main) {    // Else main ended in a tail call, and its slots are gone
+        for (uint32_t i = 0; i < result->variableCount; i++) {
+            result->initial[i] = vm.stack[result->variableSlots[i]];
+        }
+    }
+    vm.stackTop = vm.stack;
+    vm.roots = result->initial;
+    vm.rootCount = result->variableCount;
+    collectGarbage();
+    for (Object *object = vm.objects; object != NULL; object = object->nextObject) {
+        object->marked = 1;
+        if (object->type == OBJ_STRING && ((String *)object)->owner == (String *)object) {
+            ((String *)object)->used = ((String *)object)->capacity;
+        }
+    }
+    result->objects = vm.objects;
+    vm.objects = NULL;
+}
+
+void freeEpicProgram(EpicProgram *result) {
+    Object *object = result->objects;
+    while (object != NULL) {
+        Object *next = object->nextObject;
+        freeObject(object);
+        object = next;
+    }
+    freeScript(&result->script);
+    free(result->variableNames);
+    free(result->variableSlots);
+    free(result->initial);
+    free(result->bindings);
+    free(result->bindingStart);
+    free(result);
+}
+
+EpicProgram *epicCompile(const char *text, size_t length, char *error, size_t errorSize) {
+    pthread_once(&embeddingReady, initEmbedding);
+    EpicProgram *result = calloc(1, sizeof(EpicProgram));
+    jmp_buf recover;
+    volatile int compiled = 0;
+    failure.recover = &recover;
+    if (result == NULL) {
+        snprintf(failure.message, sizeof(failure.message), "Memory allocation error!");
+    } else if (setjmp(recover) == 0) {
+        copySource(text, length);
+        compiler.hostCalls = 1;
+        compileLoadedSource();
+        bindVariables(result);
+        detachScript(&result->script);
+        resetCompilation();
+        compiled = 1;
+        program = result->script.program;
+        names = result->script.names;
+        initVM(VM_INITIAL_STACK, VM_INITIAL_FRAMES);
+        input.routed = input.eof = 1;
+        runMain(result);
+        flushOutput();
+        freeVM();
+        memset(&program, 0, sizeof(program));
+        memset(&names, 0, sizeof(names));
+        failure.recover = NULL;
+        return result;
+    }
+    failure.recover = NULL;
+    if (error != NULL && errorSize > 0) {
+        snprintf(error, errorSize, "%s", failure.message);
+    }
+    if (result != NULL) {
+        if (compiled) {     // main failed; the script is already detached
+            flushOutput();
+            freeVM();
+            memset(&program, 0, sizeof(program));
+            memset(&names, 0, sizeof(names));
+        } else {
+            detachScript(&result->script);
+        }
+        freeEpicProgram(result);
+    }
+    return NULL;
+}
+
+void epicFreeProgram(EpicProgram *program) {
+    if (program != NULL) {
+        freeEpicProgram(program);
+    }
+}
+
+int32_t epicFindAction(const EpicProgram *owner, const char *name) {
+    const Program *compiled = &owner->script.program;
+    for (uint32_t i = 0; i < compiled->functionCount; i++) {
+        uint32_t symbol = compiled->functions[i].name;
+        if ((int32_t)i != compiled->mainFunction &&
+            lexemeEquals(owner->script.names.text[symbol], owner->script.names.lengths[symbol], name)) {
+            return (int32_t)i;
+        }
+    }
+    return -1;
+}
+
+int32_t epicFindVariable(const EpicProgram *owner, const char *name) {
+    for (uint32_t i = 0; i < owner->variableCount; i++) {
+        uint32_t symbol = owner->variableNames[i];
+        if (lexemeEquals(owner->script.names.text[symbol], owner->script.names.lengths[symbol], name)) {
+            return (int32_t)i;
+        }
+    }
+    return -1;
+}
+
+uint32_t epicVariableCount(const EpicProgram *owner) {
+    return owner->variableCount;
+}
+
+// Make an instance set's VM and program the thread's own until
+// leaveInstances()
+void enterInstances(const EpicInstances *instances) {
+    program = instances->program->script.program;
+    names = instances->program->script.names;
+    vm = instances->vm;
+    input.routed = input.eof = 1;   // Nothing to read: input() sees the end
+}
+
+void leaveInstances(EpicInstances *instances) {
+    flushOutput();
+    instances->vm = vm;
+    memset(&vm, 0, sizeof(vm));
+    memset(&program, 0, sizeof(program));
+    memset(&names, 0, sizeof(names));
+}
+
+EpicInstances *epicCreateInstances(const EpicProgram *owner, uint32_t count) {
+    EpicInstances *instances = calloc(1, sizeof(EpicInstances));
+    size_t columns = (size_t)owner->variableCount + 1;
+    Value *values = malloc(columns * (count > 0 ? count : 1) * sizeof(Value));
+    if (instances == NULL || values == NULL) {
+        free(instances);
+        free(values);
+        return NULL;
+    }
+    for (size_t column = 0; column < columns; column++) {
+        for (uint32_t i = 0; i < count; i++) {
+            values[column * count + i] = owner->initial[column];
+        }
+    }
+    instances->program = owner;
+    instances->count = count;
+    instances->values = values;
+    enterInstances(instances);
+    initVM(VM_INITIAL_STACK, VM_INITIAL_FRAMES);
+    vm.roots = values;
+    vm.rootCount = columns * count;
+    leaveInstances(instances);
+    return instances;
+}
+
+void epicFreeInstances(EpicInstances *instances) {
+    if (instances == NULL) {
+        return;
+    }
+    enterInstances(instances);
+    freeVM();
+    leaveInstances(instances);
+    for (uint32_t i = 0; instances->errors != NULL && i < instances->count; i++) {
+        free(instances->errors[i]);
+    }
+    free(instances->errors);
+    free(instances->values);
+    free(instances);
+}
+
+// An instance's call failed: keep the message, drop its frames
+void failInstance(EpicInstances *instances, uint32_t instance) {
+    if (!vm.heapExhausted) {
+        if (instances->errors == NULL) {
+            instances->errors = calloc(instances->count, sizeof(char *));
+        }
+        if (instances->errors != NULL) {
+            free(instances->errors[instance]);
+            instances->errors[instance] = strdup(failure.message);
+        }
+    }
+    vm.stackTop = vm.stack;
+    vm.frameCount = 0;
+}
+
+int64_t epicRunBatch(EpicInstances *instances, int32_t action, uint32_t first, uint32_t count,
+                     const EpicBudget *budget, EpicStatus *statuses) {
+    const EpicProgram *owner = instances->program;
+    const Program *compiled = &owner->script.program;
+    if (action < 0 || (uint32_t)action >= compiled->functionCount || action == compiled->mainFunction ||
+        first > instances->count || count > instances->count - first) {
+        return -1;
+    }
+    const uint32_t *bindings = &owner->bindings[owner->bindingStart[action]];
+    Function *function = &compiled->functions[action];
+    uint32_t arity = function->arity;
+    for (uint32_t p = 0; p < arity; p++) {
+        if (bindings[p] == UINT32_MAX) {
+            return -1;
+        }
+    }
+    uint64_t instructionLimit = budget != NULL ? budget->instructions : 0;
+    int64_t instructions = instructionLimit > 0 && instructionLimit < INT64_MAX ? (int64_t)instructionLimit : INT64_MAX;
+    size_t heapBytes = budget != NULL ? budget->heapBytes : 0;
+
+    enterInstances(instances);
+    uint32_t n = instances->count;
+    Value *values = instances->values;
+    Value *results = values + (size_t)owner->variableCount * n;
+    // One recovery point for the whole batch: an instance's runtime error
+    // lands here and the loop goes on with the next
+    jmp_buf recover;
+    volatile uint32_t current = first;
+    volatile int64_t failed = 0;
+    failure.recover = &recover;
+    if (setjmp(recover) != 0) {
+        if (statuses != NULL) {
+            statuses[current - first] = vm.heapExhausted ? EPIC_OUT_OF_MEMORY : EPIC_FAILED;
+        }
+        failInstance(instances, current);
+        failed = failed + 1;
+        current = current + 1;
+    }
+    for (uint32_t i = current; i < first + count; i++) {
+        current = i;
+        for (uint32_t p = 0; p < arity; p++) {
+            vm.stack[p] = values[(size_t)bindings[p] * n + i];
+        }
+        vm.stackTop = vm.stack + arity;
+        vm.budget = instructions;
+        vm.heapLimit = heapBytes > 0 && heapBytes < SIZE_MAX - vm.bytesAllocated ? vm.bytesAllocated + heapBytes
+                                                                                 : SIZE_MAX;
+        vm.heapExhausted = 0;
+        EpicStatus status = EPIC_OUT_OF_INSTRUCTIONS;
+        if (execute(function) == RUN_FINISHED) {
+            if (vm.frames[0].function == function) {
+                for (uint32_t p = 0; p < arity; p++) {
+                    values[(size_t)bindings[p] * n + i] = vm.stack[p];
+                }
+            }
+            results[i] = vm.result;
+            status = EPIC_OK;
+        } else {
+            failed = failed + 1;
+        }
+        vm.stackTop = vm.stack;
+        vm.frameCount = 0;
+        if (statuses != NULL) {
+            statuses[i - first] = status;
+        }
+    }
+    failure.recover = NULL;
+    vm.heapLimit = SIZE_MAX;
+    leaveInstances(instances);
+    return (int64_t)count - failed;
+}
+
+const char *epicInstanceError(const EpicInstances *instances, uint32_t instance) {
+    if (instances->errors == NULL || instance >= instances->count) {
+        return NULL;
+    }
+    return instances->errors[instance];
+}
+
+// An instance variable (or EPIC_RESULT), NULL when out of range
+Value *instanceValue(const EpicInstances *instances, int32_t variable, uint32_t instance) {
+    uint32_t column = variable == EPIC_RESULT ? instances->program->variableCount : (uint32_t)variable;
+    if (variable < EPIC_RESULT || column > instances->program->variableCount || instance >= instances->count) {
+        return NULL;
+    }
+    return &instances->values[(size_t)column * instances->count + instance];
+}
+
+EpicType epicGetType(const EpicInstances *instances, int32_t variable, uint32_t instance) {
+    Value *value = instanceValue(instances, variable, instance);
+    return value != NULL ? (EpicType)value->type : EPIC_TYPE_NIL;
+}
+
+int64_t epicGetInt(const EpicInstances *instances, int32_t variable, uint32_t instance) {
+    Value *value = instanceValue(instances, variable, instance);
+    return value != NULL && value->type == VAL_INT ? value->as.i : 0;
+}
+
+double epicGetNumber(const EpicInstances *instances, int32_t variable, uint32_t instance) {
+    Value *value = instanceValue(instances, variable, instance);
+    return value != NULL && IS_NUMBER(*value) ? AS_NUMBER(*value) : 0;
+}
+
+const char *epicGetString(const EpicInstances *instances, int32_t variable, uint32_t instance, size_t *length) {
+    Value *value = instanceValue(instances, variable, instance);
+    if (value == NULL || value->type != VAL_STRING) {
+        *length = 0;
+        return NULL;
+    }
+    *length = AS_STRING(*value)->length;
+    return AS_STRING(*value)->chars;
+}
+
+void epicSetInt(EpicInstances *instances, int32_t variable, uint32_t instance, int64_t number) {
+    Value *value = instanceValue(instances, variable, instance);
+    if (value != NULL) {
+        *value = INT_VALUE(number);
+    }
+}
+
+void epicSetNumber(EpicInstances *instances, int32_t variable, uint32_t instance, double number) {
+    Value *value = instanceValue(instances, variable, instance);
+    if (value != NULL) {
+        *value = DOUBLE_VALUE(number);
+    }
+}
+
+void epicSetString(EpicInstances *instances, int32_t variable, uint32_t instance, const char *text, size_t length) {
+    Value *value = instanceValue(instances, variable, instance);
+    if (value == NULL || length > UINT32_MAX) {
+        return;
+    }
+    enterInstances(instances);
+    *value = OBJECT_VALUE(VAL_STRING, newString(text, length));
+    leaveInstances(instances);
+}
+
+#ifndef EPIC_LIBRARY
+int main(int argc, char **argv) {
+    parseCommandLine(argc, argv);
+    initLexer();
+    if (options.fibers > 0 && !options.checkOnly) {
+        uint32_t failed = runFibers();
+        free(options.inputs);
+        return failed > 0 ? EXIT_FAILURE : 0;
+    }
+    if (options.batch) {
+        uint32_t failed = compileBatch();
+        free(options.inputs);
+        return failed > 0 ? EXIT_FAILURE : 0;
+    }
+
+    compileSource(options.inputPath);
+    if (!options.checkOnly) {
+        if (options.emitCPath != NULL) {
+            writeCProgram();
+        } else {
+            double start = nowSeconds();
+            jit.enabled = !options.noJit;
+            jit.dump = options.dumpJit;
+            output.capacity = options.outputBuffer;
+            output.lineBuffered = options.lineBuffered || isatty(STDOUT_FILENO);
+            runProgram(options.profilePath);
+            stats.executeSeconds = nowSeconds() - start;
+        }
+    }
+
+    if (options.printStats) {
+        writeStats(printStats);
+    }
+    resetCompilation();
+    free(options.inputs);
+    return 0;
+}
+#endif
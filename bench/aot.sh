@@ -0,0 +1,39 @@
+#!/bin/sh
+# Compare the bytecode interpreter with native builds from --emit-c.
+# Usage: bench/aot.sh [workload.epic ...]   (default: every bench/*.epic)
+# CC and CFLAGS select the C compiler used for both the compiler and the
+# generated programs. Memoization is off so calls are measured, not cached.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-bench.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+$CC $CFLAGS -pthread "$root/EpicCompiler.c" -o "$out/EpicCompiler"
+
+seconds() {
+    start=$(date +%s.%N)
+    "$@" > "$out/output" 2>&1
+    end=$(date +%s.%N)
+    echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }'
+}
+
+[ $# -gt 0 ] || set -- "$here"/*.epic
+printf '%-16s %12s %12s %9s\n' workload interpreter native speedup
+for workload in "$@"; do
+    name=$(basename "$workload" .epic)
+    "$out/EpicCompiler" --no-memo --emit-c="$out/$name.c" "$workload"
+    $CC $CFLAGS -I"$root" "$out/$name.c" -o "$out/$name"
+
+    interpreted=$(seconds "$out/EpicCompiler" --no-memo "$workload" < /dev/null)
+    cp "$out/output" "$out/expected"
+    native=$(seconds "$out/$name" < /dev/null)
+    if ! cmp -s "$out/output" "$out/expected"; then
+        echo "$name: native output differs from the interpreter" >&2
+        exit 1
+    fi
+    echo "$name $interpreted $native" | awk '{ printf "%-16s %11.3fs %11.3fs %8.1fx\n", $1, $2, $3, ($3 > 0 ? $2 / $3 : 0) }'
+done
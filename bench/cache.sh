@@ -0,0 +1,55 @@
+#!/bin/sh
+# Startup time with the compiled program cache (--cache): each run compiles
+# and starts a program whose main returns at once, so the time is all
+# reading, lexing, parsing and compiling, or loading the cached build.
+# Cold runs start with an empty cache and write an entry; warm runs map it.
+# Usage: bench/cache.sh [actions] [runs]   (default 10000, about 1 MB, and 20)
+# CC and CFLAGS select the C compiler used to build the compiler.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-cache.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+actions=${1:-10000}
+runs=${2:-20}
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+$CC $CFLAGS -pthread "$root/EpicCompiler.c" -o "$out/EpicCompiler"
+
+awk -v actions="$actions" 'BEGIN {
+    for (i = 0; i < actions; i++) {
+        printf "action f%d(a, b) {\n    var x = a + b * %d;\n", i, i % 10
+        printf "    if (x > 100) { return \"big \" + f%d(a - 1, b); }\n    return x + %d;\n}\n", (i + 1) % actions, i % 13
+    }
+    printf "main {\n    var unused = 0;\n}\n"
+}' > "$out/program.epic"
+
+# Average milliseconds per run of the compiler with the given options
+startup() {
+    start=$(date +%s.%N)
+    i=0
+    while [ $i -lt $runs ]; do
+        if [ "$1" = cold ]; then
+            rm -rf "$out/cache"
+        fi
+        if [ "$1" = none ]; then
+            "$out/EpicCompiler" "$out/program.epic" > /dev/null
+        else
+            "$out/EpicCompiler" --cache="$out/cache" "$out/program.epic" > /dev/null
+        fi
+        i=$((i + 1))
+    done
+    end=$(date +%s.%N)
+    echo "$start $end $runs" | awk '{ printf "%.2f", ($2 - $1) / $3 * 1000 }'
+}
+
+none=$(startup none)
+cold=$(startup cold)
+warm=$(startup warm)
+"$out/EpicCompiler" --cache="$out/cache" --stats="$out/stats.json" "$out/program.epic" > /dev/null
+
+printf '%s bytes of source, %s byte cache entry (%s)\n' "$(wc -c < "$out/program.epic" | tr -d ' ')" \
+    "$(cat "$out/cache"/*.epicc | wc -c | tr -d ' ')" "$(sed -n 's/.*"cache": "\([a-z]*\)".*/\1/p' "$out/stats.json")"
+echo "$none $cold $warm" | awk '{ printf "no cache   %9.2f ms\ncold       %9.2f ms\nwarm       %9.2f ms\nspeedup    %9.1fx\n", $1, $2, $3, ($3 > 0 ? $1 / $3 : 0) }'
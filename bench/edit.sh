@@ -0,0 +1,46 @@
+#!/bin/sh
+# Latency of incremental reparsing (--edits) against a full parse of the
+# same file: one-character edits to the bodies of random actions.
+# Usage: bench/edit.sh [actions] [edits]   (default 10000, about 1 MB, and 10000)
+# CC and CFLAGS select the C compiler used to build the compiler.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-edit.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+actions=${1:-10000}
+edits=${2:-10000}
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+$CC $CFLAGS -pthread "$root/EpicCompiler.c" -o "$out/EpicCompiler"
+
+# Each action holds one digit at a known offset; the edits overwrite it
+awk -v actions="$actions" -v edits="$edits" -v program="$out/program.epic" -v list="$out/edits" 'BEGIN {
+    srand(1)
+    for (i = 0; i < actions; i++) {
+        head = sprintf("action f%d(a, b) {\n    var x = a + b * ", i)
+        digit[i] = offset + length(head)
+        text = sprintf("%s%d;\n    if (x > 100) { return x - %d; }\n    return x + %d;\n}\n", head, i % 10, i, i % 13)
+        printf "%s", text > program
+        offset += length(text)
+    }
+    printf "main {\n    print(f%d(3, 4));\n}\n", actions - 1 > program
+    for (i = 0; i < edits; i++) {
+        printf "%d 1 1\n%d\n", digit[int(rand() * actions)], i % 10 > list
+    }
+}'
+
+stat() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$out/stats.json"
+}
+
+"$out/EpicCompiler" --check --jobs=1 --stats="$out/stats.json" "$out/program.epic" > /dev/null
+full=$(echo "$(stat lex_seconds) $(stat parse_seconds)" | awk '{ print ($1 + $2) * 1e6 }')
+"$out/EpicCompiler" --check --stats="$out/stats.json" --edits="$out/edits" "$out/program.epic" > /dev/null
+edit=$(echo "$(stat edit_seconds) $(stat edits)" | awk '{ print $1 / $2 * 1e6 }')
+
+printf '%s bytes, %s edits (%s incremental, %s full)\n' "$(wc -c < "$out/program.epic" | tr -d ' ')" \
+    "$(stat edits)" "$(stat incremental_reparses)" "$(stat full_reparses)"
+echo "$full $edit" | awk '{ printf "full parse %12.1f us\nper edit   %12.1f us\nspeedup    %12.0fx\n", $1, $2, ($2 > 0 ? $1 / $2 : 0) }'
@@ -0,0 +1,126 @@
+#!/bin/sh
+# The embedding API (epic.h): compile an entity script once, make many
+# instances of it, and run its update action for all of them each tick,
+# first as one batch per tick, then with one call per instance, then with
+# a separate one-instance set per entity. Prints the time per instance
+# update for each and the memory each instance costs.
+# Usage: bench/embed.sh [instances] [ticks]   (default 10000, 100)
+# CC and CFLAGS select the C compiler used to build the library and host.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-embed.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+instances=${1:-10000}
+ticks=${2:-100}
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+cat > "$out/host.c" <<'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "epic.h"
+
+static const char *script =
+    "action update(hp, x, speed, state) {\n"
+    "    x = x + speed;\n"
+    "    if (x > 1000 || x < 0) { speed = 0 - speed; }\n"
+    "    hp = hp - 1;\n"
+    "    if (hp < 50) { state = \"fleeing\"; }\n"
+    "    return hp;\n"
+    "}\n"
+    "main {\n"
+    "    var hp = 100;\n"
+    "    var x = 0;\n"
+    "    var speed = 3;\n"
+    "    var state = \"idle\";\n"
+    "}\n";
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+// Resident memory in bytes, from /proc where there is one
+static long resident() {
+    long pages = 0, size = 0;
+    FILE *file = fopen("/proc/self/statm", "r");
+    if (file != NULL) {
+        if (fscanf(file, "%ld %ld", &size, &pages) != 2) {
+            pages = 0;
+        }
+        fclose(file);
+    }
+    return pages * 4096;
+}
+
+int main(int argc, char **argv) {
+    uint32_t count = (uint32_t)atol(argv[1]);
+    int ticks = atoi(argv[2]);
+    char error[256];
+    EpicProgram *program = epicCompile(script, strlen(script), error, sizeof(error));
+    if (program == NULL) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    int32_t update = epicFindAction(program, "update");
+    int32_t speed = epicFindVariable(program, "speed");
+    EpicBudget budget = {100000, 1 << 20};
+
+    long before = resident();
+    EpicInstances *batch = epicCreateInstances(program, count);
+    for (uint32_t i = 0; i < count; i++) {
+        epicSetInt(batch, speed, i, 1 + i % 7);
+    }
+    long perInstance = (resident() - before) / (long)count;
+    double start = now();
+    for (int tick = 0; tick < ticks; tick++) {
+        epicRunBatch(batch, update, 0, count, &budget, NULL);
+    }
+    double batched = now() - start;
+
+    EpicInstances *single = epicCreateInstances(program, count);
+    start = now();
+    for (int tick = 0; tick < ticks; tick++) {
+        for (uint32_t i = 0; i < count; i++) {
+            epicRunBatch(single, update, i, 1, &budget, NULL);
+        }
+    }
+    double oneByOne = now() - start;
+
+    EpicInstances **sets = malloc(count * sizeof(EpicInstances *));
+    before = resident();
+    for (uint32_t i = 0; i < count; i++) {
+        sets[i] = epicCreateInstances(program, 1);
+    }
+    long perSet = (resident() - before) / (long)count;
+    start = now();
+    for (int tick = 0; tick < ticks; tick++) {
+        for (uint32_t i = 0; i < count; i++) {
+            epicRunBatch(sets[i], update, 0, 1, &budget, NULL);
+        }
+    }
+    double separate = now() - start;
+
+    double updates = (double)count * ticks;
+    printf("%u instances, %d ticks\n", count, ticks);
+    printf("batch:            %.1f ns per update, %ld bytes per instance\n", batched / updates * 1e9, perInstance);
+    printf("one call each:    %.1f ns per update\n", oneByOne / updates * 1e9);
+    printf("one set each:     %.1f ns per update, %ld bytes per set\n", separate / updates * 1e9, perSet);
+    for (uint32_t i = 0; i < count; i++) {
+        epicFreeInstances(sets[i]);
+    }
+    free(sets);
+    epicFreeInstances(single);
+    epicFreeInstances(batch);
+    epicFreeProgram(program);
+    return 0;
+}
+EOF
+
+$CC $CFLAGS -pthread -DEPIC_LIBRARY -I"$root" "$root/EpicCompiler.c" "$out/host.c" -o "$out/host"
+"$out/host" "$instances" "$ticks"
@@ -0,0 +1,54 @@
+#!/bin/sh
+# Many scripts at once with --fibers: every fiber runs a small entity
+# script that updates its state in a loop, then waits in input() for a
+# command. One fiber in 100 gets one; the end of stdin wakes the rest.
+# Prints the scheduler's summary (slices, steals, waits, peak memory) and
+# the per-fiber spread of run and wait times.
+# Usage: bench/fibers.sh [fibers] [threads] [budget]   (default 100000, one per CPU, 10000)
+# CC and CFLAGS select the C compiler used to build the compiler.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-fibers.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+fibers=${1:-100000}
+threads=${2:-}
+budget=${3:-10000}
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+$CC $CFLAGS -pthread "$root/EpicCompiler.c" -o "$out/EpicCompiler"
+
+cat > "$out/entity.epic" <<'EOF'
+action step(x, t) {
+    return x + t - x / 2;
+}
+main {
+    var hp = 100;
+    for (var t = 0; t < 200; t = t + 1) {
+        hp = step(hp, t);
+    }
+    var command = input();
+    if (command == "") {
+        print("idle " + hp);
+    } else {
+        print("got " + command);
+    }
+}
+EOF
+awk -v fibers="$fibers" 'BEGIN { for (i = 0; i < fibers; i += 100) print i " attack" }' > "$out/commands.txt"
+
+jobs=
+if [ -n "$threads" ]; then
+    jobs=--jobs=$threads
+fi
+"$out/EpicCompiler" --fibers="$fibers" $jobs --budget="$budget" --stats="$out/stats.json" \
+    --fiber-stats="$out/fibers.json" "$out/entity.epic" < "$out/commands.txt" > "$out/output.txt"
+
+sed 's/[{}"]//g; s/, /\n/g' "$out/stats.json"
+sed 's/.*"run_seconds": \([0-9.]*\), "wait_seconds": \([0-9.]*\).*/\1 \2/' "$out/fibers.json" | awk '
+    { run += $1; wait += $2; if (NR == 1 || $1 > maxRun) maxRun = $1; if (NR == 1 || $2 > maxWait) maxWait = $2 }
+    END { printf "per fiber: run %.1f us mean, %.1f us max; wait %.1f ms mean, %.1f ms max\n",
+          run / NR * 1e6, maxRun * 1e6, wait / NR * 1e3, maxWait * 1e3 }'
+sort "$out/output.txt" | uniq -c
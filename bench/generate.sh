@@ -0,0 +1,151 @@
+#!/bin/sh
+# Deterministic synthetic programs for benchmarking the compiler. The same
+# shape, size and seed always give the same bytes, whatever awk runs it.
+# Usage: bench/generate.sh SHAPE SIZE [SEED] > program.epic
+#   SHAPE  nesting      blocks and parentheses nested dozens deep
+#          expressions  long arithmetic expressions
+#          actions      many small actions calling each other
+#          arrays       large array literals summed in loops
+#          strings      long string literals, concatenated and measured
+#          mixed        all of the above in turn
+#   SIZE   bytes, with an optional K, M or G suffix (e.g. 64K, 10M, 1G)
+# Actions are generated until the program reaches SIZE; main then calls a
+# bounded number of them, so every program also runs, briefly.
+set -e
+if [ $# -lt 2 ]; then
+    sed -n '4,13s/^# \{0,1\}//p' "$0" >&2
+    exit 1
+fi
+shape=$1
+case $shape in
+    nesting|expressions|actions|arrays|strings|mixed) ;;
+    *) echo "Unknown shape: $shape" >&2; exit 1 ;;
+esac
+size=$(echo "$2" | awk '/^[0-9]+[KkMmGg]?$/ {
+    n = $0 + 0; unit = toupper(substr($0, length($0)))
+    printf "%.0f", n * (unit == "K" ? 1024 : unit == "M" ? 1048576 : unit == "G" ? 1073741824 : 1)
+}')
+if [ -z "$size" ]; then
+    echo "Invalid size: $2" >&2
+    exit 1
+fi
+
+awk -v shape="$shape" -v size="$size" -v seed="${3:-1}" '
+# Park-Miller: exact in the doubles every awk uses, unlike rand()
+function random(n) {
+    state = (state * 16807) % 2147483647
+    return state % n
+}
+
+function emit(text) {
+    printf "%s", text
+    bytes += length(text)
+}
+
+function operand(   r) {
+    r = random(4)
+    return r == 0 ? "a" : r == 1 ? "b" : random(1000)
+}
+
+function expression(terms,   text, open, i, ops) {
+    ops = "+-*+-"
+    text = operand()
+    open = 0
+    for (i = 1; i < terms; i++) {
+        text = text " " substr(ops, random(5) + 1, 1) " "
+        if (random(6) == 0) {
+            text = text "("
+            open++
+        }
+        text = text operand()
+        if (open > 0 && random(4) == 0) {
+            text = text ")"
+            open--
+        }
+        if (i % 12 == 0) {
+            text = text "\n        "
+        }
+    }
+    while (open-- > 0) {
+        text = text ")"
+    }
+    return text
+}
+
+function nesting(n,   depth, i, pad, text) {
+    depth = 24 + random(40)
+    emit("action u" n "(a, b) {\n    var x = a;\n")
+    pad = "    "
+    for (i = 0; i < depth; i++) {
+        if (i % 3 == 0) {
+            text = "if (((x + " i ") > (" i " - b))) {\n"
+        } else if (i % 3 == 1) {
+            text = "while (x < " i " - " i ") {\n"
+        } else {
+            text = "for (var i" i " = 0; i" i " < 1; i" i " = i" i " + 1) {\n"
+        }
+        emit(pad text)
+        pad = pad "    "
+        emit(pad "x = x + (((" i ")));\n")
+    }
+    for (i = depth - 1; i >= 0; i--) {
+        pad = substr(pad, 5)
+        emit(pad "}\n")
+    }
+    emit("    return x;\n}\n")
+}
+
+function expressions(n) {
+    emit("action u" n "(a, b) {\n    var x = " expression(200 + random(200)) ";\n")
+    emit("    return x - " expression(20) ";\n}\n")
+}
+
+function actions(n) {
+    emit("action u" n "(a, b) {\n    var x = a + b * " random(10) ";\n")
+    emit("    if (x > " random(100) " || b < 0) { return x - " random(50) "; }\n")
+    emit("    return u" (n > 0 ? random(n) : 0) "(x, b - 1) + 1;\n}\n")
+}
+
+function arrays(n,   count, i, text) {
+    count = 500 + random(1500)
+    text = ""
+    for (i = 0; i < count; i++) {
+        text = text (i == 0 ? "" : i % 16 == 0 ? ",\n        " : ", ") random(100000)
+    }
+    emit("action u" n "(a, b) {\n    array values[" count "] = {" text "};\n    var total = a;\n")
+    emit("    for (var i = 0; i < values.length(); i = i + 1) {\n        total = total + values[i];\n    }\n")
+    emit("    return total + b;\n}\n")
+}
+
+function strings(n,   chars, text, words) {
+    split("alpha beta gamma delta epsilon zeta eta theta iota kappa lambda", words, " ")
+    chars = 200 + random(3800)
+    text = ""
+    while (length(text) < chars) {
+        text = text words[random(11) + 1] " "
+    }
+    emit("action u" n "(a, b) {\n    var s = \"" text "\";\n")
+    emit("    var t = \"" substr(text, 1, int(chars / 2)) "\" + s;\n")
+    emit("    return a + b + t.length() + s.upper().length();\n}\n")
+}
+
+BEGIN {
+    state = seed % 2147483646 + 1
+    units = 0
+    split("nesting expressions actions arrays strings", shapes, " ")
+    while (bytes < size) {
+        kind = shape == "mixed" ? shapes[units % 5 + 1] : shape
+        if (kind == "nesting") nesting(units)
+        else if (kind == "expressions") expressions(units)
+        else if (kind == "actions") actions(units)
+        else if (kind == "arrays") arrays(units)
+        else strings(units)
+        units++
+    }
+    calls = units < 100 ? units : 100
+    emit("main {\n    var total = 0;\n")
+    for (i = 0; i < calls; i++) {
+        emit("    total = total + u" int(i * units / calls) "(" i ", 3);\n")
+    }
+    emit("    print(\"Total: \" + total);\n}\n")
+}'
@@ -0,0 +1,52 @@
+#!/bin/sh
+# Throughput of print and input() with the default output buffer, with
+# line buffering, and unbuffered (one write per print).
+# Usage: bench/io.sh [lines]   (default 1000000)
+# CC and CFLAGS select the C compiler used to build the compiler.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-io.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+lines=${1:-1000000}
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+$CC $CFLAGS -pthread "$root/EpicCompiler.c" -o "$out/EpicCompiler"
+
+cat > "$out/print.epic" <<PROGRAM
+main {
+    for (var i = 0; i < $lines; i = i + 1) {
+        print("line " + i);
+    }
+}
+PROGRAM
+cat > "$out/echo.epic" <<PROGRAM
+main {
+    for (var i = 0; i < $lines; i = i + 1) {
+        print(input("> "));
+    }
+}
+PROGRAM
+awk -v lines="$lines" 'BEGIN { for (i = 0; i < lines; i++) print "answer " i }' > "$out/answers"
+
+seconds() {
+    start=$(date +%s.%N)
+    "$@" < "$out/answers" > "$out/output"
+    end=$(date +%s.%N)
+    echo "$start $end" | awk '{ printf "%.3f", $2 - $1 }'
+}
+
+printf '%-8s %-12s %9s %14s\n' workload mode seconds lines/s
+for workload in print echo; do
+    for mode in buffered line unbuffered; do
+        case $mode in
+            buffered) flags= ;;
+            line) flags=--line-buffered ;;
+            unbuffered) flags=--output-buffer=0 ;;
+        esac
+        time=$(seconds "$out/EpicCompiler" $flags "$out/$workload.epic")
+        echo "$workload $mode $time $lines" | awk '{ printf "%-8s %-12s %8.3fs %14.0f\n", $1, $2, $3, ($3 > 0 ? $4 / $3 : 0) }'
+    done
+done
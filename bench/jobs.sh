@@ -0,0 +1,77 @@
+#!/bin/sh
+# Parallel parsing against one thread: every shape from bench/generate.sh,
+# the same programs with a syntax error and an undefined variable late in
+# the file, and expressions of 100000 and 1000000 operands, each compiled
+# with --jobs=1 and --jobs=8. The dumps, the output and the errors must
+# match; the AST dump is left out for the long expressions, whose depth
+# makes it quadratic. Stops at the first mismatch and keeps its files.
+# Usage: bench/jobs.sh [size]   (default 2M per shape)
+# CC and CFLAGS select the C compiler used to build the compiler.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-jobs.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+size=${1:-2M}
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+$CC $CFLAGS -pthread "$root/EpicCompiler.c" -o "$out/EpicCompiler"
+
+stat() {
+    sed -n "s/.*\"$1\": \([0-9.]*\).*/\1/p" "$out/stats.json"
+}
+
+# Compile and run `program` both ways with the given dump options
+compare() {
+    program=$1
+    shift
+    "$out/EpicCompiler" --jobs=1 "$@" "$out/$program" < /dev/null > "$out/one.out" 2> "$out/one.err" || true
+    "$out/EpicCompiler" --jobs=8 --stats="$out/stats.json" "$@" "$out/$program" < /dev/null \
+        > "$out/eight.out" 2> "$out/eight.err" || true
+    if ! cmp -s "$out/one.out" "$out/eight.out" || ! cmp -s "$out/one.err" "$out/eight.err"; then
+        trap - EXIT
+        echo "$program differs between --jobs=1 and --jobs=8; the files are in $out"
+        diff "$out/one.err" "$out/eight.err" | head -20 || true
+        diff "$out/one.out" "$out/eight.out" | head -20 || true
+        exit 1
+    fi
+    printf '%-26s %8s bytes %4s chunks  %s\n' "$program" "$(wc -c < "$out/$program" | tr -d ' ')" \
+        "$(stat parse_chunks)" "$(head -1 "$out/one.err")"
+}
+
+for shape in nesting expressions actions arrays strings mixed; do
+    "$here/generate.sh" "$shape" "$size" > "$out/$shape.epic"
+    compare "$shape.epic" --dump-ast --dump-bytecode
+    # Errors in the last quarter of the file, where a later chunk finds them
+    awk -v cut="$(($(wc -c < "$out/$shape.epic") * 3 / 4))" '
+        { bytes += length($0) + 1; print }
+        bytes > cut && !done && /^}$/ { print "action broken(a) {\n    return a +;\n}"; done = 1 }
+    ' "$out/$shape.epic" > "$out/$shape-syntax.epic"
+    compare "$shape-syntax.epic"
+    awk -v cut="$(($(wc -c < "$out/$shape.epic") * 3 / 4))" '
+        { bytes += length($0) + 1; print }
+        bytes > cut && !done && /^}$/ { print "action unknown(a) {\n    return a + missing;\n}"; done = 1 }
+    ' "$out/$shape.epic" > "$out/$shape-undefined.epic"
+    compare "$shape-undefined.epic"
+done
+
+# One long expression among enough small actions to fill several chunks
+for operands in 100000 1000000; do
+    awk -v operands="$operands" 'BEGIN {
+        for (i = 0; i < 20000; i++) {
+            printf "action f%d(a, b) {\n    var x = a + b * %d;\n    return x - %d;\n}\n", i, i % 10, i % 7
+        }
+        printf "main {\n    var v = 3;\n    print(f1(2, 5) + v"
+        for (i = 1; i < operands; i++) {
+            printf " %s %s", substr("+-+*", i % 4 + 1, 1), (i % 3 == 0 ? "v" : i % 10)
+            if (i % 16 == 0) {
+                printf "\n       "
+            }
+        }
+        printf ");\n}\n"
+    }' > "$out/expression$operands.epic"
+    compare "expression$operands.epic" --dump-bytecode
+done
+echo "--jobs=1 and --jobs=8 agree"
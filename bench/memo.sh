@@ -0,0 +1,64 @@
+#!/bin/sh
+# Result caching through tail calls: an action that prints (so is not
+# cached itself) returns a call to a pure one, and a pure action returns a
+# call to another. Tail calls must fill the callee's cache just as plain
+# calls do, so the hit and miss counts from --stats have to be the same
+# with and without --no-tail-calls, and the --emit-c build has to print the
+# same output.
+# Usage: bench/memo.sh
+# CC and CFLAGS select the C compiler used for the compiler and the native build.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-memo.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+$CC $CFLAGS -pthread "$root/EpicCompiler.c" -o "$out/EpicCompiler"
+
+cat > "$out/tail.epic" <<'EOF'
+action square(n) {
+    var total = 0;
+    for (var i = 0; i < n; i = i + 1) {
+        total = total + n;
+    }
+    return total;
+}
+action wrap(n) {
+    print("wrap " + n);
+    return square(n);
+}
+action half(n) {
+    return square(n / 2);
+}
+main {
+    for (var i = 0; i < 5; i = i + 1) {
+        print(wrap(3000));
+    }
+    print(half(6000) + half(6000) + square(3000));
+}
+EOF
+
+counts() {
+    "$out/EpicCompiler" --stats="$out/stats.json" "$@" "$out/tail.epic" > "$out/output.txt"
+    sed 's/[{}"]//g; s/, /\n/g' "$out/stats.json" | grep -E '^memo_(hits|misses)' | tr '\n' ' '
+}
+
+tail=$(counts)
+plain=$(counts --no-tail-calls)
+echo "tail calls:    $tail"
+echo "no tail calls: $plain"
+if [ "$tail" != "$plain" ]; then
+    echo "Tail calls bypass the cache" >&2
+    exit 1
+fi
+"$out/EpicCompiler" --emit-c="$out/tail.c" "$out/tail.epic"
+$CC $CFLAGS -I"$root" "$out/tail.c" -o "$out/tail"
+"$out/tail" > "$out/native.txt"
+"$out/EpicCompiler" "$out/tail.epic" > "$out/output.txt"
+if ! cmp -s "$out/output.txt" "$out/native.txt"; then
+    echo "native output differs from the interpreter" >&2
+    exit 1
+fi
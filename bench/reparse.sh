@@ -0,0 +1,109 @@
+#!/bin/sh
+# Incremental reparsing (--edits) against a full parse: random edit
+# sequences over a generated program. Some edits change a number or add an
+# action; the rest insert and delete anywhere, often half of a token or a
+# brace, and are undone later, so the document goes in and out of syntax
+# errors and ends up valid. After each edit the error reported must be the
+# one a full parse of the edited text gives, and after the last one the
+# AST, bytecode and output must match.
+# Stops at the first mismatch and keeps its files.
+# Usage: bench/reparse.sh [rounds] [edits] [seed]   (default 50, 40 and 1)
+# CC and CFLAGS select the C compiler used to build the compiler.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-reparse.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+rounds=${1:-50}
+edits=${2:-40}
+seed=${3:-1}
+LC_ALL=C
+export LC_ALL
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+$CC $CFLAGS -pthread "$root/EpicCompiler.c" -o "$out/EpicCompiler"
+
+# The program, the edits file and the text after each edit (state N)
+generate() {
+    rm -f "$out"/state*.epic
+    awk -v seed="$1" -v edits="$edits" -v dir="$out" 'BEGIN {
+        srand(seed)
+        actions = 5 + int(rand() * 20)
+        for (i = 0; i < actions; i++) {
+            text = text sprintf("action f%d(a, b) {\n    var x = a + b * %d;\n    if (x > 100) { return x - %d; }\n    return x + %d;\n}\n",
+                                i, i % 10, i, i % 13)
+        }
+        text = text sprintf("main {\n    print(f0(3, 4));\n    print(f%d(5, 6) + \"!\");\n}\n", actions - 1)
+        printf "%s", text > (dir "/program.epic")
+        pieces = split("1|+ 2|}|{|;| |\n|x|(|)|\"|var y = 7;|return 3;|\"s\" + |action g() { return 1; }\n|if (a > b) { x = 2; }|main { print(1); }\n|@", pool, "|")
+        # Breaking edits are undone in reverse order, some at once and some
+        # after other edits, and all of them by the end
+        depth = 0
+        for (e = 1; e <= edits; e++) {
+            if (depth > 0 && (depth > edits - e || rand() < 0.5)) {
+                depth--
+                at = stackAt[depth]
+                removed = length(stackInserted[depth])
+                inserted = stackRemoved[depth]
+            } else if (depth == edits - e || rand() < 0.5) {    # Change a one-digit number; offsets stay valid
+                digits = 0
+                for (i = 2; i < length(text); i++) {
+                    if (substr(text, i - 1, 3) ~ /^[ (][0-9][^0-9]/) {
+                        digit[digits++] = i - 1
+                    }
+                }
+                at = digit[int(rand() * digits)]
+                removed = 1
+                inserted = int(rand() * 10) ""
+            } else if (depth == 0 && rand() < 0.3) {    # Add an action after the first
+                at = index(text, "\n}\n") + 2
+                removed = 0
+                inserted = sprintf("action g%d(a) {\n    return a * %d;\n}\n", e, e)
+            } else {
+                at = int(rand() * (length(text) + 1))
+                removed = rand() < 0.1 ? int(rand() * 80) : int(rand() * 4)
+                if (at + removed > length(text)) {
+                    removed = length(text) - at
+                }
+                inserted = rand() < 0.7 ? pool[1 + int(rand() * pieces)] : ""
+                stackAt[depth] = at
+                stackRemoved[depth] = substr(text, at + 1, removed)
+                stackInserted[depth] = inserted
+                depth++
+            }
+            printf "%d %d %d\n%s\n", at, removed, length(inserted), inserted > (dir "/edits")
+            text = substr(text, 1, at) inserted substr(text, at + removed + 1)
+            printf "%s", text > (dir "/state" e ".epic")
+            close(dir "/state" e ".epic")
+        }
+    }'
+}
+
+round=$seed
+while [ "$round" -lt $((seed + rounds)) ]; do
+    generate "$round"
+    # Errors left by an edit are reported when the next one is applied
+    : > "$out/expected.err"
+    e=1
+    while [ "$e" -lt "$edits" ]; do
+        if ! "$out/EpicCompiler" --check "$out/state$e.epic" > /dev/null 2> "$out/state.err"; then
+            echo "Edit $e: $(cat "$out/state.err")" >> "$out/expected.err"
+        fi
+        e=$((e + 1))
+    done
+    "$out/EpicCompiler" --dump-ast --dump-bytecode "$out/state$edits.epic" < /dev/null > "$out/expected.out" 2> "$out/full.err" || true
+    cat "$out/full.err" >> "$out/expected.err"
+    "$out/EpicCompiler" --dump-ast --dump-bytecode --edits="$out/edits" "$out/program.epic" < /dev/null \
+        > "$out/actual.out" 2> "$out/actual.err" || true
+    if ! cmp -s "$out/expected.out" "$out/actual.out" || ! cmp -s "$out/expected.err" "$out/actual.err"; then
+        trap - EXIT
+        echo "Round $round differs; program.epic, edits and state*.epic are in $out"
+        diff "$out/expected.err" "$out/actual.err" | head -20 || true
+        diff "$out/expected.out" "$out/actual.out" | head -20 || true
+        exit 1
+    fi
+    round=$((round + 1))
+done
+echo "$rounds rounds of $edits edits: incremental and full parses agree"
@@ -0,0 +1,56 @@
+#!/bin/sh
+# Type specialization: runs a numeric program (recursive fib and collatz
+# loops) with and without --no-specialize, with the JIT on and off, and
+# prints the run times and the fraction of arithmetic and comparisons that
+# type inference turned into int instructions without type checks.
+# Usage: bench/specialize.sh [n]   (default 27: fib(n), collatz below 4000 * n)
+# CC and CFLAGS select the C compiler used to build the compiler.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-specialize.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+n=${1:-27}
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+$CC $CFLAGS -pthread "$root/EpicCompiler.c" -o "$out/EpicCompiler"
+
+cat > "$out/numeric.epic" <<EOF
+action fib(n) {
+    if (n < 2) { return n; }
+    return fib(n - 1) + fib(n - 2);
+}
+action steps(x) {
+    var count = 0;
+    while (x != 1) {
+        var half = x / 2;
+        if (half * 2 == x) { x = half; } else { x = 3 * x + 1; }
+        count = count + 1;
+    }
+    return count;
+}
+main {
+    print(fib($n));
+    var total = 0;
+    for (var i = 1; i < 4000 * $n; i = i + 1) {
+        total = total + steps(i);
+    }
+    print(total);
+}
+EOF
+
+run() {
+    start=$(date +%s%N)
+    "$out/EpicCompiler" "$@" "$out/numeric.epic" > "$out/output.txt"
+    end=$(date +%s%N)
+    echo $(( (end - start) / 1000000 ))
+}
+
+"$out/EpicCompiler" --stats="$out/stats.json" "$out/numeric.epic" > /dev/null
+sed 's/[{}"]//g; s/, /\n/g' "$out/stats.json" | grep -E '^(specialized|checked)_'
+echo "specialized:     $(run) ms"
+echo "not specialized: $(run --no-specialize) ms"
+echo "specialized, no JIT:     $(run --no-jit) ms"
+echo "not specialized, no JIT: $(run --no-jit --no-specialize) ms"
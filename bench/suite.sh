@@ -0,0 +1,111 @@
+#!/bin/sh
+# Compiler benchmark over the synthetic corpus from bench/generate.sh: one
+# program per shape, each compiled and run RUNS times, keeping the best
+# figure of each metric. Reports read, lex and parse throughput, tokens/s,
+# compile and execute time, peak RSS and runtime allocations, all from
+# --stats. Parsing uses one thread unless JOBS says otherwise, so results
+# compare across machines with different core counts.
+# Usage: bench/suite.sh [-s SIZE] [-r RUNS] [-o RESULTS] [-b BASELINE] [SHAPE...]
+#   -s SIZE      program size per shape (default 8M; see bench/generate.sh)
+#   -r RUNS      runs per program (default 3)
+#   -o RESULTS   save the results, to pass as a baseline later
+#   -b BASELINE  compare against saved results
+# CC and CFLAGS select the C compiler used to build the compiler.
+set -e
+here=$(cd "$(dirname "$0")" && pwd)
+root=$(dirname "$here")
+out=${TMPDIR:-/tmp}/epic-suite.$$
+CC=${CC:-cc}
+CFLAGS=${CFLAGS:--O2}
+size=8M
+runs=3
+results=
+baseline=
+while getopts s:r:o:b: flag; do
+    case $flag in
+        s) size=$OPTARG ;;
+        r) runs=$OPTARG ;;
+        o) results=$OPTARG ;;
+        b) baseline=$OPTARG ;;
+        *) sed -n '8,12s/^# \{0,1\}//p' "$0" >&2; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+[ $# -gt 0 ] || set -- nesting expressions actions arrays strings mixed
+if [ -n "$baseline" ] && [ ! -r "$baseline" ]; then
+    echo "Cannot read baseline: $baseline" >&2
+    exit 1
+fi
+mkdir -p "$out"
+trap 'rm -rf "$out"' EXIT
+
+$CC $CFLAGS -pthread "$root/EpicCompiler.c" -o "$out/EpicCompiler"
+
+# One "shape metric value" line per metric, best of the runs
+for shape in "$@"; do
+    sh "$here/generate.sh" "$shape" "$size" > "$out/$shape.epic"
+    run=0
+    while [ $run -lt "$runs" ]; do
+        "$out/EpicCompiler" --jobs="${JOBS:-1}" --stats="$out/$shape.$run.json" "$out/$shape.epic" \
+            < /dev/null > /dev/null
+        run=$((run + 1))
+    done
+    cat "$out/$shape".*.json | tr ',{}' '\n\n\n' | sed -n 's/^ *"\([a-z_]*\)": \([0-9.]*\)$/\1 \2/p' |
+    awk -v shape="$shape" '
+        function best(name, value, higher) {
+            if (!(name in result) || (higher ? value > result[name] : value < result[name])) {
+                result[name] = value
+            }
+        }
+        { stat[$1] = $2 }
+        $1 == "parse_mb_per_second" {
+            mb = stat["bytes_read"] / 1e6
+            best("read_mb_s", stat["read_seconds"] > 0 ? mb / stat["read_seconds"] : 0, 1)
+            best("lex_mb_s", stat["lex_mb_per_second"], 1)
+            best("parse_mb_s", stat["parse_mb_per_second"], 1)
+            best("tokens_per_s", stat["tokens_per_second"], 1)
+            best("compile_ms", stat["compile_seconds"] * 1000, 0)
+            best("execute_ms", stat["execute_seconds"] * 1000, 0)
+            best("peak_rss_kb", stat["peak_rss_kb"], 0)
+            best("allocations", stat["allocations"], 0)
+            result["bytes"] = stat["bytes_read"]
+            result["tokens"] = stat["tokens"]
+        }
+        END {
+            split("bytes tokens read_mb_s lex_mb_s parse_mb_s tokens_per_s compile_ms execute_ms peak_rss_kb allocations", order, " ")
+            for (i = 1; i in order; i++) {
+                printf "%s %s %.2f\n", shape, order[i], result[order[i]]
+            }
+        }'
+done > "$out/results"
+
+if [ -n "$results" ]; then
+    cp "$out/results" "$results"
+fi
+
+# Throughput is better higher, everything else lower; sizes are not judged
+awk -v baseline="$baseline" '
+    BEGIN {
+        while (baseline != "" && (getline line < baseline) > 0) {
+            split(line, field, " ")
+            base[field[1] " " field[2]] = field[3]
+        }
+        if (baseline != "") {
+            printf "%-12s %-14s %14s %14s %9s\n", "shape", "metric", "baseline", "current", "change"
+        } else {
+            printf "%-12s %-14s %14s\n", "shape", "metric", "value"
+        }
+    }
+    {
+        key = $1 " " $2
+        if (baseline == "") {
+            printf "%-12s %-14s %14.2f\n", $1, $2, $3
+        } else if (!(key in base)) {
+            printf "%-12s %-14s %14s %14.2f %9s\n", $1, $2, "-", $3, "new"
+        } else {
+            change = base[key] > 0 ? ($3 - base[key]) / base[key] * 100 : 0
+            higher = $2 ~ /_s$/
+            verdict = $2 == "bytes" || $2 == "tokens" ? "" : change == 0 ? "" : (change > 0) == higher ? " better" : " worse"
+            printf "%-12s %-14s %14.2f %14.2f %+8.1f%%%s\n", $1, $2, base[key], $3, change, verdict
+        }
+    }' "$out/results"
@@ -0,0 +1,106 @@
+// Embedding API: compile a script once, then run its actions for many
+// instances at a time.
+//
+// Build EpicCompiler.c with -DEPIC_LIBRARY (which leaves out main) and
+// link it with the host:  cc -O2 -DEPIC_LIBRARY -c EpicCompiler.c
+//
+// An instance's variables are the variables declared at the top level of
+// the script's main block. main runs once, when the script is compiled,
+// and every new instance starts with the values it left; strings and
+// arrays, which scripts cannot change, are shared. Running an action for
+// an instance passes each of the action's parameters the instance variable
+// of the same name and stores the parameters back into them when the
+// action returns (unless it ends in a tail call `return f(...)`, which
+// hands its parameters to f), along with the returned value:
+//
+//     action tick(hp, x) {
+//         x = x + 1;
+//         hp = hp - 1;
+//         return hp > 0;
+//     }
+//     main {
+//         var hp = 100;
+//         var x = 0;
+//     }
+//
+// A program is immutable and may be shared by any number of instance sets
+// on any threads. An instance set is used by one thread at a time.
+#ifndef EPIC_H
+#define EPIC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct EpicProgram EpicProgram;
+typedef struct EpicInstances EpicInstances;
+
+typedef enum {
+    EPIC_TYPE_NIL,
+    EPIC_TYPE_INT,
+    EPIC_TYPE_DOUBLE,
+    EPIC_TYPE_STRING,
+    EPIC_TYPE_ARRAY
+} EpicType;
+
+typedef enum {
+    EPIC_OK,
+    EPIC_OUT_OF_INSTRUCTIONS,   // The call was abandoned; variables keep their old values
+    EPIC_OUT_OF_MEMORY,         // Likewise
+    EPIC_FAILED                 // Runtime error; see epicInstanceError()
+} EpicStatus;
+
+// Limits for each instance's call; 0 means no limit. Instructions count
+// like the fiber budget: loop back-edges the length of the loop, calls one.
+// Memory is live heap the call may add.
+typedef struct {
+    uint64_t instructions;
+    size_t heapBytes;
+} EpicBudget;
+
+// The variable index of an action's return value
+#define EPIC_RESULT (-1)
+
+// Compile `length` bytes of source and run its main block. Returns NULL on
+// a compile or runtime error, with the message in `error` if it is not NULL.
+EpicProgram *epicCompile(const char *source, size_t length, char *error, size_t errorSize);
+void epicFreeProgram(EpicProgram *program);
+
+// Index of an action or an instance variable, or -1 if there is none
+int32_t epicFindAction(const EpicProgram *program, const char *name);
+int32_t epicFindVariable(const EpicProgram *program, const char *name);
+uint32_t epicVariableCount(const EpicProgram *program);
+
+// `count` instances, each holding its variables and its last result. All
+// of them share one heap, so they cost only their values.
+EpicInstances *epicCreateInstances(const EpicProgram *program, uint32_t count);
+void epicFreeInstances(EpicInstances *instances);
+
+// Run `action` for instances [first, first + count). `statuses`, if not
+// NULL, receives one status per instance. Returns how many finished, or -1
+// when an action parameter names no instance variable or the range is out
+// of bounds.
+int64_t epicRunBatch(EpicInstances *instances, int32_t action, uint32_t first, uint32_t count,
+                     const EpicBudget *budget, EpicStatus *statuses);
+
+// The message of the instance's last runtime error, or NULL
+const char *epicInstanceError(const EpicInstances *instances, uint32_t instance);
+
+// Instance variables (or EPIC_RESULT). Getters of the wrong type return 0
+// or NULL; epicGetNumber accepts ints. Strings are not NUL-terminated.
+EpicType epicGetType(const EpicInstances *instances, int32_t variable, uint32_t instance);
+int64_t epicGetInt(const EpicInstances *instances, int32_t variable, uint32_t instance);
+double epicGetNumber(const EpicInstances *instances, int32_t variable, uint32_t instance);
+const char *epicGetString(const EpicInstances *instances, int32_t variable, uint32_t instance, size_t *length);
+void epicSetInt(EpicInstances *instances, int32_t variable, uint32_t instance, int64_t value);
+void epicSetNumber(EpicInstances *instances, int32_t variable, uint32_t instance, double value);
+void epicSetString(EpicInstances *instances, int32_t variable, uint32_t instance, const char *text, size_t length);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,764 @@
+// Runtime for C code generated by `EpicCompiler --emit-c`.
+//
+// A generated program is one C function that runs the compiled actions
+// over the same value stack and frame layout as the interpreter's VM, so
+// values, error messages, stack limits and output match it exactly. Build
+// with:  cc -O2 -I<dir of this header> program.c -o program
+#ifndef EPIC_RUNTIME_H
+#define EPIC_RUNTIME_H
+
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     // getline under -std=c11; must precede the first #include
+#endif
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <sys/types.h>
+
+#define EPIC_STACK_SIZE (1u << 20)   // Same limits as the interpreter
+#define EPIC_MAX_FRAMES (1u << 18)
+#define EPIC_MEMO_MAX_ARGS 4
+#define EPIC_MEMO_ENTRIES 4096
+
+enum { EPIC_NIL, EPIC_INT, EPIC_DOUBLE, EPIC_STRING, EPIC_ARRAY };
+enum { EPIC_OBJ_STRING, EPIC_OBJ_ARRAY };
+enum { EPIC_OP_ADD, EPIC_OP_SUB, EPIC_OP_MUL, EPIC_OP_DIV };
+enum { EPIC_METHOD_LENGTH, EPIC_METHOD_STRIP, EPIC_METHOD_LOWER, EPIC_METHOD_UPPER };
+
+typedef struct EpicObject {
+    uint8_t type;
+    uint8_t marked;
+    struct EpicObject *next;
+} EpicObject;
+
+typedef struct {
+    uint8_t type;
+    union {
+        int64_t i;
+        double d;
+        EpicObject *object;
+    } as;
+} EpicValue;
+
+typedef struct {
+    EpicObject header;
+    uint32_t length;
+    char chars[];
+} EpicString;
+
+// Arrays of one number type are stored unboxed, as in the interpreter
+enum { EPIC_ARRAY_BOXED = EPIC_NIL, EPIC_ARRAY_INT = EPIC_INT, EPIC_ARRAY_DOUBLE = EPIC_DOUBLE };
+
+typedef struct {
+    EpicObject header;
+    uint32_t length;
+    uint8_t kind;
+    union {
+        EpicValue *items;
+        int64_t *ints;
+        double *doubles;
+    };
+} EpicArray;
+
+// Static description of one compiled action, emitted by the compiler
+typedef struct {
+    const char *name;
+    uint32_t arity;
+    uint32_t slotCount;
+    uint32_t maxStack;
+} EpicFunction;
+
+typedef struct {
+    uint32_t function;
+    uint32_t returnSite;     // Where the caller resumes
+    EpicValue *slots;
+    EpicValue *memoKey;      // Arguments of a cached call, else NULL
+    uint32_t memoFunction;
+} EpicFrame;
+
+typedef struct {
+    EpicValue args[EPIC_MEMO_MAX_ARGS];
+    EpicValue result;
+    uint8_t used;
+} EpicMemoEntry;
+
+static struct {
+    const EpicFunction *functions;
+    uint32_t functionCount;
+    EpicValue *stack;
+    EpicValue *stackEnd;
+    EpicValue *top;          // Live values end here whenever an allocation can collect
+    EpicFrame *frames;
+    uint32_t frameCount;
+    EpicMemoEntry **memo;
+    EpicObject *objects;
+    size_t bytesAllocated;
+    size_t nextCollection;
+} epic;
+
+#define EPIC_NIL_VALUE ((EpicValue){EPIC_NIL, {.i = 0}})
+#define EPIC_INT_VALUE(value) ((EpicValue){EPIC_INT, {.i = (value)}})
+#define EPIC_DOUBLE_VALUE(value) ((EpicValue){EPIC_DOUBLE, {.d = (value)}})
+#define EPIC_OBJECT_VALUE(kind, value) ((EpicValue){(kind), {.object = (EpicObject *)(value)}})
+#define EPIC_AS_STRING(value) ((EpicString *)(value).as.object)
+#define EPIC_AS_ARRAY(value) ((EpicArray *)(value).as.object)
+#define EPIC_IS_NUMBER(value) ((value).type == EPIC_INT || (value).type == EPIC_DOUBLE)
+#define EPIC_AS_NUMBER(value) ((value).type == EPIC_INT ? (double)(value).as.i : (value).as.d)
+
+static inline EpicValue epicArrayElement(const EpicArray *array, uint32_t index) {
+    switch (array->kind) {
+        case EPIC_ARRAY_INT: return EPIC_INT_VALUE(array->ints[index]);
+        case EPIC_ARRAY_DOUBLE: return EPIC_DOUBLE_VALUE(array->doubles[index]);
+        default: return array->items[index];
+    }
+}
+
+static inline size_t epicArrayElementSize(const EpicArray *array) {
+    return array->kind == EPIC_ARRAY_BOXED ? sizeof(EpicValue) : sizeof(int64_t);
+}
+
+static const char *const epicMethodNames[] = {"length", "strip", "lower", "upper"};
+
+static inline void epicRuntimeError(const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    fflush(stdout);
+    fprintf(stderr, "Runtime Error: ");
+    vfprintf(stderr, format, args);
+    if (epic.frameCount > 0) {
+        fprintf(stderr, " (in %s)", epic.functions[epic.frames[epic.frameCount - 1].function].name);
+    }
+    fprintf(stderr, "\n");
+    va_end(args);
+    exit(EXIT_FAILURE);
+}
+
+// Values
+
+static inline const char *epicFormatNumber(EpicValue value, char *buffer, size_t size, size_t *length) {
+    int written;
+    if (value.type == EPIC_INT) {
+        written = snprintf(buffer, size, "%lld", (long long)value.as.i);
+    } else {
+        written = snprintf(buffer, size, "%.15g", value.as.d);
+        if (strtod(buffer, NULL) != value.as.d) {
+            written = snprintf(buffer, size, "%.17g", value.as.d);
+        }
+        if (strspn(buffer, "-0123456789") == (size_t)written) {
+            written += snprintf(buffer + written, size - (size_t)written, ".0");
+        }
+    }
+    *length = (size_t)written;
+    return buffer;
+}
+
+static inline const char *epicValueText(EpicValue value, char *buffer, size_t size, size_t *length) {
+    switch (value.type) {
+        case EPIC_STRING:
+            *length = EPIC_AS_STRING(value)->length;
+            return EPIC_AS_STRING(value)->chars;
+        case EPIC_INT:
+        case EPIC_DOUBLE:
+            return epicFormatNumber(value, buffer, size, length);
+        case EPIC_ARRAY:
+            *length = 7;
+            return "<array>";
+        default:
+            *length = 3;
+            return "nil";
+    }
+}
+
+static inline void epicPrintValue(FILE *out, EpicValue value) {
+    if (value.type == EPIC_ARRAY) {
+        EpicArray *array = EPIC_AS_ARRAY(value);
+        fputc('[', out);
+        for (uint32_t i = 0; i < array->length; i++) {
+            if (i > 0) {
+                fputs(", ", out);
+            }
+            epicPrintValue(out, epicArrayElement(array, i));
+        }
+        fputc(']', out);
+        return;
+    }
+    char buffer[32];
+    size_t length;
+    const char *text = epicValueText(value, buffer, sizeof(buffer), &length);
+    fwrite(text, 1, length, out);
+}
+
+static inline void epicPrint(EpicValue value) {
+    epicPrintValue(stdout, value);
+    fputc('\n', stdout);
+}
+
+static inline int epicTruthy(EpicValue value) {
+    switch (value.type) {
+        case EPIC_NIL: return 0;
+        case EPIC_INT: return value.as.i != 0;
+        case EPIC_DOUBLE: return value.as.d != 0;
+        case EPIC_STRING: return EPIC_AS_STRING(value)->length != 0;
+        default: return 1;
+    }
+}
+
+static inline int epicEqual(EpicValue a, EpicValue b) {
+    if (EPIC_IS_NUMBER(a) && EPIC_IS_NUMBER(b)) {
+        if (a.type == EPIC_INT && b.type == EPIC_INT) {
+            return a.as.i == b.as.i;
+        }
+        return EPIC_AS_NUMBER(a) == EPIC_AS_NUMBER(b);
+    }
+    if (a.type != b.type) {
+        return 0;
+    }
+    if (a.type == EPIC_STRING) {
+        EpicString *x = EPIC_AS_STRING(a), *y = EPIC_AS_STRING(b);
+        return x->length == y->length && memcmp(x->chars, y->chars, x->length) == 0;
+    }
+    return a.type == EPIC_NIL || a.as.object == b.as.object;
+}
+
+static inline int epicCompare(EpicValue a, EpicValue b, const char *op) {
+    if (EPIC_IS_NUMBER(a) && EPIC_IS_NUMBER(b)) {
+        if (a.type == EPIC_INT && b.type == EPIC_INT) {
+            return (a.as.i > b.as.i) - (a.as.i < b.as.i);
+        }
+        double x = EPIC_AS_NUMBER(a), y = EPIC_AS_NUMBER(b);
+        return (x > y) - (x < y);
+    }
+    if (a.type == EPIC_STRING && b.type == EPIC_STRING) {
+        EpicString *x = EPIC_AS_STRING(a), *y = EPIC_AS_STRING(b);
+        uint32_t length = x->length < y->length ? x->length : y->length;
+        int order = memcmp(x->chars, y->chars, length);
+        if (order == 0) {
+            order = (x->length > y->length) - (x->length < y->length);
+        }
+        return order;
+    }
+    epicRuntimeError("Operands of '%s' must be two numbers or two strings", op);
+    return 0;
+}
+
+// Heap: mark-and-sweep over the value stack and the memo caches
+
+static inline void epicMarkValue(EpicValue value) {
+    if (value.type != EPIC_STRING && value.type != EPIC_ARRAY) {
+        return;
+    }
+    EpicObject *object = value.as.object;
+    if (object->marked) {
+        return;
+    }
+    object->marked = 1;
+    if (object->type == EPIC_OBJ_ARRAY && ((EpicArray *)object)->kind == EPIC_ARRAY_BOXED) {
+        EpicArray *array = (EpicArray *)object;
+        for (uint32_t i = 0; i < array->length; i++) {
+            epicMarkValue(array->items[i]);
+        }
+    }
+}
+
+static inline size_t epicObjectSize(EpicObject *object) {
+    if (object->type == EPIC_OBJ_STRING) {
+        return sizeof(EpicString) + ((EpicString *)object)->length + 1;
+    }
+    return sizeof(EpicArray) + ((EpicArray *)object)->length * epicArrayElementSize((EpicArray *)object);
+}
+
+static inline void epicFreeObject(EpicObject *object) {
+    if (object->type == EPIC_OBJ_ARRAY) {
+        free(((EpicArray *)object)->items);
+    }
+    free(object);
+}
+
+static inline void epicCollectGarbage(void) {
+    for (EpicValue *slot = epic.stack; slot < epic.top; slot++) {
+        epicMarkValue(*slot);
+    }
+    for (uint32_t f = 0; epic.memo != NULL && f < epic.functionCount; f++) {
+        for (uint32_t i = 0; epic.memo[f] != NULL && i < EPIC_MEMO_ENTRIES; i++) {
+            EpicMemoEntry *entry = &epic.memo[f][i];
+            if (entry->used) {
+                for (uint32_t arg = 0; arg < epic.functions[f].arity; arg++) {
+                    epicMarkValue(entry->args[arg]);
+                }
+                epicMarkValue(entry->result);
+            }
+        }
+    }
+
+    EpicObject **link = &epic.objects;
+    while (*link != NULL) {
+        EpicObject *object = *link;
+        if (object->marked) {
+            object->marked = 0;
+            link = &object->next;
+        } else {
+            *link = object->next;
+            epic.bytesAllocated -= epicObjectSize(object);
+            epicFreeObject(object);
+        }
+    }
+    epic.nextCollection = epic.bytesAllocated * 2 > (1u << 20) ? epic.bytesAllocated * 2 : (1u << 20);
+}
+
+static inline void *epicAllocate(size_t size, int type) {
+    if (epic.bytesAllocated + size > epic.nextCollection) {
+        epicCollectGarbage();
+    }
+    EpicObject *object = malloc(size);
+    if (object == NULL) {
+        epicRuntimeError("Out of memory");
+    }
+    object->type = (uint8_t)type;
+    object->marked = 0;
+    object->next = epic.objects;
+    epic.objects = object;
+    epic.bytesAllocated += size;
+    return object;
+}
+
+static inline EpicString *epicNewString(const char *chars, size_t length) {
+    if (length > UINT32_MAX) {
+        epicRuntimeError("String too long");
+    }
+    EpicString *string = epicAllocate(sizeof(EpicString) + length + 1, EPIC_OBJ_STRING);
+    string->length = (uint32_t)length;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    return string;
+}
+
+// Program constants live for the whole run, outside the collected heap
+static inline EpicValue epicConstantString(const char *chars, size_t length) {
+    EpicString *string = malloc(sizeof(EpicString) + length + 1);
+    if (string == NULL) {
+        epicRuntimeError("Out of memory");
+    }
+    string->header.type = EPIC_OBJ_STRING;
+    string->header.marked = 1;
+    string->header.next = NULL;
+    string->length = (uint32_t)length;
+    memcpy(string->chars, chars, length);
+    string->chars[length] = '\0';
+    return EPIC_OBJECT_VALUE(EPIC_STRING, string);
+}
+
+// Operators
+
+#define EPIC_CONCAT_MAX 16
+
+// Joins the text of `count` values, still on the stack, in one allocation
+static inline EpicValue epicConcatenateValues(const EpicValue *values, uint32_t count) {
+    char buffers[EPIC_CONCAT_MAX][32];
+    const char *texts[EPIC_CONCAT_MAX];
+    size_t lengths[EPIC_CONCAT_MAX];
+    size_t total = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        if (values[i].type == EPIC_ARRAY) {
+            epicRuntimeError("Cannot concatenate an array");
+        }
+        texts[i] = epicValueText(values[i], buffers[i], sizeof(buffers[i]), &lengths[i]);
+        total += lengths[i];
+    }
+    if (total > UINT32_MAX) {
+        epicRuntimeError("String too long");
+    }
+    EpicString *result = epicAllocate(sizeof(EpicString) + total + 1, EPIC_OBJ_STRING);
+    result->length = (uint32_t)total;
+    char *end = result->chars;
+    for (uint32_t i = 0; i < count; i++) {
+        memcpy(end, texts[i], lengths[i]);
+        end += lengths[i];
+    }
+    *end = '\0';
+    return EPIC_OBJECT_VALUE(EPIC_STRING, result);
+}
+
+static inline EpicValue epicConcatenate(EpicValue a, EpicValue b) {
+    EpicValue values[2] = {a, b};
+    return epicConcatenateValues(values, 2);
+}
+
+static inline EpicValue epicArithmetic(int op, EpicValue a, EpicValue b) {
+    if (a.type == EPIC_INT && b.type == EPIC_INT) {
+        uint64_t x = (uint64_t)a.as.i, y = (uint64_t)b.as.i;
+        switch (op) {
+            case EPIC_OP_ADD: return EPIC_INT_VALUE((int64_t)(x + y));
+            case EPIC_OP_SUB: return EPIC_INT_VALUE((int64_t)(x - y));
+            case EPIC_OP_MUL: return EPIC_INT_VALUE((int64_t)(x * y));
+            default:
+                if (b.as.i == 0) {
+                    epicRuntimeError("Division by zero");
+                }
+                if (b.as.i == -1) {
+                    return EPIC_INT_VALUE((int64_t)(0 - x));
+                }
+                return EPIC_INT_VALUE(a.as.i / b.as.i);
+        }
+    }
+    if (op == EPIC_OP_ADD && (a.type == EPIC_STRING || b.type == EPIC_STRING)) {
+        return epicConcatenate(a, b);
+    }
+    if (!EPIC_IS_NUMBER(a) || !EPIC_IS_NUMBER(b)) {
+        epicRuntimeError("Operands of '%s' must be numbers", op == EPIC_OP_ADD ? "+" : op == EPIC_OP_SUB ? "-" : op == EPIC_OP_MUL ? "*" : "/");
+    }
+    double x = EPIC_AS_NUMBER(a), y = EPIC_AS_NUMBER(b);
+    switch (op) {
+        case EPIC_OP_ADD: return EPIC_DOUBLE_VALUE(x + y);
+        case EPIC_OP_SUB: return EPIC_DOUBLE_VALUE(x - y);
+        case EPIC_OP_MUL: return EPIC_DOUBLE_VALUE(x * y);
+        default:
+            if (y == 0) {
+                epicRuntimeError("Division by zero");
+            }
+            return EPIC_DOUBLE_VALUE(x / y);
+    }
+}
+
+static inline EpicValue epicNegate(EpicValue a) {
+    if (a.type == EPIC_INT) {
+        return EPIC_INT_VALUE((int64_t)(0 - (uint64_t)a.as.i));
+    }
+    if (a.type != EPIC_DOUBLE) {
+        epicRuntimeError("Operand of '-' must be a number");
+    }
+    return EPIC_DOUBLE_VALUE(-a.as.d);
+}
+
+// Inline integer paths; everything else goes through the helpers above.
+// `end` is the first free stack slot, published before anything allocates.
+#define EPIC_SYNC(end) (epic.top = (end))
+#define EPIC_ARITH(op, intop, a, b, end) do { \
+        if ((a).type == EPIC_INT && (b).type == EPIC_INT) { \
+            (a).as.i = (int64_t)((uint64_t)(a).as.i intop (uint64_t)(b).as.i); \
+        } else { \
+            EPIC_SYNC(end); \
+            (a) = epicArithmetic((op), (a), (b)); \
+        } \
+    } while (0)
+#define EPIC_COMPARE(cmp, text, a, b) do { \
+        int epicResult = (a).type == EPIC_INT && (b).type == EPIC_INT ? (a).as.i cmp (b).as.i \
+                                                                       : epicCompare((a), (b), (text)) cmp 0; \
+        (a) = EPIC_INT_VALUE(epicResult); \
+    } while (0)
+#define EPIC_EQUAL(negate, a, b) do { \
+        int epicResult = (a).type == EPIC_INT && (b).type == EPIC_INT ? (a).as.i == (b).as.i : epicEqual((a), (b)); \
+        (a) = EPIC_INT_VALUE(epicResult != (negate)); \
+    } while (0)
+#define EPIC_TRUTHY(value) ((value).type == EPIC_INT ? (value).as.i != 0 : epicTruthy(value))
+
+// input(): numbers typed by the user become numbers, anything else a string
+static inline EpicValue epicInput(void) {
+    char *line = NULL;
+    size_t capacity = 0;
+    fflush(stdout);
+    ssize_t length = getline(&line, &capacity, stdin);
+    if (length < 0) {
+        length = 0;
+    }
+    while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r')) {
+        length--;
+    }
+
+    EpicValue value = EPIC_NIL_VALUE;
+    if (length > 0 && strspn(line, "+-0123456789.eE") == (size_t)length) {
+        line[length] = '\0';
+        char *end;
+        errno = 0;
+        long long integer = strtoll(line, &end, 10);
+        if (*end == '\0' && errno == 0) {
+            value = EPIC_INT_VALUE(integer);
+        } else {
+            errno = 0;
+            double number = strtod(line, &end);
+            if (*end == '\0') {
+                value = EPIC_DOUBLE_VALUE(number);
+            }
+        }
+        errno = 0;
+    }
+    if (value.type == EPIC_NIL) {
+        value = EPIC_OBJECT_VALUE(EPIC_STRING, epicNewString(line != NULL ? line : "", (size_t)length));
+    }
+    free(line);
+    return value;
+}
+
+static inline EpicValue epicArray(const EpicValue *items, uint32_t count) {
+    uint8_t kind = count > 0 && EPIC_IS_NUMBER(items[0]) ? items[0].type : EPIC_ARRAY_BOXED;
+    for (uint32_t i = 1; i < count && kind != EPIC_ARRAY_BOXED; i++) {
+        if (items[i].type != kind) {
+            kind = EPIC_ARRAY_BOXED;
+        }
+    }
+    EpicArray *array = epicAllocate(sizeof(EpicArray), EPIC_OBJ_ARRAY);
+    array->length = 0;
+    array->kind = kind;
+    array->items = NULL;
+    size_t elementSize = epicArrayElementSize(array);
+    epic.bytesAllocated += count * elementSize;
+    void *storage = malloc((count ? count : 1) * elementSize);
+    if (storage == NULL) {
+        epicRuntimeError("Out of memory");
+    }
+    if (kind == EPIC_ARRAY_BOXED) {
+        memcpy(storage, items, count * sizeof(EpicValue));
+        array->items = storage;
+    } else {
+        array->ints = storage;
+        for (uint32_t i = 0; i < count; i++) {
+            array->ints[i] = items[i].as.i;
+        }
+    }
+    array->length = count;
+    return EPIC_OBJECT_VALUE(EPIC_ARRAY, array);
+}
+
+static inline EpicValue epicIndex(EpicValue container, EpicValue position) {
+    if (position.type != EPIC_INT) {
+        epicRuntimeError("Array index must be an integer");
+    }
+    if (container.type == EPIC_ARRAY) {
+        EpicArray *array = EPIC_AS_ARRAY(container);
+        if (position.as.i < 0 || position.as.i >= array->length) {
+            epicRuntimeError("Array index %lld out of bounds (length %u)", (long long)position.as.i, array->length);
+        }
+        return epicArrayElement(array, (uint32_t)position.as.i);
+    }
+    if (container.type == EPIC_STRING) {
+        EpicString *string = EPIC_AS_STRING(container);
+        if (position.as.i < 0 || position.as.i >= string->length) {
+            epicRuntimeError("String index %lld out of bounds (length %u)", (long long)position.as.i, string->length);
+        }
+        return EPIC_OBJECT_VALUE(EPIC_STRING, epicNewString(string->chars + position.as.i, 1));
+    }
+    epicRuntimeError("Only arrays and strings can be indexed");
+    return EPIC_NIL_VALUE;
+}
+
+static inline EpicValue epicMethod(int method, const EpicValue *args, uint32_t argumentCount) {
+    EpicValue receiver = args[0];
+    if (argumentCount != 0) {
+        epicRuntimeError("%s() takes no arguments", epicMethodNames[method]);
+    }
+    if (method == EPIC_METHOD_LENGTH) {
+        if (receiver.type == EPIC_ARRAY) {
+            return EPIC_INT_VALUE(EPIC_AS_ARRAY(receiver)->length);
+        }
+        if (receiver.type == EPIC_STRING) {
+            return EPIC_INT_VALUE(EPIC_AS_STRING(receiver)->length);
+        }
+        epicRuntimeError("length() needs a string or an array");
+    }
+    if (receiver.type == EPIC_ARRAY) {
+        epicRuntimeError("%s() needs a string", epicMethodNames[method]);
+    }
+
+    char buffer[32];
+    size_t length;
+    const char *text = epicValueText(receiver, buffer, sizeof(buffer), &length);
+    if (method == EPIC_METHOD_STRIP) {
+        size_t start = 0;
+        while (start < length && (text[start] == ' ' || (text[start] >= '\t' && text[start] <= '\r'))) start++;
+        while (length > start && (text[length - 1] == ' ' || (text[length - 1] >= '\t' && text[length - 1] <= '\r'))) length--;
+        return EPIC_OBJECT_VALUE(EPIC_STRING, epicNewString(text + start, length - start));
+    }
+    EpicString *result = epicNewString(text, length);
+    for (uint32_t i = 0; i < result->length; i++) {
+        result->chars[i] = (char)(method == EPIC_METHOD_LOWER ? tolower((unsigned char)result->chars[i])
+                                                              : toupper((unsigned char)result->chars[i]));
+    }
+    return EPIC_OBJECT_VALUE(EPIC_STRING, result);
+}
+
+// `for (...; i < a.length(); i = i + 1) { total = total + a[i]; }` in one
+// step; the loop that follows finds nothing left to do
+static inline void epicSumArray(EpicValue *array, EpicValue *total, EpicValue *index) {
+    if (array->type != EPIC_ARRAY || index->type != EPIC_INT || !EPIC_IS_NUMBER(*total)) {
+        return;
+    }
+    EpicArray *elements = EPIC_AS_ARRAY(*array);
+    if (elements->kind == EPIC_ARRAY_BOXED || index->as.i < 0 || index->as.i >= elements->length) {
+        return;
+    }
+    if (elements->kind == EPIC_ARRAY_INT && total->type == EPIC_INT) {
+        uint64_t sum = (uint64_t)total->as.i;
+        for (uint32_t i = (uint32_t)index->as.i; i < elements->length; i++) {
+            sum += (uint64_t)elements->ints[i];
+        }
+        total->as.i = (int64_t)sum;
+    } else {
+        double sum = EPIC_AS_NUMBER(*total);
+        for (uint32_t i = (uint32_t)index->as.i; i < elements->length; i++) {
+            sum += elements->kind == EPIC_ARRAY_INT ? (double)elements->ints[i] : elements->doubles[i];
+        }
+        *total = EPIC_DOUBLE_VALUE(sum);
+    }
+    index->as.i = elements->length;
+}
+
+// Calls
+
+static inline EpicValue *epicPushFrame(uint32_t function, EpicValue *top, uint32_t returnSite) {
+    const EpicFunction *callee = &epic.functions[function];
+    EpicValue *slots = top - callee->arity;
+    if (epic.frameCount == EPIC_MAX_FRAMES || slots + callee->slotCount + callee->maxStack > epic.stackEnd) {
+        epic.top = top;
+        epicRuntimeError("Stack overflow");
+    }
+    for (EpicValue *slot = top; slot < slots + callee->slotCount; slot++) {
+        *slot = EPIC_NIL_VALUE;
+    }
+    EpicFrame *frame = &epic.frames[epic.frameCount++];
+    frame->function = function;
+    frame->returnSite = returnSite;
+    frame->slots = slots;
+    frame->memoKey = NULL;
+    return slots;
+}
+
+// return f(...): the callee's arguments replace the current frame's slots.
+// A cached call from a frame without a key of its own keeps the arguments
+// below them as the key. Returns the callee's slots.
+static inline EpicValue *epicTailCall(uint32_t function, int memoize, EpicValue *slots, EpicValue *top) {
+    const EpicFunction *callee = &epic.functions[function];
+    EpicFrame *frame = &epic.frames[epic.frameCount - 1];
+    uint32_t arity = callee->arity;
+    uint32_t key = memoize && frame->memoKey == NULL ? arity : 0;
+    if (slots + key + callee->slotCount + callee->maxStack > epic.stackEnd) {
+        epic.top = top;
+        epicRuntimeError("Stack overflow");
+    }
+    memmove(slots + key, top - arity, arity * sizeof(EpicValue));
+    if (key > 0) {
+        memcpy(slots, slots + key, arity * sizeof(EpicValue));
+        frame->memoKey = slots;
+        frame->memoFunction = function;
+        slots += key;
+        frame->slots = slots;
+    }
+    for (EpicValue *slot = top > slots + arity ? top : slots + arity; slot < slots + callee->slotCount; slot++) {
+        *slot = EPIC_NIL_VALUE;
+    }
+    frame->function = function;
+    return slots;
+}
+
+static inline int epicSameArgument(EpicValue a, EpicValue b) {
+    if (a.type != b.type) {
+        return 0;
+    }
+    switch (a.type) {
+        case EPIC_NIL: return 1;
+        case EPIC_INT: return a.as.i == b.as.i;
+        case EPIC_DOUBLE: return memcmp(&a.as.d, &b.as.d, sizeof(double)) == 0;
+        case EPIC_STRING: return epicEqual(a, b);
+        default: return a.as.object == b.as.object;
+    }
+}
+
+static inline uint64_t epicHashArgument(EpicValue value) {
+    uint64_t bits;
+    switch (value.type) {
+        case EPIC_INT: bits = (uint64_t)value.as.i; break;
+        case EPIC_DOUBLE: memcpy(&bits, &value.as.d, sizeof(bits)); break;
+        case EPIC_STRING: {
+            uint32_t hash = 2166136261u;
+            EpicString *string = EPIC_AS_STRING(value);
+            for (uint32_t i = 0; i < string->length; i++) {
+                hash = (hash ^ (unsigned char)string->chars[i]) * 16777619u;
+            }
+            bits = hash;
+            break;
+        }
+        case EPIC_ARRAY: bits = (uint64_t)(uintptr_t)value.as.object; break;
+        default: bits = 0; break;
+    }
+    bits = (bits ^ (bits >> 30) ^ value.type) * 0xbf58476d1ce4e5b9ull;
+    return bits ^ (bits >> 27);
+}
+
+static inline EpicMemoEntry *epicMemoEntry(uint32_t function, const EpicValue *args) {
+    if (epic.memo == NULL) {
+        epic.memo = calloc(epic.functionCount, sizeof(EpicMemoEntry *));
+    }
+    if (epic.memo == NULL || (epic.memo[function] == NULL &&
+        (epic.memo[function] = calloc(EPIC_MEMO_ENTRIES, sizeof(EpicMemoEntry))) == NULL)) {
+        epicRuntimeError("Out of memory");
+    }
+    uint64_t hash = function;
+    for (uint32_t i = 0; i < epic.functions[function].arity; i++) {
+        hash = hash * 31 + epicHashArgument(args[i]);
+    }
+    return &epic.memo[function][hash & (EPIC_MEMO_ENTRIES - 1)];
+}
+
+// On a hit the cached result replaces the arguments at `args`
+static inline int epicMemoLookup(uint32_t function, EpicValue *args) {
+    EpicMemoEntry *entry = epicMemoEntry(function, args);
+    if (!entry->used) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < epic.functions[function].arity; i++) {
+        if (!epicSameArgument(entry->args[i], args[i])) {
+            return 0;
+        }
+    }
+    args[0] = entry->result;
+    return 1;
+}
+
+// Call through the cache: the arguments stay below the frame as the key
+static inline EpicValue *epicPushMemoFrame(uint32_t function, EpicValue *top, uint32_t returnSite) {
+    uint32_t arity = epic.functions[function].arity;
+    if (top + arity > epic.stackEnd) {
+        epic.top = top;
+        epicRuntimeError("Stack overflow");
+    }
+    memcpy(top, top - arity, arity * sizeof(EpicValue));
+    EpicValue *slots = epicPushFrame(function, top + arity, returnSite);
+    epic.frames[epic.frameCount - 1].memoKey = top - arity;
+    epic.frames[epic.frameCount - 1].memoFunction = function;
+    return slots;
+}
+
+// Pop the current frame and leave `result` where the caller expects it.
+// Returns the frame that was popped.
+static inline EpicFrame *epicReturn(EpicValue result) {
+    EpicFrame *frame = &epic.frames[--epic.frameCount];
+    EpicValue *base = frame->slots;
+    if (frame->memoKey != NULL) {
+        base = frame->memoKey;
+        EpicMemoEntry *entry = epicMemoEntry(frame->memoFunction, base);
+        memcpy(entry->args, base, epic.functions[frame->memoFunction].arity * sizeof(EpicValue));
+        entry->result = result;
+        entry->used = 1;
+    }
+    *base = result;
+    return frame;
+}
+
+static inline void epicInit(const EpicFunction *functions, uint32_t functionCount) {
+    memset(&epic, 0, sizeof(epic));
+    epic.functions = functions;
+    epic.functionCount = functionCount;
+    epic.stack = malloc(EPIC_STACK_SIZE * sizeof(EpicValue));
+    epic.frames = malloc(EPIC_MAX_FRAMES * sizeof(EpicFrame));
+    if (epic.stack == NULL || epic.frames == NULL) {
+        fprintf(stderr, "Memory allocation error!\n");
+        exit(1);
+    }
+    epic.stackEnd = epic.stack + EPIC_STACK_SIZE;
+    epic.top = epic.stack;
+    epic.nextCollection = 1u << 20;
+}
+
+#endif